@@ -0,0 +1,1031 @@
+/*++
+Copyright (c)
+Module Name:
+    dctrie.c
+Abstract:
+    Builds and searches the protected root trie described in dctrie.h.
+Environment:
+    Kernel & user mode
+--*/
+
+#include "dctrie.h"
+#include "dcfold.h"
+
+//  Build time description of one root after its separators have been
+//  trimmed and its components located.
+typedef struct _DCTRIE_KEY {
+    PCWSTR Buffer;
+    USHORT Length;
+    USHORT ComponentCount;
+    ULONG FirstComponent;
+    ULONG RootId;
+} DCTRIE_KEY, *PDCTRIE_KEY;
+
+//  Range of sorted keys a node still has to be expanded from.
+typedef struct _DCTRIE_RANGE {
+    ULONG Low;
+    ULONG High;
+    USHORT Depth;
+} DCTRIE_RANGE, *PDCTRIE_RANGE;
+
+typedef struct _DCTRIE_BUILDER {
+    PDCTRIE_KEY Keys;
+    PULONG Order;
+    PUSHORT Components;
+    PDCTRIE_NODE Nodes;
+    PDCTRIE_RANGE Ranges;
+    PWCHAR Pool;
+    ULONG KeyCount;
+    ULONG NodeCount;
+    ULONG PoolLength;
+} DCTRIE_BUILDER, *PDCTRIE_BUILDER;
+
+
+static LONG
+DcTrieCompareKeys (
+    _In_ const DCTRIE_KEY *Left,
+    _In_ const DCTRIE_KEY *Right
+    )
+/*++
+Routine Description:
+    Orders two keys component by component, ignoring case. Separators
+    sort below every other character so that a path sorts before all
+    paths below it.
+--*/
+{
+    ULONG length = (Left->Length < Right->Length) ? Left->Length : Right->Length;
+    ULONG i;
+
+    for (i = 0; i < length; i++) {
+
+        WCHAR l = (Left->Buffer[i] == DC_PATH_SEPARATOR) ? 0 : DcUpcaseChar( Left->Buffer[i] );
+        WCHAR r = (Right->Buffer[i] == DC_PATH_SEPARATOR) ? 0 : DcUpcaseChar( Right->Buffer[i] );
+
+        if (l != r) {
+            return (l < r) ? -1 : 1;
+        }
+    }
+
+    if (Left->Length == Right->Length) {
+        return 0;
+    }
+
+    return (Left->Length < Right->Length) ? -1 : 1;
+}
+
+static LONG
+DcTrieCompareComponents (
+    _In_reads_(LeftLength) PCWSTR Left,
+    _In_ ULONG LeftLength,
+    _In_reads_(RightLength) PCWSTR Right,
+    _In_ ULONG RightLength
+    )
+{
+    ULONG length = (LeftLength < RightLength) ? LeftLength : RightLength;
+    ULONG i;
+
+    for (i = 0; i < length; i++) {
+
+        WCHAR l = DcUpcaseChar( Left[i] );
+        WCHAR r = DcUpcaseChar( Right[i] );
+
+        if (l != r) {
+            return (l < r) ? -1 : 1;
+        }
+    }
+
+    if (LeftLength == RightLength) {
+        return 0;
+    }
+
+    return (LeftLength < RightLength) ? -1 : 1;
+}
+
+static LONG
+DcTrieCompareLabel (
+    _In_reads_(NameLength) PCWSTR Name,
+    _In_ ULONG NameLength,
+    _In_reads_(LabelLength) PCWSTR Label,
+    _In_ ULONG LabelLength
+    )
+/*++
+Routine Description:
+    Same order as DcTrieCompareComponents, against a label that was
+    upcased when the trie was built, see dcfold.h.
+--*/
+{
+    return DcFoldCompare( Name, NameLength, Label, LabelLength );
+}
+
+static VOID
+DcTrieSiftDown (
+    _Inout_ PDCTRIE_BUILDER Builder,
+    _In_ ULONG Start,
+    _In_ ULONG Count
+    )
+{
+    ULONG parent = Start;
+
+    for (;;) {
+
+        ULONG child = 2 * parent + 1;
+        ULONG swap;
+
+        if (child >= Count) {
+            return;
+        }
+
+        if (child + 1 < Count &&
+            DcTrieCompareKeys( &Builder->Keys[Builder->Order[child]],
+                               &Builder->Keys[Builder->Order[child + 1]] ) < 0) {
+            child++;
+        }
+
+        if (DcTrieCompareKeys( &Builder->Keys[Builder->Order[parent]],
+                               &Builder->Keys[Builder->Order[child]] ) >= 0) {
+            return;
+        }
+
+        swap = Builder->Order[parent];
+        Builder->Order[parent] = Builder->Order[child];
+        Builder->Order[child] = swap;
+        parent = child;
+    }
+}
+
+static VOID
+DcTrieSortKeys (
+    _Inout_ PDCTRIE_BUILDER Builder
+    )
+/*++
+Routine Description:
+    Heap sorts the key order. Heap sort keeps the build free of recursion
+    and of additional allocations, which matters on a kernel stack.
+--*/
+{
+    ULONG count = Builder->KeyCount;
+    ULONG i;
+
+    for (i = 0; i < count; i++) {
+        Builder->Order[i] = i;
+    }
+
+    if (count < 2) {
+        return;
+    }
+
+    for (i = count / 2; i-- > 0; ) {
+        DcTrieSiftDown( Builder, i, count );
+    }
+
+    for (i = count - 1; i > 0; i--) {
+
+        ULONG swap = Builder->Order[0];
+        Builder->Order[0] = Builder->Order[i];
+        Builder->Order[i] = swap;
+        DcTrieSiftDown( Builder, 0, i );
+    }
+}
+
+static PDCTRIE_KEY
+DcTrieSortedKey (
+    _In_ PDCTRIE_BUILDER Builder,
+    _In_ ULONG Index
+    )
+{
+    return &Builder->Keys[Builder->Order[Index]];
+}
+
+static USHORT
+DcTrieComponentStart (
+    _In_ PDCTRIE_BUILDER Builder,
+    _In_ const DCTRIE_KEY *Key,
+    _In_ ULONG Component
+    )
+{
+    return Builder->Components[Key->FirstComponent + Component];
+}
+
+static USHORT
+DcTrieComponentEnd (
+    _In_ PDCTRIE_BUILDER Builder,
+    _In_ const DCTRIE_KEY *Key,
+    _In_ ULONG Component
+    )
+{
+    if (Component + 1 < Key->ComponentCount) {
+        return (USHORT)(DcTrieComponentStart( Builder, Key, Component + 1 ) - 1);
+    }
+
+    return Key->Length;
+}
+
+static BOOLEAN
+DcTrieSameComponent (
+    _In_ PDCTRIE_BUILDER Builder,
+    _In_ const DCTRIE_KEY *Left,
+    _In_ const DCTRIE_KEY *Right,
+    _In_ ULONG Component
+    )
+{
+    USHORT leftStart = DcTrieComponentStart( Builder, Left, Component );
+    USHORT rightStart = DcTrieComponentStart( Builder, Right, Component );
+
+    return (BOOLEAN)(0 == DcTrieCompareComponents( Left->Buffer + leftStart,
+                                                   DcTrieComponentEnd( Builder, Left, Component ) - leftStart,
+                                                   Right->Buffer + rightStart,
+                                                   DcTrieComponentEnd( Builder, Right, Component ) - rightStart ));
+}
+
+static NTSTATUS
+DcTrieLoadKeys (
+    _Inout_ PDCTRIE_BUILDER Builder,
+    _In_reads_(RootCount) const DCTRIE_ROOT *Roots,
+    _In_ ULONG RootCount
+    )
+/*++
+Routine Description:
+    Trims every root and records where each of its components starts.
+    Roots with empty components are rejected rather than guessed at.
+--*/
+{
+    ULONG componentCount = 0;
+    ULONG poolLength = 0;
+    ULONG i;
+
+    for (i = 0; i < RootCount; i++) {
+
+        PCWSTR buffer = Roots[i].Path.Buffer;
+        ULONG length = (ULONG)(Roots[i].Path.Length / sizeof(WCHAR));
+        PDCTRIE_KEY key = &Builder->Keys[i];
+        ULONG j;
+
+        if ((Roots[i].Path.Length % sizeof(WCHAR)) != 0 ||
+            (length != 0 && buffer == NULL) ||
+            Roots[i].RootId == DCTRIE_NO_ROOT) {
+
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        while (length != 0 && buffer[0] == DC_PATH_SEPARATOR) {
+            buffer++;
+            length--;
+        }
+
+        while (length != 0 && buffer[length - 1] == DC_PATH_SEPARATOR) {
+            length--;
+        }
+
+        if (length == 0) {
+            return STATUS_OBJECT_NAME_INVALID;
+        }
+
+        key->Buffer = buffer;
+        key->Length = (USHORT)length;
+        key->ComponentCount = 1;
+        key->FirstComponent = componentCount;
+        key->RootId = Roots[i].RootId;
+
+        for (j = 0; j < length; j++) {
+            if (buffer[j] == DC_PATH_SEPARATOR) {
+                if (buffer[j + 1] == DC_PATH_SEPARATOR) {
+                    return STATUS_OBJECT_NAME_INVALID;
+                }
+                key->ComponentCount++;
+            }
+        }
+
+        componentCount += key->ComponentCount;
+        poolLength += length;
+    }
+
+    Builder->Components = DcAllocate( (componentCount + 1) * sizeof(USHORT) );
+    Builder->Pool = DcAllocate( (poolLength + 1) * sizeof(WCHAR) );
+    if (Builder->Components == NULL || Builder->Pool == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < RootCount; i++) {
+
+        PDCTRIE_KEY key = &Builder->Keys[i];
+        ULONG next = key->FirstComponent;
+        USHORT j;
+
+        Builder->Components[next++] = 0;
+        for (j = 0; j < key->Length; j++) {
+            if (key->Buffer[j] == DC_PATH_SEPARATOR) {
+                Builder->Components[next++] = (USHORT)(j + 1);
+            }
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+DcTrieAddChildren (
+    _Inout_ PDCTRIE_BUILDER Builder,
+    _In_ ULONG Parent,
+    _In_ ULONG Low,
+    _In_ ULONG High,
+    _In_ USHORT Depth
+    )
+/*++
+Routine Description:
+    Allocates one child node per distinct component at Depth among the
+    sorted keys in [Low, High). The children get consecutive indices, in
+    key order, so they can be binary searched.
+--*/
+{
+    PDCTRIE_NODE parent = &Builder->Nodes[Parent];
+
+    parent->FirstChild = Builder->NodeCount;
+    parent->ChildCount = 0;
+
+    while (Low < High) {
+
+        ULONG end = Low + 1;
+        PDCTRIE_RANGE range;
+
+        while (end < High &&
+               DcTrieSameComponent( Builder, DcTrieSortedKey( Builder, Low ),
+                                    DcTrieSortedKey( Builder, end ), Depth )) {
+            end++;
+        }
+
+        range = &Builder->Ranges[Builder->NodeCount++];
+        range->Low = Low;
+        range->High = end;
+        range->Depth = Depth;
+        parent->ChildCount++;
+
+        Low = end;
+    }
+}
+
+static VOID
+DcTrieExpandNode (
+    _Inout_ PDCTRIE_BUILDER Builder,
+    _In_ ULONG Index
+    )
+/*++
+Routine Description:
+    Fills in a node from its key range: the label extends over every
+    component the keys have in common, stopping early where a root ends.
+--*/
+{
+    PDCTRIE_NODE node = &Builder->Nodes[Index];
+    PDCTRIE_RANGE range = &Builder->Ranges[Index];
+    ULONG low = range->Low;
+    ULONG high = range->High;
+    PDCTRIE_KEY first = DcTrieSortedKey( Builder, low );
+    PDCTRIE_KEY last = DcTrieSortedKey( Builder, high - 1 );
+    USHORT depth = range->Depth;
+    USHORT end = (USHORT)(depth + 1);
+    USHORT labelStart;
+    USHORT labelEnd;
+    USHORT i;
+
+    while (first->ComponentCount > end &&
+           DcTrieSameComponent( Builder, first, last, end )) {
+        end++;
+    }
+
+    labelStart = DcTrieComponentStart( Builder, first, depth );
+    labelEnd = DcTrieComponentEnd( Builder, first, end - 1 );
+
+    node->LabelOffset = Builder->PoolLength;
+    node->LabelLength = (USHORT)(labelEnd - labelStart);
+    node->FirstComponentLength = (USHORT)(DcTrieComponentEnd( Builder, first, depth ) - labelStart);
+    node->RootId = DCTRIE_NO_ROOT;
+
+    for (i = 0; i < node->LabelLength; i++) {
+        Builder->Pool[Builder->PoolLength + i] = DcUpcaseChar( first->Buffer[labelStart + i] );
+    }
+    Builder->PoolLength += node->LabelLength;
+
+    //  The shortest key sorts first; it ends here if it has no more
+    //  components. Duplicates of the same root collapse into one.
+    if (first->ComponentCount == end) {
+
+        node->RootId = first->RootId;
+        while (low < high && DcTrieSortedKey( Builder, low )->ComponentCount == end) {
+            low++;
+        }
+    }
+
+    DcTrieAddChildren( Builder, Index, low, high, end );
+}
+
+NTSTATUS
+DcTrieBuild (
+    _In_reads_(RootCount) const DCTRIE_ROOT *Roots,
+    _In_ ULONG RootCount,
+    _Outptr_ PDCTRIE *Trie
+    )
+/*++
+Routine Description:
+    Builds a trie image from a set of roots.
+Arguments:
+    Roots - Protected roots. The strings are only referenced during the
+        call.
+    RootCount - Number of entries in Roots.
+    Trie - Receives the image. Release it with DcTrieFree.
+Return Value:
+    STATUS_SUCCESS, STATUS_INVALID_PARAMETER or STATUS_OBJECT_NAME_INVALID
+    for malformed roots, STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    DCTRIE_BUILDER builder;
+    NTSTATUS status;
+    PDCTRIE trie;
+    ULONG capacity;
+    ULONG maxDepth = 0;
+    ULONG size;
+    ULONG i;
+
+    *Trie = NULL;
+    RtlZeroMemory( &builder, sizeof(builder) );
+
+    //  A compressed trie over n keys never needs more than 2n + 1 nodes.
+    capacity = 2 * RootCount + 1;
+    if (RootCount > 0x10000000) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    builder.KeyCount = RootCount;
+    builder.Keys = DcAllocate( (RootCount + 1) * sizeof(DCTRIE_KEY) );
+    builder.Order = DcAllocate( (RootCount + 1) * sizeof(ULONG) );
+    builder.Nodes = DcAllocate( capacity * sizeof(DCTRIE_NODE) );
+    builder.Ranges = DcAllocate( capacity * sizeof(DCTRIE_RANGE) );
+
+    if (builder.Keys == NULL || builder.Order == NULL ||
+        builder.Nodes == NULL || builder.Ranges == NULL) {
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    status = DcTrieLoadKeys( &builder, Roots, RootCount );
+    if (!NT_SUCCESS( status )) {
+        goto Cleanup;
+    }
+
+    DcTrieSortKeys( &builder );
+
+    for (i = 0; i < RootCount; i++) {
+        if (builder.Keys[i].ComponentCount > maxDepth) {
+            maxDepth = builder.Keys[i].ComponentCount;
+        }
+    }
+
+    //  Nodes are expanded in index order, which is breadth first, so every
+    //  child gets a larger index than its parent.
+    RtlZeroMemory( &builder.Nodes[0], sizeof(DCTRIE_NODE) );
+    builder.Nodes[0].RootId = DCTRIE_NO_ROOT;
+    builder.NodeCount = 1;
+    DcTrieAddChildren( &builder, 0, 0, RootCount, 0 );
+
+    for (i = 1; i < builder.NodeCount; i++) {
+        DcTrieExpandNode( &builder, i );
+    }
+
+    size = (ULONG)(sizeof(DCTRIE) +
+                   builder.NodeCount * sizeof(DCTRIE_NODE) +
+                   builder.PoolLength * sizeof(WCHAR));
+
+    trie = DcAllocate( size );
+    if (trie == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    trie->Size = size;
+    trie->NodeCount = builder.NodeCount;
+    trie->RootCount = 0;
+    trie->LabelPoolLength = builder.PoolLength;
+    trie->NodesOffset = (ULONG)sizeof(DCTRIE);
+    trie->LabelPoolOffset = (ULONG)(sizeof(DCTRIE) + builder.NodeCount * sizeof(DCTRIE_NODE));
+    trie->MaxDepth = maxDepth;
+
+    for (i = 0; i < builder.NodeCount; i++) {
+        if (builder.Nodes[i].RootId != DCTRIE_NO_ROOT) {
+            trie->RootCount++;
+        }
+    }
+
+    RtlCopyMemory( (PUCHAR)trie + trie->NodesOffset,
+                   builder.Nodes,
+                   builder.NodeCount * sizeof(DCTRIE_NODE) );
+    RtlCopyMemory( (PUCHAR)trie + trie->LabelPoolOffset,
+                   builder.Pool,
+                   builder.PoolLength * sizeof(WCHAR) );
+
+    *Trie = trie;
+
+Cleanup:
+
+    if (builder.Keys != NULL) {
+        DcFree( builder.Keys );
+    }
+    if (builder.Order != NULL) {
+        DcFree( builder.Order );
+    }
+    if (builder.Components != NULL) {
+        DcFree( builder.Components );
+    }
+    if (builder.Nodes != NULL) {
+        DcFree( builder.Nodes );
+    }
+    if (builder.Ranges != NULL) {
+        DcFree( builder.Ranges );
+    }
+    if (builder.Pool != NULL) {
+        DcFree( builder.Pool );
+    }
+
+    return status;
+}
+
+VOID
+DcTrieFree (
+    _In_ PDCTRIE Trie
+    )
+{
+    DcFree( Trie );
+}
+
+NTSTATUS
+DcTrieValidate (
+    _In_ const DCTRIE *Trie,
+    _In_ ULONG Size,
+    _In_ ULONG RootIdLimit
+    )
+/*++
+Routine Description:
+    Checks that an image that was not built by DcTrieBuild in this
+    process, such as one stored in a policy image, can be searched
+    without reading outside of it or looping: the node array and label
+    pool lie within the image, every label within the pool, and the
+    children of a node within the node array, after the node itself.
+Arguments:
+    Trie - The image, aligned on 8 bytes.
+    Size - Bytes available at Trie.
+    RootIdLimit - Root ids must be below this, or DCTRIE_NO_ROOT.
+Return Value:
+    STATUS_SUCCESS or STATUS_INVALID_IMAGE_FORMAT.
+--*/
+{
+    const DCTRIE_NODE *nodes;
+    ULONG i;
+
+    if (Size < sizeof(DCTRIE) || Trie->Size != Size ||
+        Trie->NodeCount == 0 ||
+        Trie->NodesOffset < sizeof(DCTRIE) || Trie->NodesOffset > Size ||
+        (Trie->NodesOffset % sizeof(ULONG)) != 0 ||
+        Trie->NodeCount > (Size - Trie->NodesOffset) / sizeof(DCTRIE_NODE) ||
+        Trie->LabelPoolOffset < sizeof(DCTRIE) || Trie->LabelPoolOffset > Size ||
+        (Trie->LabelPoolOffset % sizeof(WCHAR)) != 0 ||
+        Trie->LabelPoolLength > (Size - Trie->LabelPoolOffset) / sizeof(WCHAR)) {
+        return STATUS_INVALID_IMAGE_FORMAT;
+    }
+
+    nodes = (const DCTRIE_NODE *)((const UCHAR *)Trie + Trie->NodesOffset);
+
+    for (i = 0; i < Trie->NodeCount; i++) {
+
+        if (nodes[i].LabelOffset > Trie->LabelPoolLength ||
+            nodes[i].LabelLength > Trie->LabelPoolLength - nodes[i].LabelOffset ||
+            nodes[i].FirstComponentLength > nodes[i].LabelLength ||
+            (nodes[i].RootId != DCTRIE_NO_ROOT && nodes[i].RootId >= RootIdLimit)) {
+            return STATUS_INVALID_IMAGE_FORMAT;
+        }
+
+        if (nodes[i].ChildCount != 0 &&
+            (nodes[i].FirstChild <= i ||
+             nodes[i].FirstChild > Trie->NodeCount ||
+             nodes[i].ChildCount > Trie->NodeCount - nodes[i].FirstChild)) {
+            return STATUS_INVALID_IMAGE_FORMAT;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+DcTrieGetRoots (
+    _In_ const DCTRIE *Trie,
+    _Outptr_ PDCTRIE_ROOT *Roots,
+    _Out_ PULONG RootCount
+    )
+/*++
+Routine Description:
+    Lists the roots a trie matches, so that a policy can be changed
+    without the list it was built from. Each path is rebuilt from the
+    labels leading to its node, upcased and with a leading separator;
+    roots that were duplicates of each other come back once.
+Arguments:
+    Trie - Trie image built by DcTrieBuild or checked by DcTrieValidate.
+    Roots - Receives the roots in node order, followed by their paths
+        in the same allocation, to be freed with DcFree.
+    RootCount - Receives the number of entries in Roots.
+Return Value:
+    STATUS_SUCCESS, STATUS_INVALID_PARAMETER if a path is too long for a
+    UNICODE_STRING, or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    const DCTRIE_NODE *nodes = (const DCTRIE_NODE *)((const UCHAR *)Trie + Trie->NodesOffset);
+    PCWSTR pool = (PCWSTR)((const UCHAR *)Trie + Trie->LabelPoolOffset);
+    PDCTRIE_ROOT roots;
+    PULONG parents;
+    PWCHAR buffer;
+    ULONG64 poolLength = 0;
+    ULONG64 size;
+    ULONG length;
+    ULONG count = 0;
+    ULONG node;
+    ULONG i, j;
+
+    *Roots = NULL;
+    *RootCount = 0;
+
+    //  Children always follow their parent, so walking up the parents
+    //  ends at the trie root.
+    parents = DcAllocate( Trie->NodeCount * sizeof(ULONG) );
+    if (parents == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( parents, Trie->NodeCount * sizeof(ULONG) );
+    for (i = 0; i < Trie->NodeCount; i++) {
+        for (j = 0; j < nodes[i].ChildCount; j++) {
+            parents[nodes[i].FirstChild + j] = i;
+        }
+    }
+
+    for (i = 1; i < Trie->NodeCount; i++) {
+
+        if (nodes[i].RootId == DCTRIE_NO_ROOT) {
+            continue;
+        }
+
+        length = 0;
+        for (node = i; node != 0; node = parents[node]) {
+            length += 1 + nodes[node].LabelLength;
+        }
+
+        if (length > 0xFFFF / sizeof(WCHAR)) {
+            DcFree( parents );
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        poolLength += length;
+        count++;
+    }
+
+    size = count * (ULONG64)sizeof(DCTRIE_ROOT) + poolLength * sizeof(WCHAR);
+    roots = (size <= 0xFFFFFFFF) ? DcAllocate( (ULONG)size ) : NULL;
+    if (roots == NULL) {
+        DcFree( parents );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    buffer = (PWCHAR)&roots[count];
+    count = 0;
+
+    for (i = 1; i < Trie->NodeCount; i++) {
+
+        if (nodes[i].RootId == DCTRIE_NO_ROOT) {
+            continue;
+        }
+
+        length = 0;
+        for (node = i; node != 0; node = parents[node]) {
+            length += 1 + nodes[node].LabelLength;
+        }
+
+        //  Filled in from the end, one label at a time.
+        roots[count].Path.Buffer = buffer;
+        roots[count].Path.Length = (USHORT)(length * sizeof(WCHAR));
+        roots[count].Path.MaximumLength = roots[count].Path.Length;
+        roots[count].RootId = nodes[i].RootId;
+
+        for (node = i; node != 0; node = parents[node]) {
+            length -= nodes[node].LabelLength;
+            RtlCopyMemory( buffer + length,
+                           pool + nodes[node].LabelOffset,
+                           nodes[node].LabelLength * sizeof(WCHAR) );
+            buffer[--length] = DC_PATH_SEPARATOR;
+        }
+
+        buffer += roots[count].Path.Length / sizeof(WCHAR);
+        count++;
+    }
+
+    DcFree( parents );
+
+    *Roots = roots;
+    *RootCount = count;
+    return STATUS_SUCCESS;
+}
+
+static ULONG
+DcTrieWalk (
+    _In_ const DCTRIE *Trie,
+    _In_ PCUNICODE_STRING FileName,
+    _Out_ PULONG Depth
+    )
+/*++
+Routine Description:
+    Follows FileName down the trie as far as its components match.
+Arguments:
+    Trie - Trie image built by DcTrieBuild.
+    FileName - Full path of the file.
+    Depth - Receives the number of leading components of FileName that
+        matched whole node labels.
+Return Value:
+    RootId of the deepest root FileName lies strictly below,
+    DCTRIE_NO_ROOT if there is none.
+--*/
+{
+    const DCTRIE_NODE *nodes = (const DCTRIE_NODE *)((const UCHAR *)Trie + Trie->NodesOffset);
+    PCWSTR pool = (PCWSTR)((const UCHAR *)Trie + Trie->LabelPoolOffset);
+    PCWSTR path = FileName->Buffer;
+    ULONG length = (ULONG)(FileName->Length / sizeof(WCHAR));
+    const DCTRIE_NODE *node = &nodes[0];
+    ULONG match = DCTRIE_NO_ROOT;
+    ULONG position = 0;
+
+    *Depth = 0;
+
+    while (position < length && path[position] == DC_PATH_SEPARATOR) {
+        position++;
+    }
+
+    //  position always points at the first component below node.
+    while (position < length) {
+
+        const DCTRIE_NODE *child = NULL;
+        ULONG componentEnd = position;
+        ULONG low = 0;
+        ULONG high = node->ChildCount;
+        ULONG next;
+
+        if (node->RootId != DCTRIE_NO_ROOT) {
+            match = node->RootId;
+        }
+
+        while (componentEnd < length && path[componentEnd] != DC_PATH_SEPARATOR) {
+            componentEnd++;
+        }
+
+        while (low < high) {
+
+            ULONG middle = low + (high - low) / 2;
+            const DCTRIE_NODE *candidate = &nodes[node->FirstChild + middle];
+            LONG order = DcTrieCompareLabel( path + position,
+                                             componentEnd - position,
+                                             pool + candidate->LabelOffset,
+                                             candidate->FirstComponentLength );
+
+            if (order == 0) {
+                child = candidate;
+                break;
+            }
+
+            if (order < 0) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+
+        if (child == NULL) {
+            break;
+        }
+
+        //  The first component matched, the rest of the label must match
+        //  whole components of the path as well.
+        next = position + child->LabelLength;
+        if (next > length ||
+            (next < length && path[next] != DC_PATH_SEPARATOR) ||
+            0 != DcTrieCompareLabel( path + componentEnd,
+                                     next - componentEnd,
+                                     pool + child->LabelOffset + child->FirstComponentLength,
+                                     child->LabelLength - child->FirstComponentLength )) {
+            break;
+        }
+
+        for (; position < next; position++) {
+            if (path[position] == DC_PATH_SEPARATOR) {
+                (*Depth)++;
+            }
+        }
+        (*Depth)++;
+
+        node = child;
+        position = next + 1;
+    }
+
+    return match;
+}
+
+ULONG
+DcTrieMatch (
+    _In_ const DCTRIE *Trie,
+    _In_ PCUNICODE_STRING FileName
+    )
+/*++
+Routine Description:
+    Finds the deepest root that FileName lies strictly below.
+Arguments:
+    Trie - Trie image built by DcTrieBuild.
+    FileName - Full path of the file, e.g. a normalized name.
+Return Value:
+    RootId of the matching root, DCTRIE_NO_ROOT if there is none.
+--*/
+{
+    ULONG depth;
+
+    return DcTrieWalk( Trie, FileName, &depth );
+}
+
+ULONG
+DcTrieMatchOpenedName (
+    _In_ const DCTRIE *Trie,
+    _In_ PCUNICODE_STRING FileName,
+    _Out_ PBOOLEAN Ambiguous
+    )
+/*++
+Routine Description:
+    Matches a name that has not been normalized, such as the name a file
+    was opened by, and tells whether the result can be trusted.
+
+    The trie is expected to hold every spelling of the roots, long and
+    short component names alike. The result is then only ambiguous when
+    the name could take a way to a root that the trie does not know
+    about: a component with a '~' that did not match and could be an
+    unknown short name of a root component, an empty, "." or ".."
+    component, or a stream name on a directory in the middle of the
+    path.
+Arguments:
+    Trie - Trie image built by DcTrieBuild.
+    FileName - Full path of the file.
+    Ambiguous - Receives TRUE if the name has to be normalized before
+        it can be matched.
+Return Value:
+    RootId of the matching root, DCTRIE_NO_ROOT if there is none.
+--*/
+{
+    PCWSTR path = FileName->Buffer;
+    ULONG length = (ULONG)(FileName->Length / sizeof(WCHAR));
+    ULONG position = 0;
+    ULONG index = 0;
+    ULONG depth;
+    ULONG match;
+
+    match = DcTrieWalk( Trie, FileName, &depth );
+    *Ambiguous = FALSE;
+
+    while (position < length && path[position] == DC_PATH_SEPARATOR) {
+        position++;
+    }
+
+    while (position < length) {
+
+        ULONG start = position;
+        BOOLEAN tilde = FALSE;
+        BOOLEAN colon = FALSE;
+        ULONG componentLength;
+
+        while (position < length && path[position] != DC_PATH_SEPARATOR) {
+            if (path[position] == L'~') {
+                tilde = TRUE;
+            } else if (path[position] == L':') {
+                colon = TRUE;
+            }
+            position++;
+        }
+
+        componentLength = position - start;
+
+        //  A single trailing separator ends the name, anything else
+        //  following this component makes it an intermediate one.
+        if (componentLength == 0 ||
+            (componentLength == 1 && path[start] == L'.') ||
+            (componentLength == 2 && path[start] == L'.' && path[start + 1] == L'.') ||
+            (colon && position + 1 < length) ||
+            (tilde && index >= depth && index < Trie->MaxDepth)) {
+
+            *Ambiguous = TRUE;
+            return DCTRIE_NO_ROOT;
+        }
+
+        index++;
+        position++;
+    }
+
+    return match;
+}
+
+BOOLEAN
+DcTrieHasRootBelow (
+    _In_ const DCTRIE *Trie,
+    _In_ PCUNICODE_STRING Prefix
+    )
+/*++
+Routine Description:
+    Tells whether any root is Prefix itself or lies below it, e.g.
+    whether a volume holds protected directories.
+Arguments:
+    Trie - Trie image built by DcTrieBuild.
+    Prefix - Path made of whole components, such as a volume name.
+Return Value:
+    TRUE if a root starts with the components of Prefix.
+--*/
+{
+    const DCTRIE_NODE *nodes = (const DCTRIE_NODE *)((const UCHAR *)Trie + Trie->NodesOffset);
+    PCWSTR pool = (PCWSTR)((const UCHAR *)Trie + Trie->LabelPoolOffset);
+    PCWSTR path = Prefix->Buffer;
+    ULONG length = (ULONG)(Prefix->Length / sizeof(WCHAR));
+    const DCTRIE_NODE *node = &nodes[0];
+    PCWSTR label = NULL;
+    ULONG labelRemaining = 0;
+    ULONG position = 0;
+
+    while (position < length && path[position] == DC_PATH_SEPARATOR) {
+        position++;
+    }
+
+    while (position < length) {
+
+        ULONG componentEnd = position;
+
+        while (componentEnd < length && path[componentEnd] != DC_PATH_SEPARATOR) {
+            componentEnd++;
+        }
+
+        if (labelRemaining == 0) {
+
+            //  The current node is used up, continue with the child that
+            //  starts with this component.
+            const DCTRIE_NODE *child = NULL;
+            ULONG low = 0;
+            ULONG high = node->ChildCount;
+
+            while (low < high) {
+
+                ULONG middle = low + (high - low) / 2;
+                const DCTRIE_NODE *candidate = &nodes[node->FirstChild + middle];
+                LONG order = DcTrieCompareLabel( path + position,
+                                                 componentEnd - position,
+                                                 pool + candidate->LabelOffset,
+                                                 candidate->FirstComponentLength );
+
+                if (order == 0) {
+                    child = candidate;
+                    break;
+                }
+
+                if (order < 0) {
+                    high = middle;
+                } else {
+                    low = middle + 1;
+                }
+            }
+
+            if (child == NULL) {
+                return FALSE;
+            }
+
+            node = child;
+            label = pool + child->LabelOffset + child->FirstComponentLength;
+            labelRemaining = child->LabelLength - child->FirstComponentLength;
+
+        } else {
+
+            //  The rest of the label is a separator followed by whole
+            //  components.
+            ULONG labelComponent = 1;
+
+            while (labelComponent < labelRemaining && label[labelComponent] != DC_PATH_SEPARATOR) {
+                labelComponent++;
+            }
+
+            if (0 != DcTrieCompareLabel( path + position,
+                                         componentEnd - position,
+                                         label + 1,
+                                         labelComponent - 1 )) {
+                return FALSE;
+            }
+
+            label += labelComponent;
+            labelRemaining -= labelComponent;
+        }
+
+        position = componentEnd + 1;
+    }
+
+    //  Every node below the trie root leads to at least one root.
+    return (BOOLEAN)(node != &nodes[0] || node->ChildCount != 0);
+}
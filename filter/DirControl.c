@@ -13,29 +13,38 @@ Environment:
 #include <dontuse.h>
 #include <suppress.h>
 #include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "dcimage.h"
+#include "dcwire.h"
+#include "dcslot.h"
 #include "DirControl.h"
 #pragma prefast(disable:__WARNING_ENCODE_MEMBER_FUNCTION_POINTER, "Not valid for kernel mode drivers")
 
 #define DIRCTL_REG_TAG       'Rncs'
 #define DIRCTL_STRING_TAG    'Sncs'
+#define DIRCTL_INPUT_TAG     'Incs'
+#define DIRCTL_POLICY_TAG    'Pncs'
+#define DIRCTL_CONTEXT_TAG   'Cncs'
+#define DIRCTL_VOLUME_TAG    'Vncs'
+#define DIRCTL_HANDLE_TAG    'Hncs'
 //  Structure that contains all the global data structures
 //  used throughout the DirControl.
 
 DIRCTL_DATA DirCtlData;
-UNICODE_STRING g_DirPathToProtect;
+DCSLOTS g_PolicySlots;
 BOOLEAN g_EnableProtection;
-FAST_MUTEX g_DirPathLock;
-FAST_MUTEX g_MsgLock;
-
-typedef NTSTATUS(*QUERY_INFO_PROCESS) (
-    __in HANDLE ProcessHandle,
-    __in PROCESSINFOCLASS ProcessInformationClass,
-    __out_bcount(ProcessInformationLength) PVOID ProcessInformation,
-    __in ULONG ProcessInformationLength,
-    __out_opt PULONG ReturnLength
-    );
+volatile LONG DirCtlPolicySequence;
+FAST_MUTEX g_PolicyLock;
+ERESOURCE g_InstanceLock;
+DIRCTL_POOL g_CreateContextPool;
 
-QUERY_INFO_PROCESS ZwQueryInformationProcess;
+//  Extension rule of the service key, for policies whose message has
+//  none, or NULL if every file below the roots is protected.
+PDCAPP_EXTENSIONS g_DefaultExtensions;
+ULONG g_DefaultExtensionsLength;
 
 //  Function prototypes
 NTSTATUS
@@ -53,14 +62,30 @@ DirCtlPortDisconnect (
     );
 
 NTSTATUS
-DirCtlSendFileInfo(
+DirCtlGetFileName (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _Outptr_ PFLT_FILE_NAME_INFORMATION *NameInfo,
+    _Out_ PULONG RootId,
+    _Out_ PDCMODE_ENTRY Mode
+    );
+
+VOID
+DirCtlFreeCreateContext (
+    _In_ PDIRCTL_CREATE_CONTEXT CreateContext
+    );
+
+FLT_PREOP_CALLBACK_STATUS
+DirCtlDecideCreate (
     _Inout_ PFLT_CALLBACK_DATA Data,
-    PUNICODE_STRING FileName
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
     );
 
-BOOLEAN
-DirCtlCheckPath (
-    _In_ PUNICODE_STRING FileName
+NTSTATUS
+DirCtlQueueDenial (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PUNICODE_STRING FileName,
+    _In_ ACCESS_MASK AccessMask
     );
 
 NTSTATUS
@@ -73,11 +98,57 @@ DirCtlRecvMessage(
     OUT PULONG ReturnOutputBufferLength
 );
 
+VOID
+DirCtlLoadExtensions (
+    _In_ PUNICODE_STRING RegistryPath
+    );
+
+VOID
+DirCtlLoadPolicyImage (
+    _In_ PUNICODE_STRING RegistryPath
+    );
+
+NTSTATUS
+DirCtlQueryPolicyImage (
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
+VOID
+DirCtlFreePolicySlots (
+    VOID
+    );
+
+BOOLEAN
+DirCtlVolumeHasRoots (
+    _In_ PFLT_VOLUME Volume
+    );
+
+
+NTSTATUS
+DirCtlQueryStatistics (
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
 //  Assign text sections for each routine.
 #ifdef ALLOC_PRAGMA
     #pragma alloc_text(INIT, DriverEntry)
+    #pragma alloc_text(INIT, DirCtlQueryRegistryUlong)
+    #pragma alloc_text(INIT, DirCtlLoadExtensions)
+    #pragma alloc_text(INIT, DirCtlLoadPolicyImage)
+    #pragma alloc_text(PAGE, DirCtlQueryPolicyImage)
+    #pragma alloc_text(PAGE, DirCtlCreatePolicy)
+    #pragma alloc_text(PAGE, DirCtlCompileExtensions)
+    #pragma alloc_text(PAGE, DirCtlCompileDefaultExtensions)
     #pragma alloc_text(PAGE, DirCtlInstanceSetup)
+    #pragma alloc_text(PAGE, DirCtlVolumeHasRoots)
+    #pragma alloc_text(PAGE, DirCtlSyncInstances)
     #pragma alloc_text(PAGE, DirCtlPreCreate)
+    #pragma alloc_text(PAGE, DirCtlDecideCreate)
+    #pragma alloc_text(PAGE, DirCtlGetFileName)
     #pragma alloc_text(PAGE, DirCtlPostCreate)
     #pragma alloc_text(PAGE, DirCtlPortConnect)
     #pragma alloc_text(PAGE, DirCtlPortDisconnect)
@@ -97,15 +168,20 @@ const FLT_OPERATION_REGISTRATION Callbacks[] = {
       NULL},
 
     { IRP_MJ_WRITE,
-      0,
-      0,
+      FLTFL_OPERATION_REGISTRATION_SKIP_PAGING_IO,
+      DirCtlPreWrite,
+      NULL},
+
+    { IRP_MJ_SET_INFORMATION,
+      FLTFL_OPERATION_REGISTRATION_SKIP_PAGING_IO,
+      DirCtlPreSetInformation,
       NULL},
 
 #if (WINVER>=0x0602)
 
     { IRP_MJ_FILE_SYSTEM_CONTROL,
       0,
-      0,
+      DirCtlPreFsControl,
       NULL
     },
 
@@ -114,17 +190,28 @@ const FLT_OPERATION_REGISTRATION Callbacks[] = {
     { IRP_MJ_OPERATION_END}
 };
 
+const FLT_CONTEXT_REGISTRATION ContextRegistration[] = {
+
+    { FLT_STREAMHANDLE_CONTEXT,
+      0,
+      DirCtlHandleContextCleanup,
+      sizeof(DIRCTL_HANDLE_CONTEXT),
+      DIRCTL_HANDLE_TAG },
+
+    { FLT_CONTEXT_END }
+};
+
 const FLT_REGISTRATION FilterRegistration = {
 
     sizeof( FLT_REGISTRATION ),         //  Size
     FLT_REGISTRATION_VERSION,           //  Version
     0,                                  //  Flags
-    NULL,                               //  Context Registration.
+    ContextRegistration,                //  Context Registration.
     Callbacks,                          //  Operation callbacks
     DirCtlUnload,                       //  FilterUnload
     DirCtlInstanceSetup,                //  InstanceSetup
     DirCtlQueryTeardown,                //  InstanceQueryTeardown
-    NULL,                               //  InstanceTeardownStart
+    DirCtlInstanceTeardownStart,        //  InstanceTeardownStart
     NULL,                               //  InstanceTeardownComplete
     NULL,                               //  GenerateFileName
     NULL,                               //  GenerateDestinationFileName
@@ -156,7 +243,6 @@ Return Value:
     Returns STATUS_SUCCESS.
 --*/
 {
-    UNREFERENCED_PARAMETER(RegistryPath);
     OBJECT_ATTRIBUTES oa;
     UNICODE_STRING uniString;
     PSECURITY_DESCRIPTOR sd;
@@ -164,11 +250,99 @@ Return Value:
 
     ExInitializeDriverRuntime( DrvRtPoolNxOptIn );
 
+    ExInitializeFastMutex(&g_PolicyLock);
+    DirCtlInitializeUpdates();
+    g_EnableProtection = FALSE;
+
+    status = ExInitializeResourceLite( &g_InstanceLock );
+    if (!NT_SUCCESS( status )) {
+        return status;
+    }
+
+    //  No policy is published until the first control message.
+    status = DcSlotsInitialize( &g_PolicySlots );
+    if (!NT_SUCCESS( status )) {
+        ExDeleteResourceLite( &g_InstanceLock );
+        return status;
+    }
+
+    status = DirCtlInitializeCounters();
+    if (!NT_SUCCESS( status )) {
+        DirCtlFreePolicySlots();
+        ExDeleteResourceLite( &g_InstanceLock );
+        return status;
+    }
+
+    status = DirCtlInitializeNegativeCache();
+    if (!NT_SUCCESS( status )) {
+        DirCtlFreeCounters();
+        DirCtlFreePolicySlots();
+        ExDeleteResourceLite( &g_InstanceLock );
+        return status;
+    }
+
+    status = DirCtlInitializePool( &g_CreateContextPool,
+                                   sizeof(DIRCTL_CREATE_CONTEXT),
+                                   DIRCTL_CONTEXT_TAG,
+                                   DCAPP_COUNTER_CONTEXT_ALLOCATIONS,
+                                   DCAPP_COUNTER_CONTEXT_FREES );
+    if (!NT_SUCCESS( status )) {
+        DirCtlFreeNegativeCache();
+        DirCtlFreeCounters();
+        DirCtlFreePolicySlots();
+        ExDeleteResourceLite( &g_InstanceLock );
+        return status;
+    }
+
+    //  Processes are matched against the allowlist from the notify
+    //  routine the process cache registers.
+    DirCtlInitializeTrust();
+    DirCtlInitializeProcessCache();
+
     status = FltRegisterFilter( DriverObject, &FilterRegistration, &DirCtlData.Filter );
     if (!NT_SUCCESS( status )) {
+        DirCtlFreeProcessCache();
+        DirCtlFreeTrust();
+        DirCtlDeletePool( &g_CreateContextPool );
+        DirCtlFreeNegativeCache();
+        DirCtlFreeCounters();
+        DirCtlFreePolicySlots();
+        ExDeleteResourceLite( &g_InstanceLock );
+        return status;
+    }
+
+    status = DirCtlStartEventQueue();
+    if (!NT_SUCCESS( status )) {
+        FltUnregisterFilter( DirCtlData.Filter );
+        DirCtlFreeProcessCache();
+        DirCtlFreeTrust();
+        DirCtlDeletePool( &g_CreateContextPool );
+        DirCtlFreeNegativeCache();
+        DirCtlFreeCounters();
+        DirCtlFreePolicySlots();
+        ExDeleteResourceLite( &g_InstanceLock );
+        return status;
+    }
+
+    //  Repeats are reported through the event queue.
+    status = DirCtlInitializeDedup( RegistryPath );
+    if (!NT_SUCCESS( status )) {
+        DirCtlStopEventQueue();
+        FltUnregisterFilter( DirCtlData.Filter );
+        DirCtlFreeEventQueue();
+        DirCtlFreeProcessCache();
+        DirCtlFreeTrust();
+        DirCtlDeletePool( &g_CreateContextPool );
+        DirCtlFreeNegativeCache();
+        DirCtlFreeCounters();
+        DirCtlFreePolicySlots();
+        ExDeleteResourceLite( &g_InstanceLock );
         return status;
     }
 
+    DirCtlLoadExtensions( RegistryPath );
+    DirCtlLoadPolicyImage( RegistryPath );
+
     RtlInitUnicodeString( &uniString, DCAPPPortName);
     status = FltBuildDefaultSecurityDescriptor( &sd, FLT_PORT_ALL_ACCESS );
     if (NT_SUCCESS( status )) {
@@ -187,9 +361,6 @@ Return Value:
 
             status = FltStartFiltering( DirCtlData.Filter );
             if (NT_SUCCESS( status )) {
-                ExInitializeFastMutex(&g_DirPathLock);
-                ExInitializeFastMutex(&g_MsgLock);
-                g_EnableProtection = FALSE;
                 return STATUS_SUCCESS;
             }
 
@@ -197,10 +368,416 @@ Return Value:
         }
     }
 
+    DirCtlStopEventQueue();
     FltUnregisterFilter( DirCtlData.Filter );
+    if (g_DefaultExtensions != NULL) {
+        ExFreePoolWithTag( g_DefaultExtensions, DIRCTL_REG_TAG );
+    }
+    DirCtlFreeDedup();
+    DirCtlFreeEventQueue();
+    DirCtlFreeProcessCache();
+    DirCtlFreeTrust();
+    DirCtlDeletePool( &g_CreateContextPool );
+    DirCtlFreeNegativeCache();
+    DirCtlFreeCounters();
+    DirCtlFreePolicySlots();
+    ExDeleteResourceLite( &g_InstanceLock );
     return status;
 }
 
+ULONG
+DirCtlQueryRegistryUlong (
+    _In_ PUNICODE_STRING RegistryPath,
+    _In_ PCWSTR ValueName,
+    _In_ ULONG DefaultValue
+    )
+/*++
+Routine Description:
+    Reads a REG_DWORD value of the driver's service key.
+Arguments:
+    RegistryPath - The service key, as passed to DriverEntry.
+    ValueName - Name of the value.
+    DefaultValue - Returned if the value is missing or not a REG_DWORD.
+Return Value:
+    The value.
+--*/
+{
+    OBJECT_ATTRIBUTES oa;
+    UNICODE_STRING name;
+    HANDLE key;
+    UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)];
+    PKEY_VALUE_PARTIAL_INFORMATION info = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+    ULONG length;
+    ULONG value = DefaultValue;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    InitializeObjectAttributes( &oa, RegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL );
+    status = ZwOpenKey( &key, KEY_READ, &oa );
+    if (!NT_SUCCESS( status )) {
+        return DefaultValue;
+    }
+
+    RtlInitUnicodeString( &name, ValueName );
+    status = ZwQueryValueKey( key, &name, KeyValuePartialInformation, info, sizeof(buffer), &length );
+
+    if (NT_SUCCESS( status ) && info->Type == REG_DWORD && info->DataLength == sizeof(ULONG)) {
+        value = *(PULONG)info->Data;
+    }
+
+    ZwClose( key );
+    return value;
+}
+
+VOID
+DirCtlLoadExtensions (
+    _In_ PUNICODE_STRING RegistryPath
+    )
+/*++
+Routine Description:
+    Reads the extension rule of the service key: ExtensionRule, a
+    DCEXT_RULE_* value, and Extensions, the REG_MULTI_SZ list it applies
+    to. The rule is kept as a DCAPP_EXTENSIONS for an update that sets
+    none while no policy is in effect. A rule that does not compile is
+    ignored, which leaves every file below the roots protected.
+Arguments:
+    RegistryPath - The service key, as passed to DriverEntry.
+--*/
+{
+    OBJECT_ATTRIBUTES oa;
+    UNICODE_STRING name;
+    HANDLE key;
+    PKEY_VALUE_PARTIAL_INFORMATION info = NULL;
+    PDCAPP_EXTENSIONS extensions = NULL;
+    PDCAPP_ROOT entry;
+    PDCEXT_SET set;
+    PWCHAR string;
+    PWCHAR end;
+    ULONG rule;
+    ULONG length = 0;
+    ULONG size;
+    ULONG offset;
+    ULONG count;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    rule = DirCtlQueryRegistryUlong( RegistryPath, L"ExtensionRule", DCEXT_RULE_ALL );
+    if (rule == DCEXT_RULE_ALL) {
+        return;
+    }
+
+    InitializeObjectAttributes( &oa, RegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL );
+    status = ZwOpenKey( &key, KEY_READ, &oa );
+    if (!NT_SUCCESS( status )) {
+        return;
+    }
+
+    RtlInitUnicodeString( &name, L"Extensions" );
+    status = ZwQueryValueKey( key, &name, KeyValuePartialInformation, NULL, 0, &length );
+    if ((status == STATUS_BUFFER_TOO_SMALL || status == STATUS_BUFFER_OVERFLOW) &&
+        length <= DCAPP_MAX_INPUT_SIZE) {
+
+        info = ExAllocatePoolWithTag( PagedPool, length, DIRCTL_REG_TAG );
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        if (info != NULL) {
+            status = ZwQueryValueKey( key, &name, KeyValuePartialInformation, info, length, &length );
+        }
+    }
+
+    ZwClose( key );
+
+    if (!NT_SUCCESS( status ) || info == NULL || info->Type != REG_MULTI_SZ) {
+        goto Cleanup;
+    }
+
+    //  Size the packed list, then fill it. The strings end at the first
+    //  empty one or at the end of the data, terminated or not.
+    end = (PWCHAR)info->Data + info->DataLength / sizeof(WCHAR);
+    size = FIELD_OFFSET(DCAPP_EXTENSIONS, Extensions);
+    count = 0;
+    for (string = (PWCHAR)info->Data; string < end && *string != 0; string += length + 1) {
+
+        for (length = 0; string + length < end && string[length] != 0; length++) {
+            NOTHING;
+        }
+
+        if (length > DCEXT_MAX_LENGTH) {
+            status = STATUS_OBJECT_NAME_INVALID;
+            goto Cleanup;
+        }
+
+        size += DCAPP_ROOT_SIZE(length * sizeof(WCHAR));
+        count++;
+    }
+
+    extensions = ExAllocatePoolWithTag( PagedPool, size, DIRCTL_REG_TAG );
+    if (extensions == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    RtlZeroMemory( extensions, size );
+    extensions->Rule = rule;
+    extensions->ExtensionCount = count;
+    extensions->ExtensionsLength = size - FIELD_OFFSET(DCAPP_EXTENSIONS, Extensions);
+
+    offset = 0;
+    for (string = (PWCHAR)info->Data; string < end && *string != 0; string += length + 1) {
+
+        for (length = 0; string + length < end && string[length] != 0; length++) {
+            NOTHING;
+        }
+
+        entry = (PDCAPP_ROOT)&extensions->Extensions[offset];
+        entry->Length = (USHORT)(length * sizeof(WCHAR));
+        RtlCopyMemory( entry->Path, string, entry->Length );
+        offset += DCAPP_ROOT_SIZE(entry->Length);
+    }
+
+    status = DirCtlCompileExtensions( extensions, size, &set );
+    if (NT_SUCCESS( status )) {
+        if (set != NULL) {
+            DcExtFree( set );
+        }
+        g_DefaultExtensions = extensions;
+        g_DefaultExtensionsLength = size;
+        extensions = NULL;
+    }
+
+Cleanup:
+
+    if (!NT_SUCCESS( status )) {
+        DbgPrint( "!!! dir ctl -- ignoring extension rule, status 0x%X\n", status );
+    }
+
+    if (extensions != NULL) {
+        ExFreePoolWithTag( extensions, DIRCTL_REG_TAG );
+    }
+
+    if (info != NULL) {
+        ExFreePoolWithTag( info, DIRCTL_REG_TAG );
+    }
+}
+
+VOID
+DirCtlLoadPolicyImage (
+    _In_ PUNICODE_STRING RegistryPath
+    )
+/*++
+Routine Description:
+    Enforces the policy image DCApp stored in the PolicyImage value of
+    the service key, so that the roots are protected from the first
+    create on, before DCApp runs. The image is used where it is read
+    to; an image that does not validate is ignored.
+Arguments:
+    RegistryPath - The service key, as passed to DriverEntry.
+--*/
+{
+    OBJECT_ATTRIBUTES oa;
+    UNICODE_STRING name;
+    HANDLE key;
+    PKEY_VALUE_PARTIAL_INFORMATION info = NULL;
+    PDIRCTL_POLICY policy;
+    PVOID image = NULL;
+    ULONG length = 0;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    InitializeObjectAttributes( &oa, RegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL );
+    status = ZwOpenKey( &key, KEY_READ, &oa );
+    if (!NT_SUCCESS( status )) {
+        return;
+    }
+
+    RtlInitUnicodeString( &name, DCAPP_POLICY_IMAGE_VALUE );
+    status = ZwQueryValueKey( key, &name, KeyValuePartialInformation, NULL, 0, &length );
+    if ((status == STATUS_BUFFER_TOO_SMALL || status == STATUS_BUFFER_OVERFLOW) &&
+        length <= FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + DCIMAGE_MAX_SIZE) {
+
+        info = ExAllocatePoolWithTag( PagedPool, length, DIRCTL_REG_TAG );
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        if (info != NULL) {
+            status = ZwQueryValueKey( key, &name, KeyValuePartialInformation, info, length, &length );
+        }
+    }
+
+    ZwClose( key );
+
+    if (!NT_SUCCESS( status ) || info == NULL) {
+        goto Cleanup;
+    }
+
+    if (info->Type != REG_BINARY) {
+        status = STATUS_INVALID_IMAGE_FORMAT;
+        goto Cleanup;
+    }
+
+    //  The value data is not 8 byte aligned in the query buffer.
+    image = ExAllocatePoolWithTag( NonPagedPool, max( info->DataLength, 1 ), DIRCTL_POLICY_TAG );
+    policy = ExAllocatePoolWithTag( NonPagedPool, sizeof(DIRCTL_POLICY), DIRCTL_POLICY_TAG );
+    if (image == NULL || policy == NULL) {
+        if (policy != NULL) {
+            ExFreePoolWithTag( policy, DIRCTL_POLICY_TAG );
+        }
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    RtlCopyMemory( image, info->Data, info->DataLength );
+
+    status = DcImageValidate( image, info->DataLength );
+    if (!NT_SUCCESS( status )) {
+        ExFreePoolWithTag( policy, DIRCTL_POLICY_TAG );
+        goto Cleanup;
+    }
+
+    RtlZeroMemory( policy, sizeof(DIRCTL_POLICY) );
+    policy->Image = image;
+    policy->Core.Roots = DcImageRoots( image );
+    policy->Core.Modes = DcImageModes( image );
+    policy->Core.Extensions = DcImageExtensions( image );
+    image = NULL;
+
+    //  Instances are attached by FltStartFiltering, which sees the roots.
+    DirCtlPublishPolicy( policy );
+
+    DbgPrint( "!!! dir ctl -- enforcing stored policy, %u roots\n", policy->Core.Modes->RootCount );
+
+Cleanup:
+
+    if (!NT_SUCCESS( status ) && status != STATUS_OBJECT_NAME_NOT_FOUND) {
+        DbgPrint( "!!! dir ctl -- ignoring stored policy, status 0x%X\n", status );
+    }
+
+    if (image != NULL) {
+        ExFreePoolWithTag( image, DIRCTL_POLICY_TAG );
+    }
+
+    if (info != NULL) {
+        ExFreePoolWithTag( info, DIRCTL_REG_TAG );
+    }
+}
+
+VOID
+DirCtlFreePolicySlots (
+    VOID
+    )
+/*++
+Routine Description:
+    Releases the policy slots and whatever policy is still published.
+    Only called once no callback can reference a policy any more.
+--*/
+{
+    for (ULONG i = 0; i < DCSLOT_COUNT; i++) {
+
+        if (g_PolicySlots.Slots[i].Object != NULL) {
+            DirCtlFreePolicy( (PDIRCTL_POLICY)g_PolicySlots.Slots[i].Object );
+            g_PolicySlots.Slots[i].Object = NULL;
+        }
+    }
+
+    DcSlotsUninitialize( &g_PolicySlots );
+}
+
+PDIRCTL_POLICY
+DirCtlReferencePolicy (
+    VOID
+    )
+/*++
+Routine Description:
+    Returns the active policy without taking a lock. The reference only
+    touches this processor's rundown counter, so concurrent creates do
+    not contend with each other.
+Return Value:
+    The active policy, to be released with DirCtlDereferencePolicy, or
+    NULL if protection is off.
+--*/
+{
+    return (PDIRCTL_POLICY)DcSlotReference( &g_PolicySlots );
+}
+
+VOID
+DirCtlDereferencePolicy (
+    _In_ PDIRCTL_POLICY Policy
+    )
+{
+    DcSlotDereference( &g_PolicySlots, Policy->Slot );
+}
+
+VOID
+DirCtlPublishPolicy (
+    _In_opt_ PDIRCTL_POLICY Policy
+    )
+/*++
+Routine Description:
+    Makes Policy the active policy and frees the one it replaces once the
+    readers still using it are gone. Publishers are serialized by
+    g_PolicyLock; readers never take it.
+Arguments:
+    Policy - New policy, or NULL to turn protection off.
+--*/
+{
+    PDIRCTL_POLICY oldPolicy;
+    ULONG oldSlot;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&g_PolicyLock);
+
+    if (Policy != NULL) {
+        Policy->Slot = DcSlotNext( &g_PolicySlots );
+    }
+    oldSlot = DcSlotPublish( &g_PolicySlots, Policy );
+    g_EnableProtection = (BOOLEAN)(Policy != NULL);
+
+    //  Handle contexts decided under the previous policy are matched
+    //  again. Readers sample the sequence before the policy, so they can
+    //  only pair an older sequence with a newer policy.
+    InterlockedIncrement( &DirCtlPolicySequence );
+
+    //  Parent directories cached as unprotected under the previous policy
+    //  may be protected now.
+    DirCtlInvalidateNegativeCache();
+
+    //  Wait for the readers of the previous policy.
+    oldPolicy = (PDIRCTL_POLICY)DcSlotRetire( &g_PolicySlots, oldSlot );
+
+    ExReleaseFastMutex(&g_PolicyLock);
+
+    if (oldPolicy != NULL) {
+        DirCtlFreePolicy( oldPolicy );
+    }
+}
+
+VOID
+DirCtlFreePolicy (
+    _In_ PDIRCTL_POLICY Policy
+    )
+{
+    if (Policy->Image != NULL) {
+        ExFreePoolWithTag( Policy->Image, DIRCTL_POLICY_TAG );
+        ExFreePoolWithTag( Policy, DIRCTL_POLICY_TAG );
+        return;
+    }
+
+    if (Policy->Core.Roots != NULL) {
+        DcTrieFree( Policy->Core.Roots );
+    }
+
+    if (Policy->Core.Modes != NULL) {
+        DcModeFree( Policy->Core.Modes );
+    }
+
+    if (Policy->Core.Extensions != NULL) {
+        DcExtFree( Policy->Core.Extensions );
+    }
+
+    ExFreePoolWithTag( Policy, DIRCTL_POLICY_TAG );
+}
+
 
 NTSTATUS
 DirCtlPortConnect (
@@ -267,6 +844,7 @@ Return value
     UNREFERENCED_PARAMETER( ConnectionCookie );
     PAGED_CODE();
     FltCloseClientPort( DirCtlData.Filter, &DirCtlData.ClientPort );
+    DirCtlDetachRing();
     DirCtlData.UserProcess = NULL;
 }
 
@@ -289,8 +867,27 @@ Return Value:
     UNREFERENCED_PARAMETER( Flags );
     g_EnableProtection = FALSE;
     FltCloseCommunicationPort( DirCtlData.ServerPort );
+
+    //  The worker sends through the filter, stop it first. Callbacks may
+    //  still queue events until the filter is unregistered.
+    DirCtlStopEventQueue();
     FltUnregisterFilter( DirCtlData.Filter );
 
+    if (g_DefaultExtensions != NULL) {
+        ExFreePoolWithTag( g_DefaultExtensions, DIRCTL_REG_TAG );
+    }
+
+    //  Flushing repeats queues events, stop that before the queue goes.
+    DirCtlFreeDedup();
+    DirCtlFreeEventQueue();
+    DirCtlFreeProcessCache();
+    DirCtlFreeTrust();
+    DirCtlDeletePool( &g_CreateContextPool );
+    DirCtlFreeNegativeCache();
+    DirCtlFreeCounters();
+    DirCtlFreePolicySlots();
+    ExDeleteResourceLite( &g_InstanceLock );
+
     return STATUS_SUCCESS;
 }
 
@@ -306,8 +903,9 @@ DirCtlInstanceSetup (
 
 Routine Description:
     This routine is called by the filter manager when a new instance is created.
-    We specified in the registry that we only want for manual attachments,
-    so that is all we should receive here.
+    Instances are only attached to volumes that hold a protected root, so
+    creates on every other volume never reach the filter. DirCtlSyncInstances
+    attaches and detaches instances when the roots change.
 Arguments:
     FltObjects - Describes the instance and volume which we are being asked to
         setup.
@@ -320,7 +918,6 @@ Return Value:
   STATUS_FLT_DO_NOT_ATTACH  - no, thank you
 --*/
 {
-    UNREFERENCED_PARAMETER( FltObjects );
     UNREFERENCED_PARAMETER( Flags );
     UNREFERENCED_PARAMETER( VolumeFilesystemType );
 
@@ -334,7 +931,129 @@ Return Value:
        return STATUS_FLT_DO_NOT_ATTACH;
     }
 
-    return STATUS_SUCCESS;
+    if (!DirCtlVolumeHasRoots( FltObjects->Volume )) {
+
+        return STATUS_FLT_DO_NOT_ATTACH;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+DirCtlVolumeHasRoots (
+    _In_ PFLT_VOLUME Volume
+    )
+/*++
+Routine Description:
+    Checks whether the active policy protects a directory on the volume.
+Arguments:
+    Volume - Volume to check.
+Return Value:
+    TRUE if a protected root lies on the volume.
+--*/
+{
+    UNICODE_STRING volumeName;
+    PDIRCTL_POLICY policy;
+    BOOLEAN hasRoots = FALSE;
+    ULONG length = 0;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = FltGetVolumeName( Volume, NULL, &length );
+    if (status != STATUS_BUFFER_TOO_SMALL || length == 0 || length > MAXUSHORT) {
+        return FALSE;
+    }
+
+    volumeName.Buffer = ExAllocatePoolWithTag( PagedPool, length, DIRCTL_VOLUME_TAG );
+    if (volumeName.Buffer == NULL) {
+        return FALSE;
+    }
+    volumeName.Length = 0;
+    volumeName.MaximumLength = (USHORT)length;
+
+    status = FltGetVolumeName( Volume, &volumeName, NULL );
+    if (NT_SUCCESS( status )) {
+
+        policy = DirCtlReferencePolicy();
+        if (policy != NULL) {
+            hasRoots = DcTrieHasRootBelow( policy->Core.Roots, &volumeName );
+            DirCtlDereferencePolicy( policy );
+        }
+    }
+
+    ExFreePoolWithTag( volumeName.Buffer, DIRCTL_VOLUME_TAG );
+    return hasRoots;
+}
+
+VOID
+DirCtlSyncInstances (
+    VOID
+    )
+/*++
+Routine Description:
+    Attaches an instance to every volume that holds a protected root under
+    the active policy and detaches the instances from the volumes that no
+    longer do. Called after a new policy has been published.
+--*/
+{
+    PFLT_VOLUME *volumes = NULL;
+    PFLT_INSTANCE instance;
+    ULONG volumeCount = 0;
+    BOOLEAN attached;
+    NTSTATUS status;
+    ULONG i;
+
+    PAGED_CODE();
+
+    FltAcquireResourceExclusive( &g_InstanceLock );
+
+    status = FltEnumerateVolumes( DirCtlData.Filter, NULL, 0, &volumeCount );
+    if (status == STATUS_BUFFER_TOO_SMALL && volumeCount != 0) {
+
+        volumes = ExAllocatePoolWithTag( PagedPool, volumeCount * sizeof(PFLT_VOLUME),
+                                         DIRCTL_VOLUME_TAG );
+        if (volumes != NULL) {
+            status = FltEnumerateVolumes( DirCtlData.Filter, volumes, volumeCount, &volumeCount );
+        }
+    }
+
+    if (volumes == NULL || !NT_SUCCESS( status )) {
+
+        if (volumes != NULL) {
+            ExFreePoolWithTag( volumes, DIRCTL_VOLUME_TAG );
+        }
+        FltReleaseResource( &g_InstanceLock );
+        return;
+    }
+
+    for (i = 0; i < volumeCount; i++) {
+
+        attached = FALSE;
+        if (NT_SUCCESS( FltGetVolumeInstanceFromName( DirCtlData.Filter, volumes[i],
+                                                      NULL, &instance ) )) {
+            attached = TRUE;
+            FltObjectDereference( instance );
+        }
+
+        if (DirCtlVolumeHasRoots( volumes[i] )) {
+
+            //  DirCtlInstanceSetup turns down the volumes it should not
+            //  attach to, such as network volumes.
+            if (!attached) {
+                FltAttachVolume( DirCtlData.Filter, volumes[i], NULL, NULL );
+            }
+
+        } else if (attached) {
+
+            FltDetachVolume( DirCtlData.Filter, volumes[i], NULL );
+        }
+
+        FltObjectDereference( volumes[i] );
+    }
+
+    ExFreePoolWithTag( volumes, DIRCTL_VOLUME_TAG );
+    FltReleaseResource( &g_InstanceLock );
 }
 
 NTSTATUS
@@ -363,41 +1082,227 @@ Return Value:
 }
 
 
-BOOLEAN
+VOID
+DirCtlInstanceTeardownStart (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ FLT_INSTANCE_TEARDOWN_FLAGS Flags
+    )
+/*++
+Routine Description:
+    Called when an instance is being torn down. The negative lookup cache
+    is keyed by volume object, whose address may be reused once the
+    volume goes away, so it is invalidated here.
+Arguments:
+    FltObjects - Describes the instance being torn down.
+    Flags - Reason for the teardown.
+Return Value:
+    None.
+--*/
+{
+    UNREFERENCED_PARAMETER( FltObjects );
+    UNREFERENCED_PARAMETER( Flags );
+
+    DirCtlInvalidateNegativeCache();
+}
+
+
+ULONG
 DirCtlCheckPath (
-        _In_ PUNICODE_STRING FileName
+        _In_ PFLT_FILE_NAME_INFORMATION NameInfo,
+        _Out_opt_ PDCMODE_ENTRY Mode
     )
 /*++
 Routine Description:
-    Checks if this file name is something we are interested in
+    Checks if this file name is below one of the protected roots, see
+    DcPolicyCheckPath.
 Arguments
-    Extension - Pointer to the file name extension
+    NameInfo - Pointer to the normalized file name
+    Mode - Receives the mode of the root, under the same policy, or an
+        entry that denies nothing if the file is not protected, also when
+        the extension rule leaves it out.
 Return Value
-    TRUE - Yes we are interested
-    FALSE - No
+    The id of the deepest protected root above the file, or
+    DCTRIE_NO_ROOT if the file is not protected.
 --*/
 {
-    if (FileName->Length == 0) {
-        return FALSE;
+    if (Mode != NULL) {
+        RtlZeroMemory(Mode, sizeof(DCMODE_ENTRY));
+    }
+
+    if (NameInfo->Name.Length == 0) {
+        return DCTRIE_NO_ROOT;
     }
     
-    BOOLEAN bFound = FALSE;
-    ExAcquireFastMutex(&g_DirPathLock);
-    bFound = RtlPrefixUnicodeString(&g_DirPathToProtect, FileName, FALSE);
-    ExReleaseFastMutex(&g_DirPathLock);
-    return bFound;
+    ULONG rootId = DCTRIE_NO_ROOT;
+    PDIRCTL_POLICY policy = DirCtlReferencePolicy();
+    if (policy != NULL) {
+        LONG64 start = KeQueryPerformanceCounter(NULL).QuadPart;
+        rootId = DcPolicyCheckPath(&policy->Core, &NameInfo->Name, Mode);
+        DirCtlRecordLatency(DCAPP_LATENCY_PATH_MATCH, start);
+        DirCtlCount(DCAPP_COUNTER_PATH_LOOKUPS);
+        if (rootId != DCTRIE_NO_ROOT) {
+            DirCtlCount(DCAPP_COUNTER_PATH_MATCHES);
+        }
+        DirCtlDereferencePolicy(policy);
+    }
+    return rootId;
+}
+
+ULONG
+DirCtlCheckOpenedPath (
+    _In_ PFLT_FILE_NAME_INFORMATION NameInfo,
+    _Out_ PBOOLEAN Ambiguous,
+    _Out_opt_ PDCMODE_ENTRY Mode
+    )
+/*++
+Routine Description:
+    Checks if a file name that has not been normalized is below one of
+    the protected roots, see DcPolicyCheckOpenedPath.
+Arguments
+    NameInfo - Pointer to the opened file name
+    Ambiguous - Receives TRUE if the answer cannot be trusted and the
+        normalized name has to be checked instead.
+    Mode - Receives the mode of the root, under the same policy, or an
+        entry that denies nothing if the file is not protected, also when
+        the extension rule leaves it out.
+Return Value
+    The id of the deepest protected root above the file, or
+    DCTRIE_NO_ROOT if the file is not protected or the name is
+    ambiguous.
+--*/
+{
+    ULONG rootId = DCTRIE_NO_ROOT;
+    PDIRCTL_POLICY policy;
+    LONG64 start;
+
+    *Ambiguous = FALSE;
+    if (Mode != NULL) {
+        RtlZeroMemory(Mode, sizeof(DCMODE_ENTRY));
+    }
+
+    if (NameInfo->Name.Length == 0) {
+        *Ambiguous = TRUE;
+        return DCTRIE_NO_ROOT;
+    }
+
+    policy = DirCtlReferencePolicy();
+    if (policy != NULL) {
+        start = KeQueryPerformanceCounter(NULL).QuadPart;
+        rootId = DcPolicyCheckOpenedPath(&policy->Core, &NameInfo->Name, Ambiguous, Mode);
+        DirCtlRecordLatency(DCAPP_LATENCY_PATH_MATCH, start);
+        DirCtlCount(DCAPP_COUNTER_PATH_LOOKUPS);
+        if (rootId != DCTRIE_NO_ROOT) {
+            DirCtlCount(DCAPP_COUNTER_PATH_MATCHES);
+        }
+        DirCtlDereferencePolicy(policy);
+    }
+    return rootId;
+}
+
+NTSTATUS
+DirCtlGetFileName (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _Outptr_ PFLT_FILE_NAME_INFORMATION *NameInfo,
+    _Out_ PULONG RootId,
+    _Out_ PDCMODE_ENTRY Mode
+    )
+/*++
+Routine Description:
+    Gets the name of the file being created and matches it against the
+    protected roots, using the cheapest name that gives a reliable answer.
+
+    The opened name is built from the file object without asking the
+    file system and is matched against every spelling of the roots. Only
+    if that match is ambiguous is the normalized name used, from the
+    filter manager's name cache if it is there, by normalizing the name
+    otherwise.
+Arguments:
+    Data - Pre create callback data.
+    NameInfo - Receives the referenced name the match was made on.
+    RootId - Receives the id of the protected root above the file, or
+        DCTRIE_NO_ROOT.
+    Mode - Receives the mode of that root.
+Return Value:
+    The status of the name query.
+--*/
+{
+    PFLT_FILE_NAME_INFORMATION nameInfo;
+    BOOLEAN ambiguous;
+    NTSTATUS status;
+    LONG64 start;
+
+    PAGED_CODE();
+
+    *NameInfo = NULL;
+    *RootId = DCTRIE_NO_ROOT;
+    RtlZeroMemory(Mode, sizeof(DCMODE_ENTRY));
+
+    //  The opened name of an open by file id is the id, not a path.
+    if (!FlagOn(Data->Iopb->Parameters.Create.Options, FILE_OPEN_BY_FILE_ID)) {
+
+        start = KeQueryPerformanceCounter(NULL).QuadPart;
+        status = FltGetFileNameInformation(Data, FLT_FILE_NAME_OPENED |
+                                            FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo);
+        DirCtlRecordLatency(DCAPP_LATENCY_NAME_QUERY, start);
+        DirCtlCount(DCAPP_COUNTER_NAME_QUERIES);
+        if (NT_SUCCESS(status)) {
+
+            *RootId = DirCtlCheckOpenedPath(nameInfo, &ambiguous, Mode);
+            if (!ambiguous) {
+                DirCtlCount(DCAPP_COUNTER_OPENED_NAMES);
+                *NameInfo = nameInfo;
+                return STATUS_SUCCESS;
+            }
+
+            FltReleaseFileNameInformation(nameInfo);
+        } else {
+            DirCtlCount(DCAPP_COUNTER_NAME_QUERY_FAILURES);
+        }
+    }
+
+    //  A name missing from the cache is not counted as a failed query.
+    start = KeQueryPerformanceCounter(NULL).QuadPart;
+    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED |
+                                        FLT_FILE_NAME_QUERY_CACHE_ONLY, &nameInfo);
+    DirCtlRecordLatency(DCAPP_LATENCY_NAME_QUERY, start);
+    DirCtlCount(DCAPP_COUNTER_NAME_QUERIES);
+    if (NT_SUCCESS(status)) {
+
+        DirCtlCount(DCAPP_COUNTER_CACHED_NAMES);
+
+    } else {
+
+        start = KeQueryPerformanceCounter(NULL).QuadPart;
+        status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED |
+                                            FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo);
+        DirCtlRecordLatency(DCAPP_LATENCY_NAME_QUERY, start);
+        DirCtlCount(DCAPP_COUNTER_NAME_QUERIES);
+        if (!NT_SUCCESS(status)) {
+            DirCtlCount(DCAPP_COUNTER_NAME_QUERY_FAILURES);
+            return status;
+        }
+
+        DirCtlCount(DCAPP_COUNTER_NORMALIZED_NAMES);
+    }
+
+    *RootId = DirCtlCheckPath(nameInfo, Mode);
+    *NameInfo = nameInfo;
+    return STATUS_SUCCESS;
 }
 
 FLT_PREOP_CALLBACK_STATUS
-DirCtlPreCreate(
+DirCtlDecideCreate(
     _Inout_ PFLT_CALLBACK_DATA Data,
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
     _Flt_CompletionContext_Outptr_ PVOID* CompletionContext
 )
 /* --
 Routine Description :
-Pre create callback. If the file is opened with FILE_SUPERSEDE, FILE_OVERWRITE, 
-FILE_OVERWRITE_IF option then denying the access.
+Decides on a create for the pre create callback. Creates below a protected root that ask for access,
+create options or a disposition the mode of the root denies are denied
+here, before the file system opens the file. Creates of files outside
+the protected roots are let through without a post create callback; the
+others get one, which attaches a handle context.
 Arguments :
     Data - The structure which describes the operation parameters.
     FltObject - The structure which describes the objects affected by this
@@ -405,63 +1310,146 @@ Arguments :
     CompletionContext - Output parameter which can be used to pass a context
     from this pre - create callback to the post - create callback.
 Return Value :
-    FLT_PREOP_COMPLETE - if file is opened with FILE_SUPERSEDE, FILE_OVERWRITE,
-    FILE_OVERWRITE_IF option. otherwise
-    FLT_PREOP_SUCCESS_WITH_CALLBACK.
+    FLT_PREOP_COMPLETE - the create is denied, or failed for lack of memory.
+    FLT_PREOP_SUCCESS_WITH_CALLBACK - the file is protected, CompletionContext
+    receives a DIRCTL_CREATE_CONTEXT for the post create callback.
+    FLT_PREOP_SUCCESS_NO_CALLBACK - the create is allowed.
  */
 {
-    UNREFERENCED_PARAMETER(CompletionContext);
-    UNREFERENCED_PARAMETER(FltObjects);
-
     NTSTATUS status;
     PFLT_FILE_NAME_INFORMATION nameInfo;
-    BOOLEAN safeToOpen = TRUE;
-    BOOLEAN checkFile;
-    FLT_PREOP_CALLBACK_STATUS returnValue = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+    PDIRCTL_CREATE_CONTEXT createContext;
+    DIRCTL_PARENT_KEY parentKey;
+    DCMODE_ENTRY mode;
+    ACCESS_MASK desiredAccess;
+    BOOLEAN cacheable;
+    ULONG rootId;
+    ULONG decision;
+    LONG policySequence;
+
+    PAGED_CODE();
+
+    *CompletionContext = NULL;
+
+    DirCtlCount(DCAPP_COUNTER_PRE_CREATE);
 
     if (g_EnableProtection == FALSE) {
-        return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
     }
 
-    status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED |
-                                        FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo);
+    //  Processes on the allowlist were decided on when they started.
+    if (DirCtlIsTrustedProcess(UlongToHandle(FltGetRequestorProcessId(Data)))) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    policySequence = ReadAcquire(&DirCtlPolicySequence);
+
+    //  Most creates happen in directories far from any protected root;
+    //  answer those from the negative cache without a name query.
+    cacheable = DirCtlGetParentKey(Data, FltObjects, &parentKey);
+    if (cacheable && DirCtlLookupNegativeCache(&parentKey)) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    status = DirCtlGetFileName(Data, &nameInfo, &rootId, &mode);
     if (!NT_SUCCESS(status)) {
-        return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
     }
 
-    FltParseFileNameInformation(nameInfo);
+    desiredAccess = Data->Iopb->Parameters.Create.SecurityContext->DesiredAccess;
+    decision = DcPolicyDecideCreate(rootId, &mode, desiredAccess, Data->Iopb->Parameters.Create.Options);
 
-    checkFile = DirCtlCheckPath(&nameInfo->Name);
+    if (decision == DCPOLICY_ALLOW) {
+        //  Nothing below the parent directory is protected either.
+        if (cacheable) {
+            DirCtlInsertNegativeCache(&parentKey);
+        }
 
-    if (!checkFile) {
         //  Release file name info, we're done with it
         FltReleaseFileNameInformation(nameInfo);
-        return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
     }
 
-    UCHAR createDisposition = (UCHAR)(Data->Iopb->Parameters.Create.Options >> 24);
-
-    if (createDisposition == FILE_SUPERSEDE || createDisposition == FILE_OVERWRITE
-        || createDisposition == FILE_OVERWRITE_IF) {
-
-        safeToOpen = FALSE;
-        DirCtlSendFileInfo(Data, &nameInfo->Name);
+    //  Below a root, but of an extension the rule leaves alone. The
+    //  parent directory still holds protected files, so it is not cached.
+    if (decision == DCPOLICY_ALLOW_EXCLUDED) {
+        FltReleaseFileNameInformation(nameInfo);
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
     }
 
-    //  Release file name info, we're done with it
-    FltReleaseFileNameInformation(nameInfo);
+    //  Deciding here spares the file system the open, and the filter the
+    //  cleanup and close that FltCancelFileOpen would send down again.
+    if (decision == DCPOLICY_DENY) {
 
-    if (!safeToOpen) {
-        //  Ask the filter manager to undo the create.
-        DbgPrint("!!! dir ctl -- undoing create \n");
+        DirCtlCount(DCAPP_COUNTER_DENIED_CREATES);
+        DirCtlSendFileInfo(Data, &nameInfo->Name, desiredAccess);
+
+        //  Release file name info, we're done with it
+        FltReleaseFileNameInformation(nameInfo);
 
         Data->IoStatus.Status = STATUS_ACCESS_DENIED;
         Data->IoStatus.Information = 0;
 
-        returnValue = FLT_PREOP_COMPLETE;
+        return FLT_PREOP_COMPLETE;
     }
 
-    return returnValue;
+    //  Hand the name and the match over to the post create callback so
+    //  that it does not have to query and match the name again. Without
+    //  the post create check, e.g. a MAXIMUM_ALLOWED open could keep the
+    //  write access the mode denies, so the create fails instead.
+    createContext = DirCtlAllocateFromPool(&g_CreateContextPool);
+    if (createContext == NULL) {
+        FltReleaseFileNameInformation(nameInfo);
+
+        Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        Data->IoStatus.Information = 0;
+
+        return FLT_PREOP_COMPLETE;
+    }
+
+    createContext->NameInfo = nameInfo;
+    createContext->RootId = rootId;
+    createContext->DeniedAccess = mode.DeniedAccess;
+    createContext->DeniedCreations = mode.DeniedCreations;
+    createContext->PolicySequence = policySequence;
+    *CompletionContext = createContext;
+
+    return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+DirCtlPreCreate (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    )
+/*++
+Routine Description:
+    Pre create callback. Times DirCtlDecideCreate and reports the create
+    to TraceLogging sessions that asked for creates.
+Return Value:
+    That of DirCtlDecideCreate.
+--*/
+{
+    FLT_PREOP_CALLBACK_STATUS result;
+    LONG64 start;
+
+    PAGED_CODE();
+
+    start = KeQueryPerformanceCounter(NULL).QuadPart;
+    result = DirCtlDecideCreate(Data, FltObjects, CompletionContext);
+    DirCtlRecordLatency(DCAPP_LATENCY_PRE_CREATE, start);
+
+    TraceLoggingWrite(g_DirCtlProvider,
+                      "PreCreate",
+                      TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                      TraceLoggingKeyword(DIRCTL_KEYWORD_CREATE),
+                      TraceLoggingUInt32(FltGetRequestorProcessId(Data), "ProcessId"),
+                      TraceLoggingHexUInt32(Data->Iopb->Parameters.Create.Options, "Options"),
+                      TraceLoggingUInt32((ULONG)result, "Result"),
+                      TraceLoggingInt64(KeQueryPerformanceCounter(NULL).QuadPart - start, "Ticks"));
+
+    return result;
 }
 
 FLT_POSTOP_CALLBACK_STATUS
@@ -473,12 +1461,18 @@ DirCtlPostCreate (
     )
 /*++
 Routine Description:
-    Post create callback.  
+    Post create callback. Only called for files below a protected root.
+    The open is undone if the file system granted access the mode of the
+    root denies, which only MAXIMUM_ALLOWED can lead to, or created a
+    file or directory the mode does not let be added, which e.g.
+    FILE_OPEN_IF can; the file created is deleted first. Otherwise a
+    handle context is attached so that later writes are decided without
+    a name query.
 Arguments:
     Data - The structure which describes the operation parameters.
     FltObject - The structure which describes the objects affected by this
         operation.
-    CompletionContext - The operation context passed fron the pre-create
+    CompletionContext - The DIRCTL_CREATE_CONTEXT passed from the pre-create
         callback.
     Flags - Flags to say why we are getting this post-operation callback.
 Return Value:
@@ -486,200 +1480,474 @@ Return Value:
                                      access to this file, hence undo the open
 --*/
 {
-    FLT_POSTOP_CALLBACK_STATUS returnStatus = FLT_POSTOP_FINISHED_PROCESSING;
+    PDIRCTL_CREATE_CONTEXT createContext = CompletionContext;
     PFLT_FILE_NAME_INFORMATION nameInfo;
-    NTSTATUS status;
+    PACCESS_STATE accessState;
+    FILE_DISPOSITION_INFORMATION disposition;
+    ULONG options = Data->Iopb->Parameters.Create.Options;
     BOOLEAN safeToOpen = TRUE;
-    BOOLEAN checkFile;
+    LONG64 start;
 
-    UNREFERENCED_PARAMETER( CompletionContext );
-    UNREFERENCED_PARAMETER( Flags );
+    PAGED_CODE();
+
+    start = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    FLT_ASSERT(createContext != NULL);
+    nameInfo = createContext->NameInfo;
 
-    if (!NT_SUCCESS( Data->IoStatus.Status ) ||
+    DirCtlCount(DCAPP_COUNTER_POST_CREATE);
+
+    if (FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING) ||
+        !NT_SUCCESS( Data->IoStatus.Status ) ||
         (STATUS_REPARSE == Data->IoStatus.Status)) {
-        return FLT_POSTOP_FINISHED_PROCESSING;
-    }
 
-    if (g_EnableProtection == FALSE) {
+        DirCtlFreeCreateContext(createContext);
+        DirCtlRecordLatency(DCAPP_LATENCY_POST_CREATE, start);
         return FLT_POSTOP_FINISHED_PROCESSING;
     }
 
-    status = FltGetFileNameInformation( Data, FLT_FILE_NAME_NORMALIZED |
-                                        FLT_FILE_NAME_QUERY_DEFAULT, &nameInfo );
-    if (!NT_SUCCESS( status )) {
-        return FLT_POSTOP_FINISHED_PROCESSING;
-    }
+    accessState = Data->Iopb->Parameters.Create.SecurityContext->AccessState;
+    if (DcPolicyDeniesOpen(createContext->DeniedAccess, accessState->PreviouslyGrantedAccess)) {
 
-    FltParseFileNameInformation( nameInfo );
+        safeToOpen = FALSE;
+        DirCtlCount(DCAPP_COUNTER_DENIED_OPENS);
+        DirCtlSendFileInfo( Data, &nameInfo->Name, accessState->PreviouslyGrantedAccess);
 
-    checkFile = DirCtlCheckPath( &nameInfo->Name );
+    } else if (DcPolicyDeniesCreated(createContext->DeniedCreations, options,
+                                     Data->IoStatus.Information)) {
 
-    if (!checkFile) {
-        //  Release file name info, we're done with it
-        FltReleaseFileNameInformation(nameInfo);
-        return FLT_POSTOP_FINISHED_PROCESSING;
-    }
+        //  Cancelling the open leaves what was created; the file is
+        //  marked for deletion through the handle that created it, and
+        //  goes when the cancel closes it.
+        safeToOpen = FALSE;
+        disposition.DeleteFile = TRUE;
+        FltSetInformationFile( FltObjects->Instance, FltObjects->FileObject, &disposition,
+                               sizeof(FILE_DISPOSITION_INFORMATION), FileDispositionInformation );
 
-    if (FlagOn(Data->Iopb->Parameters.Create.SecurityContext->DesiredAccess,
-        FILE_WRITE_DATA | FILE_APPEND_DATA |
-        DELETE | FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA |
-        WRITE_DAC | WRITE_OWNER | ACCESS_SYSTEM_SECURITY) 
-        || FlagOn(Data->Iopb->Parameters.Create.Options, FILE_DELETE_ON_CLOSE)) {
+        DirCtlCount(DCAPP_COUNTER_DENIED_CREATES);
+        DirCtlSendFileInfo( Data, &nameInfo->Name,
+                            FlagOn(options, FILE_DIRECTORY_FILE) ? FILE_ADD_SUBDIRECTORY : FILE_ADD_FILE );
 
-        safeToOpen = FALSE;
-        DirCtlSendFileInfo( Data, &nameInfo->Name);
+    } else {
+
+        //  Takes over the name on success.
+        DirCtlSetHandleContext( FltObjects, createContext );
     }
-   
-    //  Release file name info, we're done with it
-    FltReleaseFileNameInformation(nameInfo);
+
+    //  Release the context and its file name info, we're done with it
+    DirCtlFreeCreateContext(createContext);
 
     if (!safeToOpen) {
         //  Ask the filter manager to undo the create.
-        DbgPrint( "!!! dir ctl -- undoing create \n" );
-
         FltCancelFileOpen( FltObjects->Instance, FltObjects->FileObject );
 
         Data->IoStatus.Status = STATUS_ACCESS_DENIED;
         Data->IoStatus.Information = 0;
+    }
+
+    DirCtlRecordLatency(DCAPP_LATENCY_POST_CREATE, start);
+
+    TraceLoggingWrite(g_DirCtlProvider,
+                      "PostCreate",
+                      TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                      TraceLoggingKeyword(DIRCTL_KEYWORD_CREATE),
+                      TraceLoggingUInt32(FltGetRequestorProcessId(Data), "ProcessId"),
+                      TraceLoggingBoolean(!safeToOpen, "Undone"),
+                      TraceLoggingInt64(KeQueryPerformanceCounter(NULL).QuadPart - start, "Ticks"));
+
+    return FLT_POSTOP_FINISHED_PROCESSING;
+}
 
-        returnStatus = FLT_POSTOP_FINISHED_PROCESSING;
+VOID
+DirCtlFreeCreateContext (
+    _In_ PDIRCTL_CREATE_CONTEXT CreateContext
+    )
+{
+    if (CreateContext->NameInfo != NULL) {
+        FltReleaseFileNameInformation(CreateContext->NameInfo);
     }
+    DirCtlFreeToPool(&g_CreateContextPool, CreateContext);
+}
 
-    return returnStatus;
+NTSTATUS
+DirCtlSendFileInfo (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PUNICODE_STRING FileName,
+    _In_ ACCESS_MASK AccessMask
+    )
+/*++
+Routine Description:
+    Reports a denial: times DirCtlQueueDenial and writes the denial to
+    TraceLogging sessions that asked for denials, also when DCApp is not
+    connected.
+Return Value:
+    That of DirCtlQueueDenial.
+--*/
+{
+    NTSTATUS status;
+    LONG64 start = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    status = DirCtlQueueDenial(Data, FileName, AccessMask);
+    DirCtlRecordLatency(DCAPP_LATENCY_NOTIFY, start);
+
+    TraceLoggingWrite(g_DirCtlProvider,
+                      "Denial",
+                      TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+                      TraceLoggingKeyword(DIRCTL_KEYWORD_DENIAL),
+                      TraceLoggingUInt32(FltGetRequestorProcessId(Data), "ProcessId"),
+                      TraceLoggingUInt8(Data->Iopb->MajorFunction, "MajorFunction"),
+                      TraceLoggingHexUInt32(AccessMask, "AccessMask"),
+                      TraceLoggingCountedWideString(FileName->Buffer,
+                                                    FileName->Length / sizeof(WCHAR),
+                                                    "FileName"),
+                      TraceLoggingNTStatus(status, "Status"),
+                      TraceLoggingInt64(KeQueryPerformanceCounter(NULL).QuadPart - start, "Ticks"));
+
+    return status;
 }
 
-NTSTATUS GetProcessImageName(
-    PUNICODE_STRING ProcessImageName
-)
+NTSTATUS
+DirCtlQueueDenial (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PUNICODE_STRING FileName,
+    _In_ ACCESS_MASK AccessMask
+    )
+/*++
+Routine Description:
+    This routine is called to queue a denial event for user mode. The
+    event is sent by the event queue worker; this thread does not wait
+    for DCApp. Repeats within the coalescing window are only counted.
+Arguments:
+    Data - The denied operation.
+    FileName -   Name of the file.
+    AccessMask - Access the operation asked for or was granted.
+Return Value:
+    STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES if the event queue
+    is full and the event was dropped.
+--*/
 {
     NTSTATUS status;
-    ULONG returnedLength;
-    ULONG bufferLength;
-    PVOID buffer;
-    PUNICODE_STRING imageName;
+    PVOID record;
+    WCHAR processName[DIRCTL_PROCESS_NAME_SIZE / sizeof(WCHAR)];
+    UNICODE_STRING pni;
+    LARGE_INTEGER systemTime;
+    DCWIRE_EVENT event;
+    DIRCTL_DEDUP_KEY key;
+    LONG position;
+
+    //  If not client port just return.
+    if (DirCtlData.ClientPort == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    //  The thread that issued the operation, not necessarily the current
+    //  one, e.g. when the create was posted to a worker.
+    PEPROCESS objCurProcess = IoThreadToProcess(Data->Thread);
+
+    KeQuerySystemTime(&systemTime);
+
+    //  A repeat of a denial reported within the coalescing window is only
+    //  counted, before anything expensive is done for it.
+    DirCtlGetDedupKey(PsGetProcessId(objCurProcess), FileName, Data->Iopb->MajorFunction, &key);
+    if (DirCtlSuppressEvent(&key, systemTime.QuadPart)) {
+        return STATUS_SUCCESS;
+    }
+
+    //  Look the image name up before taking a slot, the worker drains the
+    //  slots in order and must not wait for this.
+    RtlInitEmptyUnicodeString(&pni, processName, sizeof(processName));
+    status = DirCtlGetProcessName(objCurProcess, &pni);
+    if (!NT_SUCCESS(status)) {
+        pni.Length = 0;
+    }
+
+    RtlZeroMemory(&event, sizeof(event));
+    event.Type = DCWIRE_RECORD_DENIAL;
+    event.ProcessId = (ULONG64)(ULONG_PTR)PsGetProcessId(objCurProcess);
+    event.ThreadId = (ULONG64)(ULONG_PTR)PsGetThreadId(Data->Thread);
+    event.Timestamp = systemTime.QuadPart;
+    event.LastTimestamp = systemTime.QuadPart;
+    event.Operation = Data->Iopb->MajorFunction;
+    event.AccessMask = AccessMask;
+    event.FilePath = FileName->Buffer;
+    event.FilePathLength = FileName->Length / sizeof(WCHAR);
+    event.ProcessName = pni.Buffer;
+    event.ProcessNameLength = pni.Length / sizeof(WCHAR);
+
+    record = DirCtlReserveEvent(&position);
+    if (record == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //  Names that do not fit in the slot are truncated and flagged.
+    DcWireEncodeRecord(record, DIRCTL_EVENT_RECORD_SIZE, &event);
+    DirCtlRememberEvent(&key, record);
+
+    DirCtlCommitEvent(position);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+DirCtlCompileExtensions (
+    _In_ PDCAPP_EXTENSIONS Extensions,
+    _In_ ULONG ExtensionsLength,
+    _Outptr_result_maybenull_ PDCEXT_SET *Set
+    )
+/*++
+Routine Description:
+    Validates an extension rule and compiles it.
+Arguments:
+    Extensions - Captured rule, from an update or from the service key.
+    ExtensionsLength - Size of the rule in bytes.
+    Set - Receives the compiled rule, to be freed with DcExtFree, or NULL
+        if every file is protected.
+Return Value:
+    STATUS_SUCCESS or an error if the rule is malformed.
+--*/
+{
+    PUNICODE_STRING names = NULL;
+    PDCAPP_ROOT entry;
+    LARGE_INTEGER counter;
+    ULONG64 seed;
+    ULONG random;
+    ULONG offset = 0;
+    ULONG i;
+    NTSTATUS status = STATUS_SUCCESS;
 
     PAGED_CODE();
 
-    if (NULL == ZwQueryInformationProcess) {
-        UNICODE_STRING routineName;
-        RtlInitUnicodeString(&routineName, L"ZwQueryInformationProcess");
-        ZwQueryInformationProcess =
-            (QUERY_INFO_PROCESS)MmGetSystemRoutineAddress(&routineName);
-        if (NULL == ZwQueryInformationProcess) {
-            DbgPrint("Cannot resolve ZwQueryInformationProcess\n");
+    *Set = NULL;
+
+    if (ExtensionsLength < (ULONG)FIELD_OFFSET(DCAPP_EXTENSIONS, Extensions) ||
+        Extensions->ExtensionsLength > ExtensionsLength - FIELD_OFFSET(DCAPP_EXTENSIONS, Extensions) ||
+        Extensions->ExtensionCount > DCEXT_MAX_EXTENSIONS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Extensions->ExtensionCount != 0) {
+        names = ExAllocatePoolWithTag(PagedPool, Extensions->ExtensionCount * sizeof(UNICODE_STRING),
+                                      DIRCTL_INPUT_TAG);
+        if (names == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
     }
 
-    status = ZwQueryInformationProcess(NtCurrentProcess(),
-        ProcessImageFileName,
-        NULL, // buffer
-        0, // buffer size
-        &returnedLength);
-    if (STATUS_INFO_LENGTH_MISMATCH != status) {
-        return status;
+    for (i = 0; i < Extensions->ExtensionCount; i++) {
+
+        if (Extensions->ExtensionsLength - offset < (ULONG)FIELD_OFFSET(DCAPP_ROOT, Path)) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        entry = (PDCAPP_ROOT)&Extensions->Extensions[offset];
+        if (DCAPP_ROOT_SIZE(entry->Length) > Extensions->ExtensionsLength - offset ||
+            entry->Flags != 0) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        names[i].Buffer = entry->Path;
+        names[i].Length = entry->Length;
+        names[i].MaximumLength = entry->Length;
+        offset += DCAPP_ROOT_SIZE(entry->Length);
     }
 
-    bufferLength = returnedLength - sizeof(UNICODE_STRING);
-    if (ProcessImageName->MaximumLength < bufferLength) {
-        ProcessImageName->Length = (USHORT)bufferLength;
-        return STATUS_BUFFER_OVERFLOW;
+    if (NT_SUCCESS(status)) {
+
+        //  A fresh seed for every policy, like the caches get at load.
+        counter = KeQueryPerformanceCounter(NULL);
+        random = counter.LowPart;
+        seed = ((ULONG64)RtlRandomEx(&random) << 32) | RtlRandomEx(&random);
+
+        status = DcExtBuildSet(Extensions->Rule, names, Extensions->ExtensionCount, seed, Set);
+    }
+
+    if (names != NULL) {
+        ExFreePoolWithTag(names, DIRCTL_INPUT_TAG);
+    }
+    return status;
+}
+
+NTSTATUS
+DirCtlCompileDefaultExtensions (
+    _Outptr_result_maybenull_ PDCEXT_SET *Set
+    )
+/*++
+Routine Description:
+    Compiles the extension rule of the service key, for an update that
+    sets none while no policy is in effect.
+--*/
+{
+    PAGED_CODE();
+
+    *Set = NULL;
+
+    if (g_DefaultExtensions != NULL) {
+        return DirCtlCompileExtensions(g_DefaultExtensions, g_DefaultExtensionsLength, Set);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+DirCtlCreatePolicy (
+    _In_reads_(RootCount) const DCTRIE_ROOT *Roots,
+    _In_ ULONG RootCount,
+    _In_reads_(ModeCount) const ULONG *Modes,
+    _In_ ULONG ModeCount,
+    _In_opt_ PDCEXT_SET Extensions,
+    _Outptr_result_maybenull_ PDIRCTL_POLICY *Policy
+    )
+/*++
+Routine Description:
+    Compiles a list of roots into a policy.
+Arguments:
+    Roots - Protected roots, whose ids index Modes.
+    RootCount - Number of entries in Roots.
+    Modes - DCMODE_PROTECT_* flags of each root id.
+    ModeCount - Number of entries in Modes.
+    Extensions - Compiled extension rule, which belongs to the policy
+        from now on, even if the call fails.
+    Policy - Receives the policy, to be published or freed with
+        DirCtlFreePolicy, or NULL if there are no roots.
+Return Value:
+    STATUS_SUCCESS or the reason the roots could not be compiled.
+--*/
+{
+    PDIRCTL_POLICY policy;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *Policy = NULL;
+
+    if (RootCount == 0) {
+        if (Extensions != NULL) {
+            DcExtFree(Extensions);
+        }
+        return STATUS_SUCCESS;
     }
 
-    buffer = ExAllocatePoolWithTag(PagedPool, returnedLength, 'nacS');
-    if (NULL == buffer) {
+    policy = ExAllocatePoolWithTag(NonPagedPool, sizeof(DIRCTL_POLICY), DIRCTL_POLICY_TAG);
+    if (policy == NULL) {
+        if (Extensions != NULL) {
+            DcExtFree(Extensions);
+        }
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    status = ZwQueryInformationProcess(NtCurrentProcess(), ProcessImageFileName,
-                                        buffer, returnedLength, &returnedLength);
+    RtlZeroMemory(policy, sizeof(DIRCTL_POLICY));
+    policy->Core.Extensions = Extensions;
 
+    status = DcModeBuildTable(Modes, ModeCount, &policy->Core.Modes);
     if (NT_SUCCESS(status)) {
-        imageName = (PUNICODE_STRING)buffer;
-        RtlCopyUnicodeString(ProcessImageName, imageName);
+        status = DcTrieBuild(Roots, RootCount, &policy->Core.Roots);
     }
 
-    ExFreePool(buffer);
-    return status;
+    if (!NT_SUCCESS(status)) {
+        DirCtlFreePolicy(policy);
+        return status;
+    }
 
+    *Policy = policy;
+    return STATUS_SUCCESS;
 }
 
 NTSTATUS
-DirCtlSendFileInfo (
-    _Inout_ PFLT_CALLBACK_DATA Data,
-    _In_ PUNICODE_STRING FileName
+DirCtlQueryStatistics (
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
     )
 /*++
 Routine Description:
-    This routine is called to send file info to user mode 
+    Returns a DCAPP_STATISTICS snapshot to DCApp.
 Arguments:
-    FileName -   Name of the file.
+    OutputBuffer - Caller's buffer, in the caller's address space.
+    OutputBufferLength - Size of OutputBuffer in bytes.
+    ReturnOutputBufferLength - Receives the number of bytes written.
 Return Value:
-    The status of the operation, hopefully STATUS_SUCCESS.  The common failure
-    status will probably be STATUS_INSUFFICIENT_RESOURCES.
+    STATUS_SUCCESS or STATUS_BUFFER_TOO_SMALL.
 --*/
 {
+    DCAPP_STATISTICS statistics;
     NTSTATUS status = STATUS_SUCCESS;
-    PDCAPP_NOTIFICATION notification = NULL;
-    ULONG replyLength;
-    UNICODE_STRING pni; 
 
-    //  If not client port just return.
-    if (DirCtlData.ClientPort == NULL) {
-        return STATUS_SUCCESS;
+    if (OutputBuffer == NULL || OutputBufferLength < sizeof(DCAPP_STATISTICS)) {
+        return STATUS_BUFFER_TOO_SMALL;
     }
 
+    RtlZeroMemory(&statistics, sizeof(statistics));
+    DirCtlQueryNegativeCache(&statistics.NegativeCacheHits,
+                             &statistics.NegativeCacheMisses);
+    statistics.OpenedNames = DirCtlReadCounter(DCAPP_COUNTER_OPENED_NAMES);
+    statistics.CachedNames = DirCtlReadCounter(DCAPP_COUNTER_CACHED_NAMES);
+    statistics.NormalizedNames = DirCtlReadCounter(DCAPP_COUNTER_NORMALIZED_NAMES);
+    statistics.EventsSent = DirCtlReadCounter(DCAPP_COUNTER_EVENTS_SENT);
+    statistics.EventsDropped = DirCtlReadCounter(DCAPP_COUNTER_EVENTS_DROPPED);
+    statistics.EventsLost = DirCtlReadCounter(DCAPP_COUNTER_EVENTS_LOST);
+    DirCtlQueryDedup(&statistics.EventsSuppressed, &statistics.EventRepeats);
+    statistics.TrustedProcesses = DirCtlQueryTrust();
+    DirCtlQueryPool(&g_CreateContextPool, &statistics.CreateContextPool);
+    statistics.PolicyGeneration = DirCtlQueryGeneration();
+
     try {
-        notification = ExAllocatePoolWithTag(NonPagedPool, sizeof(DCAPP_NOTIFICATION), 'nacS');
+        RtlCopyMemory(OutputBuffer, &statistics, sizeof(statistics));
+        *ReturnOutputBufferLength = sizeof(statistics);
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
 
-        if (NULL == notification) {
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            leave;
-        }
-        RtlZeroMemory(notification, sizeof(DCAPP_NOTIFICATION));
-        
-        PEPROCESS objCurProcess = IoThreadToProcess(Data->Thread);
-        HANDLE nCurProcID = PsGetProcessId(objCurProcess);
-
-        pni.MaximumLength = DCAPP_BUFFER_SIZE;
-        pni.Buffer = ExAllocatePoolWithTag(NonPagedPool, pni.MaximumLength, 'nacS');
-
-        if (pni.Buffer != NULL) {
-        
-            pni.Length = 0;
-            status = GetProcessImageName(&pni);
-            if (NT_SUCCESS(status)){
-
-                DbgPrint("ProcessName = %ws\n", pni.Buffer);
-                RtlCopyMemory(&notification->ProcessName, pni.Buffer, pni.Length);
-                pni.MaximumLength = 0;
-                ExFreePool(pni.Buffer);
-                pni.Buffer = NULL;
-            }
-        }
+    return status;
+}
 
-        RtlCopyMemory(&notification->FilePath, FileName->Buffer, FileName->Length);
-        RtlCopyMemory(&notification->ProcessID, (void*)&nCurProcID, sizeof(ULONG));
-        
-        ExAcquireFastMutex(&g_MsgLock);
-        status = FltSendMessage( DirCtlData.Filter,
-                                    &DirCtlData.ClientPort,
-                                    notification,
-                                    sizeof(DCAPP_NOTIFICATION),
-                                    notification,
-                                    &replyLength,
-                                    NULL );
-        
-        if (STATUS_SUCCESS != status) {
-                //  Couldn't send message
-                DbgPrint( "!!! dir ctl --- couldn't send message to user-mode, status 0x%X\n", status );
-        }
-    } finally {
-        
-        if (NULL != notification) {
-            ExFreePoolWithTag( notification, 'nacS' );
-        }
-        ExReleaseFastMutex(&g_MsgLock);
+NTSTATUS
+DirCtlQueryPolicyImage (
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    )
+/*++
+Routine Description:
+    Returns the active policy laid out as a policy image, for DCApp to
+    store in the service key.
+Return Value:
+    STATUS_SUCCESS, STATUS_INVALID_DEVICE_STATE if protection is off,
+    STATUS_BUFFER_TOO_SMALL or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    PDIRCTL_POLICY policy;
+    PVOID image;
+    ULONG size;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    policy = DirCtlReferencePolicy();
+    if (policy == NULL) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    status = DcImageBuild(policy->Core.Roots, policy->Core.Modes, policy->Core.Extensions, &image, &size);
+    DirCtlDereferencePolicy(policy);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (OutputBuffer == NULL || OutputBufferLength < size) {
+        DcFree(image);
+        return STATUS_BUFFER_TOO_SMALL;
     }
+
+    try {
+        RtlCopyMemory(OutputBuffer, image, size);
+        *ReturnOutputBufferLength = size;
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    DcFree(image);
     return status;
 }
 
@@ -692,39 +1960,107 @@ DirCtlRecvMessage(
     IN ULONG OutputBufferLength,
     OUT PULONG ReturnOutputBufferLength
 )
+/*++
+Routine Description:
+    Handles control messages from DCApp. The message changes the policy
+    in a transaction, disables protection, queries statistics, counters,
+    latency histograms or the policy image, or attaches an event ring.
+Return Value:
+    STATUS_SUCCESS or the reason the message was rejected.
+--*/
 {
+    PDCAPP_INPUT input;
+    NTSTATUS status = STATUS_SUCCESS;
+
     UNREFERENCED_PARAMETER(PortCookie);
-    UNREFERENCED_PARAMETER(InputBufferLength);
-    UNREFERENCED_PARAMETER(OutputBuffer);
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(ReturnOutputBufferLength);
 
-    ExAcquireFastMutex(&g_DirPathLock);
+    *ReturnOutputBufferLength = 0;
+
+    if (InputBuffer == NULL ||
+        InputBufferLength < sizeof(DCAPP_INPUT) ||
+        InputBufferLength > DCAPP_MAX_INPUT_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //  The input buffer belongs to the caller's address space, capture it
+    //  before looking at it.
+    input = ExAllocatePoolWithTag(PagedPool, InputBufferLength, DIRCTL_INPUT_TAG);
+    if (input == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
     try {
-        if (((PDCAPP_INPUT)InputBuffer)->ONOFF == 1)
-        {
-            RtlInitUnicodeString(&g_DirPathToProtect, NULL);
-            g_DirPathToProtect.MaximumLength = (USHORT)(((PDCAPP_INPUT)InputBuffer)->FileSize);
-            g_DirPathToProtect.Buffer = ExAllocatePoolWithTag(NonPagedPool,
-                                            g_DirPathToProtect.MaximumLength, 'nacS');
-            if (g_DirPathToProtect.Buffer == NULL) {
-                ExReleaseFastMutex(&g_DirPathLock);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
-                
-            RtlCopyMemory(g_DirPathToProtect.Buffer, ((PDCAPP_INPUT)InputBuffer)->DirPath, 
-                g_DirPathToProtect.MaximumLength);
-            g_EnableProtection = TRUE;
-        }
-        else {
-            g_EnableProtection = FALSE;
-            RtlFreeUnicodeString(&g_DirPathToProtect);
+        RtlCopyMemory(input, InputBuffer, InputBufferLength);
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    if (NT_SUCCESS(status) && input->ONOFF == DCAPP_QUERY_STATISTICS) {
+
+        status = DirCtlQueryStatistics(OutputBuffer, OutputBufferLength,
+                                       ReturnOutputBufferLength);
+        ExFreePoolWithTag(input, DIRCTL_INPUT_TAG);
+        return status;
+    }
+
+    if (NT_SUCCESS(status) && input->ONOFF == DCAPP_QUERY_COUNTERS) {
+
+        status = DirCtlQueryCounters(OutputBuffer, OutputBufferLength,
+                                     ReturnOutputBufferLength);
+        ExFreePoolWithTag(input, DIRCTL_INPUT_TAG);
+        return status;
+    }
+
+    if (NT_SUCCESS(status) && input->ONOFF == DCAPP_QUERY_LATENCY) {
+
+        status = DirCtlQueryLatency(OutputBuffer, OutputBufferLength,
+                                    ReturnOutputBufferLength);
+        ExFreePoolWithTag(input, DIRCTL_INPUT_TAG);
+        return status;
+    }
+
+    if (NT_SUCCESS(status) && input->ONOFF == DCAPP_QUERY_POLICY_IMAGE) {
+
+        status = DirCtlQueryPolicyImage(OutputBuffer, OutputBufferLength,
+                                        ReturnOutputBufferLength);
+        ExFreePoolWithTag(input, DIRCTL_INPUT_TAG);
+        return status;
+    }
+
+    //  Still in DCApp's context, where the section handle is valid.
+    if (NT_SUCCESS(status) && input->ONOFF == DCAPP_ATTACH_RING) {
+
+        if (InputBufferLength < sizeof(DCAPP_RING_INPUT)) {
+            status = STATUS_INVALID_PARAMETER;
+        } else {
+            status = DirCtlAttachRing((HANDLE)(ULONG_PTR)((PDCAPP_RING_INPUT)input)->Section);
         }
+        ExFreePoolWithTag(input, DIRCTL_INPUT_TAG);
+        return status;
     }
-    finally {
+
+    if (NT_SUCCESS(status) && input->ONOFF == DCAPP_UPDATE_POLICY) {
+
+        status = DirCtlUpdatePolicy((PDCAPP_UPDATE_INPUT)input, InputBufferLength,
+                                    OutputBuffer, OutputBufferLength,
+                                    ReturnOutputBufferLength);
+        ExFreePoolWithTag(input, DIRCTL_INPUT_TAG);
+        return status;
     }
-    ExReleaseFastMutex(&g_DirPathLock);
-      
-    DbgPrint("!!! Dir ctl --- received message\n", DirCtlData.ClientPort);
-    return STATUS_SUCCESS;
+
+    if (NT_SUCCESS(status) && input->ONOFF != DCAPP_PROTECTION_OFF) {
+        status = STATUS_INVALID_PARAMETER;
+    }
+
+    //  Creates that still hold the current policy finish with it; it is
+    //  freed once they are done.
+    if (NT_SUCCESS(status)) {
+        DirCtlLockUpdates();
+        DirCtlPublishPolicy(NULL);
+        DirCtlSyncInstances();
+        DirCtlUnlockUpdates(TRUE);
+    }
+
+    ExFreePoolWithTag(input, DIRCTL_INPUT_TAG);
+    return status;
 }
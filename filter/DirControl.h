@@ -10,6 +10,9 @@ Environment:
 --*/
 #ifndef __DIRCONTROL_H__
 #define __DIRCONTROL_H__
+
+#include <TraceLoggingProvider.h>
+
 ///////////////////////////////////////////////////////////////////////////
 //
 //  Global variables
@@ -38,6 +41,141 @@ typedef struct _DIRCTL_DATA {
 
 extern DIRCTL_DATA DirCtlData;
 
+//  Immutable protection policy. A new policy is built for every control
+//  message and published in one of two slots, see dcslot.h; readers
+//  reference the active slot through its cache aware rundown protection
+//  instead of taking a lock, and the previous policy is freed once the
+//  readers that still use it have finished.
+
+typedef struct _DIRCTL_POLICY {
+
+    //  Compiled roots, modes and extension rule, see dcpolicy.h.
+    DCPOLICY Core;
+
+    //  Policy image the parts of Core lie in, see dcimage.h, or NULL if
+    //  each was allocated on its own.
+    PVOID Image;
+
+    //  Slot the policy is published in.
+    ULONG Slot;
+
+} DIRCTL_POLICY, *PDIRCTL_POLICY;
+
+//  Trusted process allowlist, see DirCtlTrust.c.
+
+typedef struct _DIRCTL_TRUSTED_IMAGES DIRCTL_TRUSTED_IMAGES, *PDIRCTL_TRUSTED_IMAGES;
+
+//  A change to the allowlist made by an update, see DirCtlUpdate.c.
+
+typedef struct _DIRCTL_TRUST_CHANGE {
+
+    //  Image path in device form, in the captured message.
+    UNICODE_STRING Image;
+    BOOLEAN Remove;
+
+    //  Index of the record that asked for the change.
+    ULONG Record;
+
+} DIRCTL_TRUST_CHANGE, *PDIRCTL_TRUST_CHANGE;
+
+//  Passed from DirCtlPreCreate to DirCtlPostCreate for creates below a
+//  protected root, so the name is queried and matched only once.
+
+typedef struct _DIRCTL_CREATE_CONTEXT {
+
+    //  Name of the file the match was made on, opened or normalized,
+    //  referenced.
+    PFLT_FILE_NAME_INFORMATION NameInfo;
+
+    //  Protected root the file lies below, the access its mode denies
+    //  and the DCMODE_CREATE_* bits of what it may not add.
+    ULONG RootId;
+    ACCESS_MASK DeniedAccess;
+    ULONG DeniedCreations;
+
+    //  DirCtlPolicySequence before the match was made.
+    LONG PolicySequence;
+
+} DIRCTL_CREATE_CONTEXT, *PDIRCTL_CREATE_CONTEXT;
+
+//  Stream handle context of a handle opened below a protected root, see
+//  DirCtlHandle.c.
+
+typedef struct _DIRCTL_HANDLE_CONTEXT {
+
+    //  Name the create was matched on, referenced.
+    PFLT_FILE_NAME_INFORMATION NameInfo;
+
+    //  Protected root the file lies below and the access its mode
+    //  denies, as decided under the policy with sequence PolicySequence.
+    ULONG RootId;
+    ACCESS_MASK DeniedAccess;
+    LONG PolicySequence;
+
+} DIRCTL_HANDLE_CONTEXT, *PDIRCTL_HANDLE_CONTEXT;
+
+//  Room for an encoded denial record in each event queue slot. Names
+//  that do not fit are truncated and the record is flagged.
+
+#define DIRCTL_EVENT_RECORD_SIZE    2048
+
+//  Largest process image name, in bytes, looked up for a denial event.
+
+#define DIRCTL_PROCESS_NAME_SIZE    512
+
+//  Denials with the same key within the coalescing window are reported
+//  once, followed by a repeat record, see DirCtlDedup.c.
+
+typedef struct _DIRCTL_DEDUP_KEY {
+
+    ULONG64 ProcessId;
+
+    //  Seeded hash of the file name.
+    ULONG64 Hash;
+
+    //  IRP major function.
+    ULONG Operation;
+
+} DIRCTL_DEDUP_KEY, *PDIRCTL_DEDUP_KEY;
+
+//  Lookaside backed pool of fixed size objects, with counters.
+
+typedef struct _DIRCTL_POOL {
+
+    LOOKASIDE_LIST_EX Lookaside;
+    ULONG Tag;
+    BOOLEAN Initialized;
+
+    //  DCAPP_COUNTER_* the objects handed out and returned are counted
+    //  in, per processor.
+    ULONG AllocationCounter;
+    ULONG FreeCounter;
+
+    //  Updated when the lookaside list goes to the general pool.
+    volatile LONG64 PoolAllocations;
+    volatile LONG64 PoolFrees;
+
+} DIRCTL_POOL, *PDIRCTL_POOL;
+
+//  Key of a parent directory in the negative lookup cache.
+
+typedef struct _DIRCTL_PARENT_KEY {
+
+    PFLT_VOLUME Volume;
+
+    //  Seeded hash of the parent directory part of the opened name.
+    ULONG64 Hash;
+
+    //  Cache epoch at the time the key was computed.
+    LONG Epoch;
+
+} DIRCTL_PARENT_KEY, *PDIRCTL_PARENT_KEY;
+
+extern BOOLEAN g_EnableProtection;
+
+//  Changes every time a policy is published.
+extern volatile LONG DirCtlPolicySequence;
+
 #pragma warning(push)
 #pragma warning(disable:4200) // disable warnings for structures with zero length arrays.
 
@@ -83,6 +221,411 @@ DirCtlPostCreate (
 //    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
 //    );
 
+FLT_PREOP_CALLBACK_STATUS
+DirCtlPreWrite (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    );
+
+FLT_PREOP_CALLBACK_STATUS
+DirCtlPreSetInformation (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    );
+
+FLT_PREOP_CALLBACK_STATUS
+DirCtlPreFsControl (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    );
+
+NTSTATUS
+DirCtlSetHandleContext (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PDIRCTL_CREATE_CONTEXT CreateContext
+    );
+
+VOID
+DirCtlHandleContextCleanup (
+    _In_ PFLT_CONTEXT Context,
+    _In_ FLT_CONTEXT_TYPE ContextType
+    );
+
+NTSTATUS
+DirCtlSendFileInfo (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PUNICODE_STRING FileName,
+    _In_ ACCESS_MASK AccessMask
+    );
+
+ULONG
+DirCtlCheckPath (
+    _In_ PFLT_FILE_NAME_INFORMATION NameInfo,
+    _Out_opt_ PDCMODE_ENTRY Mode
+    );
+
+ULONG
+DirCtlCheckOpenedPath (
+    _In_ PFLT_FILE_NAME_INFORMATION NameInfo,
+    _Out_ PBOOLEAN Ambiguous,
+    _Out_opt_ PDCMODE_ENTRY Mode
+    );
+
+PDIRCTL_POLICY
+DirCtlReferencePolicy (
+    VOID
+    );
+
+VOID
+DirCtlDereferencePolicy (
+    _In_ PDIRCTL_POLICY Policy
+    );
+
+VOID
+DirCtlPublishPolicy (
+    _In_opt_ PDIRCTL_POLICY Policy
+    );
+
+VOID
+DirCtlFreePolicy (
+    _In_ PDIRCTL_POLICY Policy
+    );
+
+NTSTATUS
+DirCtlCreatePolicy (
+    _In_reads_(RootCount) const DCTRIE_ROOT *Roots,
+    _In_ ULONG RootCount,
+    _In_reads_(ModeCount) const ULONG *Modes,
+    _In_ ULONG ModeCount,
+    _In_opt_ PDCEXT_SET Extensions,
+    _Outptr_result_maybenull_ PDIRCTL_POLICY *Policy
+    );
+
+NTSTATUS
+DirCtlCompileExtensions (
+    _In_ PDCAPP_EXTENSIONS Extensions,
+    _In_ ULONG ExtensionsLength,
+    _Outptr_result_maybenull_ PDCEXT_SET *Set
+    );
+
+NTSTATUS
+DirCtlCompileDefaultExtensions (
+    _Outptr_result_maybenull_ PDCEXT_SET *Set
+    );
+
+VOID
+DirCtlSyncInstances (
+    VOID
+    );
+
+VOID
+DirCtlInitializeUpdates (
+    VOID
+    );
+
+VOID
+DirCtlLockUpdates (
+    VOID
+    );
+
+VOID
+DirCtlUnlockUpdates (
+    _In_ BOOLEAN Changed
+    );
+
+ULONG64
+DirCtlQueryGeneration (
+    VOID
+    );
+
+NTSTATUS
+DirCtlUpdatePolicy (
+    _In_ PDCAPP_UPDATE_INPUT Input,
+    _In_ ULONG InputLength,
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
+NTSTATUS
+DirCtlInitializeCounters (
+    VOID
+    );
+
+VOID
+DirCtlFreeCounters (
+    VOID
+    );
+
+VOID
+DirCtlAddCounter (
+    _In_ ULONG Counter,
+    _In_ ULONG64 Value
+    );
+
+#define DirCtlCount(Counter)    DirCtlAddCounter( (Counter), 1 )
+
+ULONG64
+DirCtlReadCounter (
+    _In_ ULONG Counter
+    );
+
+NTSTATUS
+DirCtlQueryCounters (
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
+VOID
+DirCtlRecordLatency (
+    _In_ ULONG Latency,
+    _In_ LONG64 Start
+    );
+
+NTSTATUS
+DirCtlQueryLatency (
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
+//  TraceLogging provider "DirControl", registered with the counters.
+//  Keywords select the events of creates and of denials.
+
+TRACELOGGING_DECLARE_PROVIDER( g_DirCtlProvider );
+
+#define DIRCTL_KEYWORD_CREATE       0x0000000000000001ULL
+#define DIRCTL_KEYWORD_DENIAL       0x0000000000000002ULL
+
+NTSTATUS
+DirCtlInitializeNegativeCache (
+    VOID
+    );
+
+VOID
+DirCtlFreeNegativeCache (
+    VOID
+    );
+
+VOID
+DirCtlInvalidateNegativeCache (
+    VOID
+    );
+
+BOOLEAN
+DirCtlGetParentKey (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Out_ PDIRCTL_PARENT_KEY Key
+    );
+
+BOOLEAN
+DirCtlLookupNegativeCache (
+    _In_ PDIRCTL_PARENT_KEY Key
+    );
+
+VOID
+DirCtlInsertNegativeCache (
+    _In_ PDIRCTL_PARENT_KEY Key
+    );
+
+VOID
+DirCtlQueryNegativeCache (
+    _Out_ PULONG64 Hits,
+    _Out_ PULONG64 Misses
+    );
+
+NTSTATUS
+DirCtlInitializePool (
+    _Out_ PDIRCTL_POOL Pool,
+    _In_ SIZE_T Size,
+    _In_ ULONG Tag,
+    _In_ ULONG AllocationCounter,
+    _In_ ULONG FreeCounter
+    );
+
+VOID
+DirCtlDeletePool (
+    _Inout_ PDIRCTL_POOL Pool
+    );
+
+PVOID
+DirCtlAllocateFromPool (
+    _Inout_ PDIRCTL_POOL Pool
+    );
+
+VOID
+DirCtlFreeToPool (
+    _Inout_ PDIRCTL_POOL Pool,
+    _In_ PVOID Buffer
+    );
+
+VOID
+DirCtlQueryPool (
+    _In_ PDIRCTL_POOL Pool,
+    _Out_ PDCAPP_POOL_STATISTICS Statistics
+    );
+
+VOID
+DirCtlInitializeProcessCache (
+    VOID
+    );
+
+VOID
+DirCtlFreeProcessCache (
+    VOID
+    );
+
+NTSTATUS
+DirCtlGetProcessName (
+    _In_ PEPROCESS Process,
+    _Inout_ PUNICODE_STRING Name
+    );
+
+BOOLEAN
+DirCtlIsProcessNotifyRegistered (
+    VOID
+    );
+
+VOID
+DirCtlInitializeTrust (
+    VOID
+    );
+
+VOID
+DirCtlFreeTrust (
+    VOID
+    );
+
+BOOLEAN
+DirCtlIsTrustedProcess (
+    _In_ HANDLE ProcessId
+    );
+
+VOID
+DirCtlTrustProcessNotify (
+    _In_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _In_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+    );
+
+NTSTATUS
+DirCtlBuildTrustedImages (
+    _In_ BOOLEAN Keep,
+    _In_reads_(ChangeCount) const DIRCTL_TRUST_CHANGE *Changes,
+    _In_ ULONG ChangeCount,
+    _Outptr_result_maybenull_ PDIRCTL_TRUSTED_IMAGES *Images,
+    _Out_ PULONG Failed
+    );
+
+NTSTATUS
+DirCtlCommitTrustedImages (
+    _In_opt_ PDIRCTL_TRUSTED_IMAGES Images
+    );
+
+VOID
+DirCtlFreeTrustedImages (
+    _In_ PDIRCTL_TRUSTED_IMAGES Images
+    );
+
+ULONG
+DirCtlCountTrustedImages (
+    VOID
+    );
+
+ULONG
+DirCtlQueryTrust (
+    VOID
+    );
+
+NTSTATUS
+DirCtlStartEventQueue (
+    VOID
+    );
+
+VOID
+DirCtlStopEventQueue (
+    VOID
+    );
+
+VOID
+DirCtlFreeEventQueue (
+    VOID
+    );
+
+NTSTATUS
+DirCtlAttachRing (
+    _In_ HANDLE Section
+    );
+
+VOID
+DirCtlDetachRing (
+    VOID
+    );
+
+PVOID
+DirCtlReserveEvent (
+    _Out_ PLONG Position
+    );
+
+VOID
+DirCtlCommitEvent (
+    _In_ LONG Position
+    );
+
+NTSTATUS
+DirCtlInitializeDedup (
+    _In_ PUNICODE_STRING RegistryPath
+    );
+
+VOID
+DirCtlFreeDedup (
+    VOID
+    );
+
+VOID
+DirCtlGetDedupKey (
+    _In_ HANDLE ProcessId,
+    _In_ PCUNICODE_STRING FileName,
+    _In_ ULONG Operation,
+    _Out_ PDIRCTL_DEDUP_KEY Key
+    );
+
+BOOLEAN
+DirCtlSuppressEvent (
+    _In_ PDIRCTL_DEDUP_KEY Key,
+    _In_ LONG64 Timestamp
+    );
+
+VOID
+DirCtlRememberEvent (
+    _In_ PDIRCTL_DEDUP_KEY Key,
+    _In_ const VOID *Record
+    );
+
+VOID
+DirCtlQueryDedup (
+    _Out_ PULONG64 Suppressed,
+    _Out_ PULONG64 Repeats
+    );
+
+ULONG
+DirCtlQueryRegistryUlong (
+    _In_ PUNICODE_STRING RegistryPath,
+    _In_ PCWSTR ValueName,
+    _In_ ULONG DefaultValue
+    );
+
+VOID
+DirCtlInstanceTeardownStart (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ FLT_INSTANCE_TEARDOWN_FLAGS Flags
+    );
+
 NTSTATUS
 DirCtlInstanceSetup (
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
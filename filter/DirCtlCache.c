@@ -0,0 +1,296 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlCache.c
+Abstract:
+    Per-processor negative lookup cache. It remembers parent directories
+    whose files were found not to be below any protected root, so that
+    later creates in the same directory can leave DirCtlPreCreate before
+    querying the normalized file name.
+
+    Entries are keyed by volume and a seeded hash of the parent directory
+    as it appears in the opened name, and are tagged with the cache epoch.
+    The epoch changes whenever the policy is replaced or an instance goes
+    away, which invalidates every entry at once.
+
+    Each processor only ever touches its own cache, at DISPATCH_LEVEL, so
+    lookups and inserts need neither locks nor interlocked operations.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "dchash.h"
+#include "DirControl.h"
+
+#define DIRCTL_CACHE_TAG                'Nncs'
+
+#define DIRCTL_NEGATIVE_CACHE_SETS      64
+#define DIRCTL_NEGATIVE_CACHE_WAYS      4
+
+typedef struct _DIRCTL_NEGATIVE_ENTRY {
+    PFLT_VOLUME Volume;
+    ULONG64 Hash;
+    LONG Epoch;
+} DIRCTL_NEGATIVE_ENTRY, *PDIRCTL_NEGATIVE_ENTRY;
+
+typedef struct DECLSPEC_CACHEALIGN _DIRCTL_NEGATIVE_CACHE {
+
+    ULONG64 Hits;
+    ULONG64 Misses;
+
+    //  Next way to replace in each set.
+    UCHAR Victim[DIRCTL_NEGATIVE_CACHE_SETS];
+
+    DIRCTL_NEGATIVE_ENTRY Entries[DIRCTL_NEGATIVE_CACHE_SETS][DIRCTL_NEGATIVE_CACHE_WAYS];
+
+} DIRCTL_NEGATIVE_CACHE, *PDIRCTL_NEGATIVE_CACHE;
+
+PDIRCTL_NEGATIVE_CACHE g_NegativeCaches;
+ULONG g_NegativeCacheCount;
+ULONG64 g_NegativeCacheSeed;
+
+//  Starts at 1 so that zeroed entries never match.
+volatile LONG g_NegativeCacheEpoch = 1;
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(INIT, DirCtlInitializeNegativeCache)
+    #pragma alloc_text(PAGE, DirCtlGetParentKey)
+#endif
+
+
+NTSTATUS
+DirCtlInitializeNegativeCache (
+    VOID
+    )
+/*++
+Routine Description:
+    Allocates one cache per possible processor and picks the hash seed.
+Return Value:
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    LARGE_INTEGER counter = KeQueryPerformanceCounter( NULL );
+    ULONG seed = counter.LowPart;
+    SIZE_T size;
+
+    g_NegativeCacheCount = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+    size = (SIZE_T)g_NegativeCacheCount * sizeof(DIRCTL_NEGATIVE_CACHE);
+
+    g_NegativeCaches = ExAllocatePoolWithTag( NonPagedPool, size, DIRCTL_CACHE_TAG );
+    if (g_NegativeCaches == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( g_NegativeCaches, size );
+
+    g_NegativeCacheSeed = ((ULONG64)RtlRandomEx( &seed ) << 32) | RtlRandomEx( &seed );
+    g_NegativeCacheSeed ^= (ULONG64)counter.QuadPart;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+DirCtlFreeNegativeCache (
+    VOID
+    )
+{
+    if (g_NegativeCaches != NULL) {
+        ExFreePoolWithTag( g_NegativeCaches, DIRCTL_CACHE_TAG );
+        g_NegativeCaches = NULL;
+    }
+}
+
+VOID
+DirCtlInvalidateNegativeCache (
+    VOID
+    )
+/*++
+Routine Description:
+    Invalidates every cached entry on every processor. Called after a new
+    policy has been published and when an instance is torn down, since
+    the address of its volume object may be reused.
+--*/
+{
+    InterlockedIncrement( &g_NegativeCacheEpoch );
+}
+
+BOOLEAN
+DirCtlGetParentKey (
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Out_ PDIRCTL_PARENT_KEY Key
+    )
+/*++
+Routine Description:
+    Computes the cache key of the parent directory of the file being
+    created, from the name the caller opened.
+
+    The key is only usable when the opened parent always names the same
+    directory as the parent of the normalized name: relative and file ID
+    opens are skipped, as are names whose parent could contain a short
+    name or whose last component is empty, "." or "..".
+Arguments:
+    Data - Pre create callback data.
+    FltObjects - Objects of the create.
+    Key - Receives the key. The epoch is captured first, so an entry made
+        from a decision that races with a policy change is already stale.
+Return Value:
+    TRUE if the key may be used with the cache.
+--*/
+{
+    PFILE_OBJECT fileObject = FltObjects->FileObject;
+    PCWSTR name = fileObject->FileName.Buffer;
+    ULONG length = fileObject->FileName.Length / sizeof(WCHAR);
+    ULONG parentLength;
+    ULONG i;
+
+    PAGED_CODE();
+
+    Key->Epoch = ReadAcquire( &g_NegativeCacheEpoch );
+
+    if (fileObject->RelatedFileObject != NULL ||
+        length == 0 ||
+        FlagOn( Data->Iopb->Parameters.Create.Options, FILE_OPEN_BY_FILE_ID ) ||
+        FlagOn( Data->Iopb->OperationFlags, SL_OPEN_PAGING_FILE )) {
+        return FALSE;
+    }
+
+    parentLength = length;
+    while (parentLength > 0 && name[parentLength - 1] != L'\\') {
+        parentLength--;
+    }
+
+    if (parentLength == 0) {
+        return FALSE;
+    }
+
+    //  Last component: name[parentLength .. length).
+    i = length - parentLength;
+    if (i == 0 ||
+        (i == 1 && name[parentLength] == L'.') ||
+        (i == 2 && name[parentLength] == L'.' && name[parentLength + 1] == L'.')) {
+        return FALSE;
+    }
+
+    parentLength--;
+    for (i = 0; i < parentLength; i++) {
+        if (name[i] == L'~') {
+            return FALSE;
+        }
+    }
+
+    Key->Volume = FltObjects->Volume;
+    Key->Hash = DcHashFinalize( DcHashBytes( name,
+                                             parentLength * sizeof(WCHAR),
+                                             g_NegativeCacheSeed ) );
+
+    return TRUE;
+}
+
+//  Lookup and insert run at DISPATCH_LEVEL. They are kept out of line so
+//  the compiler cannot fold them into the pageable create callbacks.
+
+DECLSPEC_NOINLINE
+BOOLEAN
+DirCtlLookupNegativeCache (
+    _In_ PDIRCTL_PARENT_KEY Key
+    )
+/*++
+Routine Description:
+    Checks whether the parent directory is known not to be below any
+    protected root under the current policy.
+Return Value:
+    TRUE on a hit.
+--*/
+{
+    ULONG set = (ULONG)(Key->Hash % DIRCTL_NEGATIVE_CACHE_SETS);
+    LONG epoch = ReadNoFence( &g_NegativeCacheEpoch );
+    PDIRCTL_NEGATIVE_CACHE cache;
+    BOOLEAN hit = FALSE;
+    KIRQL oldIrql;
+    ULONG way;
+
+    KeRaiseIrql( DISPATCH_LEVEL, &oldIrql );
+
+    cache = &g_NegativeCaches[KeGetCurrentProcessorNumberEx( NULL )];
+
+    for (way = 0; way < DIRCTL_NEGATIVE_CACHE_WAYS; way++) {
+
+        PDIRCTL_NEGATIVE_ENTRY entry = &cache->Entries[set][way];
+
+        if (entry->Hash == Key->Hash &&
+            entry->Volume == Key->Volume &&
+            entry->Epoch == epoch) {
+
+            hit = TRUE;
+            break;
+        }
+    }
+
+    if (hit) {
+        cache->Hits++;
+    } else {
+        cache->Misses++;
+    }
+
+    KeLowerIrql( oldIrql );
+    return hit;
+}
+
+DECLSPEC_NOINLINE
+VOID
+DirCtlInsertNegativeCache (
+    _In_ PDIRCTL_PARENT_KEY Key
+    )
+/*++
+Routine Description:
+    Records that the parent directory is not below any protected root.
+    The entry carries the epoch captured with the key.
+--*/
+{
+    ULONG set = (ULONG)(Key->Hash % DIRCTL_NEGATIVE_CACHE_SETS);
+    PDIRCTL_NEGATIVE_CACHE cache;
+    PDIRCTL_NEGATIVE_ENTRY entry;
+    KIRQL oldIrql;
+
+    KeRaiseIrql( DISPATCH_LEVEL, &oldIrql );
+
+    cache = &g_NegativeCaches[KeGetCurrentProcessorNumberEx( NULL )];
+
+    entry = &cache->Entries[set][cache->Victim[set]];
+    cache->Victim[set] = (UCHAR)((cache->Victim[set] + 1) % DIRCTL_NEGATIVE_CACHE_WAYS);
+
+    entry->Volume = Key->Volume;
+    entry->Hash = Key->Hash;
+    entry->Epoch = Key->Epoch;
+
+    KeLowerIrql( oldIrql );
+}
+
+VOID
+DirCtlQueryNegativeCache (
+    _Out_ PULONG64 Hits,
+    _Out_ PULONG64 Misses
+    )
+/*++
+Routine Description:
+    Sums the hit and miss counters of all processors. The counters are
+    read without synchronization, which is fine for statistics.
+--*/
+{
+    ULONG i;
+
+    *Hits = 0;
+    *Misses = 0;
+
+    for (i = 0; i < g_NegativeCacheCount; i++) {
+        *Hits += g_NegativeCaches[i].Hits;
+        *Misses += g_NegativeCaches[i].Misses;
+    }
+}
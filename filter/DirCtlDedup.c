@@ -0,0 +1,514 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlDedup.c
+Abstract:
+    Coalescing of repeated denial events. A process that retries a denied
+    operation in a loop would otherwise fill the event queue and DCApp's
+    console with copies of the same event.
+
+    Once a denial has been queued, further denials with the same process,
+    path and operation are only counted for the length of the window.
+    When the window expires a single DCWIRE_RECORD_REPEAT record with the
+    count and the time of the last repeat is queued, provided there was a
+    repeat at all; the next denial after that is reported again.
+
+    The table of recent denials is split per processor and each
+    processor only ever touches its own part, at DISPATCH_LEVEL, so
+    neither lookups nor inserts take locks or use interlocked operations.
+    A thread that moves to another processor between two denials may have
+    one reported on each, which is harmless. Expired entries are flushed
+    by a periodic timer whose DPC queues a DPC to each processor that has
+    entries, so that a summary does not wait for another denial.
+
+    The window and the table size are read from the service key:
+    DedupWindow in milliseconds, 0 disabling coalescing, and DedupEntries
+    per processor.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "dchash.h"
+#include "dcwire.h"
+#include "DirControl.h"
+
+#define DIRCTL_DEDUP_TAG                'Dncs'
+
+#define DIRCTL_DEDUP_DEFAULT_WINDOW     1000
+#define DIRCTL_DEDUP_MAX_WINDOW         (60 * 1000)
+
+//  Entries per processor, rounded up to a power of two.
+#define DIRCTL_DEDUP_DEFAULT_ENTRIES    32
+#define DIRCTL_DEDUP_MIN_ENTRIES        DIRCTL_DEDUP_WAYS
+#define DIRCTL_DEDUP_MAX_ENTRIES        1024
+
+#define DIRCTL_DEDUP_WAYS               4
+
+//  Room for the record a repeat is reported from. Longer names are
+//  truncated in the repeat record only.
+#define DIRCTL_DEDUP_RECORD_SIZE        1024
+
+typedef struct _DIRCTL_DEDUP_ENTRY {
+
+    DIRCTL_DEDUP_KEY Key;
+
+    //  Interrupt time at which the window ends. 0 if the entry is free.
+    ULONG64 Expires;
+
+    ULONG Repeats;
+    LONG64 LastTimestamp;
+
+    //  The denial that was reported, encoded.
+    ULONG64 Record[DIRCTL_DEDUP_RECORD_SIZE / sizeof(ULONG64)];
+
+} DIRCTL_DEDUP_ENTRY, *PDIRCTL_DEDUP_ENTRY;
+
+typedef struct DECLSPEC_CACHEALIGN _DIRCTL_DEDUP_TABLE {
+
+    //  Runs on the processor that owns the table.
+    KDPC FlushDpc;
+    BOOLEAN Targeted;
+
+    //  Entries in use.
+    LONG Used;
+
+    //  Next way to replace in each set.
+    UCHAR Victim[DIRCTL_DEDUP_MAX_ENTRIES / DIRCTL_DEDUP_WAYS];
+
+    ULONG64 Suppressed;
+    ULONG64 Repeats;
+
+    //  Sets of DIRCTL_DEDUP_WAYS entries.
+    PDIRCTL_DEDUP_ENTRY Entries;
+
+} DIRCTL_DEDUP_TABLE, *PDIRCTL_DEDUP_TABLE;
+
+typedef struct _DIRCTL_DEDUP {
+
+    PDIRCTL_DEDUP_TABLE Tables;
+    PDIRCTL_DEDUP_ENTRY Entries;
+    ULONG TableCount;
+
+    //  Sets per table, a power of two.
+    ULONG Sets;
+
+    //  Window in 100ns units, 0 if coalescing is disabled.
+    ULONG64 Window;
+
+    ULONG64 Seed;
+
+    KTIMER Timer;
+    KDPC TimerDpc;
+    volatile BOOLEAN Stopping;
+
+} DIRCTL_DEDUP, *PDIRCTL_DEDUP;
+
+DIRCTL_DEDUP g_Dedup;
+
+KDEFERRED_ROUTINE DirCtlDedupTimerDpc;
+KDEFERRED_ROUTINE DirCtlDedupFlushDpc;
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(INIT, DirCtlInitializeDedup)
+    #pragma alloc_text(PAGE, DirCtlFreeDedup)
+    #pragma alloc_text(PAGE, DirCtlGetDedupKey)
+#endif
+
+
+NTSTATUS
+DirCtlInitializeDedup (
+    _In_ PUNICODE_STRING RegistryPath
+    )
+/*++
+Routine Description:
+    Reads the configuration, allocates one table per possible processor
+    and starts the flush timer.
+Arguments:
+    RegistryPath - The driver's service key.
+Return Value:
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    LARGE_INTEGER counter = KeQueryPerformanceCounter( NULL );
+    LARGE_INTEGER dueTime;
+    PROCESSOR_NUMBER number;
+    ULONG seed = counter.LowPart;
+    ULONG window;
+    ULONG entries;
+    ULONG i;
+
+    RtlZeroMemory( &g_Dedup, sizeof(g_Dedup) );
+
+    window = DirCtlQueryRegistryUlong( RegistryPath, L"DedupWindow", DIRCTL_DEDUP_DEFAULT_WINDOW );
+    entries = DirCtlQueryRegistryUlong( RegistryPath, L"DedupEntries", DIRCTL_DEDUP_DEFAULT_ENTRIES );
+
+    if (window == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    window = min( window, DIRCTL_DEDUP_MAX_WINDOW );
+    entries = max( min( entries, DIRCTL_DEDUP_MAX_ENTRIES ), DIRCTL_DEDUP_MIN_ENTRIES );
+
+    g_Dedup.Sets = 1;
+    while (g_Dedup.Sets * DIRCTL_DEDUP_WAYS < entries) {
+        g_Dedup.Sets <<= 1;
+    }
+
+    g_Dedup.TableCount = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+
+    g_Dedup.Tables = ExAllocatePoolWithTag( NonPagedPool,
+                                            (SIZE_T)g_Dedup.TableCount * sizeof(DIRCTL_DEDUP_TABLE),
+                                            DIRCTL_DEDUP_TAG );
+    g_Dedup.Entries = ExAllocatePoolWithTag( NonPagedPool,
+                                             (SIZE_T)g_Dedup.TableCount * g_Dedup.Sets *
+                                                 DIRCTL_DEDUP_WAYS * sizeof(DIRCTL_DEDUP_ENTRY),
+                                             DIRCTL_DEDUP_TAG );
+
+    if (g_Dedup.Tables == NULL || g_Dedup.Entries == NULL) {
+        DirCtlFreeDedup();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( g_Dedup.Tables, (SIZE_T)g_Dedup.TableCount * sizeof(DIRCTL_DEDUP_TABLE) );
+
+    for (i = 0; i < g_Dedup.TableCount; i++) {
+
+        PDIRCTL_DEDUP_TABLE table = &g_Dedup.Tables[i];
+        ULONG j;
+
+        table->Entries = &g_Dedup.Entries[(SIZE_T)i * g_Dedup.Sets * DIRCTL_DEDUP_WAYS];
+        for (j = 0; j < g_Dedup.Sets * DIRCTL_DEDUP_WAYS; j++) {
+            table->Entries[j].Expires = 0;
+        }
+
+        //  Processors that are not present get no DPC; they never insert
+        //  either.
+        KeInitializeDpc( &table->FlushDpc, DirCtlDedupFlushDpc, table );
+        if (NT_SUCCESS( KeGetProcessorNumberFromIndex( i, &number ) ) &&
+            NT_SUCCESS( KeSetTargetProcessorDpcEx( &table->FlushDpc, &number ) )) {
+            table->Targeted = TRUE;
+        }
+    }
+
+    g_Dedup.Seed = ((ULONG64)RtlRandomEx( &seed ) << 32) | RtlRandomEx( &seed );
+    g_Dedup.Window = (ULONG64)window * 10 * 1000;
+
+    KeInitializeTimerEx( &g_Dedup.Timer, NotificationTimer );
+    KeInitializeDpc( &g_Dedup.TimerDpc, DirCtlDedupTimerDpc, NULL );
+
+    dueTime.QuadPart = -(LONGLONG)g_Dedup.Window;
+    KeSetTimerEx( &g_Dedup.Timer, dueTime, (LONG)window, &g_Dedup.TimerDpc );
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+DirCtlFreeDedup (
+    VOID
+    )
+/*++
+Routine Description:
+    Stops the flush timer and frees the tables. Repeats that have not
+    been reported yet are discarded. Only called once no callback can
+    queue events any more, and before the event queue is freed.
+--*/
+{
+    PAGED_CODE();
+
+    if (g_Dedup.Window != 0) {
+
+        g_Dedup.Stopping = TRUE;
+        KeCancelTimer( &g_Dedup.Timer );
+
+        //  The first flush waits for a timer DPC that may still be queuing
+        //  flush DPCs, the second one for those.
+        KeFlushQueuedDpcs();
+        KeFlushQueuedDpcs();
+
+        g_Dedup.Window = 0;
+    }
+
+    if (g_Dedup.Entries != NULL) {
+        ExFreePoolWithTag( g_Dedup.Entries, DIRCTL_DEDUP_TAG );
+        g_Dedup.Entries = NULL;
+    }
+
+    if (g_Dedup.Tables != NULL) {
+        ExFreePoolWithTag( g_Dedup.Tables, DIRCTL_DEDUP_TAG );
+        g_Dedup.Tables = NULL;
+    }
+}
+
+VOID
+DirCtlGetDedupKey (
+    _In_ HANDLE ProcessId,
+    _In_ PCUNICODE_STRING FileName,
+    _In_ ULONG Operation,
+    _Out_ PDIRCTL_DEDUP_KEY Key
+    )
+{
+    PAGED_CODE();
+
+    Key->ProcessId = (ULONG64)(ULONG_PTR)ProcessId;
+    Key->Operation = Operation;
+    Key->Hash = DcHashFinalize( DcHashBytes( FileName->Buffer, FileName->Length, g_Dedup.Seed ) );
+}
+
+static PDIRCTL_DEDUP_ENTRY
+DirCtlDedupSet (
+    _In_ PDIRCTL_DEDUP_TABLE Table,
+    _In_ PDIRCTL_DEDUP_KEY Key
+    )
+{
+    return &Table->Entries[(ULONG)(Key->Hash & (g_Dedup.Sets - 1)) * DIRCTL_DEDUP_WAYS];
+}
+
+static VOID
+DirCtlFlushEntry (
+    _In_ PDIRCTL_DEDUP_TABLE Table,
+    _Inout_ PDIRCTL_DEDUP_ENTRY Entry
+    )
+/*++
+Routine Description:
+    Frees an entry, queuing a repeat record first if there were any
+    repeats. Called at DISPATCH_LEVEL on the processor owning the table.
+--*/
+{
+    PDCWIRE_RECORD record;
+    LONG position;
+
+    if (Entry->Repeats != 0) {
+
+        record = DirCtlReserveEvent( &position );
+        if (record != NULL) {
+
+            RtlCopyMemory( record, Entry->Record, ((PDCWIRE_RECORD)Entry->Record)->Length );
+            record->Type = DCWIRE_RECORD_REPEAT;
+            record->RepeatCount = Entry->Repeats;
+            record->LastTimestamp = Entry->LastTimestamp;
+
+            DirCtlCommitEvent( position );
+            Table->Repeats++;
+        }
+    }
+
+    Entry->Expires = 0;
+    Table->Used--;
+}
+
+//  The routines below run at DISPATCH_LEVEL. They are kept out of line so
+//  the compiler cannot fold them into the pageable create callbacks.
+
+DECLSPEC_NOINLINE
+BOOLEAN
+DirCtlSuppressEvent (
+    _In_ PDIRCTL_DEDUP_KEY Key,
+    _In_ LONG64 Timestamp
+    )
+/*++
+Routine Description:
+    Checks whether a denial repeats one reported within the window. If
+    so it is counted against that one; if that one's window has expired
+    its repeats are reported now.
+Arguments:
+    Key - Key of the denial.
+    Timestamp - System time of the denial.
+Return Value:
+    TRUE if the denial must not be reported.
+--*/
+{
+    PDIRCTL_DEDUP_TABLE table;
+    PDIRCTL_DEDUP_ENTRY entry;
+    BOOLEAN suppress = FALSE;
+    ULONG64 now;
+    KIRQL oldIrql;
+    ULONG way;
+
+    if (g_Dedup.Window == 0) {
+        return FALSE;
+    }
+
+    KeRaiseIrql( DISPATCH_LEVEL, &oldIrql );
+
+    table = &g_Dedup.Tables[KeGetCurrentProcessorNumberEx( NULL )];
+    entry = DirCtlDedupSet( table, Key );
+
+    for (way = 0; way < DIRCTL_DEDUP_WAYS; way++, entry++) {
+
+        if (entry->Expires != 0 &&
+            entry->Key.Hash == Key->Hash &&
+            entry->Key.ProcessId == Key->ProcessId &&
+            entry->Key.Operation == Key->Operation) {
+
+            now = KeQueryInterruptTime();
+            if (now < entry->Expires) {
+
+                entry->Repeats++;
+                entry->LastTimestamp = Timestamp;
+                table->Suppressed++;
+                suppress = TRUE;
+
+            } else {
+
+                DirCtlFlushEntry( table, entry );
+            }
+            break;
+        }
+    }
+
+    KeLowerIrql( oldIrql );
+    return suppress;
+}
+
+DECLSPEC_NOINLINE
+VOID
+DirCtlRememberEvent (
+    _In_ PDIRCTL_DEDUP_KEY Key,
+    _In_ const VOID *Record
+    )
+/*++
+Routine Description:
+    Opens a window for a denial that is being reported, replacing the
+    oldest entry of its set if need be.
+Arguments:
+    Key - Key of the denial.
+    Record - The denial as encoded into the event queue, a DCWIRE record
+        in nonpaged memory.
+--*/
+{
+    PDIRCTL_DEDUP_TABLE table;
+    PDIRCTL_DEDUP_ENTRY set;
+    PDIRCTL_DEDUP_ENTRY entry = NULL;
+    DCWIRE_EVENT event;
+    ULONG setIndex;
+    KIRQL oldIrql;
+    ULONG way;
+
+    if (g_Dedup.Window == 0 ||
+        !NT_SUCCESS( DcWireDecodeRecord( Record, ((const DCWIRE_RECORD *)Record)->Length, &event ) )) {
+        return;
+    }
+
+    KeRaiseIrql( DISPATCH_LEVEL, &oldIrql );
+
+    table = &g_Dedup.Tables[KeGetCurrentProcessorNumberEx( NULL )];
+    set = DirCtlDedupSet( table, Key );
+    setIndex = (ULONG)(set - table->Entries) / DIRCTL_DEDUP_WAYS;
+
+    for (way = 0; way < DIRCTL_DEDUP_WAYS; way++) {
+
+        //  Another thread on this processor got here first.
+        if (set[way].Expires != 0 &&
+            set[way].Key.Hash == Key->Hash &&
+            set[way].Key.ProcessId == Key->ProcessId &&
+            set[way].Key.Operation == Key->Operation) {
+
+            KeLowerIrql( oldIrql );
+            return;
+        }
+
+        if (set[way].Expires == 0 && entry == NULL) {
+            entry = &set[way];
+        }
+    }
+
+    if (entry == NULL) {
+        entry = &set[table->Victim[setIndex]];
+        table->Victim[setIndex] = (UCHAR)((table->Victim[setIndex] + 1) % DIRCTL_DEDUP_WAYS);
+        DirCtlFlushEntry( table, entry );
+    }
+
+    entry->Key = *Key;
+    entry->Repeats = 0;
+    entry->LastTimestamp = event.Timestamp;
+    entry->Expires = KeQueryInterruptTime() + g_Dedup.Window;
+    DcWireEncodeRecord( entry->Record, DIRCTL_DEDUP_RECORD_SIZE, &event );
+    table->Used++;
+
+    KeLowerIrql( oldIrql );
+}
+
+VOID
+DirCtlDedupFlushDpc (
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+    )
+/*++
+Routine Description:
+    Flushes the expired entries of the table of the current processor.
+--*/
+{
+    PDIRCTL_DEDUP_TABLE table = (PDIRCTL_DEDUP_TABLE)DeferredContext;
+    ULONG64 now = KeQueryInterruptTime();
+    ULONG i;
+
+    UNREFERENCED_PARAMETER( Dpc );
+    UNREFERENCED_PARAMETER( SystemArgument1 );
+    UNREFERENCED_PARAMETER( SystemArgument2 );
+
+    for (i = 0; i < g_Dedup.Sets * DIRCTL_DEDUP_WAYS && table->Used != 0; i++) {
+
+        if (table->Entries[i].Expires != 0 && now >= table->Entries[i].Expires) {
+            DirCtlFlushEntry( table, &table->Entries[i] );
+        }
+    }
+}
+
+VOID
+DirCtlDedupTimerDpc (
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+    )
+/*++
+Routine Description:
+    Queues a flush to every processor whose table has entries. Used is
+    read without synchronization; a flush missed now happens on the next
+    tick.
+--*/
+{
+    ULONG i;
+
+    UNREFERENCED_PARAMETER( Dpc );
+    UNREFERENCED_PARAMETER( DeferredContext );
+    UNREFERENCED_PARAMETER( SystemArgument1 );
+    UNREFERENCED_PARAMETER( SystemArgument2 );
+
+    for (i = 0; i < g_Dedup.TableCount && !g_Dedup.Stopping; i++) {
+
+        if (g_Dedup.Tables[i].Targeted && ReadNoFence( &g_Dedup.Tables[i].Used ) != 0) {
+            KeInsertQueueDpc( &g_Dedup.Tables[i].FlushDpc, NULL, NULL );
+        }
+    }
+}
+
+VOID
+DirCtlQueryDedup (
+    _Out_ PULONG64 Suppressed,
+    _Out_ PULONG64 Repeats
+    )
+/*++
+Routine Description:
+    Sums the counters of all processors. The counters are read without
+    synchronization, which is fine for statistics.
+--*/
+{
+    ULONG i;
+
+    *Suppressed = 0;
+    *Repeats = 0;
+
+    for (i = 0; i < g_Dedup.TableCount && g_Dedup.Tables != NULL; i++) {
+        *Suppressed += g_Dedup.Tables[i].Suppressed;
+        *Repeats += g_Dedup.Tables[i].Repeats;
+    }
+}
@@ -0,0 +1,605 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlEvent.c
+Abstract:
+    Denial event queue. Threads whose create is denied encode the event
+    as a DCWIRE record into a bounded queue in nonpaged memory and carry
+    on; a system worker thread drains the queue and sends the records to
+    DCApp in batches. No create ever waits for DCApp: when the queue is full the
+    event is dropped and counted instead.
+
+    The queue is a ring of slots, each with a sequence number that tells
+    whether it is free for the producer at a given position or filled for
+    the consumer. Producers claim a position with a compare exchange on
+    the tail; the worker is the only consumer.
+
+    DCApp may share an event ring with the filter, see dcring.h. While it
+    is attached the worker is its only producer: it copies the drained
+    records into the ring and only sends a doorbell through the port when
+    DCApp is waiting for one.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "dcring.h"
+#include "dcwire.h"
+#include "DirControl.h"
+
+#define DIRCTL_EVENT_TAG                'Encs'
+
+//  Must be a power of two.
+#define DIRCTL_EVENT_QUEUE_DEPTH        256
+
+//  How long the worker waits for DCApp to pick up a batch before it
+//  gives up on it.
+#define DIRCTL_EVENT_SEND_TIMEOUT       (-10 * 1000 * 1000)
+
+typedef struct _DIRCTL_EVENT_SLOT {
+
+    //  Equal to the position when the slot is free for it, to the position
+    //  plus one once the record at that position has been filled in.
+    volatile LONG Sequence;
+
+    //  Encoded DCWIRE record.
+    ULONG64 Record[DIRCTL_EVENT_RECORD_SIZE / sizeof(ULONG64)];
+
+} DIRCTL_EVENT_SLOT, *PDIRCTL_EVENT_SLOT;
+
+typedef struct _DIRCTL_EVENT_QUEUE {
+
+    PDIRCTL_EVENT_SLOT Slots;
+
+    //  Next position to fill, shared by all producers.
+    DECLSPEC_CACHEALIGN volatile LONG Tail;
+
+    //  Next position to drain, only used by the worker.
+    DECLSPEC_CACHEALIGN LONG Head;
+
+    //  Set by the worker before it waits; producers signal WorkAvailable
+    //  only when they find it set.
+    volatile LONG WorkerIdle;
+
+    //  Message being sent, only used by the worker.
+    PDCAPP_EVENT_MESSAGE Message;
+
+    KEVENT WorkAvailable;
+    volatile BOOLEAN Stop;
+    PKTHREAD Worker;
+
+    //  Event ring shared with DCApp, if any. The worker holds the lock
+    //  shared while it writes to the ring, attach and detach exclusive.
+    EX_PUSH_LOCK RingLock;
+    PVOID RingSection;
+    PVOID RingView;
+    DCRING_PRODUCER Ring;
+
+} DIRCTL_EVENT_QUEUE, *PDIRCTL_EVENT_QUEUE;
+
+DIRCTL_EVENT_QUEUE g_EventQueue;
+
+KSTART_ROUTINE DirCtlEventWorker;
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, DirCtlStartEventQueue)
+    #pragma alloc_text(PAGE, DirCtlStopEventQueue)
+    #pragma alloc_text(PAGE, DirCtlFreeEventQueue)
+    #pragma alloc_text(PAGE, DirCtlAttachRing)
+    #pragma alloc_text(PAGE, DirCtlDetachRing)
+#endif
+
+
+NTSTATUS
+DirCtlStartEventQueue (
+    VOID
+    )
+/*++
+Routine Description:
+    Allocates the queue and starts its worker thread. Called once the
+    filter is registered.
+Return Value:
+    STATUS_SUCCESS or the reason the queue could not be started.
+--*/
+{
+    OBJECT_ATTRIBUTES oa;
+    HANDLE thread;
+    NTSTATUS status;
+    LONG i;
+
+    PAGED_CODE();
+
+    RtlZeroMemory( &g_EventQueue, sizeof(g_EventQueue) );
+    KeInitializeEvent( &g_EventQueue.WorkAvailable, SynchronizationEvent, FALSE );
+    FltInitializePushLock( &g_EventQueue.RingLock );
+
+    g_EventQueue.Slots = ExAllocatePoolWithTag( NonPagedPool,
+                                                DIRCTL_EVENT_QUEUE_DEPTH * sizeof(DIRCTL_EVENT_SLOT),
+                                                DIRCTL_EVENT_TAG );
+    g_EventQueue.Message = ExAllocatePoolWithTag( NonPagedPool,
+                                                  sizeof(DCAPP_EVENT_MESSAGE),
+                                                  DIRCTL_EVENT_TAG );
+
+    if (g_EventQueue.Slots == NULL || g_EventQueue.Message == NULL) {
+        DirCtlFreeEventQueue();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (i = 0; i < DIRCTL_EVENT_QUEUE_DEPTH; i++) {
+        g_EventQueue.Slots[i].Sequence = i;
+    }
+
+    InitializeObjectAttributes( &oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL );
+
+    status = PsCreateSystemThread( &thread, THREAD_ALL_ACCESS, &oa, NULL, NULL,
+                                   DirCtlEventWorker, NULL );
+    if (!NT_SUCCESS( status )) {
+        DirCtlFreeEventQueue();
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle( thread, SYNCHRONIZE, *PsThreadType, KernelMode,
+                                        (PVOID *)&g_EventQueue.Worker, NULL );
+    FLT_ASSERT( NT_SUCCESS( status ) );
+    ZwClose( thread );
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+DirCtlStopEventQueue (
+    VOID
+    )
+/*++
+Routine Description:
+    Stops the worker thread. Events queued from then on are discarded;
+    the queue itself stays valid until DirCtlFreeEventQueue.
+--*/
+{
+    PAGED_CODE();
+
+    if (g_EventQueue.Worker != NULL) {
+
+        g_EventQueue.Stop = TRUE;
+        KeSetEvent( &g_EventQueue.WorkAvailable, IO_NO_INCREMENT, FALSE );
+
+        KeWaitForSingleObject( g_EventQueue.Worker, Executive, KernelMode, FALSE, NULL );
+        ObDereferenceObject( g_EventQueue.Worker );
+        g_EventQueue.Worker = NULL;
+    }
+}
+
+VOID
+DirCtlFreeEventQueue (
+    VOID
+    )
+/*++
+Routine Description:
+    Frees the queue once the worker has stopped and no callback can
+    queue events any more.
+--*/
+{
+    PAGED_CODE();
+
+    FLT_ASSERT( g_EventQueue.Worker == NULL );
+
+    DirCtlDetachRing();
+    FltDeletePushLock( &g_EventQueue.RingLock );
+
+    if (g_EventQueue.Message != NULL) {
+        ExFreePoolWithTag( g_EventQueue.Message, DIRCTL_EVENT_TAG );
+        g_EventQueue.Message = NULL;
+    }
+
+    if (g_EventQueue.Slots != NULL) {
+        ExFreePoolWithTag( g_EventQueue.Slots, DIRCTL_EVENT_TAG );
+        g_EventQueue.Slots = NULL;
+    }
+}
+
+NTSTATUS
+DirCtlAttachRing (
+    _In_ HANDLE Section
+    )
+/*++
+Routine Description:
+    Maps a section created by DCApp into system space and formats it as
+    the event ring, replacing the ring attached before if any. Must be
+    called in the context of DCApp, since Section is one of its handles.
+Arguments:
+    Section - DCApp's handle to the section.
+Return Value:
+    STATUS_SUCCESS or the reason the ring could not be attached.
+--*/
+{
+    DCRING_PRODUCER producer;
+    PVOID section;
+    PVOID view = NULL;
+    SIZE_T viewSize = 0;
+    PVOID oldSection;
+    PVOID oldView;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = ObReferenceObjectByHandle( Section, SECTION_MAP_READ | SECTION_MAP_WRITE,
+                                        *MmSectionObjectType, UserMode, &section, NULL );
+    if (!NT_SUCCESS( status )) {
+        return status;
+    }
+
+    status = MmMapViewInSystemSpace( section, &view, &viewSize );
+    if (!NT_SUCCESS( status )) {
+        ObDereferenceObject( section );
+        return status;
+    }
+
+    if (viewSize < DCAPP_MIN_RING_SIZE || viewSize > DCAPP_MAX_RING_SIZE) {
+        status = STATUS_INVALID_PARAMETER;
+    } else {
+
+        //  The view is backed by the pagefile, touching it can fail.
+        try {
+            status = DcRingInitializeProducer( &producer, view, (ULONG)viewSize );
+        } except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+        }
+    }
+
+    if (!NT_SUCCESS( status )) {
+        MmUnmapViewInSystemSpace( view );
+        ObDereferenceObject( section );
+        return status;
+    }
+
+    FltAcquirePushLockExclusive( &g_EventQueue.RingLock );
+    oldSection = g_EventQueue.RingSection;
+    oldView = g_EventQueue.RingView;
+    g_EventQueue.RingSection = section;
+    g_EventQueue.RingView = view;
+    g_EventQueue.Ring = producer;
+    FltReleasePushLock( &g_EventQueue.RingLock );
+
+    if (oldView != NULL) {
+        MmUnmapViewInSystemSpace( oldView );
+        ObDereferenceObject( oldSection );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+DirCtlDetachRing (
+    VOID
+    )
+/*++
+Routine Description:
+    Unmaps the event ring, if any. Called when DCApp disconnects; the
+    worker goes back to sending events through the port.
+--*/
+{
+    PVOID section;
+    PVOID view;
+
+    PAGED_CODE();
+
+    FltAcquirePushLockExclusive( &g_EventQueue.RingLock );
+    section = g_EventQueue.RingSection;
+    view = g_EventQueue.RingView;
+    g_EventQueue.RingSection = NULL;
+    g_EventQueue.RingView = NULL;
+    FltReleasePushLock( &g_EventQueue.RingLock );
+
+    if (view != NULL) {
+        MmUnmapViewInSystemSpace( view );
+        ObDereferenceObject( section );
+    }
+}
+
+PVOID
+DirCtlReserveEvent (
+    _Out_ PLONG Position
+    )
+/*++
+Routine Description:
+    Claims the next free slot of the queue. The caller encodes a record
+    of at most DIRCTL_EVENT_RECORD_SIZE bytes into it and hands it to the
+    worker with DirCtlCommitEvent; it must do so promptly, since the
+    worker drains the slots in order.
+Arguments:
+    Position - Receives the position to pass to DirCtlCommitEvent.
+Return Value:
+    The buffer to encode the record into, or NULL if the queue is full.
+    The event is then counted as dropped.
+--*/
+{
+    PDIRCTL_EVENT_SLOT slot;
+    LONG position = ReadNoFence( &g_EventQueue.Tail );
+    LONG sequence;
+    LONG current;
+
+    for (;;) {
+
+        slot = &g_EventQueue.Slots[position & (DIRCTL_EVENT_QUEUE_DEPTH - 1)];
+        sequence = ReadAcquire( &slot->Sequence );
+
+        if (sequence == position) {
+
+            current = InterlockedCompareExchange( &g_EventQueue.Tail, position + 1, position );
+            if (current == position) {
+                break;
+            }
+            position = current;
+
+        } else if (sequence - position < 0) {
+
+            //  The slot still holds the event from one lap ago.
+            DirCtlCount( DCAPP_COUNTER_EVENTS_DROPPED );
+            return NULL;
+
+        } else {
+
+            position = ReadNoFence( &g_EventQueue.Tail );
+        }
+    }
+
+    *Position = position;
+    return slot->Record;
+}
+
+VOID
+DirCtlCommitEvent (
+    _In_ LONG Position
+    )
+/*++
+Routine Description:
+    Publishes a record encoded after DirCtlReserveEvent and wakes
+    the worker if it is waiting.
+Arguments:
+    Position - Position returned by DirCtlReserveEvent.
+--*/
+{
+    PDIRCTL_EVENT_SLOT slot = &g_EventQueue.Slots[Position & (DIRCTL_EVENT_QUEUE_DEPTH - 1)];
+
+    //  Full barrier: the worker sets WorkerIdle before it looks at the
+    //  slots, this thread fills the slot before it looks at WorkerIdle,
+    //  so one of them always sees the other.
+    InterlockedExchange( &slot->Sequence, Position + 1 );
+    DirCtlCount( DCAPP_COUNTER_EVENTS_QUEUED );
+
+    if (ReadNoFence( &g_EventQueue.WorkerIdle ) != 0 &&
+        InterlockedExchange( &g_EventQueue.WorkerIdle, 0 ) != 0) {
+
+        KeSetEvent( &g_EventQueue.WorkAvailable, IO_NO_INCREMENT, FALSE );
+    }
+}
+
+static PDIRCTL_EVENT_SLOT
+DirCtlPeekEvent (
+    VOID
+    )
+/*++
+Routine Description:
+    Returns the slot at the head of the queue if its record has been
+    published, NULL otherwise.
+--*/
+{
+    PDIRCTL_EVENT_SLOT slot = &g_EventQueue.Slots[g_EventQueue.Head & (DIRCTL_EVENT_QUEUE_DEPTH - 1)];
+
+    if (ReadAcquire( &slot->Sequence ) != g_EventQueue.Head + 1) {
+        return NULL;
+    }
+
+    return slot;
+}
+
+static VOID
+DirCtlReleaseEvent (
+    _In_ PDIRCTL_EVENT_SLOT Slot
+    )
+{
+    //  Hand the slot back to the producers for the next lap.
+    WriteRelease( &Slot->Sequence, g_EventQueue.Head + DIRCTL_EVENT_QUEUE_DEPTH );
+    g_EventQueue.Head++;
+}
+
+static ULONG
+DirCtlBatchEvents (
+    _Out_ PULONG Length,
+    _Out_ PULONG RecordLength
+    )
+/*++
+Routine Description:
+    Moves as many published records out of the queue as fit into the
+    message, stopping at the first slot that has not been published yet.
+Arguments:
+    Length - Receives the size of the batch in bytes.
+    RecordLength - Receives the size of the records in it.
+Return Value:
+    Number of records moved.
+--*/
+{
+    DCWIRE_WRITER writer;
+    PDIRCTL_EVENT_SLOT slot;
+
+    *RecordLength = 0;
+
+    DcWireBeginBatch( &writer, g_EventQueue.Message->Batch, sizeof(g_EventQueue.Message->Batch) );
+
+    while ((slot = DirCtlPeekEvent()) != NULL &&
+           DcWireAppendRecord( &writer, (PDCWIRE_RECORD)slot->Record )) {
+
+        *RecordLength += ((PDCWIRE_RECORD)slot->Record)->Length;
+        DirCtlReleaseEvent( slot );
+    }
+
+    *Length = DcWireEndBatch( &writer );
+    return writer.Count;
+}
+
+static NTSTATUS
+DirCtlSendMessage (
+    _In_ ULONG Type,
+    _In_ ULONG BatchLength
+    )
+{
+    LARGE_INTEGER timeout;
+
+    if (DirCtlData.ClientPort == NULL) {
+        return STATUS_PORT_DISCONNECTED;
+    }
+
+    g_EventQueue.Message->Type = Type;
+    g_EventQueue.Message->Reserved = 0;
+    timeout.QuadPart = DIRCTL_EVENT_SEND_TIMEOUT;
+
+    return FltSendMessage( DirCtlData.Filter,
+                           &DirCtlData.ClientPort,
+                           g_EventQueue.Message,
+                           FIELD_OFFSET(DCAPP_EVENT_MESSAGE, Batch) + BatchLength,
+                           NULL,
+                           NULL,
+                           &timeout );
+}
+
+static BOOLEAN
+DirCtlRingEvents (
+    _Out_ PBOOLEAN Doorbell
+    )
+/*++
+Routine Description:
+    Moves the published records out of the queue into the event ring.
+    Records that do not fit are counted as lost.
+Arguments:
+    Doorbell - Receives TRUE if DCApp is waiting for a doorbell.
+Return Value:
+    FALSE if no ring is attached and nothing was done.
+--*/
+{
+    PDIRCTL_EVENT_SLOT slot;
+    PDCWIRE_RECORD record;
+    PVOID buffer;
+    ULONG written = 0;
+    ULONG lost = 0;
+    ULONG bytes = 0;
+
+    *Doorbell = FALSE;
+
+    FltAcquirePushLockShared( &g_EventQueue.RingLock );
+
+    if (g_EventQueue.RingView == NULL) {
+        FltReleasePushLock( &g_EventQueue.RingLock );
+        return FALSE;
+    }
+
+    try {
+
+        while ((slot = DirCtlPeekEvent()) != NULL) {
+
+            record = (PDCWIRE_RECORD)slot->Record;
+            buffer = DcRingReserve( &g_EventQueue.Ring, DCAPP_RECORD_EVENT, record->Length );
+
+            if (buffer != NULL) {
+                RtlCopyMemory( buffer, record, record->Length );
+                bytes += record->Length;
+                written++;
+            } else {
+                lost++;
+            }
+
+            DirCtlReleaseEvent( slot );
+        }
+
+        if (written != 0) {
+            DcRingCommit( &g_EventQueue.Ring );
+            *Doorbell = DcRingShouldRing( &g_EventQueue.Ring );
+        }
+
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+
+        //  The view could not be paged in. It is unlikely to recover, so
+        //  stop using it until DCApp attaches another one.
+        g_EventQueue.Ring.Broken = TRUE;
+        lost += written;
+        written = 0;
+        bytes = 0;
+    }
+
+    FltReleasePushLock( &g_EventQueue.RingLock );
+
+    DirCtlAddCounter( DCAPP_COUNTER_EVENTS_SENT, written );
+    DirCtlAddCounter( DCAPP_COUNTER_EVENT_BYTES_SENT, bytes );
+    DirCtlAddCounter( DCAPP_COUNTER_EVENTS_LOST, lost );
+    return TRUE;
+}
+
+VOID
+DirCtlEventWorker (
+    _In_ PVOID StartContext
+    )
+/*++
+Routine Description:
+    Sends the queued records to DCApp, through the event ring if
+    one is attached and through the port otherwise. A batch that DCApp
+    does not pick up within DIRCTL_EVENT_SEND_TIMEOUT, or that cannot be
+    sent because DCApp is not connected, is counted as lost.
+--*/
+{
+    BOOLEAN doorbell;
+    NTSTATUS status;
+    ULONG length;
+    ULONG recordLength;
+    ULONG count;
+
+    UNREFERENCED_PARAMETER( StartContext );
+
+    for (;;) {
+
+        InterlockedExchange( &g_EventQueue.WorkerIdle, 1 );
+        if (DirCtlPeekEvent() == NULL && !g_EventQueue.Stop) {
+            KeWaitForSingleObject( &g_EventQueue.WorkAvailable, Executive, KernelMode, FALSE, NULL );
+        }
+        InterlockedExchange( &g_EventQueue.WorkerIdle, 0 );
+
+        if (g_EventQueue.Stop) {
+            break;
+        }
+
+        while (DirCtlPeekEvent() != NULL) {
+
+            if (DirCtlRingEvents( &doorbell )) {
+
+                //  A lost doorbell only delays the events, DCApp also
+                //  polls the ring.
+                if (doorbell) {
+                    DirCtlSendMessage( DCAPP_MESSAGE_DOORBELL, 0 );
+                }
+
+            } else {
+
+                count = DirCtlBatchEvents( &length, &recordLength );
+                status = DirCtlSendMessage( DCAPP_MESSAGE_EVENTS, length );
+
+                if (status == STATUS_SUCCESS) {
+                    DirCtlAddCounter( DCAPP_COUNTER_EVENTS_SENT, count );
+                    DirCtlAddCounter( DCAPP_COUNTER_EVENT_BYTES_SENT, recordLength );
+                } else {
+                    DirCtlAddCounter( DCAPP_COUNTER_EVENTS_LOST, count );
+                    DbgPrint( "!!! dir ctl --- couldn't send %u events to user-mode, status 0x%X\n",
+                              count, status );
+                }
+            }
+
+            if (g_EventQueue.Stop) {
+                break;
+            }
+        }
+    }
+
+    PsTerminateSystemThread( STATUS_SUCCESS );
+}
@@ -0,0 +1,487 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlHandle.c
+Abstract:
+    Enforcement on handles opened below a protected root. Post create
+    attaches a stream handle context to every such handle, holding the
+    name the create was matched on and the access the mode of the root
+    denies. The
+    write, set information and file system control callbacks then decide
+    with a single context lookup, without querying the file name, and let
+    handles without a context through.
+
+    A handle can be below a protected root and still have no context: one
+    opened before the root was protected, or opened by a trusted process
+    and duplicated into another one. Operations through such handles are
+    not checked until the file is opened again.
+
+    Contexts record the policy they were decided under. After the policy
+    is replaced the name held by the context is matched against the new
+    one instead, which is a trie walk and still no name query.
+
+    Renames and hard links can also move a file below a protected root
+    through a handle that is not below one. Only those operations query
+    the name of their destination, and are denied where the mode of its
+    root would deny creating the file or directory moved there. Roots only match names strictly below
+    them, so a root and the directories above it have no context either;
+    renames and deletes of directories query their own name, so that a
+    root is neither moved out from under its protection nor removed.
+
+    Operations of trusted processes, see DirCtlTrust.c, are not checked.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "DirControl.h"
+
+static BOOLEAN
+DirCtlDenyDirectory (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+    );
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(PAGE, DirCtlSetHandleContext)
+    #pragma alloc_text(PAGE, DirCtlHandleContextCleanup)
+    #pragma alloc_text(PAGE, DirCtlDenyDirectory)
+    #pragma alloc_text(PAGE, DirCtlPreSetInformation)
+#endif
+
+
+NTSTATUS
+DirCtlSetHandleContext (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Inout_ PDIRCTL_CREATE_CONTEXT CreateContext
+    )
+/*++
+Routine Description:
+    Attaches a context to a handle opened below a protected root. On
+    success the context takes over the create context's name reference.
+Arguments:
+    FltObjects - Objects of the create.
+    CreateContext - The match made in pre create.
+Return Value:
+    STATUS_SUCCESS or the reason the context could not be attached.
+--*/
+{
+    PDIRCTL_HANDLE_CONTEXT context;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = FltAllocateContext( FltObjects->Filter,
+                                 FLT_STREAMHANDLE_CONTEXT,
+                                 sizeof(DIRCTL_HANDLE_CONTEXT),
+                                 NonPagedPool,
+                                 &context );
+    if (!NT_SUCCESS( status )) {
+        return status;
+    }
+
+    context->NameInfo = CreateContext->NameInfo;
+    context->RootId = CreateContext->RootId;
+    context->DeniedAccess = CreateContext->DeniedAccess;
+    context->PolicySequence = CreateContext->PolicySequence;
+
+    status = FltSetStreamHandleContext( FltObjects->Instance,
+                                        FltObjects->FileObject,
+                                        FLT_SET_CONTEXT_KEEP_IF_EXISTS,
+                                        context,
+                                        NULL );
+
+    if (NT_SUCCESS( status )) {
+        CreateContext->NameInfo = NULL;
+    } else {
+        context->NameInfo = NULL;
+    }
+
+    FltReleaseContext( context );
+    return status;
+}
+
+VOID
+DirCtlHandleContextCleanup (
+    _In_ PFLT_CONTEXT Context,
+    _In_ FLT_CONTEXT_TYPE ContextType
+    )
+{
+    PDIRCTL_HANDLE_CONTEXT context = Context;
+
+    UNREFERENCED_PARAMETER( ContextType );
+    PAGED_CODE();
+
+    if (context->NameInfo != NULL) {
+        FltReleaseFileNameInformation( context->NameInfo );
+    }
+}
+
+static PDIRCTL_HANDLE_CONTEXT
+DirCtlGetProtectedHandle (
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ ACCESS_MASK Access
+    )
+/*++
+Routine Description:
+    Returns the context of a handle below a protected root whose mode,
+    under the current policy, denies Access.
+Return Value:
+    The referenced context, to be released with FltReleaseContext, or
+    NULL if the operation is not denied.
+--*/
+{
+    PDIRCTL_HANDLE_CONTEXT context;
+    DCMODE_ENTRY mode;
+    ACCESS_MASK deniedAccess;
+    BOOLEAN ambiguous = FALSE;
+
+    if (!NT_SUCCESS( FltGetStreamHandleContext( FltObjects->Instance,
+                                                FltObjects->FileObject,
+                                                &context ) )) {
+        return NULL;
+    }
+
+    if (context->PolicySequence == ReadAcquire( &DirCtlPolicySequence )) {
+        deniedAccess = context->DeniedAccess;
+    } else if (FlagOn( context->NameInfo->Format, FLT_FILE_NAME_NORMALIZED )) {
+        DirCtlCheckPath( context->NameInfo, &mode );
+        deniedAccess = mode.DeniedAccess;
+    } else {
+        DirCtlCheckOpenedPath( context->NameInfo, &ambiguous, &mode );
+
+        //  An opened name that became ambiguous keeps its protection.
+        deniedAccess = ambiguous ? context->DeniedAccess : mode.DeniedAccess;
+    }
+
+    if (!FlagOn( deniedAccess, Access )) {
+        FltReleaseContext( context );
+        return NULL;
+    }
+
+    return context;
+}
+
+static FLT_PREOP_CALLBACK_STATUS
+DirCtlDenyOperation (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PDIRCTL_HANDLE_CONTEXT Context,
+    _In_ ACCESS_MASK AccessMask,
+    _In_ ULONG Counter
+    )
+{
+    DirCtlCount( Counter );
+    DirCtlSendFileInfo( Data, &Context->NameInfo->Name, AccessMask );
+    FltReleaseContext( Context );
+
+    Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+    Data->IoStatus.Information = 0;
+
+    return FLT_PREOP_COMPLETE;
+}
+
+static BOOLEAN
+DirCtlDenyDirectory (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects
+    )
+/*++
+Routine Description:
+    Denies renaming or deleting a directory that is a protected root or
+    holds one, whatever the mode of the root.
+Return Value:
+    TRUE if the operation was denied and completed.
+--*/
+{
+    PFLT_FILE_NAME_INFORMATION nameInfo;
+    PDIRCTL_POLICY policy;
+    BOOLEAN isDirectory;
+    BOOLEAN holdsRoot = FALSE;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = FltIsDirectory( FltObjects->FileObject, FltObjects->Instance, &isDirectory );
+    if (!NT_SUCCESS( status ) || !isDirectory) {
+        return FALSE;
+    }
+
+    status = FltGetFileNameInformation( Data,
+                                        FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT,
+                                        &nameInfo );
+    DirCtlCount( DCAPP_COUNTER_NAME_QUERIES );
+    if (!NT_SUCCESS( status )) {
+        DirCtlCount( DCAPP_COUNTER_NAME_QUERY_FAILURES );
+        return FALSE;
+    }
+
+    policy = DirCtlReferencePolicy();
+    if (policy != NULL) {
+        holdsRoot = DcTrieHasRootBelow( policy->Core.Roots, &nameInfo->Name );
+        DirCtlDereferencePolicy( policy );
+    }
+
+    if (holdsRoot) {
+        DirCtlCount( DCAPP_COUNTER_DENIED_SET_INFORMATION );
+        DirCtlSendFileInfo( Data, &nameInfo->Name, DELETE );
+
+        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+        Data->IoStatus.Information = 0;
+    }
+
+    FltReleaseFileNameInformation( nameInfo );
+    return holdsRoot;
+}
+
+FLT_PREOP_CALLBACK_STATUS
+DirCtlPreWrite (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    )
+/*++
+Routine Description:
+    Denies writes through protected handles. Paging writes are not seen:
+    they flush data written through other handles.
+--*/
+{
+    PLARGE_INTEGER byteOffset = &Data->Iopb->Parameters.Write.ByteOffset;
+    PDIRCTL_HANDLE_CONTEXT context;
+    ACCESS_MASK access;
+
+    *CompletionContext = NULL;
+
+    DirCtlCount( DCAPP_COUNTER_PRE_WRITE );
+
+    if (g_EnableProtection == FALSE ||
+        DirCtlIsTrustedProcess( UlongToHandle( FltGetRequestorProcessId( Data ) ) )) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    //  The I/O manager turns every write through a handle that only has
+    //  append access into a write at end of file, which append-only roots
+    //  allow.
+    access = (byteOffset->LowPart == FILE_WRITE_TO_END_OF_FILE && byteOffset->HighPart == -1) ?
+                 FILE_APPEND_DATA : FILE_WRITE_DATA;
+
+    context = DirCtlGetProtectedHandle( FltObjects, access );
+    if (context == NULL) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    return DirCtlDenyOperation( Data, context, access, DCAPP_COUNTER_DENIED_WRITES );
+}
+
+FLT_PREOP_CALLBACK_STATUS
+DirCtlPreSetInformation (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    )
+/*++
+Routine Description:
+    Denies changes to protected files that the mode of their root does
+    not allow, renames and deletes of directories that are or hold a
+    root, and renames and hard links whose destination is below a root
+    that does not allow files, or for a directory subdirectories, to be
+    added.
+--*/
+{
+    FILE_INFORMATION_CLASS infoClass = Data->Iopb->Parameters.SetFileInformation.FileInformationClass;
+    PVOID infoBuffer = Data->Iopb->Parameters.SetFileInformation.InfoBuffer;
+    PFLT_FILE_NAME_INFORMATION nameInfo;
+    PDIRCTL_HANDLE_CONTEXT context;
+    DCMODE_ENTRY mode;
+    ACCESS_MASK accessMask;
+    HANDLE rootDirectory;
+    PWSTR name;
+    ULONG nameLength;
+    ULONG options = 0;
+    BOOLEAN isDirectory;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *CompletionContext = NULL;
+
+    DirCtlCount( DCAPP_COUNTER_PRE_SET_INFORMATION );
+
+    if (g_EnableProtection == FALSE ||
+        DirCtlIsTrustedProcess( UlongToHandle( FltGetRequestorProcessId( Data ) ) )) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    switch (infoClass) {
+
+    //  These only change the state of the handle.
+    case FilePositionInformation:
+    case FileModeInformation:
+    case FileIoPriorityHintInformation:
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+
+    //  The cache manager extending the file for data written through
+    //  another handle.
+    case FileEndOfFileInformation:
+        if (Data->Iopb->Parameters.SetFileInformation.AdvanceOnly) {
+            return FLT_PREOP_SUCCESS_NO_CALLBACK;
+        }
+        accessMask = FILE_WRITE_DATA;
+        break;
+
+    case FileBasicInformation:
+        accessMask = FILE_WRITE_ATTRIBUTES;
+        break;
+
+    case FileDispositionInformation:
+    case FileDispositionInformationEx:
+    case FileRenameInformation:
+    case FileRenameInformationEx:
+    case FileLinkInformation:
+    case FileLinkInformationEx:
+        accessMask = DELETE;
+        break;
+
+    default:
+        accessMask = FILE_WRITE_DATA;
+        break;
+    }
+
+    context = DirCtlGetProtectedHandle( FltObjects, accessMask );
+    if (context != NULL) {
+        return DirCtlDenyOperation( Data, context, accessMask,
+                                    DCAPP_COUNTER_DENIED_SET_INFORMATION );
+    }
+
+    if ((infoClass == FileRenameInformation || infoClass == FileRenameInformationEx ||
+         (infoClass == FileDispositionInformation &&
+          ((PFILE_DISPOSITION_INFORMATION)infoBuffer)->DeleteFile) ||
+         (infoClass == FileDispositionInformationEx &&
+          FlagOn( ((PFILE_DISPOSITION_INFORMATION_EX)infoBuffer)->Flags, FILE_DISPOSITION_DELETE ))) &&
+        DirCtlDenyDirectory( Data, FltObjects )) {
+        return FLT_PREOP_COMPLETE;
+    }
+
+    if (infoClass == FileRenameInformation || infoClass == FileRenameInformationEx) {
+
+        PFILE_RENAME_INFORMATION renameInfo = infoBuffer;
+        rootDirectory = renameInfo->RootDirectory;
+        name = renameInfo->FileName;
+        nameLength = renameInfo->FileNameLength;
+
+    } else if (infoClass == FileLinkInformation || infoClass == FileLinkInformationEx) {
+
+        PFILE_LINK_INFORMATION linkInfo = infoBuffer;
+        rootDirectory = linkInfo->RootDirectory;
+        name = linkInfo->FileName;
+        nameLength = linkInfo->FileNameLength;
+
+    } else {
+
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    status = FltGetDestinationFileNameInformation( FltObjects->Instance,
+                                                   FltObjects->FileObject,
+                                                   rootDirectory,
+                                                   name,
+                                                   nameLength,
+                                                   FLT_FILE_NAME_NORMALIZED |
+                                                       FLT_FILE_NAME_QUERY_DEFAULT,
+                                                   &nameInfo );
+    DirCtlCount( DCAPP_COUNTER_NAME_QUERIES );
+    if (!NT_SUCCESS( status )) {
+        DirCtlCount( DCAPP_COUNTER_NAME_QUERY_FAILURES );
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    //  Judged as a create of what is moved would be; what cannot be
+    //  told to be a directory is taken for a file.
+    if (NT_SUCCESS( FltIsDirectory( FltObjects->FileObject, FltObjects->Instance, &isDirectory ) ) &&
+        isDirectory) {
+        options = FILE_DIRECTORY_FILE;
+    }
+
+    DirCtlCheckPath( nameInfo, &mode );
+    if (!DcModeDeniesCreation( mode.DeniedCreations, options )) {
+        FltReleaseFileNameInformation( nameInfo );
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    DirCtlCount( DCAPP_COUNTER_DENIED_DESTINATIONS );
+    DirCtlSendFileInfo( Data, &nameInfo->Name,
+                        FlagOn( options, FILE_DIRECTORY_FILE ) ? FILE_ADD_SUBDIRECTORY : FILE_ADD_FILE );
+    FltReleaseFileNameInformation( nameInfo );
+
+    Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+    Data->IoStatus.Information = 0;
+
+    return FLT_PREOP_COMPLETE;
+}
+
+#if (WINVER>=0x0602)
+
+FLT_PREOP_CALLBACK_STATUS
+DirCtlPreFsControl (
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    )
+/*++
+Routine Description:
+    Denies file system controls that change a file whose data is
+    protected: those that require write access and those that change its
+    reparse point, object id, sparseness, compression or integrity, or
+    share its extents.
+--*/
+{
+    PDIRCTL_HANDLE_CONTEXT context;
+    ULONG controlCode;
+
+    *CompletionContext = NULL;
+
+    DirCtlCount( DCAPP_COUNTER_PRE_FS_CONTROL );
+
+    if (g_EnableProtection == FALSE ||
+        (Data->Iopb->MinorFunction != IRP_MN_USER_FS_REQUEST &&
+         Data->Iopb->MinorFunction != IRP_MN_KERNEL_CALL) ||
+        DirCtlIsTrustedProcess( UlongToHandle( FltGetRequestorProcessId( Data ) ) )) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    controlCode = Data->Iopb->Parameters.FileSystemControl.Common.FsControlCode;
+
+    switch (controlCode) {
+
+    case FSCTL_SET_REPARSE_POINT:
+    case FSCTL_DELETE_REPARSE_POINT:
+    case FSCTL_SET_OBJECT_ID:
+    case FSCTL_SET_OBJECT_ID_EXTENDED:
+    case FSCTL_DELETE_OBJECT_ID:
+    case FSCTL_SET_SPARSE:
+    case FSCTL_SET_COMPRESSION:
+    case FSCTL_SET_INTEGRITY_INFORMATION:
+    case FSCTL_DUPLICATE_EXTENTS_TO_FILE:
+        break;
+
+    default:
+        if (!FlagOn( (controlCode >> 14) & 3, FILE_WRITE_ACCESS )) {
+            return FLT_PREOP_SUCCESS_NO_CALLBACK;
+        }
+        break;
+    }
+
+    context = DirCtlGetProtectedHandle( FltObjects, FILE_WRITE_DATA );
+    if (context == NULL) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    return DirCtlDenyOperation( Data, context, FILE_WRITE_DATA,
+                                DCAPP_COUNTER_DENIED_FS_CONTROLS );
+}
+
+#endif
@@ -0,0 +1,177 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlPool.c
+Abstract:
+    Lookaside backed pools for the fixed size objects the filter
+    allocates per operation. Objects are taken from and returned to a
+    per-processor lookaside list, which only goes to the general nonpaged
+    pool, always NX, when it is empty or full.
+
+    Objects handed out and returned are counted in per-processor counters,
+    see DirCtlStats.c, so that neither path touches a shared cache line.
+    The lookaside list calls back into this module whenever it does go
+    to the general pool, which is rare enough for interlocked counters;
+    together they show how often the lists fall back to it and how many
+    objects they hold.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "DirControl.h"
+
+ALLOCATE_FUNCTION_EX DirCtlPoolAllocate;
+FREE_FUNCTION_EX DirCtlPoolFree;
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(INIT, DirCtlInitializePool)
+    #pragma alloc_text(PAGE, DirCtlDeletePool)
+#endif
+
+
+PVOID
+DirCtlPoolAllocate (
+    _In_ POOL_TYPE PoolType,
+    _In_ SIZE_T NumberOfBytes,
+    _In_ ULONG Tag,
+    _Inout_ PLOOKASIDE_LIST_EX Lookaside
+    )
+{
+    PDIRCTL_POOL pool = CONTAINING_RECORD( Lookaside, DIRCTL_POOL, Lookaside );
+    PVOID buffer;
+
+    buffer = ExAllocatePoolWithTag( PoolType, NumberOfBytes, Tag );
+    if (buffer != NULL) {
+        InterlockedIncrement64( &pool->PoolAllocations );
+    }
+
+    return buffer;
+}
+
+VOID
+DirCtlPoolFree (
+    _In_ __drv_freesMem(Mem) PVOID Buffer,
+    _Inout_ PLOOKASIDE_LIST_EX Lookaside
+    )
+{
+    PDIRCTL_POOL pool = CONTAINING_RECORD( Lookaside, DIRCTL_POOL, Lookaside );
+
+    InterlockedIncrement64( &pool->PoolFrees );
+    ExFreePoolWithTag( Buffer, pool->Tag );
+}
+
+NTSTATUS
+DirCtlInitializePool (
+    _Out_ PDIRCTL_POOL Pool,
+    _In_ SIZE_T Size,
+    _In_ ULONG Tag,
+    _In_ ULONG AllocationCounter,
+    _In_ ULONG FreeCounter
+    )
+/*++
+Routine Description:
+    Initializes a pool of objects of Size bytes, counting the objects it
+    hands out and takes back in the DCAPP_COUNTER_* counters given.
+Return Value:
+    STATUS_SUCCESS or the reason the lookaside list could not be created.
+--*/
+{
+    NTSTATUS status;
+
+    RtlZeroMemory( Pool, sizeof(DIRCTL_POOL) );
+    Pool->Tag = Tag;
+    Pool->AllocationCounter = AllocationCounter;
+    Pool->FreeCounter = FreeCounter;
+
+    status = ExInitializeLookasideListEx( &Pool->Lookaside,
+                                          DirCtlPoolAllocate,
+                                          DirCtlPoolFree,
+                                          NonPagedPoolNx,
+                                          0,
+                                          Size,
+                                          Tag,
+                                          0 );
+
+    Pool->Initialized = (BOOLEAN)NT_SUCCESS( status );
+    return status;
+}
+
+VOID
+DirCtlDeletePool (
+    _Inout_ PDIRCTL_POOL Pool
+    )
+/*++
+Routine Description:
+    Frees the objects held by the lookaside list. Every object must have
+    been returned to the pool.
+--*/
+{
+    PAGED_CODE();
+
+    if (Pool->Initialized) {
+
+        FLT_ASSERT( DirCtlReadCounter( Pool->AllocationCounter ) ==
+                    DirCtlReadCounter( Pool->FreeCounter ) );
+
+        ExDeleteLookasideListEx( &Pool->Lookaside );
+        Pool->Initialized = FALSE;
+    }
+}
+
+PVOID
+DirCtlAllocateFromPool (
+    _Inout_ PDIRCTL_POOL Pool
+    )
+{
+    PVOID buffer = ExAllocateFromLookasideListEx( &Pool->Lookaside );
+
+    if (buffer != NULL) {
+        DirCtlCount( Pool->AllocationCounter );
+    }
+
+    return buffer;
+}
+
+VOID
+DirCtlFreeToPool (
+    _Inout_ PDIRCTL_POOL Pool,
+    _In_ PVOID Buffer
+    )
+{
+    DirCtlCount( Pool->FreeCounter );
+    ExFreeToLookasideListEx( &Pool->Lookaside, Buffer );
+}
+
+VOID
+DirCtlQueryPool (
+    _In_ PDIRCTL_POOL Pool,
+    _Out_ PDCAPP_POOL_STATISTICS Statistics
+    )
+/*++
+Routine Description:
+    Returns the counters of a pool, summing the per-processor ones. They
+    are read one at a time while the pool is in use, so Depth is only
+    approximate.
+--*/
+{
+    ULONG64 allocations = DirCtlReadCounter( Pool->AllocationCounter );
+    ULONG64 frees = DirCtlReadCounter( Pool->FreeCounter );
+    ULONG64 poolAllocations = (ULONG64)ReadNoFence64( &Pool->PoolAllocations );
+    ULONG64 poolFrees = (ULONG64)ReadNoFence64( &Pool->PoolFrees );
+    LONG64 depth;
+
+    Statistics->Allocations = allocations;
+    Statistics->Frees = frees;
+    Statistics->PoolAllocations = poolAllocations;
+    Statistics->PoolFrees = poolFrees;
+
+    //  Objects that exist, less the ones in use.
+    depth = (LONG64)(poolAllocations - poolFrees) - (LONG64)(allocations - frees);
+    Statistics->Depth = (depth > 0) ? (ULONG64)depth : 0;
+}
@@ -0,0 +1,324 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlProcess.c
+Abstract:
+    Process image name cache. Denial events carry the image name of the
+    process that issued the operation; it is looked up once per process
+    with SeLocateProcessImageName and kept in a hash table keyed by
+    process id, so that later denials by the same process only cost a
+    lookup.
+
+    Entries are removed from a process notify routine when the process
+    exits. Process ids are reused, so every entry also records the create
+    time of its process and only matches a process with the same one;
+    an entry inserted for a process that was exiting at the same time is
+    never used and goes away when its id is reused.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "DirControl.h"
+
+#define DIRCTL_PROCESS_TAG              'Oncs'
+
+//  Must be a power of two.
+#define DIRCTL_PROCESS_BUCKETS          256
+
+//  Names are not cached for more processes than this at once.
+#define DIRCTL_PROCESS_MAX_ENTRIES      4096
+
+//  Longer names are truncated.
+#define DIRCTL_PROCESS_MAX_NAME         DIRCTL_PROCESS_NAME_SIZE
+
+typedef struct _DIRCTL_PROCESS_ENTRY {
+
+    LIST_ENTRY Link;
+
+    HANDLE ProcessId;
+    LONGLONG CreateTime;
+
+    //  Length of Name in bytes.
+    USHORT Length;
+    WCHAR Name[ANYSIZE_ARRAY];
+
+} DIRCTL_PROCESS_ENTRY, *PDIRCTL_PROCESS_ENTRY;
+
+typedef struct _DIRCTL_PROCESS_CACHE {
+
+    //  Lookups hold the lock shared, inserts and removals exclusive.
+    EX_PUSH_LOCK Lock;
+    LIST_ENTRY Buckets[DIRCTL_PROCESS_BUCKETS];
+    ULONG Count;
+
+    //  Without the notify routine nothing would ever be removed, so the
+    //  cache is bypassed if it could not be registered.
+    BOOLEAN NotifyRegistered;
+
+} DIRCTL_PROCESS_CACHE, *PDIRCTL_PROCESS_CACHE;
+
+DIRCTL_PROCESS_CACHE g_ProcessCache;
+
+static VOID
+DirCtlProcessNotify (
+    _Inout_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+    );
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(INIT, DirCtlInitializeProcessCache)
+    #pragma alloc_text(PAGE, DirCtlFreeProcessCache)
+    #pragma alloc_text(PAGE, DirCtlGetProcessName)
+    #pragma alloc_text(PAGE, DirCtlProcessNotify)
+#endif
+
+
+static PLIST_ENTRY
+DirCtlProcessBucket (
+    _In_ HANDLE ProcessId
+    )
+{
+    //  Process ids are multiples of four.
+    return &g_ProcessCache.Buckets[((ULONG_PTR)ProcessId >> 2) & (DIRCTL_PROCESS_BUCKETS - 1)];
+}
+
+VOID
+DirCtlInitializeProcessCache (
+    VOID
+    )
+/*++
+Routine Description:
+    Sets up the cache and registers the process notify routine. If the
+    routine cannot be registered names are looked up every time.
+--*/
+{
+    NTSTATUS status;
+    ULONG i;
+
+    FltInitializePushLock( &g_ProcessCache.Lock );
+    for (i = 0; i < DIRCTL_PROCESS_BUCKETS; i++) {
+        InitializeListHead( &g_ProcessCache.Buckets[i] );
+    }
+    g_ProcessCache.Count = 0;
+
+    //  Requires the driver to be linked with /INTEGRITYCHECK.
+    status = PsSetCreateProcessNotifyRoutineEx( DirCtlProcessNotify, FALSE );
+    g_ProcessCache.NotifyRegistered = (BOOLEAN)NT_SUCCESS( status );
+
+    if (!NT_SUCCESS( status )) {
+        DbgPrint( "!!! dir ctl --- process name cache disabled, status 0x%X\n", status );
+    }
+}
+
+VOID
+DirCtlFreeProcessCache (
+    VOID
+    )
+/*++
+Routine Description:
+    Unregisters the notify routine, which waits for the calls in
+    progress, and frees every entry. Only called once no callback can
+    look names up any more.
+--*/
+{
+    PDIRCTL_PROCESS_ENTRY entry;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (g_ProcessCache.NotifyRegistered) {
+        PsSetCreateProcessNotifyRoutineEx( DirCtlProcessNotify, TRUE );
+        g_ProcessCache.NotifyRegistered = FALSE;
+    }
+
+    for (i = 0; i < DIRCTL_PROCESS_BUCKETS; i++) {
+
+        while (!IsListEmpty( &g_ProcessCache.Buckets[i] )) {
+
+            entry = CONTAINING_RECORD( RemoveHeadList( &g_ProcessCache.Buckets[i] ),
+                                       DIRCTL_PROCESS_ENTRY,
+                                       Link );
+            ExFreePoolWithTag( entry, DIRCTL_PROCESS_TAG );
+        }
+    }
+    g_ProcessCache.Count = 0;
+
+    FltDeletePushLock( &g_ProcessCache.Lock );
+}
+
+static VOID
+DirCtlRemoveProcess (
+    _In_ HANDLE ProcessId
+    )
+/*++
+Routine Description:
+    Removes the entry, if any, of ProcessId. Called with the lock held
+    exclusive.
+--*/
+{
+    PLIST_ENTRY bucket = DirCtlProcessBucket( ProcessId );
+    PLIST_ENTRY link;
+    PDIRCTL_PROCESS_ENTRY entry;
+
+    for (link = bucket->Flink; link != bucket; link = link->Flink) {
+
+        entry = CONTAINING_RECORD( link, DIRCTL_PROCESS_ENTRY, Link );
+        if (entry->ProcessId == ProcessId) {
+
+            RemoveEntryList( &entry->Link );
+            g_ProcessCache.Count--;
+            ExFreePoolWithTag( entry, DIRCTL_PROCESS_TAG );
+            return;
+        }
+    }
+}
+
+static VOID
+DirCtlProcessNotify (
+    _Inout_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+    )
+/*++
+Routine Description:
+    Drops the cached name of a process when it exits, and any stale
+    entry left under its id when a new process reuses the id. Also
+    decides whether a new process is trusted, see DirCtlTrust.c.
+--*/
+{
+    PAGED_CODE();
+
+    FltAcquirePushLockExclusive( &g_ProcessCache.Lock );
+    DirCtlRemoveProcess( ProcessId );
+    FltReleasePushLock( &g_ProcessCache.Lock );
+
+    DirCtlTrustProcessNotify( Process, ProcessId, CreateInfo );
+}
+
+BOOLEAN
+DirCtlIsProcessNotifyRegistered (
+    VOID
+    )
+{
+    return g_ProcessCache.NotifyRegistered;
+}
+
+static BOOLEAN
+DirCtlLookupProcess (
+    _In_ HANDLE ProcessId,
+    _In_ LONGLONG CreateTime,
+    _Inout_ PUNICODE_STRING Name
+    )
+/*++
+Routine Description:
+    Copies the cached name of the process into Name, truncated to its
+    MaximumLength.
+Return Value:
+    TRUE if the process has an entry.
+--*/
+{
+    PLIST_ENTRY bucket = DirCtlProcessBucket( ProcessId );
+    PLIST_ENTRY link;
+    PDIRCTL_PROCESS_ENTRY entry;
+    BOOLEAN found = FALSE;
+
+    FltAcquirePushLockShared( &g_ProcessCache.Lock );
+
+    for (link = bucket->Flink; link != bucket; link = link->Flink) {
+
+        entry = CONTAINING_RECORD( link, DIRCTL_PROCESS_ENTRY, Link );
+        if (entry->ProcessId == ProcessId && entry->CreateTime == CreateTime) {
+
+            Name->Length = min( entry->Length, Name->MaximumLength );
+            RtlCopyMemory( Name->Buffer, entry->Name, Name->Length );
+            found = TRUE;
+            break;
+        }
+    }
+
+    FltReleasePushLock( &g_ProcessCache.Lock );
+    return found;
+}
+
+NTSTATUS
+DirCtlGetProcessName (
+    _In_ PEPROCESS Process,
+    _Inout_ PUNICODE_STRING Name
+    )
+/*++
+Routine Description:
+    Returns the image name of a process, in device form, from the cache,
+    looking it up and caching it the first time.
+Arguments:
+    Process - The process.
+    Name - Initialized over the caller's buffer; receives the name,
+        truncated to its MaximumLength.
+Return Value:
+    STATUS_SUCCESS or the reason the name could not be looked up.
+--*/
+{
+    HANDLE processId = PsGetProcessId( Process );
+    LONGLONG createTime = PsGetProcessCreateTimeQuadPart( Process );
+    PDIRCTL_PROCESS_ENTRY entry = NULL;
+    PUNICODE_STRING imageName;
+    NTSTATUS status;
+    USHORT length;
+
+    PAGED_CODE();
+
+    if (g_ProcessCache.NotifyRegistered &&
+        DirCtlLookupProcess( processId, createTime, Name )) {
+        return STATUS_SUCCESS;
+    }
+
+    status = SeLocateProcessImageName( Process, &imageName );
+    if (!NT_SUCCESS( status )) {
+        return status;
+    }
+
+    length = min( imageName->Length, (USHORT)DIRCTL_PROCESS_MAX_NAME );
+    Name->Length = min( length, Name->MaximumLength );
+    RtlCopyMemory( Name->Buffer, imageName->Buffer, Name->Length );
+
+    if (g_ProcessCache.NotifyRegistered) {
+        entry = ExAllocatePoolWithTag( PagedPool,
+                                       FIELD_OFFSET(DIRCTL_PROCESS_ENTRY, Name) + length,
+                                       DIRCTL_PROCESS_TAG );
+    }
+
+    if (entry != NULL) {
+
+        entry->ProcessId = processId;
+        entry->CreateTime = createTime;
+        entry->Length = length;
+        RtlCopyMemory( entry->Name, imageName->Buffer, length );
+
+        FltAcquirePushLockExclusive( &g_ProcessCache.Lock );
+
+        //  Replaces an entry another thread inserted meanwhile, or a stale
+        //  one for an earlier process with the same id.
+        DirCtlRemoveProcess( processId );
+
+        if (g_ProcessCache.Count < DIRCTL_PROCESS_MAX_ENTRIES) {
+            InsertHeadList( DirCtlProcessBucket( processId ), &entry->Link );
+            g_ProcessCache.Count++;
+            entry = NULL;
+        }
+
+        FltReleasePushLock( &g_ProcessCache.Lock );
+
+        if (entry != NULL) {
+            ExFreePoolWithTag( entry, DIRCTL_PROCESS_TAG );
+        }
+    }
+
+    ExFreePool( imageName );
+    return STATUS_SUCCESS;
+}
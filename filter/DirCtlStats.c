@@ -0,0 +1,280 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlStats.c
+Abstract:
+    Per-processor runtime counters and latency histograms, see
+    DCAPP_COUNTER_* and DCAPP_LATENCY_* in dcuk.h, and the TraceLogging
+    provider of the filter.
+
+    Each processor has its own block of counters and histograms on cache
+    lines of its own. A counter is bumped, or a latency recorded, at
+    DISPATCH_LEVEL on the current processor's block, so the callbacks
+    neither take a lock nor use an interlocked operation for it, and no
+    two processors ever write the same line. Queries sum the blocks
+    without synchronization, which is fine for statistics.
+
+    Latencies are measured in ticks of the performance counter. The
+    provider writes an event per operation only while a session has it
+    enabled; otherwise TraceLoggingWrite returns after testing a flag.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "DirControl.h"
+
+#define DIRCTL_COUNTERS_TAG             'Kncs'
+
+#if (WINVER>=0x0602)
+#define DIRCTL_COUNTERS_POOL            NonPagedPoolNxCacheAligned
+#else
+#define DIRCTL_COUNTERS_POOL            NonPagedPoolCacheAligned
+#endif
+
+typedef struct DECLSPEC_CACHEALIGN _DIRCTL_COUNTERS {
+
+    ULONG64 Counters[DCAPP_COUNTER_COUNT];
+
+    DCHIST Latency[DCAPP_LATENCY_COUNT];
+
+} DIRCTL_COUNTERS, *PDIRCTL_COUNTERS;
+
+PDIRCTL_COUNTERS g_Counters;
+ULONG g_CounterBlockCount;
+
+//  DirControl {8ca20116-88d8-4856-8876-27ad454ffb06}
+TRACELOGGING_DEFINE_PROVIDER( g_DirCtlProvider,
+                              "DirControl",
+                              (0x8ca20116, 0x88d8, 0x4856, 0x88, 0x76, 0x27, 0xad, 0x45, 0x4f, 0xfb, 0x06) );
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(INIT, DirCtlInitializeCounters)
+    #pragma alloc_text(PAGE, DirCtlFreeCounters)
+    #pragma alloc_text(PAGE, DirCtlQueryLatency)
+#endif
+
+
+NTSTATUS
+DirCtlInitializeCounters (
+    VOID
+    )
+/*++
+Routine Description:
+    Allocates one block of counters per possible processor. The blocks
+    are cache aligned and padded to whole cache lines.
+Return Value:
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    SIZE_T size;
+
+    g_CounterBlockCount = KeQueryMaximumProcessorCountEx( ALL_PROCESSOR_GROUPS );
+    size = (SIZE_T)g_CounterBlockCount * sizeof(DIRCTL_COUNTERS);
+
+    g_Counters = ExAllocatePoolWithTag( DIRCTL_COUNTERS_POOL, size, DIRCTL_COUNTERS_TAG );
+    if (g_Counters == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( g_Counters, size );
+
+    //  Without the provider the filter only goes without events.
+    TraceLoggingRegister( g_DirCtlProvider );
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+DirCtlFreeCounters (
+    VOID
+    )
+{
+    PAGED_CODE();
+
+    TraceLoggingUnregister( g_DirCtlProvider );
+
+    if (g_Counters != NULL) {
+        ExFreePoolWithTag( g_Counters, DIRCTL_COUNTERS_TAG );
+        g_Counters = NULL;
+    }
+}
+
+VOID
+DirCtlAddCounter (
+    _In_ ULONG Counter,
+    _In_ ULONG64 Value
+    )
+/*++
+Routine Description:
+    Adds to a counter of the current processor. Raising to DISPATCH_LEVEL
+    keeps the thread on this processor and keeps other threads off it
+    while the counter is updated.
+Arguments:
+    Counter - DCAPP_COUNTER_* index.
+    Value - Amount to add.
+--*/
+{
+    KIRQL oldIrql;
+
+    NT_ASSERT( Counter < DCAPP_COUNTER_COUNT );
+
+    KeRaiseIrql( DISPATCH_LEVEL, &oldIrql );
+    g_Counters[KeGetCurrentProcessorNumberEx( NULL )].Counters[Counter] += Value;
+    KeLowerIrql( oldIrql );
+}
+
+VOID
+DirCtlRecordLatency (
+    _In_ ULONG Latency,
+    _In_ LONG64 Start
+    )
+/*++
+Routine Description:
+    Records the time from Start to now in a histogram of the current
+    processor.
+Arguments:
+    Latency - DCAPP_LATENCY_* index.
+    Start - Performance counter at the start of what is measured.
+--*/
+{
+    LONG64 end = KeQueryPerformanceCounter( NULL ).QuadPart;
+    KIRQL oldIrql;
+
+    NT_ASSERT( Latency < DCAPP_LATENCY_COUNT );
+
+    KeRaiseIrql( DISPATCH_LEVEL, &oldIrql );
+    DcHistRecord( &g_Counters[KeGetCurrentProcessorNumberEx( NULL )].Latency[Latency],
+                  end > Start ? (ULONG64)(end - Start) : 0 );
+    KeLowerIrql( oldIrql );
+}
+
+ULONG64
+DirCtlReadCounter (
+    _In_ ULONG Counter
+    )
+/*++
+Routine Description:
+    Sums a counter over all processors.
+--*/
+{
+    ULONG64 value = 0;
+    ULONG i;
+
+    for (i = 0; i < g_CounterBlockCount; i++) {
+        value += g_Counters[i].Counters[Counter];
+    }
+
+    return value;
+}
+
+NTSTATUS
+DirCtlQueryCounters (
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    )
+/*++
+Routine Description:
+    Returns a DCAPP_COUNTERS snapshot to DCApp.
+Arguments:
+    OutputBuffer - Caller's buffer, in the caller's address space.
+    OutputBufferLength - Size of OutputBuffer in bytes.
+    ReturnOutputBufferLength - Receives the number of bytes written.
+Return Value:
+    STATUS_SUCCESS or STATUS_BUFFER_TOO_SMALL.
+--*/
+{
+    DCAPP_COUNTERS counters;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG i;
+
+    *ReturnOutputBufferLength = 0;
+
+    if (OutputBuffer == NULL || OutputBufferLength < sizeof(DCAPP_COUNTERS)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    RtlZeroMemory( &counters, sizeof(counters) );
+    counters.CounterCount = DCAPP_COUNTER_COUNT;
+    counters.ProcessorCount = g_CounterBlockCount;
+    counters.Timestamp = KeQueryInterruptTime();
+
+    for (i = 0; i < DCAPP_COUNTER_COUNT; i++) {
+        counters.Counters[i] = DirCtlReadCounter( i );
+    }
+
+    try {
+        RtlCopyMemory( OutputBuffer, &counters, sizeof(counters) );
+        *ReturnOutputBufferLength = sizeof(counters);
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    return status;
+}
+
+NTSTATUS
+DirCtlQueryLatency (
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    )
+/*++
+Routine Description:
+    Returns the latency histograms of all processors, merged, to DCApp.
+Arguments:
+    OutputBuffer - Caller's buffer, in the caller's address space.
+    OutputBufferLength - Size of OutputBuffer in bytes.
+    ReturnOutputBufferLength - Receives the number of bytes written.
+Return Value:
+    STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL or
+    STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    PDCAPP_LATENCY latency;
+    LARGE_INTEGER frequency;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG i, j;
+
+    PAGED_CODE();
+
+    *ReturnOutputBufferLength = 0;
+
+    if (OutputBuffer == NULL || OutputBufferLength < sizeof(DCAPP_LATENCY)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    //  Too large for the stack.
+    latency = ExAllocatePoolWithTag( PagedPool, sizeof(DCAPP_LATENCY), DIRCTL_COUNTERS_TAG );
+    if (latency == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( latency, sizeof(DCAPP_LATENCY) );
+    KeQueryPerformanceCounter( &frequency );
+    latency->HistogramCount = DCAPP_LATENCY_COUNT;
+    latency->BucketCount = DCHIST_BUCKET_COUNT;
+    latency->Frequency = (ULONG64)frequency.QuadPart;
+
+    for (i = 0; i < g_CounterBlockCount; i++) {
+        for (j = 0; j < DCAPP_LATENCY_COUNT; j++) {
+            DcHistMerge( &latency->Histograms[j], &g_Counters[i].Latency[j] );
+        }
+    }
+
+    try {
+        RtlCopyMemory( OutputBuffer, latency, sizeof(DCAPP_LATENCY) );
+        *ReturnOutputBufferLength = sizeof(DCAPP_LATENCY);
+    } except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    ExFreePoolWithTag( latency, DIRCTL_COUNTERS_TAG );
+    return status;
+}
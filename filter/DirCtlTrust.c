@@ -0,0 +1,722 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlTrust.c
+Abstract:
+    Trusted process allowlist. DCApp names the image files of processes
+    that may change protected files, e.g. a deployment agent, and the
+    operations those processes issue are let through unchecked.
+
+    Whether a process is trusted is decided once, when it is created, by
+    matching the normalized name of its image against a hash set of the
+    listed images. The result is kept in a bitmap indexed by process id,
+    so that the callbacks only test a bit, without a lock. Replacing the
+    list matches every running process again.
+
+    Bits are cleared from the process notify routine when a process
+    exits, before its id can be reused.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "dchash.h"
+#include "DirControl.h"
+
+#define DIRCTL_TRUST_TAG                'Tncs'
+
+//  Process ids are multiples of four below 2^26. The bitmap is split in
+//  pages of 2^16 ids, allocated once a process in their range is trusted.
+#define DIRCTL_TRUST_PAGE_SHIFT         16
+#define DIRCTL_TRUST_PAGE_IDS           (1UL << DIRCTL_TRUST_PAGE_SHIFT)
+#define DIRCTL_TRUST_PAGES              256
+
+//  Longer lists are rejected.
+#define DIRCTL_TRUST_MAX_IMAGES         4096
+
+typedef struct _DIRCTL_TRUST_PAGE {
+
+    volatile LONG Bits[DIRCTL_TRUST_PAGE_IDS / 32];
+
+} DIRCTL_TRUST_PAGE, *PDIRCTL_TRUST_PAGE;
+
+typedef struct _DIRCTL_TRUSTED_IMAGE {
+
+    ULONG64 Hash;
+
+    //  Upcased device form name. Buffer is NULL in empty slots.
+    UNICODE_STRING Name;
+
+} DIRCTL_TRUSTED_IMAGE, *PDIRCTL_TRUSTED_IMAGE;
+
+//  Open addressed hash set of images, in one allocation followed by the
+//  names. The slot count is a power of two, at least twice the image
+//  count.
+
+struct _DIRCTL_TRUSTED_IMAGES {
+
+    ULONG Mask;
+    ULONG Count;
+    DIRCTL_TRUSTED_IMAGE Slots[ANYSIZE_ARRAY];
+
+};
+
+typedef struct _DIRCTL_TRUST {
+
+    //  Held shared while processes are matched against Images and
+    //  exclusive while it is replaced, so that no decision made against
+    //  the previous list survives the match of the running processes.
+    EX_PUSH_LOCK ListLock;
+    PDIRCTL_TRUSTED_IMAGES Images;
+    ULONG64 Seed;
+
+    //  Serializes changes to the bitmap. Lookups take no lock.
+    EX_PUSH_LOCK BitmapLock;
+    PDIRCTL_TRUST_PAGE Pages[DIRCTL_TRUST_PAGES];
+
+    //  Processes currently trusted.
+    volatile LONG Count;
+
+} DIRCTL_TRUST, *PDIRCTL_TRUST;
+
+DIRCTL_TRUST g_Trust;
+
+//
+//  Not in the WDK headers. The process information layout is the part
+//  documented in winternl.h.
+//
+
+#define DIRCTL_SYSTEM_PROCESS_INFORMATION_CLASS    5
+
+typedef struct _DIRCTL_SYSTEM_PROCESS_INFORMATION {
+
+    ULONG NextEntryOffset;
+    ULONG NumberOfThreads;
+    UCHAR Reserved1[48];
+    UNICODE_STRING ImageName;
+    LONG BasePriority;
+    HANDLE UniqueProcessId;
+
+} DIRCTL_SYSTEM_PROCESS_INFORMATION, *PDIRCTL_SYSTEM_PROCESS_INFORMATION;
+
+NTSYSAPI
+NTSTATUS
+NTAPI
+ZwQuerySystemInformation (
+    _In_ ULONG SystemInformationClass,
+    _Out_writes_bytes_opt_(SystemInformationLength) PVOID SystemInformation,
+    _In_ ULONG SystemInformationLength,
+    _Out_opt_ PULONG ReturnLength
+    );
+
+NTKERNELAPI
+NTSTATUS
+PsReferenceProcessFilePointer (
+    _In_ PEPROCESS Process,
+    _Outptr_ PFILE_OBJECT *FileObject
+    );
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(INIT, DirCtlInitializeTrust)
+    #pragma alloc_text(PAGE, DirCtlFreeTrust)
+    #pragma alloc_text(PAGE, DirCtlBuildTrustedImages)
+    #pragma alloc_text(PAGE, DirCtlCommitTrustedImages)
+    #pragma alloc_text(PAGE, DirCtlCountTrustedImages)
+    #pragma alloc_text(PAGE, DirCtlTrustProcessNotify)
+#endif
+
+
+VOID
+DirCtlInitializeTrust (
+    VOID
+    )
+/*++
+Routine Description:
+    Sets up an empty allowlist. Must run before the process notify
+    routine is registered.
+--*/
+{
+    LARGE_INTEGER counter = KeQueryPerformanceCounter( NULL );
+    ULONG seed = counter.LowPart;
+
+    RtlZeroMemory( &g_Trust, sizeof(g_Trust) );
+    FltInitializePushLock( &g_Trust.ListLock );
+    FltInitializePushLock( &g_Trust.BitmapLock );
+
+    g_Trust.Seed = ((ULONG64)RtlRandomEx( &seed ) << 32) | RtlRandomEx( &seed );
+}
+
+VOID
+DirCtlFreeTrust (
+    VOID
+    )
+/*++
+Routine Description:
+    Frees the allowlist and the bitmap. Only called once the process
+    notify routine is unregistered and no callback can run any more.
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (g_Trust.Images != NULL) {
+        ExFreePoolWithTag( g_Trust.Images, DIRCTL_TRUST_TAG );
+        g_Trust.Images = NULL;
+    }
+
+    for (i = 0; i < DIRCTL_TRUST_PAGES; i++) {
+        if (g_Trust.Pages[i] != NULL) {
+            ExFreePoolWithTag( g_Trust.Pages[i], DIRCTL_TRUST_TAG );
+            g_Trust.Pages[i] = NULL;
+        }
+    }
+    g_Trust.Count = 0;
+
+    FltDeletePushLock( &g_Trust.BitmapLock );
+    FltDeletePushLock( &g_Trust.ListLock );
+}
+
+BOOLEAN
+DirCtlIsTrustedProcess (
+    _In_ HANDLE ProcessId
+    )
+/*++
+Routine Description:
+    Tells whether a process is on the allowlist. Callable at any IRQL up
+    to DISPATCH_LEVEL.
+--*/
+{
+    ULONG_PTR index = (ULONG_PTR)ProcessId >> 2;
+    PDIRCTL_TRUST_PAGE page;
+    ULONG bit;
+
+    if (index >= (ULONG_PTR)DIRCTL_TRUST_PAGES * DIRCTL_TRUST_PAGE_IDS) {
+        return FALSE;
+    }
+
+    page = ReadPointerAcquire( (PVOID volatile *)&g_Trust.Pages[index >> DIRCTL_TRUST_PAGE_SHIFT] );
+    if (page == NULL) {
+        return FALSE;
+    }
+
+    bit = (ULONG)index & (DIRCTL_TRUST_PAGE_IDS - 1);
+    return (BOOLEAN)((ReadNoFence( &page->Bits[bit / 32] ) >> (bit % 32)) & 1);
+}
+
+static VOID
+DirCtlSetProcessTrust (
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Trusted
+    )
+/*++
+Routine Description:
+    Sets or clears the bit of a process. Called with the bitmap lock held
+    exclusive. A process whose page cannot be allocated stays untrusted.
+--*/
+{
+    ULONG_PTR index = (ULONG_PTR)ProcessId >> 2;
+    PDIRCTL_TRUST_PAGE page;
+    LONG bit;
+
+    if (index >= (ULONG_PTR)DIRCTL_TRUST_PAGES * DIRCTL_TRUST_PAGE_IDS) {
+        return;
+    }
+
+    page = g_Trust.Pages[index >> DIRCTL_TRUST_PAGE_SHIFT];
+    if (page == NULL) {
+
+        if (!Trusted) {
+            return;
+        }
+
+        page = ExAllocatePoolWithTag( NonPagedPool, sizeof(DIRCTL_TRUST_PAGE), DIRCTL_TRUST_TAG );
+        if (page == NULL) {
+            DbgPrint( "!!! dir ctl --- cannot trust process %p\n", ProcessId );
+            return;
+        }
+
+        RtlZeroMemory( page, sizeof(DIRCTL_TRUST_PAGE) );
+        WritePointerRelease( (PVOID volatile *)&g_Trust.Pages[index >> DIRCTL_TRUST_PAGE_SHIFT],
+                             page );
+    }
+
+    bit = (LONG)(index & (DIRCTL_TRUST_PAGE_IDS - 1));
+
+    if (Trusted) {
+        if (!InterlockedBitTestAndSet( &page->Bits[bit / 32], bit % 32 )) {
+            InterlockedIncrement( &g_Trust.Count );
+        }
+    } else if (InterlockedBitTestAndReset( &page->Bits[bit / 32], bit % 32 )) {
+        InterlockedDecrement( &g_Trust.Count );
+    }
+}
+
+static BOOLEAN
+DirCtlIsTrustedImage (
+    _In_ PFILE_OBJECT FileObject
+    )
+/*++
+Routine Description:
+    Matches the normalized name of an image file against the allowlist.
+    Called with the list lock held.
+--*/
+{
+    PDIRCTL_TRUSTED_IMAGES images = g_Trust.Images;
+    PFLT_FILE_NAME_INFORMATION nameInfo;
+    UNICODE_STRING name;
+    BOOLEAN found = FALSE;
+    ULONG64 hash;
+    ULONG i;
+
+    if (images == NULL) {
+        return FALSE;
+    }
+
+    if (!NT_SUCCESS( FltGetFileNameInformationUnsafe( FileObject,
+                                                      NULL,
+                                                      FLT_FILE_NAME_NORMALIZED |
+                                                          FLT_FILE_NAME_QUERY_DEFAULT,
+                                                      &nameInfo ) )) {
+        return FALSE;
+    }
+
+    if (!NT_SUCCESS( RtlUpcaseUnicodeString( &name, &nameInfo->Name, TRUE ) )) {
+        FltReleaseFileNameInformation( nameInfo );
+        return FALSE;
+    }
+    FltReleaseFileNameInformation( nameInfo );
+
+    hash = DcHashFinalize( DcHashBytes( name.Buffer, name.Length, g_Trust.Seed ) );
+
+    for (i = (ULONG)hash & images->Mask;
+         images->Slots[i].Name.Buffer != NULL;
+         i = (i + 1) & images->Mask) {
+
+        if (images->Slots[i].Hash == hash &&
+            RtlEqualUnicodeString( &images->Slots[i].Name, &name, FALSE )) {
+            found = TRUE;
+            break;
+        }
+    }
+
+    RtlFreeUnicodeString( &name );
+    return found;
+}
+
+VOID
+DirCtlTrustProcessNotify (
+    _In_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _In_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+    )
+/*++
+Routine Description:
+    Decides whether a new process is trusted, before its first thread
+    runs, and forgets an exiting one.
+--*/
+{
+    BOOLEAN trusted = FALSE;
+
+    UNREFERENCED_PARAMETER( Process );
+    PAGED_CODE();
+
+    if (CreateInfo == NULL) {
+
+        FltAcquirePushLockExclusive( &g_Trust.BitmapLock );
+        DirCtlSetProcessTrust( ProcessId, FALSE );
+        FltReleasePushLock( &g_Trust.BitmapLock );
+        return;
+    }
+
+    FltAcquirePushLockShared( &g_Trust.ListLock );
+
+    if (CreateInfo->FileObject != NULL) {
+        trusted = DirCtlIsTrustedImage( CreateInfo->FileObject );
+    }
+
+    FltAcquirePushLockExclusive( &g_Trust.BitmapLock );
+    DirCtlSetProcessTrust( ProcessId, trusted );
+    FltReleasePushLock( &g_Trust.BitmapLock );
+
+    FltReleasePushLock( &g_Trust.ListLock );
+}
+
+static NTSTATUS
+DirCtlQueryProcesses (
+    _Outptr_ PVOID *Processes
+    )
+/*++
+Routine Description:
+    Takes a snapshot of the running processes, to be freed with
+    ExFreePoolWithTag.
+--*/
+{
+    PVOID buffer = NULL;
+    ULONG length = 256 * 1024;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    *Processes = NULL;
+
+    for (;;) {
+
+        buffer = ExAllocatePoolWithTag( PagedPool, length, DIRCTL_TRUST_TAG );
+        if (buffer == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        status = ZwQuerySystemInformation( DIRCTL_SYSTEM_PROCESS_INFORMATION_CLASS,
+                                           buffer,
+                                           length,
+                                           NULL );
+        if (status != STATUS_INFO_LENGTH_MISMATCH || length >= 64 * 1024 * 1024) {
+            break;
+        }
+
+        ExFreePoolWithTag( buffer, DIRCTL_TRUST_TAG );
+        length *= 2;
+    }
+
+    if (!NT_SUCCESS( status )) {
+        ExFreePoolWithTag( buffer, DIRCTL_TRUST_TAG );
+        return status;
+    }
+
+    *Processes = buffer;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+DirCtlReevaluateProcesses (
+    _In_ PVOID Processes
+    )
+/*++
+Routine Description:
+    Matches every process of a snapshot against the current list.
+    Processes created since the snapshot are matched by the notify
+    routine; those that have already exited are left alone, their bit is
+    cleared.
+--*/
+{
+    PDIRCTL_SYSTEM_PROCESS_INFORMATION info;
+    PFILE_OBJECT fileObject;
+    PEPROCESS process;
+    BOOLEAN trusted;
+
+    PAGED_CODE();
+
+    FltAcquirePushLockShared( &g_Trust.ListLock );
+
+    info = Processes;
+    for (;;) {
+
+        if (info->UniqueProcessId != NULL &&
+            NT_SUCCESS( PsLookupProcessByProcessId( info->UniqueProcessId, &process ) )) {
+
+            trusted = FALSE;
+            if (NT_SUCCESS( PsReferenceProcessFilePointer( process, &fileObject ) )) {
+                trusted = DirCtlIsTrustedImage( fileObject );
+                ObDereferenceObject( fileObject );
+            }
+
+            FltAcquirePushLockExclusive( &g_Trust.BitmapLock );
+            if (PsGetProcessExitStatus( process ) == STATUS_PENDING) {
+                DirCtlSetProcessTrust( info->UniqueProcessId, trusted );
+            }
+            FltReleasePushLock( &g_Trust.BitmapLock );
+
+            ObDereferenceObject( process );
+        }
+
+        if (info->NextEntryOffset == 0) {
+            break;
+        }
+        info = (PDIRCTL_SYSTEM_PROCESS_INFORMATION)((PUCHAR)info + info->NextEntryOffset);
+    }
+
+    FltReleasePushLock( &g_Trust.ListLock );
+}
+
+static NTSTATUS
+DirCtlCreateTrustedImages (
+    _In_reads_(Count) PCUNICODE_STRING Names,
+    _In_ ULONG Count,
+    _Outptr_result_maybenull_ PDIRCTL_TRUSTED_IMAGES *Images
+    )
+/*++
+Routine Description:
+    Builds the hash set of a list of images; duplicates are kept once.
+    An empty list gives no set.
+--*/
+{
+    PDIRCTL_TRUSTED_IMAGES images;
+    UNICODE_STRING name;
+    PWCHAR names;
+    ULONG64 hash;
+    ULONG namesLength = 0;
+    ULONG slotCount;
+    ULONG i, j;
+
+    PAGED_CODE();
+
+    *Images = NULL;
+
+    if (Count == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    for (slotCount = 2; slotCount < Count * 2; slotCount *= 2) {
+        NOTHING;
+    }
+
+    for (i = 0; i < Count; i++) {
+        namesLength += Names[i].Length;
+    }
+
+    images = ExAllocatePoolWithTag( PagedPool,
+                                    FIELD_OFFSET(DIRCTL_TRUSTED_IMAGES, Slots) +
+                                        slotCount * sizeof(DIRCTL_TRUSTED_IMAGE) +
+                                        namesLength,
+                                    DIRCTL_TRUST_TAG );
+    if (images == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( images, FIELD_OFFSET(DIRCTL_TRUSTED_IMAGES, Slots) +
+                               slotCount * sizeof(DIRCTL_TRUSTED_IMAGE) );
+    images->Mask = slotCount - 1;
+    names = (PWCHAR)&images->Slots[slotCount];
+
+    for (i = 0; i < Count; i++) {
+
+        name.Buffer = names;
+        name.Length = 0;
+        name.MaximumLength = Names[i].Length;
+        RtlUpcaseUnicodeString( &name, &Names[i], FALSE );
+
+        hash = DcHashFinalize( DcHashBytes( name.Buffer, name.Length, g_Trust.Seed ) );
+
+        for (j = (ULONG)hash & images->Mask;
+             images->Slots[j].Name.Buffer != NULL;
+             j = (j + 1) & images->Mask) {
+
+            if (images->Slots[j].Hash == hash &&
+                RtlEqualUnicodeString( &images->Slots[j].Name, &name, FALSE )) {
+                break;
+            }
+        }
+
+        //  A duplicate leaves its copy of the name unused.
+        if (images->Slots[j].Name.Buffer == NULL) {
+
+            images->Slots[j].Hash = hash;
+            images->Slots[j].Name = name;
+            images->Count++;
+            names += name.Length / sizeof(WCHAR);
+        }
+    }
+
+    *Images = images;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+DirCtlBuildTrustedImages (
+    _In_ BOOLEAN Keep,
+    _In_reads_(ChangeCount) const DIRCTL_TRUST_CHANGE *Changes,
+    _In_ ULONG ChangeCount,
+    _Outptr_result_maybenull_ PDIRCTL_TRUSTED_IMAGES *Images,
+    _Out_ PULONG Failed
+    )
+/*++
+Routine Description:
+    Builds the allowlist that results from applying a list of changes, in
+    order, to the current one, without replacing it. Called with updates
+    locked, so that the current list cannot change before the result is
+    committed.
+Arguments:
+    Keep - FALSE to apply the changes to an empty list instead.
+    Changes - Images to add or remove, in device form.
+    ChangeCount - Number of entries in Changes.
+    Images - Receives the list, to be passed to
+        DirCtlCommitTrustedImages, or NULL if it is empty.
+    Failed - Receives the index of the change that could not be made, or
+        DCAPP_NO_RECORD.
+Return Value:
+    STATUS_SUCCESS, STATUS_OBJECT_NAME_NOT_FOUND if an image to remove is
+    not listed, STATUS_INVALID_PARAMETER if the list gets too long or
+    STATUS_NOT_SUPPORTED if processes cannot be tracked.
+--*/
+{
+    PDIRCTL_TRUSTED_IMAGES current = g_Trust.Images;
+    PUNICODE_STRING names;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG capacity;
+    ULONG count = 0;
+    ULONG i, j;
+
+    PAGED_CODE();
+
+    *Images = NULL;
+    *Failed = DCAPP_NO_RECORD;
+
+    if (ChangeCount > 2 * DIRCTL_TRUST_MAX_IMAGES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!Keep) {
+        current = NULL;
+    }
+
+    capacity = (current != NULL ? current->Count : 0) + ChangeCount;
+    if (capacity == 0) {
+        return STATUS_SUCCESS;
+    }
+
+    names = ExAllocatePoolWithTag( PagedPool, capacity * sizeof(UNICODE_STRING), DIRCTL_TRUST_TAG );
+    if (names == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //  The names of the current list stay valid until the result is
+    //  committed, which copies them.
+    if (current != NULL) {
+        for (i = 0; i <= current->Mask; i++) {
+            if (current->Slots[i].Name.Buffer != NULL) {
+                names[count++] = current->Slots[i].Name;
+            }
+        }
+    }
+
+    //  Lists are short, a linear search is enough.
+    for (i = 0; i < ChangeCount && NT_SUCCESS( status ); i++) {
+
+        for (j = 0; j < count; j++) {
+            if (RtlEqualUnicodeString( &names[j], &Changes[i].Image, TRUE )) {
+                break;
+            }
+        }
+
+        if (Changes[i].Remove) {
+
+            if (j == count) {
+                status = STATUS_OBJECT_NAME_NOT_FOUND;
+            } else {
+                names[j] = names[--count];
+            }
+
+        } else if (j == count) {
+
+            if (count == DIRCTL_TRUST_MAX_IMAGES) {
+                status = STATUS_INVALID_PARAMETER;
+            } else {
+                names[count++] = Changes[i].Image;
+            }
+        }
+
+        if (!NT_SUCCESS( status )) {
+            *Failed = i;
+        }
+    }
+
+    //  Without the notify routine exits would not clear the bits, and
+    //  a reused id would inherit the trust of the process that had it.
+    if (NT_SUCCESS( status ) && count != 0 && !DirCtlIsProcessNotifyRegistered()) {
+        status = STATUS_NOT_SUPPORTED;
+    }
+
+    if (NT_SUCCESS( status )) {
+        status = DirCtlCreateTrustedImages( names, count, Images );
+    }
+
+    ExFreePoolWithTag( names, DIRCTL_TRUST_TAG );
+    return status;
+}
+
+NTSTATUS
+DirCtlCommitTrustedImages (
+    _In_opt_ PDIRCTL_TRUSTED_IMAGES Images
+    )
+/*++
+Routine Description:
+    Replaces the allowlist and matches the running processes against the
+    new one. The processes are listed first, so that the list is only
+    replaced once nothing can fail any more.
+Arguments:
+    Images - List built by DirCtlBuildTrustedImages, or NULL to trust no
+        process. It still belongs to the caller if the call fails.
+Return Value:
+    STATUS_SUCCESS or the reason the processes could not be listed.
+--*/
+{
+    PDIRCTL_TRUSTED_IMAGES previous;
+    PVOID processes;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    status = DirCtlQueryProcesses( &processes );
+    if (!NT_SUCCESS( status )) {
+        return status;
+    }
+
+    FltAcquirePushLockExclusive( &g_Trust.ListLock );
+    previous = g_Trust.Images;
+    g_Trust.Images = Images;
+    FltReleasePushLock( &g_Trust.ListLock );
+
+    if (previous != NULL) {
+        ExFreePoolWithTag( previous, DIRCTL_TRUST_TAG );
+    }
+
+    DirCtlReevaluateProcesses( processes );
+    ExFreePoolWithTag( processes, DIRCTL_TRUST_TAG );
+    return STATUS_SUCCESS;
+}
+
+VOID
+DirCtlFreeTrustedImages (
+    _In_ PDIRCTL_TRUSTED_IMAGES Images
+    )
+{
+    ExFreePoolWithTag( Images, DIRCTL_TRUST_TAG );
+}
+
+ULONG
+DirCtlCountTrustedImages (
+    VOID
+    )
+/*++
+Routine Description:
+    Returns the number of images on the allowlist.
+--*/
+{
+    ULONG count;
+
+    PAGED_CODE();
+
+    FltAcquirePushLockShared( &g_Trust.ListLock );
+    count = (g_Trust.Images != NULL) ? g_Trust.Images->Count : 0;
+    FltReleasePushLock( &g_Trust.ListLock );
+
+    return count;
+}
+
+ULONG
+DirCtlQueryTrust (
+    VOID
+    )
+/*++
+Routine Description:
+    Returns the number of processes currently trusted.
+--*/
+{
+    return (ULONG)ReadNoFence( &g_Trust.Count );
+}
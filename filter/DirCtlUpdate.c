@@ -0,0 +1,945 @@
+/*++
+Copyright (c)
+Module Name:
+    DirCtlUpdate.c
+Abstract:
+    Transactional policy updates, see DCAPP_UPDATE_INPUT in dcuk.h.
+
+    An update goes through four steps. Every record is checked on its
+    own before anything else is looked at. With updates locked, the roots
+    of the policy in effect are listed from its trie, so that updates also
+    apply to a policy loaded from an image, and the records are applied to
+    that list and to the trusted images in order. The policy and the
+    allowlist that result are then compiled, and only once both are built
+    are they committed, the allowlist first. A message is thus applied in
+    full or not at all, and readers go from the old policy to the new one
+    without a moment of no protection.
+
+    The list of roots is indexed by a hash of the upcased path, so that
+    each record costs the same whether a handful or tens of thousands of
+    roots are protected.
+
+    Every change made through the port, updates and the message that
+    turns protection off, is made with updates locked and advances the
+    generation.
+Environment:
+    Kernel mode
+--*/
+
+#include <fltKernel.h>
+#include "dcuk.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcpolicy.h"
+#include "dchash.h"
+#include "DirControl.h"
+
+#define DIRCTL_UPDATE_TAG       'Uncs'
+
+#define DIRCTL_NO_ENTRY         ((ULONG)-1)
+
+//  A root of the policy being built. Removed entries stay in the list,
+//  and in its index, until the policy is compiled.
+
+typedef struct _DIRCTL_UPDATE_ROOT {
+
+    //  Path without leading or trailing separators.
+    UNICODE_STRING Path;
+    ULONG64 Hash;
+
+    //  Entry of the root the path is a spelling of, the entry itself if
+    //  the path is not an alias. The aliases of a root are linked from
+    //  its entry through Next.
+    ULONG Primary;
+    ULONG Next;
+
+    //  DCMODE_PROTECT_* flags, kept in the entry of the root.
+    ULONG Mode;
+
+    //  Root id in the compiled policy.
+    ULONG RootId;
+
+    BOOLEAN Removed;
+
+} DIRCTL_UPDATE_ROOT, *PDIRCTL_UPDATE_ROOT;
+
+typedef struct _DIRCTL_UPDATE {
+
+    PDIRCTL_UPDATE_ROOT Roots;
+    ULONG RootCount;
+    ULONG Capacity;
+
+    //  Open addressed index of Roots by path: entry index + 1, 0 in empty
+    //  slots. The slot count is a power of two, at least twice Capacity.
+    PULONG Index;
+    ULONG IndexMask;
+    ULONG64 Seed;
+
+    //  Last root added by the message, for the aliases that follow it.
+    ULONG LastAdded;
+
+    //  Roots of the policy in effect, which the first entries point into.
+    PDCTRIE_ROOT CurrentRoots;
+
+    PDIRCTL_TRUST_CHANGE TrustChanges;
+    ULONG TrustChangeCount;
+    BOOLEAN TrustChanged;
+    BOOLEAN KeepTrusted;
+
+    //  Last DCAPP_UPDATE_SET_EXTENSIONS record and its index, or NULL.
+    PDCAPP_UPDATE_RECORD Extensions;
+    ULONG ExtensionsRecord;
+
+} DIRCTL_UPDATE, *PDIRCTL_UPDATE;
+
+//  Serializes every change made through the port. Taken at passive level
+//  only; needs no cleanup.
+EX_PUSH_LOCK g_UpdateLock;
+
+//  Changes made through the port since the driver was loaded.
+volatile LONG64 g_PolicyGeneration;
+
+#ifdef ALLOC_PRAGMA
+    #pragma alloc_text(INIT, DirCtlInitializeUpdates)
+    #pragma alloc_text(PAGE, DirCtlLockUpdates)
+    #pragma alloc_text(PAGE, DirCtlUnlockUpdates)
+    #pragma alloc_text(PAGE, DirCtlUpdatePolicy)
+#endif
+
+
+VOID
+DirCtlInitializeUpdates (
+    VOID
+    )
+{
+    FltInitializePushLock( &g_UpdateLock );
+    g_PolicyGeneration = 0;
+}
+
+VOID
+DirCtlLockUpdates (
+    VOID
+    )
+/*++
+Routine Description:
+    Locks out other changes to the policy and the allowlist.
+--*/
+{
+    PAGED_CODE();
+
+    FltAcquirePushLockExclusive( &g_UpdateLock );
+}
+
+VOID
+DirCtlUnlockUpdates (
+    _In_ BOOLEAN Changed
+    )
+/*++
+Routine Description:
+    Lets other changes proceed.
+Arguments:
+    Changed - TRUE if the policy or the allowlist was changed, which
+        advances the generation.
+--*/
+{
+    PAGED_CODE();
+
+    if (Changed) {
+        InterlockedIncrement64( &g_PolicyGeneration );
+    }
+
+    FltReleasePushLock( &g_UpdateLock );
+}
+
+ULONG64
+DirCtlQueryGeneration (
+    VOID
+    )
+{
+    return (ULONG64)ReadNoFence64( &g_PolicyGeneration );
+}
+
+static VOID
+DirCtlTrimPath (
+    _In_reads_bytes_(Length) PWCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PUNICODE_STRING Path
+    )
+/*++
+Routine Description:
+    Describes a path without its leading and trailing separators, which
+    the trie ignores as well.
+--*/
+{
+    ULONG count = Length / sizeof(WCHAR);
+
+    while (count != 0 && Buffer[0] == DC_PATH_SEPARATOR) {
+        Buffer++;
+        count--;
+    }
+
+    while (count != 0 && Buffer[count - 1] == DC_PATH_SEPARATOR) {
+        count--;
+    }
+
+    Path->Buffer = Buffer;
+    Path->Length = (USHORT)(count * sizeof(WCHAR));
+    Path->MaximumLength = Path->Length;
+}
+
+static BOOLEAN
+DirCtlIsValidRootPath (
+    _In_ PDCAPP_UPDATE_RECORD Record
+    )
+/*++
+Routine Description:
+    Checks the path of a root record the way DcTrieBuild will: a whole
+    number of characters, at least one component and no empty ones.
+--*/
+{
+    UNICODE_STRING path;
+    ULONG i;
+
+    if (Record->Length == 0 || Record->Length > MAXUSHORT ||
+        (Record->Length % sizeof(WCHAR)) != 0) {
+        return FALSE;
+    }
+
+    DirCtlTrimPath( (PWCHAR)Record->Value, Record->Length, &path );
+    if (path.Length == 0) {
+        return FALSE;
+    }
+
+    for (i = 1; i < path.Length / sizeof(WCHAR); i++) {
+        if (path.Buffer[i] == DC_PATH_SEPARATOR && path.Buffer[i - 1] == DC_PATH_SEPARATOR) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN
+DirCtlIsValidMode (
+    _In_ USHORT Flags
+    )
+{
+    return (BOOLEAN)((((Flags & DCAPP_ROOT_MODE_MASK) >> DCAPP_ROOT_MODE_SHIFT) &
+                      ~DCMODE_PROTECT_ALL) == 0);
+}
+
+static NTSTATUS
+DirCtlCheckRecords (
+    _In_ PDCAPP_UPDATE_INPUT Input,
+    _In_ ULONG InputLength,
+    _Out_ PULONG AddCount,
+    _Out_ PULONG TrustCount,
+    _Out_ PULONG Failed
+    )
+/*++
+Routine Description:
+    Checks the framing of a captured update and every record in it,
+    without looking at the policy in effect.
+Arguments:
+    Input - Captured copy of the message sent by DCApp.
+    InputLength - Size of the captured message in bytes.
+    AddCount - Receives the number of roots the message adds.
+    TrustCount - Receives the number of trusted images it adds or
+        removes.
+    Failed - Receives the index of the first malformed record, or
+        DCAPP_NO_RECORD.
+Return Value:
+    STATUS_SUCCESS, STATUS_UNKNOWN_REVISION for another version of the
+    message or STATUS_INVALID_PARAMETER.
+--*/
+{
+    PDCAPP_UPDATE_RECORD record;
+    BOOLEAN added = FALSE;
+    BOOLEAN valid;
+    ULONG offset = 0;
+    ULONG i;
+
+    *AddCount = 0;
+    *TrustCount = 0;
+    *Failed = DCAPP_NO_RECORD;
+
+    if (InputLength < (ULONG)FIELD_OFFSET(DCAPP_UPDATE_INPUT, Records)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Input->Version != DCAPP_UPDATE_VERSION) {
+        return STATUS_UNKNOWN_REVISION;
+    }
+
+    if (Input->Reserved != 0 ||
+        Input->RecordsLength > InputLength - FIELD_OFFSET(DCAPP_UPDATE_INPUT, Records) ||
+        Input->RecordCount > Input->RecordsLength / DCAPP_UPDATE_RECORD_SIZE(0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < Input->RecordCount; i++) {
+
+        *Failed = i;
+
+        if (Input->RecordsLength - offset < (ULONG)FIELD_OFFSET(DCAPP_UPDATE_RECORD, Value)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        record = (PDCAPP_UPDATE_RECORD)&Input->Records[offset];
+        if (record->Length > Input->RecordsLength - offset - FIELD_OFFSET(DCAPP_UPDATE_RECORD, Value) ||
+            DCAPP_UPDATE_RECORD_SIZE(record->Length) > Input->RecordsLength - offset) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        switch (record->Type) {
+
+        case DCAPP_UPDATE_CLEAR_ROOTS:
+        case DCAPP_UPDATE_CLEAR_TRUSTED:
+            valid = (BOOLEAN)(record->Length == 0 && record->Flags == 0);
+            break;
+
+        case DCAPP_UPDATE_ADD_ROOT:
+
+            //  An alias is another spelling of the last root added
+            //  before it, which must be in the same message.
+            valid = (BOOLEAN)(DirCtlIsValidRootPath( record ) &&
+                              (record->Flags & ~(DCAPP_ROOT_ALIAS | DCAPP_ROOT_MODE_MASK)) == 0 &&
+                              DirCtlIsValidMode( record->Flags ) &&
+                              (added || !FlagOn( record->Flags, DCAPP_ROOT_ALIAS )));
+            added = TRUE;
+            (*AddCount)++;
+            break;
+
+        case DCAPP_UPDATE_REMOVE_ROOT:
+            valid = (BOOLEAN)(DirCtlIsValidRootPath( record ) && record->Flags == 0);
+            break;
+
+        case DCAPP_UPDATE_SET_MODE:
+            valid = (BOOLEAN)(DirCtlIsValidRootPath( record ) &&
+                              (record->Flags & ~DCAPP_ROOT_MODE_MASK) == 0 &&
+                              DirCtlIsValidMode( record->Flags ));
+            break;
+
+        case DCAPP_UPDATE_ADD_TRUSTED:
+        case DCAPP_UPDATE_REMOVE_TRUSTED:
+            valid = (BOOLEAN)(record->Length != 0 && record->Length <= MAXUSHORT &&
+                              (record->Length % sizeof(WCHAR)) == 0 &&
+                              record->Flags == 0);
+            (*TrustCount)++;
+            break;
+
+        case DCAPP_UPDATE_SET_EXTENSIONS:
+
+            //  The rule itself is checked when it is compiled.
+            valid = (BOOLEAN)(record->Length >= (ULONG)FIELD_OFFSET(DCAPP_EXTENSIONS, Extensions) &&
+                              record->Flags == 0);
+            break;
+
+        default:
+            valid = FALSE;
+            break;
+        }
+
+        if (!valid) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        offset += DCAPP_UPDATE_RECORD_SIZE(record->Length);
+    }
+
+    *Failed = DCAPP_NO_RECORD;
+
+    if (offset != Input->RecordsLength) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static ULONG64
+DirCtlHashPath (
+    _In_ PCUNICODE_STRING Path,
+    _In_ ULONG64 Seed
+    )
+/*++
+Routine Description:
+    Seeded FNV-1a over the upcased characters of a path, so that two
+    spellings that differ only in case hash alike.
+--*/
+{
+    ULONG64 hash = Seed ^ 0xCBF29CE484222325ULL;
+    ULONG i;
+
+    for (i = 0; i < Path->Length / sizeof(WCHAR); i++) {
+        hash ^= RtlUpcaseUnicodeChar( Path->Buffer[i] );
+        hash *= DC_HASH_PRIME;
+    }
+
+    return DcHashFinalize( hash );
+}
+
+static ULONG
+DirCtlFindRoot (
+    _In_ PDIRCTL_UPDATE Update,
+    _In_ PCUNICODE_STRING Path,
+    _In_ ULONG64 Hash
+    )
+/*++
+Routine Description:
+    Returns the entry of a root that has not been removed with the given
+    path, or DIRCTL_NO_ENTRY.
+--*/
+{
+    PDIRCTL_UPDATE_ROOT entry;
+    ULONG slot;
+
+    for (slot = (ULONG)Hash & Update->IndexMask;
+         Update->Index[slot] != 0;
+         slot = (slot + 1) & Update->IndexMask) {
+
+        entry = &Update->Roots[Update->Index[slot] - 1];
+        if (!entry->Removed && entry->Hash == Hash &&
+            RtlEqualUnicodeString( &entry->Path, Path, TRUE )) {
+            return Update->Index[slot] - 1;
+        }
+    }
+
+    return DIRCTL_NO_ENTRY;
+}
+
+static ULONG
+DirCtlAppendRoot (
+    _Inout_ PDIRCTL_UPDATE Update,
+    _In_ PCUNICODE_STRING Path,
+    _In_ ULONG64 Hash,
+    _In_ ULONG Primary,
+    _In_ ULONG Mode
+    )
+/*++
+Routine Description:
+    Adds an entry to the list and its index.
+Arguments:
+    Primary - Entry of the root the path is an alias of, or
+        DIRCTL_NO_ENTRY if the path is a root of its own.
+    Mode - DCMODE_PROTECT_* flags of a root of its own.
+Return Value:
+    Index of the new entry.
+--*/
+{
+    ULONG index = Update->RootCount++;
+    PDIRCTL_UPDATE_ROOT entry = &Update->Roots[index];
+    ULONG slot;
+
+    NT_ASSERT( index < Update->Capacity );
+
+    entry->Path = *Path;
+    entry->Hash = Hash;
+    entry->Next = DIRCTL_NO_ENTRY;
+    entry->Mode = Mode;
+    entry->RootId = DCTRIE_NO_ROOT;
+    entry->Removed = FALSE;
+
+    if (Primary == DIRCTL_NO_ENTRY) {
+        entry->Primary = index;
+    } else {
+        entry->Primary = Primary;
+        entry->Next = Update->Roots[Primary].Next;
+        Update->Roots[Primary].Next = index;
+    }
+
+    for (slot = (ULONG)Hash & Update->IndexMask;
+         Update->Index[slot] != 0;
+         slot = (slot + 1) & Update->IndexMask) {
+        NOTHING;
+    }
+    Update->Index[slot] = index + 1;
+
+    return index;
+}
+
+static VOID
+DirCtlRemoveRoot (
+    _Inout_ PDIRCTL_UPDATE Update,
+    _In_ ULONG Index
+    )
+/*++
+Routine Description:
+    Removes the root an entry spells, with all its aliases.
+--*/
+{
+    ULONG index;
+
+    for (index = Update->Roots[Index].Primary;
+         index != DIRCTL_NO_ENTRY;
+         index = Update->Roots[index].Next) {
+        Update->Roots[index].Removed = TRUE;
+    }
+}
+
+static NTSTATUS
+DirCtlLoadRoots (
+    _Inout_ PDIRCTL_UPDATE Update,
+    _In_opt_ PDIRCTL_POLICY Policy,
+    _In_ ULONG AddCount
+    )
+/*++
+Routine Description:
+    Starts the list from the roots of the policy in effect and makes room
+    for the roots the message adds. Paths that share a root id become
+    aliases of the first of them.
+--*/
+{
+    PULONG primaries = NULL;
+    UNICODE_STRING path;
+    LARGE_INTEGER counter;
+    ULONG random;
+    ULONG rootCount = 0;
+    ULONG slotCount;
+    ULONG rootId;
+    ULONG i;
+    NTSTATUS status;
+
+    if (Policy != NULL) {
+
+        status = DcTrieGetRoots( Policy->Core.Roots, &Update->CurrentRoots, &rootCount );
+        if (!NT_SUCCESS( status )) {
+            return status;
+        }
+
+        if (Policy->Core.Modes->RootCount != 0) {
+            primaries = ExAllocatePoolWithTag( PagedPool,
+                                               Policy->Core.Modes->RootCount * sizeof(ULONG),
+                                               DIRCTL_UPDATE_TAG );
+            if (primaries == NULL) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            RtlFillMemory( primaries, Policy->Core.Modes->RootCount * sizeof(ULONG), 0xFF );
+        }
+    }
+
+    if ((ULONG64)rootCount + AddCount > MAXULONG / 2 / sizeof(ULONG)) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Cleanup;
+    }
+
+    Update->Capacity = rootCount + AddCount;
+    for (slotCount = 2; slotCount < Update->Capacity * 2; slotCount *= 2) {
+        NOTHING;
+    }
+
+    Update->Roots = ExAllocatePoolWithTag( PagedPool,
+                                           max( Update->Capacity, 1 ) * sizeof(DIRCTL_UPDATE_ROOT),
+                                           DIRCTL_UPDATE_TAG );
+    Update->Index = ExAllocatePoolWithTag( PagedPool, slotCount * sizeof(ULONG), DIRCTL_UPDATE_TAG );
+    if (Update->Roots == NULL || Update->Index == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    RtlZeroMemory( Update->Index, slotCount * sizeof(ULONG) );
+    Update->IndexMask = slotCount - 1;
+
+    counter = KeQueryPerformanceCounter( NULL );
+    random = counter.LowPart;
+    Update->Seed = ((ULONG64)RtlRandomEx( &random ) << 32) | RtlRandomEx( &random );
+
+    for (i = 0; i < rootCount; i++) {
+
+        rootId = Update->CurrentRoots[i].RootId;
+        DirCtlTrimPath( Update->CurrentRoots[i].Path.Buffer,
+                        Update->CurrentRoots[i].Path.Length,
+                        &path );
+
+        if (primaries[rootId] == DIRCTL_NO_ENTRY) {
+            primaries[rootId] = DirCtlAppendRoot( Update,
+                                                  &path,
+                                                  DirCtlHashPath( &path, Update->Seed ),
+                                                  DIRCTL_NO_ENTRY,
+                                                  DcModeLookup( Policy->Core.Modes, rootId )->Mode );
+        } else {
+            DirCtlAppendRoot( Update,
+                              &path,
+                              DirCtlHashPath( &path, Update->Seed ),
+                              primaries[rootId],
+                              0 );
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+Cleanup:
+
+    if (primaries != NULL) {
+        ExFreePoolWithTag( primaries, DIRCTL_UPDATE_TAG );
+    }
+
+    return status;
+}
+
+static NTSTATUS
+DirCtlApplyRecords (
+    _Inout_ PDIRCTL_UPDATE Update,
+    _In_ PDCAPP_UPDATE_INPUT Input,
+    _Out_ PULONG Failed
+    )
+/*++
+Routine Description:
+    Applies the checked records of an update, in order, to the list of
+    roots and the trusted image changes.
+Return Value:
+    STATUS_SUCCESS, STATUS_OBJECT_NAME_NOT_FOUND if a record names a root
+    that is not protected, or STATUS_INVALID_PARAMETER if an alias follows
+    a root that was removed since it was added.
+--*/
+{
+    PDCAPP_UPDATE_RECORD record;
+    UNICODE_STRING path;
+    ULONG64 hash;
+    ULONG offset = 0;
+    ULONG found;
+    ULONG mode;
+    ULONG i, j;
+
+    *Failed = DCAPP_NO_RECORD;
+
+    for (i = 0; i < Input->RecordCount; i++) {
+
+        record = (PDCAPP_UPDATE_RECORD)&Input->Records[offset];
+        offset += DCAPP_UPDATE_RECORD_SIZE(record->Length);
+        mode = (record->Flags & DCAPP_ROOT_MODE_MASK) >> DCAPP_ROOT_MODE_SHIFT;
+
+        switch (record->Type) {
+
+        case DCAPP_UPDATE_CLEAR_ROOTS:
+            for (j = 0; j < Update->RootCount; j++) {
+                Update->Roots[j].Removed = TRUE;
+            }
+            break;
+
+        case DCAPP_UPDATE_ADD_ROOT:
+
+            DirCtlTrimPath( (PWCHAR)record->Value, record->Length, &path );
+            hash = DirCtlHashPath( &path, Update->Seed );
+
+            //  An added path replaces the root, or the alias, it is
+            //  already a spelling of.
+            found = DirCtlFindRoot( Update, &path, hash );
+            if (found != DIRCTL_NO_ENTRY) {
+                if (Update->Roots[found].Primary == found) {
+                    DirCtlRemoveRoot( Update, found );
+                } else {
+                    Update->Roots[found].Removed = TRUE;
+                }
+            }
+
+            if (!FlagOn( record->Flags, DCAPP_ROOT_ALIAS )) {
+                Update->LastAdded = DirCtlAppendRoot( Update, &path, hash, DIRCTL_NO_ENTRY, mode );
+                break;
+            }
+
+            if (Update->Roots[Update->LastAdded].Removed) {
+                *Failed = i;
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            DirCtlAppendRoot( Update, &path, hash, Update->Roots[Update->LastAdded].Primary, 0 );
+            break;
+
+        case DCAPP_UPDATE_REMOVE_ROOT:
+        case DCAPP_UPDATE_SET_MODE:
+
+            DirCtlTrimPath( (PWCHAR)record->Value, record->Length, &path );
+            found = DirCtlFindRoot( Update, &path, DirCtlHashPath( &path, Update->Seed ) );
+            if (found == DIRCTL_NO_ENTRY) {
+                *Failed = i;
+                return STATUS_OBJECT_NAME_NOT_FOUND;
+            }
+
+            if (record->Type == DCAPP_UPDATE_REMOVE_ROOT) {
+                DirCtlRemoveRoot( Update, found );
+            } else {
+                Update->Roots[Update->Roots[found].Primary].Mode = mode;
+            }
+            break;
+
+        case DCAPP_UPDATE_CLEAR_TRUSTED:
+            Update->TrustChangeCount = 0;
+            Update->TrustChanged = TRUE;
+            Update->KeepTrusted = FALSE;
+            break;
+
+        case DCAPP_UPDATE_ADD_TRUSTED:
+        case DCAPP_UPDATE_REMOVE_TRUSTED:
+
+            j = Update->TrustChangeCount++;
+            Update->TrustChanges[j].Image.Buffer = (PWCHAR)record->Value;
+            Update->TrustChanges[j].Image.Length = (USHORT)record->Length;
+            Update->TrustChanges[j].Image.MaximumLength = (USHORT)record->Length;
+            Update->TrustChanges[j].Remove = (BOOLEAN)(record->Type == DCAPP_UPDATE_REMOVE_TRUSTED);
+            Update->TrustChanges[j].Record = i;
+            Update->TrustChanged = TRUE;
+            break;
+
+        case DCAPP_UPDATE_SET_EXTENSIONS:
+            Update->Extensions = record;
+            Update->ExtensionsRecord = i;
+            break;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+DirCtlCompileUpdate (
+    _In_ PDIRCTL_UPDATE Update,
+    _In_opt_ PDIRCTL_POLICY Current,
+    _Outptr_result_maybenull_ PDIRCTL_POLICY *Policy,
+    _Out_ PULONG Failed
+    )
+/*++
+Routine Description:
+    Compiles the roots left in the list, with the extension rule of the
+    message or else that of the policy in effect, into a new policy.
+    Roots get consecutive ids in list order, their aliases share them.
+Arguments:
+    Policy - Receives the policy, or NULL if no root is left.
+--*/
+{
+    PDCTRIE_ROOT roots = NULL;
+    PULONG modes = NULL;
+    PDCEXT_SET extensions = NULL;
+    PDIRCTL_UPDATE_ROOT entry;
+    NTSTATUS status;
+    ULONG rootCount = 0;
+    ULONG modeCount = 0;
+    ULONG i;
+
+    *Policy = NULL;
+    *Failed = DCAPP_NO_RECORD;
+
+    if (Update->Extensions != NULL) {
+
+        status = DirCtlCompileExtensions( (PDCAPP_EXTENSIONS)Update->Extensions->Value,
+                                          Update->Extensions->Length,
+                                          &extensions );
+        if (!NT_SUCCESS( status )) {
+            *Failed = Update->ExtensionsRecord;
+            return status;
+        }
+
+    } else if (Current == NULL) {
+
+        status = DirCtlCompileDefaultExtensions( &extensions );
+        if (!NT_SUCCESS( status )) {
+            return status;
+        }
+
+    } else if (Current->Core.Extensions != NULL) {
+
+        extensions = DcAllocate( Current->Core.Extensions->Size );
+        if (extensions == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlCopyMemory( extensions, Current->Core.Extensions, Current->Core.Extensions->Size );
+    }
+
+    if (Update->RootCount != 0) {
+
+        roots = ExAllocatePoolWithTag( PagedPool, Update->RootCount * sizeof(DCTRIE_ROOT),
+                                       DIRCTL_UPDATE_TAG );
+        modes = ExAllocatePoolWithTag( PagedPool, Update->RootCount * sizeof(ULONG),
+                                       DIRCTL_UPDATE_TAG );
+        if (roots == NULL || modes == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Cleanup;
+        }
+    }
+
+    //  A root always comes before its aliases in the list.
+    for (i = 0; i < Update->RootCount; i++) {
+
+        entry = &Update->Roots[i];
+        if (entry->Removed) {
+            continue;
+        }
+
+        if (entry->Primary == i) {
+            entry->RootId = modeCount;
+            modes[modeCount++] = entry->Mode;
+        }
+
+        roots[rootCount].Path = entry->Path;
+        roots[rootCount].RootId = Update->Roots[entry->Primary].RootId;
+        rootCount++;
+    }
+
+    status = DirCtlCreatePolicy( roots, rootCount, modes, modeCount, extensions, Policy );
+    extensions = NULL;
+
+Cleanup:
+
+    if (extensions != NULL) {
+        DcExtFree( extensions );
+    }
+    if (modes != NULL) {
+        ExFreePoolWithTag( modes, DIRCTL_UPDATE_TAG );
+    }
+    if (roots != NULL) {
+        ExFreePoolWithTag( roots, DIRCTL_UPDATE_TAG );
+    }
+
+    return status;
+}
+
+NTSTATUS
+DirCtlUpdatePolicy (
+    _In_ PDCAPP_UPDATE_INPUT Input,
+    _In_ ULONG InputLength,
+    _Out_writes_bytes_opt_(OutputBufferLength) PVOID OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    )
+/*++
+Routine Description:
+    Applies a captured DCAPP_UPDATE_INPUT and returns a
+    DCAPP_UPDATE_OUTPUT, whether the update was applied or not.
+Arguments:
+    Input - Captured copy of the message sent by DCApp.
+    InputLength - Size of the captured message in bytes.
+    OutputBuffer - Caller's buffer, in the caller's address space.
+    OutputBufferLength - Size of OutputBuffer in bytes.
+    ReturnOutputBufferLength - Receives the number of bytes written.
+Return Value:
+    STATUS_SUCCESS, STATUS_REVISION_MISMATCH if the policy changed since
+    the generation of the message, or the reason the message or one of
+    its records was rejected.
+--*/
+{
+    DIRCTL_UPDATE update;
+    DCAPP_UPDATE_OUTPUT output;
+    PDIRCTL_POLICY current = NULL;
+    PDIRCTL_POLICY policy = NULL;
+    PDIRCTL_TRUSTED_IMAGES images = NULL;
+    BOOLEAN changed = FALSE;
+    ULONG addCount;
+    ULONG trustCount;
+    ULONG failed;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    RtlZeroMemory( &update, sizeof(update) );
+    update.KeepTrusted = TRUE;
+
+    status = DirCtlCheckRecords( Input, InputLength, &addCount, &trustCount, &failed );
+
+    if (NT_SUCCESS( status ) && trustCount != 0) {
+        update.TrustChanges = ExAllocatePoolWithTag( PagedPool,
+                                                     trustCount * sizeof(DIRCTL_TRUST_CHANGE),
+                                                     DIRCTL_UPDATE_TAG );
+        if (update.TrustChanges == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    DirCtlLockUpdates();
+
+    if (NT_SUCCESS( status ) &&
+        Input->Generation != DCAPP_ANY_GENERATION &&
+        Input->Generation != DirCtlQueryGeneration()) {
+        status = STATUS_REVISION_MISMATCH;
+    }
+
+    //  Policies are only published with updates locked, so the reference
+    //  stays the policy in effect until the new one replaces it.
+    if (NT_SUCCESS( status )) {
+        current = DirCtlReferencePolicy();
+        status = DirCtlLoadRoots( &update, current, addCount );
+    }
+
+    if (NT_SUCCESS( status )) {
+        status = DirCtlApplyRecords( &update, Input, &failed );
+    }
+
+    if (NT_SUCCESS( status )) {
+        status = DirCtlCompileUpdate( &update, current, &policy, &failed );
+    }
+
+    if (NT_SUCCESS( status ) && update.TrustChanged) {
+        status = DirCtlBuildTrustedImages( update.KeepTrusted,
+                                           update.TrustChanges,
+                                           update.TrustChangeCount,
+                                           &images,
+                                           &failed );
+        if (failed != DCAPP_NO_RECORD) {
+            failed = update.TrustChanges[failed].Record;
+        }
+    }
+
+    if (current != NULL) {
+        DirCtlDereferencePolicy( current );
+    }
+
+    //  Nothing has changed so far. Committing the allowlist can still
+    //  fail, publishing the policy cannot.
+    if (NT_SUCCESS( status ) && update.TrustChanged) {
+        status = DirCtlCommitTrustedImages( images );
+        if (NT_SUCCESS( status )) {
+            images = NULL;
+        }
+    }
+
+    if (NT_SUCCESS( status )) {
+        DirCtlPublishPolicy( policy );
+        DirCtlSyncInstances();
+        policy = NULL;
+        changed = TRUE;
+    }
+
+    RtlZeroMemory( &output, sizeof(output) );
+    output.Generation = DirCtlQueryGeneration() + (changed ? 1 : 0);
+    output.TrustedCount = DirCtlCountTrustedImages();
+    output.Record = failed;
+
+    current = DirCtlReferencePolicy();
+    if (current != NULL) {
+        output.RootCount = current->Core.Roots->RootCount;
+        DirCtlDereferencePolicy( current );
+    }
+
+    DirCtlUnlockUpdates( changed );
+
+    if (OutputBuffer != NULL && OutputBufferLength >= sizeof(output)) {
+        try {
+            RtlCopyMemory( OutputBuffer, &output, sizeof(output) );
+            *ReturnOutputBufferLength = sizeof(output);
+        } except (EXCEPTION_EXECUTE_HANDLER) {
+            if (NT_SUCCESS( status )) {
+                status = GetExceptionCode();
+            }
+        }
+    }
+
+    if (images != NULL) {
+        DirCtlFreeTrustedImages( images );
+    }
+    if (policy != NULL) {
+        DirCtlFreePolicy( policy );
+    }
+    if (update.TrustChanges != NULL) {
+        ExFreePoolWithTag( update.TrustChanges, DIRCTL_UPDATE_TAG );
+    }
+    if (update.Index != NULL) {
+        ExFreePoolWithTag( update.Index, DIRCTL_UPDATE_TAG );
+    }
+    if (update.Roots != NULL) {
+        ExFreePoolWithTag( update.Roots, DIRCTL_UPDATE_TAG );
+    }
+    if (update.CurrentRoots != NULL) {
+        DcFree( update.CurrentRoots );
+    }
+
+    return status;
+}
@@ -0,0 +1,512 @@
+/*++
+Copyright (c)
+Module Name:
+    dcext.h
+Abstract:
+    File extension rules of the policy.
+
+    A rule either protects only the files with one of the listed
+    extensions below the roots, or every file but those. The list is
+    compiled into a minimal perfect hash when the policy is loaded: every
+    listed extension has a slot of its own, found from its hash and a
+    displacement stored for its hash bucket, so deciding on a name is a
+    hash of its extension, two table reads and one comparison, whatever
+    the length of the list, and needs no allocation.
+
+    Names without an extension, which includes nearly every directory,
+    are protected whatever the rule is, so that a rule cannot open a way
+    to rename a protected directory away.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCEXT_H__
+#define __DCEXT_H__
+
+#include "dcport.h"
+#include "dchash.h"
+#include "dcfold.h"
+
+//  Values of DCEXT_SET.Rule. With DCEXT_RULE_ALL extensions play no part
+//  and no set is built.
+#define DCEXT_RULE_ALL          0
+#define DCEXT_RULE_ONLY         1
+#define DCEXT_RULE_EXCEPT       2
+
+//  Longest extension that can be listed, in characters. Longer ones are
+//  never listed, so they never match.
+#define DCEXT_MAX_LENGTH        16
+
+#define DCEXT_MAX_EXTENSIONS    1024
+
+typedef struct _DCEXT_KEY {
+
+    //  Length of Name in bytes.
+    USHORT Length;
+
+    //  Upcased extension, without the dot.
+    WCHAR Name[DCEXT_MAX_LENGTH];
+
+} DCEXT_KEY, *PDCEXT_KEY;
+
+typedef struct _DCEXT_SET {
+
+    //  Size in bytes of the whole set including this header.
+    ULONG Size;
+
+    ULONG Rule;
+
+    //  Number of extensions, and of slots in Keys.
+    ULONG Count;
+
+    //  Number of hash buckets, and of entries in Displacements.
+    ULONG BucketCount;
+
+    ULONG64 Seed;
+
+    //  Byte offsets from the start of the set of the displacement of
+    //  every bucket, either the one that sends its keys to their slots
+    //  or -(slot + 1) for a bucket of one key placed directly, and of
+    //  the keys. The set holds no pointers, so it can be copied and used
+    //  wherever it lands.
+    ULONG DisplacementsOffset;
+    ULONG KeysOffset;
+
+} DCEXT_SET, *PDCEXT_SET;
+
+typedef const DCEXT_SET *PCDCEXT_SET;
+
+#define DcExtDisplacements(Set) \
+    ((LONG *)((PUCHAR)(Set) + (Set)->DisplacementsOffset))
+
+#define DcExtKeys(Set) \
+    ((PDCEXT_KEY)((PUCHAR)(Set) + (Set)->KeysOffset))
+
+DC_INLINE ULONG
+DcExtRange (
+    _In_ ULONG64 Hash,
+    _In_ ULONG Count
+    )
+/*++
+Routine Description:
+    Maps the low 32 bits of a hash onto [0, Count) without a division.
+--*/
+{
+    return (ULONG)(((Hash & 0xFFFFFFFF) * Count) >> 32);
+}
+
+DC_INLINE ULONG
+DcExtSlot (
+    _In_ ULONG64 Hash,
+    _In_ LONG Displacement,
+    _In_ ULONG Count
+    )
+{
+    return DcExtRange( DcHashFinalize( Hash + (ULONG64)(ULONG)Displacement * 0x9E3779B97F4A7C15ULL ),
+                       Count );
+}
+
+DC_INLINE BOOLEAN
+DcExtMakeKey (
+    _In_ PCUNICODE_STRING Extension,
+    _In_ ULONG64 Seed,
+    _Out_ PDCEXT_KEY Key,
+    _Out_ PULONG64 Hash
+    )
+/*++
+Routine Description:
+    Upcases an extension into a key and hashes it.
+Return Value:
+    FALSE if the extension is empty or longer than DCEXT_MAX_LENGTH.
+--*/
+{
+    ULONG length = Extension->Length / sizeof(WCHAR);
+    ULONG i;
+
+    if (length == 0 || length > DCEXT_MAX_LENGTH) {
+        return FALSE;
+    }
+
+    //  Extensions are nearly always ASCII, spare those the case table.
+    Key->Length = (USHORT)(length * sizeof(WCHAR));
+    for (i = 0; i < length; i++) {
+        Key->Name[i] = DcFoldChar( Extension->Buffer[i] );
+    }
+
+    *Hash = DcHashFinalize( DcHashBytes( Key->Name, Key->Length, Seed ) );
+    return TRUE;
+}
+
+DC_INLINE BOOLEAN
+DcExtIsListed (
+    _In_ PCDCEXT_SET Set,
+    _In_ PCUNICODE_STRING Extension
+    )
+/*++
+Routine Description:
+    Looks an extension up, ignoring case.
+Arguments:
+    Set - Compiled extension list.
+    Extension - Extension without the dot, as FltParseFileNameInformation
+        returns it.
+Return Value:
+    TRUE if the extension is on the list.
+--*/
+{
+    const DCEXT_KEY *keys = DcExtKeys( Set );
+    DCEXT_KEY key;
+    ULONG64 hash;
+    LONG displacement;
+    ULONG slot;
+
+    if (Set->Count == 0 || !DcExtMakeKey( Extension, Set->Seed, &key, &hash )) {
+        return FALSE;
+    }
+
+    displacement = DcExtDisplacements( Set )[DcExtRange( hash >> 32, Set->BucketCount )];
+    slot = displacement < 0 ? (ULONG)(-(displacement + 1)) :
+                              DcExtSlot( hash, displacement, Set->Count );
+
+    return (BOOLEAN)(keys[slot].Length == key.Length &&
+                     RtlEqualMemory( keys[slot].Name, key.Name, key.Length ));
+}
+
+DC_INLINE BOOLEAN
+DcExtIsProtected (
+    _In_opt_ PCDCEXT_SET Set,
+    _In_ PCUNICODE_STRING Extension
+    )
+/*++
+Routine Description:
+    Applies the extension rule to a file below a protected root.
+Arguments:
+    Set - Compiled rule, NULL for DCEXT_RULE_ALL.
+    Extension - Extension of the file, empty if it has none.
+Return Value:
+    TRUE if the rule leaves the file protected.
+--*/
+{
+    if (Set == NULL || Extension->Length == 0) {
+        return TRUE;
+    }
+
+    return (BOOLEAN)(DcExtIsListed( Set, Extension ) == (Set->Rule == DCEXT_RULE_ONLY));
+}
+
+DC_INLINE NTSTATUS
+DcExtPlace (
+    _Inout_ PDCEXT_SET Set,
+    _In_reads_(Count) const DCEXT_KEY *Keys,
+    _In_reads_(Count) const ULONG64 *Hashes,
+    _In_ ULONG Count,
+    _Inout_ PULONG Order,
+    _Inout_ PULONG Start,
+    _Inout_ PUCHAR Used,
+    _Inout_ PULONG Slots
+    )
+/*++
+Routine Description:
+    Hash and displace: distributes the keys over the buckets, then finds
+    for every bucket, largest first, a displacement that sends its keys
+    to slots still free. Buckets of one key take any free slot.
+Arguments:
+    Set - Set with Seed, Count and BucketCount filled in.
+    Keys, Hashes - Distinct keys and their hashes under Set->Seed.
+    Order - Scratch, Count entries.
+    Start - Scratch, BucketCount + 1 entries.
+    Used - Scratch, Count entries.
+    Slots - Scratch, Count entries.
+Return Value:
+    STATUS_SUCCESS, or STATUS_INVALID_PARAMETER if no displacement was
+    found for some bucket and another seed has to be tried.
+--*/
+{
+    LONG *displacements = DcExtDisplacements( Set );
+    PDCEXT_KEY keys = DcExtKeys( Set );
+    ULONG bucketCount = Set->BucketCount;
+    ULONG largest = 0;
+    ULONG size;
+    ULONG bucket;
+    ULONG freeSlot = 0;
+    ULONG i, j;
+    LONG displacement;
+
+    RtlZeroMemory( Start, (bucketCount + 1) * sizeof(ULONG) );
+    RtlZeroMemory( Used, Count );
+    RtlZeroMemory( displacements, bucketCount * sizeof(LONG) );
+
+    //  Counting sort of the keys by bucket; Start[b] ends up at the first
+    //  key of bucket b.
+    for (i = 0; i < Count; i++) {
+        Start[DcExtRange( Hashes[i] >> 32, bucketCount ) + 1]++;
+    }
+    for (i = 0; i < bucketCount; i++) {
+        if (Start[i + 1] > largest) {
+            largest = Start[i + 1];
+        }
+        Start[i + 1] += Start[i];
+    }
+    for (i = 0; i < Count; i++) {
+        bucket = DcExtRange( Hashes[i] >> 32, bucketCount );
+        Order[Start[bucket]++] = i;
+    }
+    for (i = bucketCount; i > 0; i--) {
+        Start[i] = Start[i - 1];
+    }
+    Start[0] = 0;
+
+    for (size = largest; size > 1; size--) {
+        for (bucket = 0; bucket < bucketCount; bucket++) {
+
+            if (Start[bucket + 1] - Start[bucket] != size) {
+                continue;
+            }
+
+            for (displacement = 1; displacement < 0x100000; displacement++) {
+
+                for (i = 0; i < size; i++) {
+                    Slots[i] = DcExtSlot( Hashes[Order[Start[bucket] + i]], displacement, Count );
+                    if (Used[Slots[i]]) {
+                        break;
+                    }
+                    for (j = 0; j < i; j++) {
+                        if (Slots[j] == Slots[i]) {
+                            break;
+                        }
+                    }
+                    if (j < i) {
+                        break;
+                    }
+                }
+
+                if (i == size) {
+                    break;
+                }
+            }
+
+            if (displacement == 0x100000) {
+                return STATUS_INVALID_PARAMETER;
+            }
+
+            displacements[bucket] = displacement;
+            for (i = 0; i < size; i++) {
+                Used[Slots[i]] = 1;
+                keys[Slots[i]] = Keys[Order[Start[bucket] + i]];
+            }
+        }
+    }
+
+    for (bucket = 0; bucket < bucketCount; bucket++) {
+
+        if (Start[bucket + 1] - Start[bucket] != 1) {
+            continue;
+        }
+
+        while (Used[freeSlot]) {
+            freeSlot++;
+        }
+
+        Used[freeSlot] = 1;
+        displacements[bucket] = -(LONG)(freeSlot + 1);
+        keys[freeSlot] = Keys[Order[Start[bucket]]];
+    }
+
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE NTSTATUS
+DcExtBuildSet (
+    _In_ ULONG Rule,
+    _In_reads_(Count) PCUNICODE_STRING Extensions,
+    _In_ ULONG Count,
+    _In_ ULONG64 Seed,
+    _Outptr_result_maybenull_ PDCEXT_SET *Set
+    )
+/*++
+Routine Description:
+    Compiles an extension rule.
+Arguments:
+    Rule - DCEXT_RULE_* value.
+    Extensions - Extensions without the dot. Duplicates, in any case,
+        are dropped.
+    Count - Number of extensions.
+    Seed - Hash seed, chosen at random by the caller.
+    Set - Receives the set, to be freed with DcExtFree, or NULL for
+        DCEXT_RULE_ALL.
+Return Value:
+    STATUS_SUCCESS, STATUS_INVALID_PARAMETER for an unknown rule or too
+    many extensions, STATUS_OBJECT_NAME_INVALID for an empty, too long or
+    malformed extension, or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    PDCEXT_SET set;
+    PDCEXT_KEY keys;
+    PULONG64 hashes;
+    PULONG order;
+    PULONG start;
+    PULONG slots;
+    PUCHAR used;
+    PUCHAR scratch;
+    ULONG bucketCount;
+    ULONG size;
+    ULONG distinct = 0;
+    ULONG attempt;
+    ULONG i, j;
+    NTSTATUS status;
+
+    *Set = NULL;
+
+    if (Rule == DCEXT_RULE_ALL) {
+        return STATUS_SUCCESS;
+    }
+
+    if ((Rule != DCEXT_RULE_ONLY && Rule != DCEXT_RULE_EXCEPT) || Count > DCEXT_MAX_EXTENSIONS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < Count; i++) {
+        if (Extensions[i].Length == 0 ||
+            Extensions[i].Length > DCEXT_MAX_LENGTH * sizeof(WCHAR) ||
+            (Extensions[i].Length % sizeof(WCHAR)) != 0) {
+            return STATUS_OBJECT_NAME_INVALID;
+        }
+        for (j = 0; j < Extensions[i].Length / sizeof(WCHAR); j++) {
+            if (Extensions[i].Buffer[j] == L'.' || Extensions[i].Buffer[j] == L'\\' ||
+                Extensions[i].Buffer[j] == L':' || Extensions[i].Buffer[j] == 0) {
+                return STATUS_OBJECT_NAME_INVALID;
+            }
+        }
+    }
+
+    //  One bucket per two keys keeps the displacement search short for
+    //  lists of any size this is used with.
+    bucketCount = Count / 2 + 1;
+
+    size = (ULONG)(sizeof(DCEXT_SET) + bucketCount * sizeof(LONG) + Count * sizeof(DCEXT_KEY));
+    set = (PDCEXT_SET)DcAllocate( size );
+    if (set == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    scratch = (PUCHAR)DcAllocate( Count * (sizeof(DCEXT_KEY) + sizeof(ULONG64) +
+                                           3 * sizeof(ULONG) + 1) +
+                                  (bucketCount + 1) * sizeof(ULONG) + 1 );
+    if (scratch == NULL) {
+        DcFree( set );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    hashes = (PULONG64)scratch;
+    order = (PULONG)(hashes + Count);
+    slots = order + Count;
+    start = slots + Count;
+    keys = (PDCEXT_KEY)(start + bucketCount + 1);
+    used = (PUCHAR)(keys + Count);
+
+    RtlZeroMemory( set, size );
+    set->Rule = Rule;
+    set->BucketCount = bucketCount;
+    set->DisplacementsOffset = (ULONG)sizeof(DCEXT_SET);
+    set->KeysOffset = (ULONG)(sizeof(DCEXT_SET) + bucketCount * sizeof(LONG));
+
+    status = STATUS_INVALID_PARAMETER;
+    for (attempt = 0; attempt < 8 && status == STATUS_INVALID_PARAMETER; attempt++) {
+
+        set->Seed = DcHashFinalize( Seed + attempt );
+
+        distinct = 0;
+        for (i = 0; i < Count; i++) {
+
+            DcExtMakeKey( &Extensions[i], set->Seed, &keys[distinct], &hashes[distinct] );
+
+            for (j = 0; j < distinct; j++) {
+                if (hashes[j] == hashes[distinct] &&
+                    keys[j].Length == keys[distinct].Length &&
+                    RtlEqualMemory( keys[j].Name, keys[distinct].Name, keys[j].Length )) {
+                    break;
+                }
+            }
+
+            if (j == distinct) {
+                distinct++;
+            }
+        }
+
+        set->Count = distinct;
+        set->Size = set->KeysOffset + distinct * (ULONG)sizeof(DCEXT_KEY);
+
+        status = DcExtPlace( set, keys, hashes, distinct, order, start, used, slots );
+    }
+
+    DcFree( scratch );
+
+    if (!NT_SUCCESS( status )) {
+        DcFree( set );
+        return status;
+    }
+
+    *Set = set;
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE NTSTATUS
+DcExtValidate (
+    _In_ PCDCEXT_SET Set,
+    _In_ ULONG Size
+    )
+/*++
+Routine Description:
+    Checks that a set found in a policy image can be used where it lies:
+    that its arrays are within its Size bytes and that every bucket and
+    key stays within them.
+Arguments:
+    Set - The set, aligned on 8 bytes.
+    Size - Bytes available at Set.
+Return Value:
+    STATUS_SUCCESS or STATUS_INVALID_IMAGE_FORMAT.
+--*/
+{
+    const LONG *displacements;
+    const DCEXT_KEY *keys;
+    ULONG i;
+
+    if (Size < sizeof(DCEXT_SET) || Set->Size != Size ||
+        (Set->Rule != DCEXT_RULE_ONLY && Set->Rule != DCEXT_RULE_EXCEPT) ||
+        Set->Count > DCEXT_MAX_EXTENSIONS ||
+        Set->BucketCount == 0 || Set->BucketCount > DCEXT_MAX_EXTENSIONS / 2 + 1 ||
+        Set->DisplacementsOffset < sizeof(DCEXT_SET) || Set->DisplacementsOffset > Size ||
+        (Set->DisplacementsOffset % sizeof(LONG)) != 0 ||
+        Set->BucketCount * sizeof(LONG) > Size - Set->DisplacementsOffset ||
+        Set->KeysOffset < sizeof(DCEXT_SET) || Set->KeysOffset > Size ||
+        (Set->KeysOffset % sizeof(USHORT)) != 0 ||
+        Set->Count * sizeof(DCEXT_KEY) > Size - Set->KeysOffset) {
+        return STATUS_INVALID_IMAGE_FORMAT;
+    }
+
+    displacements = DcExtDisplacements( Set );
+    for (i = 0; i < Set->BucketCount; i++) {
+        if (displacements[i] < 0 && (ULONG)(-(displacements[i] + 1)) >= Set->Count) {
+            return STATUS_INVALID_IMAGE_FORMAT;
+        }
+    }
+
+    keys = DcExtKeys( Set );
+    for (i = 0; i < Set->Count; i++) {
+        if (keys[i].Length == 0 || keys[i].Length > DCEXT_MAX_LENGTH * sizeof(WCHAR) ||
+            (keys[i].Length % sizeof(WCHAR)) != 0) {
+            return STATUS_INVALID_IMAGE_FORMAT;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE VOID
+DcExtFree (
+    _In_ PDCEXT_SET Set
+    )
+{
+    DcFree( Set );
+}
+
+#endif //  __DCEXT_H__
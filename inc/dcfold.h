@@ -0,0 +1,262 @@
+/*++
+Copyright (c)
+Module Name:
+    dcfold.h
+Abstract:
+    Case-insensitive comparison of a name with a string that was upcased
+    beforehand, such as a label of the root trie.
+
+    Names are nearly always ASCII. An ASCII code unit is upcased by
+    taking 0x20 off a..z, which the vector kernels do for 8 (SSE2) or 16
+    (AVX2) code units at a time; only the other code units go through
+    DcUpcaseChar. The result is that of upcasing every code unit of the
+    name with DcUpcaseChar, given that it maps the ASCII letters the
+    usual way. RtlUpcaseUnicodeChar does, towupper does in every locale
+    but a few such as Turkish.
+
+    In kernel mode SSE2 is only used on x64, where it needs no floating
+    point state to be saved, and AVX2 not at all. User mode builds use
+    AVX2 when they target it, e.g. with -mavx2 or /arch:AVX2. Other
+    targets compare one code unit at a time.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCFOLD_H__
+#define __DCFOLD_H__
+
+#include "dcport.h"
+
+#if defined(_M_AMD64) || defined(__x86_64__) || \
+    (!defined(_KERNEL_MODE) && (defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)))
+#define DC_FOLD_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__) && !defined(_KERNEL_MODE)
+#define DC_FOLD_AVX2
+#include <immintrin.h>
+#endif
+
+DC_INLINE WCHAR
+DcFoldChar (
+    _In_ WCHAR Char
+    )
+/*++
+Routine Description:
+    Upcases a code unit, without the case table for ASCII.
+--*/
+{
+    if ((WCHAR)(Char - L'a') <= (WCHAR)(L'z' - L'a')) {
+        return (WCHAR)(Char - (L'a' - L'A'));
+    }
+
+    if (Char < 0x80) {
+        return Char;
+    }
+
+    return DcUpcaseChar( Char );
+}
+
+DC_INLINE LONG
+DcFoldCompareRange (
+    _In_ PCWSTR Name,
+    _In_ PCWSTR Upcased,
+    _In_ ULONG Position,
+    _In_ ULONG Length
+    )
+/*++
+Routine Description:
+    Compares the code units from Position up to Length one at a time.
+Return Value:
+    -1 or 1 as the first upcased code unit of Name that differs is below
+    or above that of Upcased, 0 if none differs.
+--*/
+{
+    for (; Position < Length; Position++) {
+
+        WCHAR c = DcFoldChar( Name[Position] );
+
+        if (c != Upcased[Position]) {
+            return (c < Upcased[Position]) ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef DC_FOLD_SSE2
+
+DC_INLINE LONG
+DcFoldCompareRangeSse2 (
+    _In_ PCWSTR Name,
+    _In_ PCWSTR Upcased,
+    _In_ ULONG Position,
+    _In_ ULONG Length
+    )
+/*++
+Routine Description:
+    DcFoldCompareRange, 8 code units at a time. Code units that are not
+    ASCII, and the first that differs, are compared one at a time.
+--*/
+{
+    const __m128i beforeA = _mm_set1_epi16( L'a' - 1 );
+    const __m128i afterZ = _mm_set1_epi16( L'z' + 1 );
+    const __m128i caseBit = _mm_set1_epi16( L'a' - L'A' );
+    const __m128i notAscii = _mm_set1_epi16( -0x80 );
+    const __m128i zero = _mm_setzero_si128();
+    LONG order;
+    ULONG mask;
+    ULONG lane;
+
+    while (Length - Position >= 8) {
+
+        __m128i name = _mm_loadu_si128( (const __m128i *)(Name + Position) );
+        __m128i upcased = _mm_loadu_si128( (const __m128i *)(Upcased + Position) );
+
+        //  Code units above 0x7FFF are negative to the signed compares and
+        //  so never taken for lowercase letters.
+        __m128i lower = _mm_and_si128( _mm_cmpgt_epi16( name, beforeA ),
+                                       _mm_cmplt_epi16( name, afterZ ) );
+        __m128i folded = _mm_sub_epi16( name, _mm_and_si128( lower, caseBit ) );
+        __m128i same = _mm_and_si128( _mm_cmpeq_epi16( folded, upcased ),
+                                      _mm_cmpeq_epi16( _mm_and_si128( name, notAscii ), zero ) );
+
+        //  Two bits per code unit.
+        mask = (ULONG)_mm_movemask_epi8( same ) ^ 0xFFFF;
+        while (mask != 0) {
+            lane = Position + DcLowestBit32( mask ) / 2;
+            order = DcFoldCompareRange( Name, Upcased, lane, lane + 1 );
+            if (order != 0) {
+                return order;
+            }
+            mask &= mask - 1;
+            mask &= mask - 1;
+        }
+
+        Position += 8;
+    }
+
+    return DcFoldCompareRange( Name, Upcased, Position, Length );
+}
+
+#endif
+
+#ifdef DC_FOLD_AVX2
+
+DC_INLINE LONG
+DcFoldCompareRangeAvx2 (
+    _In_ PCWSTR Name,
+    _In_ PCWSTR Upcased,
+    _In_ ULONG Position,
+    _In_ ULONG Length
+    )
+/*++
+Routine Description:
+    DcFoldCompareRangeSse2, 16 code units at a time.
+--*/
+{
+    const __m256i beforeA = _mm256_set1_epi16( L'a' - 1 );
+    const __m256i afterZ = _mm256_set1_epi16( L'z' + 1 );
+    const __m256i caseBit = _mm256_set1_epi16( L'a' - L'A' );
+    const __m256i notAscii = _mm256_set1_epi16( -0x80 );
+    const __m256i zero = _mm256_setzero_si256();
+    LONG order;
+    ULONG mask;
+    ULONG lane;
+
+    while (Length - Position >= 16) {
+
+        __m256i name = _mm256_loadu_si256( (const __m256i *)(Name + Position) );
+        __m256i upcased = _mm256_loadu_si256( (const __m256i *)(Upcased + Position) );
+        __m256i lower = _mm256_and_si256( _mm256_cmpgt_epi16( name, beforeA ),
+                                          _mm256_cmpgt_epi16( afterZ, name ) );
+        __m256i folded = _mm256_sub_epi16( name, _mm256_and_si256( lower, caseBit ) );
+        __m256i same = _mm256_and_si256( _mm256_cmpeq_epi16( folded, upcased ),
+                                         _mm256_cmpeq_epi16( _mm256_and_si256( name, notAscii ), zero ) );
+
+        mask = ~(ULONG)_mm256_movemask_epi8( same );
+        while (mask != 0) {
+            lane = Position + DcLowestBit32( mask ) / 2;
+            order = DcFoldCompareRange( Name, Upcased, lane, lane + 1 );
+            if (order != 0) {
+                return order;
+            }
+            mask &= mask - 1;
+            mask &= mask - 1;
+        }
+
+        Position += 16;
+    }
+
+    //  What is left may still fill a block of 8.
+    return DcFoldCompareRangeSse2( Name, Upcased, Position, Length );
+}
+
+#endif
+
+DC_INLINE LONG
+DcFoldCompareLengths (
+    _In_ LONG Order,
+    _In_ ULONG NameLength,
+    _In_ ULONG UpcasedLength
+    )
+{
+    if (Order != 0 || NameLength == UpcasedLength) {
+        return Order;
+    }
+
+    return (NameLength < UpcasedLength) ? -1 : 1;
+}
+
+DC_INLINE LONG
+DcFoldCompareScalar (
+    _In_reads_(NameLength) PCWSTR Name,
+    _In_ ULONG NameLength,
+    _In_reads_(UpcasedLength) PCWSTR Upcased,
+    _In_ ULONG UpcasedLength
+    )
+{
+    ULONG length = (NameLength < UpcasedLength) ? NameLength : UpcasedLength;
+
+    return DcFoldCompareLengths( DcFoldCompareRange( Name, Upcased, 0, length ),
+                                 NameLength,
+                                 UpcasedLength );
+}
+
+DC_INLINE LONG
+DcFoldCompare (
+    _In_reads_(NameLength) PCWSTR Name,
+    _In_ ULONG NameLength,
+    _In_reads_(UpcasedLength) PCWSTR Upcased,
+    _In_ ULONG UpcasedLength
+    )
+/*++
+Routine Description:
+    Orders a name against an upcased string, ignoring the case of the
+    name, with the widest kernel the build allows.
+Arguments:
+    Name - The name, in any case.
+    NameLength - Length of Name in code units.
+    Upcased - The string to compare with, upcased with DcUpcaseChar.
+    UpcasedLength - Length of Upcased in code units.
+Return Value:
+    -1, 0 or 1 as the upcased name sorts below, equal to or above
+    Upcased, code unit by code unit and then by length.
+--*/
+{
+    ULONG length = (NameLength < UpcasedLength) ? NameLength : UpcasedLength;
+    LONG order;
+
+#if defined(DC_FOLD_AVX2)
+    order = DcFoldCompareRangeAvx2( Name, Upcased, 0, length );
+#elif defined(DC_FOLD_SSE2)
+    order = DcFoldCompareRangeSse2( Name, Upcased, 0, length );
+#else
+    order = DcFoldCompareRange( Name, Upcased, 0, length );
+#endif
+
+    return DcFoldCompareLengths( order, NameLength, UpcasedLength );
+}
+
+#endif //  __DCFOLD_H__
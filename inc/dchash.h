@@ -0,0 +1,61 @@
+/*++
+Copyright (c)
+Module Name:
+    dchash.h
+Abstract:
+    Seeded string hashing shared by the caches and tables of the policy
+    core. The seed is chosen at load time so that names cannot be
+    crafted to collide with a protected path.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCHASH_H__
+#define __DCHASH_H__
+
+#include "dcport.h"
+
+#define DC_HASH_PRIME   0x00000100000001B3ULL
+
+DC_INLINE ULONG64
+DcHashBytes (
+    _In_reads_bytes_(Length) const VOID *Buffer,
+    _In_ ULONG Length,
+    _In_ ULONG64 Seed
+    )
+/*++
+Routine Description:
+    FNV-1a over a byte range, started from Seed instead of the fixed
+    offset basis.
+--*/
+{
+    const UCHAR *bytes = (const UCHAR *)Buffer;
+    ULONG64 hash = Seed ^ 0xCBF29CE484222325ULL;
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        hash ^= bytes[i];
+        hash *= DC_HASH_PRIME;
+    }
+
+    return hash;
+}
+
+DC_INLINE ULONG64
+DcHashFinalize (
+    _In_ ULONG64 Hash
+    )
+/*++
+Routine Description:
+    Mixes the high bits of an FNV hash into the low bits so that the low
+    bits can be used directly as a table index.
+--*/
+{
+    Hash ^= Hash >> 33;
+    Hash *= 0xFF51AFD7ED558CCDULL;
+    Hash ^= Hash >> 33;
+
+    return Hash;
+}
+
+#endif //  __DCHASH_H__
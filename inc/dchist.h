@@ -0,0 +1,210 @@
+/*++
+Copyright (c)
+Module Name:
+    dchist.h
+Abstract:
+    Log-bucketed histograms of latencies, or of any other unsigned value.
+
+    Each power of two is split into DCHIST_SUB_BUCKETS buckets of equal
+    width, so a bucket is never wider than a quarter of its lower bound
+    and a histogram fits in well under a kilobyte. Values beyond the
+    last bucket are counted in it; Max still holds the exact largest
+    value.
+
+    Recording a value touches the histogram only, so a caller that keeps
+    one histogram per processor records without interlocked operations
+    and merges the histograms when it reports them. Histograms of the
+    same kind can be merged and subtracted in any order, e.g. to get the
+    histogram of an interval from two snapshots.
+
+    The filter records in ticks of the performance counter and reports
+    its frequency alongside, DCApp converts when it prints.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCHIST_H__
+#define __DCHIST_H__
+
+#include "dcport.h"
+
+#define DCHIST_SUB_BITS         2
+#define DCHIST_SUB_BUCKETS      (1 << DCHIST_SUB_BITS)
+
+//  Values from 7 * 2^22 on, 2.9 seconds in ticks of a 10MHz performance
+//  counter, share the last bucket.
+#define DCHIST_BUCKET_COUNT     96
+
+typedef struct _DCHIST {
+
+    //  Values recorded, their sum and the largest of them.
+    ULONG64 Count;
+    ULONG64 Sum;
+    ULONG64 Max;
+
+    ULONG64 Buckets[DCHIST_BUCKET_COUNT];
+
+} DCHIST, *PDCHIST;
+
+typedef const DCHIST *PCDCHIST;
+
+DC_INLINE ULONG
+DcHistBucket (
+    _In_ ULONG64 Value
+    )
+/*++
+Routine Description:
+    Bucket a value is counted in: values below DCHIST_SUB_BUCKETS have a
+    bucket each, above that the highest bit picks the power of two and
+    the DCHIST_SUB_BITS bits below it the bucket within it.
+--*/
+{
+    ULONG highest;
+    ULONG bucket;
+
+    if (Value < DCHIST_SUB_BUCKETS) {
+        return (ULONG)Value;
+    }
+
+    highest = DcHighestBit64( Value );
+    bucket = (highest - DCHIST_SUB_BITS + 1) * DCHIST_SUB_BUCKETS +
+             (ULONG)((Value >> (highest - DCHIST_SUB_BITS)) & (DCHIST_SUB_BUCKETS - 1));
+
+    return bucket < DCHIST_BUCKET_COUNT ? bucket : DCHIST_BUCKET_COUNT - 1;
+}
+
+DC_INLINE ULONG64
+DcHistBucketLow (
+    _In_ ULONG Bucket
+    )
+/*++
+Routine Description:
+    Smallest value counted in a bucket.
+--*/
+{
+    if (Bucket < DCHIST_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    return (ULONG64)(DCHIST_SUB_BUCKETS + Bucket % DCHIST_SUB_BUCKETS) <<
+           (Bucket / DCHIST_SUB_BUCKETS - 1);
+}
+
+DC_INLINE ULONG64
+DcHistBucketHigh (
+    _In_ ULONG Bucket
+    )
+/*++
+Routine Description:
+    Largest value counted in a bucket; the last bucket has no bound.
+--*/
+{
+    if (Bucket >= DCHIST_BUCKET_COUNT - 1) {
+        return (ULONG64)-1;
+    }
+
+    return DcHistBucketLow( Bucket + 1 ) - 1;
+}
+
+DC_INLINE VOID
+DcHistRecord (
+    _Inout_ PDCHIST Hist,
+    _In_ ULONG64 Value
+    )
+{
+    Hist->Buckets[DcHistBucket( Value )]++;
+    Hist->Count++;
+    Hist->Sum += Value;
+    if (Value > Hist->Max) {
+        Hist->Max = Value;
+    }
+}
+
+DC_INLINE VOID
+DcHistMerge (
+    _Inout_ PDCHIST Into,
+    _In_ PCDCHIST From
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < DCHIST_BUCKET_COUNT; i++) {
+        Into->Buckets[i] += From->Buckets[i];
+    }
+
+    Into->Count += From->Count;
+    Into->Sum += From->Sum;
+    if (From->Max > Into->Max) {
+        Into->Max = From->Max;
+    }
+}
+
+DC_INLINE VOID
+DcHistSubtract (
+    _Inout_ PDCHIST Into,
+    _In_ PCDCHIST Earlier
+    )
+/*++
+Routine Description:
+    Turns a snapshot into the histogram of the values recorded since an
+    earlier snapshot of the same histogram. Max cannot be taken apart and
+    stays the largest value ever recorded.
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < DCHIST_BUCKET_COUNT; i++) {
+        Into->Buckets[i] -= Earlier->Buckets[i];
+    }
+
+    Into->Count -= Earlier->Count;
+    Into->Sum -= Earlier->Sum;
+}
+
+DC_INLINE ULONG64
+DcHistPercentile (
+    _In_ PCDCHIST Hist,
+    _In_ ULONG Permille
+    )
+/*++
+Routine Description:
+    Estimates the value below which Permille thousandths of the recorded
+    values lie, as the upper bound of the bucket that value falls in,
+    never above Max.
+Arguments:
+    Hist - The histogram.
+    Permille - 500 for the median, 990 for the 99th percentile, up to
+        1000.
+Return Value:
+    The estimate, 0 if the histogram is empty.
+--*/
+{
+    ULONG64 rank;
+    ULONG64 seen = 0;
+    ULONG64 high;
+    ULONG i;
+
+    if (Hist->Count == 0) {
+        return 0;
+    }
+
+    //  Rank of the value, from 1, rounded up.
+    rank = (Hist->Count / 1000) * Permille +
+           ((Hist->Count % 1000) * Permille + 999) / 1000;
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < DCHIST_BUCKET_COUNT; i++) {
+
+        seen += Hist->Buckets[i];
+        if (seen >= rank) {
+            high = DcHistBucketHigh( i );
+            return high < Hist->Max ? high : Hist->Max;
+        }
+    }
+
+    return Hist->Max;
+}
+
+#endif //  __DCHIST_H__
@@ -0,0 +1,271 @@
+/*++
+Copyright (c)
+Module Name:
+    dcimage.h
+Abstract:
+    Policy image: a compiled policy stored as one block of bytes, so that
+    the filter can enforce it from the moment it loads, before DCApp is
+    started.
+
+    The image is a DCIMAGE_HEADER followed by the compiled parts of the
+    policy exactly as they are used in memory: the root trie (dctrie.h),
+    the mode table (dcmode.h) and the extension set (dcext.h). None of
+    them holds a pointer, so once the image has been validated the policy
+    points into it and nothing is parsed or copied. Every part starts on
+    an 8 byte boundary of the image.
+
+    The header carries a format version and a CRC-32 of the whole image,
+    which DcImageValidate checks before it checks the bounds of every
+    part; an image that fails either is not used.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCIMAGE_H__
+#define __DCIMAGE_H__
+
+#include "dcport.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+
+//  "DCPI" in the first four bytes.
+#define DCIMAGE_MAGIC           0x49504344
+
+#define DCIMAGE_VERSION         2
+
+//  Images are kept in the SYSTEM hive, which is loaded at boot and has to
+//  stay small.
+#define DCIMAGE_MAX_SIZE        (1024 * 1024)
+
+#define DCIMAGE_ALIGN(Size)     (((Size) + 7) & ~7UL)
+
+typedef struct _DCIMAGE_SECTION {
+
+    //  Byte offset from the start of the image, and size in bytes; both
+    //  0 for a part the policy does not have.
+    ULONG Offset;
+    ULONG Size;
+
+} DCIMAGE_SECTION, *PDCIMAGE_SECTION;
+
+typedef struct _DCIMAGE_HEADER {
+
+    ULONG Magic;
+    USHORT Version;
+    USHORT HeaderSize;
+
+    //  Size in bytes of the whole image including this header.
+    ULONG Size;
+
+    //  CRC-32 of the whole image, computed with this field 0.
+    ULONG Checksum;
+
+    DCIMAGE_SECTION Roots;
+    DCIMAGE_SECTION Modes;
+    DCIMAGE_SECTION Extensions;
+
+} DCIMAGE_HEADER, *PDCIMAGE_HEADER;
+
+typedef const DCIMAGE_HEADER *PCDCIMAGE_HEADER;
+
+DC_INLINE ULONG
+DcImageChecksum (
+    _In_reads_bytes_(Size) const VOID *Image,
+    _In_ ULONG Size
+    )
+/*++
+Routine Description:
+    CRC-32 (IEEE 802.3, reflected) of an image, the Checksum field of its
+    header counting as 0. Four bits at a time, the table is small and
+    images are only checked when they are loaded.
+--*/
+{
+    static const ULONG table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    const UCHAR *bytes = (const UCHAR *)Image;
+    ULONG crc = 0xFFFFFFFF;
+    ULONG i;
+    UCHAR byte;
+
+    for (i = 0; i < Size; i++) {
+
+        byte = bytes[i];
+        if (i >= FIELD_OFFSET(DCIMAGE_HEADER, Checksum) &&
+            i < FIELD_OFFSET(DCIMAGE_HEADER, Checksum) + sizeof(ULONG)) {
+            byte = 0;
+        }
+
+        crc = (crc >> 4) ^ table[(crc ^ byte) & 0xF];
+        crc = (crc >> 4) ^ table[(crc ^ (byte >> 4)) & 0xF];
+    }
+
+    return ~crc;
+}
+
+DC_INLINE BOOLEAN
+DcImageSectionValid (
+    _In_ const DCIMAGE_SECTION *Section,
+    _In_ ULONG ImageSize,
+    _In_ BOOLEAN Optional
+    )
+{
+    if (Section->Offset == 0 && Section->Size == 0) {
+        return Optional;
+    }
+
+    return (BOOLEAN)(Section->Offset >= sizeof(DCIMAGE_HEADER) &&
+                     (Section->Offset % 8) == 0 &&
+                     Section->Offset <= ImageSize &&
+                     Section->Size <= ImageSize - Section->Offset);
+}
+
+DC_INLINE NTSTATUS
+DcImageValidate (
+    _In_reads_bytes_(Size) const VOID *Image,
+    _In_ ULONG Size
+    )
+/*++
+Routine Description:
+    Checks that an image can be used in place: its format, its checksum,
+    and that every part lies within the image and is consistent in
+    itself and with the others.
+Arguments:
+    Image - The image, aligned on 8 bytes.
+    Size - Size of the image in bytes.
+Return Value:
+    STATUS_SUCCESS, STATUS_INVALID_IMAGE_FORMAT or STATUS_INVALID_PARAMETER
+    if the image is too large.
+--*/
+{
+    PCDCIMAGE_HEADER header = (PCDCIMAGE_HEADER)Image;
+    const UCHAR *base = (const UCHAR *)Image;
+    PCDCMODE_TABLE modes;
+    NTSTATUS status;
+
+    if (Size > DCIMAGE_MAX_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Size < sizeof(DCIMAGE_HEADER) ||
+        header->Magic != DCIMAGE_MAGIC ||
+        header->Version != DCIMAGE_VERSION ||
+        header->HeaderSize != sizeof(DCIMAGE_HEADER) ||
+        header->Size != Size ||
+        header->Checksum != DcImageChecksum( Image, Size ) ||
+        !DcImageSectionValid( &header->Roots, Size, FALSE ) ||
+        !DcImageSectionValid( &header->Modes, Size, FALSE ) ||
+        !DcImageSectionValid( &header->Extensions, Size, TRUE )) {
+        return STATUS_INVALID_IMAGE_FORMAT;
+    }
+
+    modes = (PCDCMODE_TABLE)(base + header->Modes.Offset);
+    status = DcModeValidate( modes, header->Modes.Size );
+    if (!NT_SUCCESS( status )) {
+        return status;
+    }
+
+    //  Root ids index the mode table.
+    status = DcTrieValidate( (const DCTRIE *)(base + header->Roots.Offset),
+                             header->Roots.Size,
+                             modes->RootCount );
+    if (!NT_SUCCESS( status )) {
+        return status;
+    }
+
+    if (header->Extensions.Size != 0) {
+        status = DcExtValidate( (PCDCEXT_SET)(base + header->Extensions.Offset),
+                                header->Extensions.Size );
+    }
+
+    return status;
+}
+
+DC_INLINE NTSTATUS
+DcImageBuild (
+    _In_ const DCTRIE *Roots,
+    _In_ PCDCMODE_TABLE Modes,
+    _In_opt_ PCDCEXT_SET Extensions,
+    _Outptr_ PVOID *Image,
+    _Out_ PULONG Size
+    )
+/*++
+Routine Description:
+    Lays a compiled policy out as an image.
+Arguments:
+    Roots, Modes, Extensions - Parts of the policy. Extensions is NULL if
+        every file below the roots is protected.
+    Image - Receives the image, to be freed with DcFree.
+    Size - Receives the size of the image in bytes.
+Return Value:
+    STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL if the policy does not fit in
+    DCIMAGE_MAX_SIZE, or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    PDCIMAGE_HEADER header;
+    PUCHAR base;
+    ULONG64 size;
+    ULONG modesSize = DcModeTableSize( Modes->RootCount );
+
+    *Image = NULL;
+    *Size = 0;
+
+    size = DCIMAGE_ALIGN( (ULONG64)sizeof(DCIMAGE_HEADER) ) +
+           DCIMAGE_ALIGN( (ULONG64)Roots->Size ) +
+           DCIMAGE_ALIGN( (ULONG64)modesSize ) +
+           (Extensions != NULL ? DCIMAGE_ALIGN( (ULONG64)Extensions->Size ) : 0);
+
+    if (size > DCIMAGE_MAX_SIZE) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    base = (PUCHAR)DcAllocate( (ULONG)size );
+    if (base == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory( base, (ULONG)size );
+    header = (PDCIMAGE_HEADER)base;
+    header->Magic = DCIMAGE_MAGIC;
+    header->Version = DCIMAGE_VERSION;
+    header->HeaderSize = (USHORT)sizeof(DCIMAGE_HEADER);
+    header->Size = (ULONG)size;
+
+    header->Roots.Offset = (ULONG)DCIMAGE_ALIGN( sizeof(DCIMAGE_HEADER) );
+    header->Roots.Size = Roots->Size;
+    RtlCopyMemory( base + header->Roots.Offset, Roots, Roots->Size );
+
+    header->Modes.Offset = (ULONG)DCIMAGE_ALIGN( header->Roots.Offset + Roots->Size );
+    header->Modes.Size = modesSize;
+    RtlCopyMemory( base + header->Modes.Offset, Modes, modesSize );
+
+    if (Extensions != NULL) {
+        header->Extensions.Offset = (ULONG)DCIMAGE_ALIGN( header->Modes.Offset + modesSize );
+        header->Extensions.Size = Extensions->Size;
+        RtlCopyMemory( base + header->Extensions.Offset, Extensions, Extensions->Size );
+    }
+
+    header->Checksum = DcImageChecksum( base, header->Size );
+
+    *Image = base;
+    *Size = header->Size;
+    return STATUS_SUCCESS;
+}
+
+//  Parts of an image that passed DcImageValidate.
+
+#define DcImageRoots(Image) \
+    ((PDCTRIE)((PUCHAR)(Image) + ((PDCIMAGE_HEADER)(Image))->Roots.Offset))
+
+#define DcImageModes(Image) \
+    ((PDCMODE_TABLE)((PUCHAR)(Image) + ((PDCIMAGE_HEADER)(Image))->Modes.Offset))
+
+#define DcImageExtensions(Image) \
+    (((PDCIMAGE_HEADER)(Image))->Extensions.Size != 0 ? \
+     (PDCEXT_SET)((PUCHAR)(Image) + ((PDCIMAGE_HEADER)(Image))->Extensions.Offset) : NULL)
+
+#endif //  __DCIMAGE_H__
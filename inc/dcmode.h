@@ -0,0 +1,309 @@
+/*++
+Copyright (c)
+Module Name:
+    dcmode.h
+Abstract:
+    Protection modes of the protected roots.
+
+    A mode is a set of DCMODE_PROTECT_* flags, each naming a kind of
+    change that is denied below the root. When a policy is loaded every
+    root's mode is compiled into a DCMODE_ENTRY: the access rights,
+    create options and create dispositions it denies, and whether it
+    denies creating files and directories. Deciding on an
+    operation is then a table index and a few masks, the same for every
+    mode, instead of a chain of tests.
+
+    The table has one entry more than there are roots, the first, which
+    denies nothing and is what DCTRIE_NO_ROOT indexes, so files outside
+    the roots need no test either.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCMODE_H__
+#define __DCMODE_H__
+
+#include "dcport.h"
+
+//  Writing or truncating the data of a file, or adding files to a
+//  directory: FILE_ADD_FILE is FILE_WRITE_DATA.
+#define DCMODE_PROTECT_DATA         0x00000001
+
+//  Appending to a file, or adding subdirectories to a directory:
+//  FILE_ADD_SUBDIRECTORY is FILE_APPEND_DATA.
+#define DCMODE_PROTECT_APPEND       0x00000002
+
+//  Deleting, renaming or superseding a file.
+#define DCMODE_PROTECT_DELETE       0x00000004
+
+//  Changing the attributes, times or extended attributes of a file.
+#define DCMODE_PROTECT_ATTRIBUTES   0x00000008
+
+//  Changing the owner, DACL or SACL of a file.
+#define DCMODE_PROTECT_SECURITY     0x00000010
+
+#define DCMODE_PROTECT_ALL          0x0000001F
+
+//  Named modes. A mode without any flag is taken as read-only.
+#define DCMODE_READ_ONLY            DCMODE_PROTECT_ALL
+#define DCMODE_APPEND_ONLY          (DCMODE_PROTECT_ALL & ~DCMODE_PROTECT_APPEND)
+#define DCMODE_NO_DELETE            DCMODE_PROTECT_DELETE
+#define DCMODE_NO_ACL_CHANGE        DCMODE_PROTECT_SECURITY
+
+//  Bits of DeniedCreations. FILE_DIRECTORY_FILE, bit 0 of the create
+//  options, is the bit a create is tested on.
+#define DCMODE_CREATE_FILE          0x00000001
+#define DCMODE_CREATE_DIRECTORY     0x00000002
+
+typedef struct _DCMODE_ENTRY {
+
+    //  Access rights that are never granted.
+    ACCESS_MASK DeniedAccess;
+
+    //  Create options that are denied.
+    ULONG DeniedOptions;
+
+    //  Bit n is set if create disposition n is denied.
+    ULONG DeniedDispositions;
+
+    //  DCMODE_CREATE_* bits of what a create may not add below the root.
+    ULONG DeniedCreations;
+
+    //  DCMODE_PROTECT_* flags the entry was compiled from.
+    ULONG Mode;
+
+} DCMODE_ENTRY, *PDCMODE_ENTRY;
+
+typedef const DCMODE_ENTRY *PCDCMODE_ENTRY;
+
+typedef struct _DCMODE_TABLE {
+
+    ULONG RootCount;
+
+    //  Entries[0] denies nothing, Entries[RootId + 1] is the entry of
+    //  root RootId.
+    DCMODE_ENTRY Entries[ANYSIZE_ARRAY];
+
+} DCMODE_TABLE, *PDCMODE_TABLE;
+
+typedef const DCMODE_TABLE *PCDCMODE_TABLE;
+
+#define DcModeTableSize(RootCount) \
+    ((ULONG)(FIELD_OFFSET(DCMODE_TABLE, Entries) + ((RootCount) + 1) * sizeof(DCMODE_ENTRY)))
+
+DC_INLINE VOID
+DcModeCompile (
+    _In_ ULONG Mode,
+    _Out_ PDCMODE_ENTRY Entry
+    )
+/*++
+Routine Description:
+    Compiles a mode into the access rights, create options, create
+    dispositions and creations it denies.
+Arguments:
+    Mode - DCMODE_PROTECT_* flags. Others are ignored.
+    Entry - Receives the compiled mode.
+--*/
+{
+    static const struct {
+        ULONG Protection;
+        ACCESS_MASK Access;
+        ULONG Options;
+        ULONG Dispositions;
+        ULONG Creations;
+    } rules[] = {
+        { DCMODE_PROTECT_DATA,
+          FILE_WRITE_DATA,
+          0,
+          (1UL << FILE_SUPERSEDE) | (1UL << FILE_OVERWRITE) | (1UL << FILE_OVERWRITE_IF),
+          DCMODE_CREATE_FILE },
+        { DCMODE_PROTECT_APPEND,
+          FILE_APPEND_DATA,
+          0,
+          0,
+          DCMODE_CREATE_DIRECTORY },
+        { DCMODE_PROTECT_DELETE,
+          DELETE,
+          FILE_DELETE_ON_CLOSE,
+          1UL << FILE_SUPERSEDE,
+          0 },
+        { DCMODE_PROTECT_ATTRIBUTES,
+          FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA,
+          0,
+          0,
+          0 },
+        { DCMODE_PROTECT_SECURITY,
+          WRITE_DAC | WRITE_OWNER | ACCESS_SYSTEM_SECURITY,
+          0,
+          0,
+          0 },
+    };
+    ULONG i;
+
+    Mode &= DCMODE_PROTECT_ALL;
+    if (Mode == 0) {
+        Mode = DCMODE_READ_ONLY;
+    }
+
+    RtlZeroMemory( Entry, sizeof(DCMODE_ENTRY) );
+    Entry->Mode = Mode;
+
+    for (i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        if ((Mode & rules[i].Protection) != 0) {
+            Entry->DeniedAccess |= rules[i].Access;
+            Entry->DeniedOptions |= rules[i].Options;
+            Entry->DeniedDispositions |= rules[i].Dispositions;
+            Entry->DeniedCreations |= rules[i].Creations;
+        }
+    }
+}
+
+DC_INLINE NTSTATUS
+DcModeBuildTable (
+    _In_reads_(RootCount) const ULONG *Modes,
+    _In_ ULONG RootCount,
+    _Outptr_ PDCMODE_TABLE *Table
+    )
+/*++
+Routine Description:
+    Compiles the mode of every root into a table.
+Arguments:
+    Modes - Mode of each root, indexed by root id.
+    RootCount - Number of roots.
+    Table - Receives the table, to be freed with DcModeFree.
+Return Value:
+    STATUS_SUCCESS, STATUS_INVALID_PARAMETER if there are too many roots
+    or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    PDCMODE_TABLE table;
+    ULONG i;
+
+    *Table = NULL;
+
+    if (RootCount >= 0x7FFFFFFF / sizeof(DCMODE_ENTRY) - 1) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    table = (PDCMODE_TABLE)DcAllocate( DcModeTableSize( RootCount ) );
+    if (table == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    table->RootCount = RootCount;
+    RtlZeroMemory( &table->Entries[0], sizeof(DCMODE_ENTRY) );
+
+    for (i = 0; i < RootCount; i++) {
+        DcModeCompile( Modes[i], &table->Entries[i + 1] );
+    }
+
+    *Table = table;
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE NTSTATUS
+DcModeValidate (
+    _In_ PCDCMODE_TABLE Table,
+    _In_ ULONG Size
+    )
+/*++
+Routine Description:
+    Checks that a table found in a policy image fills Size bytes and that
+    every entry is what its mode compiles to, the first denying nothing.
+Return Value:
+    STATUS_SUCCESS or STATUS_INVALID_IMAGE_FORMAT.
+--*/
+{
+    DCMODE_ENTRY entry;
+    ULONG i;
+
+    if (Size < (ULONG)FIELD_OFFSET(DCMODE_TABLE, Entries) ||
+        Table->RootCount >= (Size - FIELD_OFFSET(DCMODE_TABLE, Entries)) / sizeof(DCMODE_ENTRY) ||
+        DcModeTableSize( Table->RootCount ) != Size) {
+        return STATUS_INVALID_IMAGE_FORMAT;
+    }
+
+    RtlZeroMemory( &entry, sizeof(entry) );
+    if (!RtlEqualMemory( &Table->Entries[0], &entry, sizeof(entry) )) {
+        return STATUS_INVALID_IMAGE_FORMAT;
+    }
+
+    for (i = 1; i <= Table->RootCount; i++) {
+        DcModeCompile( Table->Entries[i].Mode, &entry );
+        if (!RtlEqualMemory( &Table->Entries[i], &entry, sizeof(entry) )) {
+            return STATUS_INVALID_IMAGE_FORMAT;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE VOID
+DcModeFree (
+    _In_ PDCMODE_TABLE Table
+    )
+{
+    DcFree( Table );
+}
+
+DC_INLINE PCDCMODE_ENTRY
+DcModeLookup (
+    _In_ PCDCMODE_TABLE Table,
+    _In_ ULONG RootId
+    )
+/*++
+Routine Description:
+    Returns the entry of a root, or the entry that denies nothing for
+    DCTRIE_NO_ROOT, whose index wraps around to 0.
+--*/
+{
+    return &Table->Entries[(ULONG)(RootId + 1)];
+}
+
+DC_INLINE BOOLEAN
+DcModeDeniesCreation (
+    _In_ ULONG DeniedCreations,
+    _In_ ULONG Options
+    )
+/*++
+Routine Description:
+    Decides whether a create may add the file or directory it names.
+Arguments:
+    DeniedCreations - DeniedCreations of the mode of the root.
+    Options - Create options; only FILE_DIRECTORY_FILE is looked at.
+Return Value:
+    TRUE if the file or directory may not be created.
+--*/
+{
+    return (BOOLEAN)(((DeniedCreations >> (Options & FILE_DIRECTORY_FILE)) & 1) != 0);
+}
+
+DC_INLINE BOOLEAN
+DcModeDeniesCreate (
+    _In_ PCDCMODE_ENTRY Entry,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG Options
+    )
+/*++
+Routine Description:
+    Decides on a create.
+Arguments:
+    Entry - Mode of the root the file lies below.
+    DesiredAccess - Access the create asks for, generic rights mapped.
+    Options - Create options, with the disposition in the high 8 bits.
+Return Value:
+    TRUE if the create is denied. Other dispositions than FILE_CREATE
+    may create the file as well; that is only known once it is open, see
+    DcPolicyDeniesCreated.
+--*/
+{
+    //  Dispositions are below 32; a byte above that denies nothing
+    //  rather than alias one that is.
+    return (BOOLEAN)(((DesiredAccess & Entry->DeniedAccess) |
+                      (Options & 0x00FFFFFF & Entry->DeniedOptions) |
+                      ((Entry->DeniedDispositions >> ((Options >> 24) & 31)) & (ULONG)((Options >> 29) == 0)) |
+                      (DcModeDeniesCreation( Entry->DeniedCreations, Options ) &
+                       (ULONG)((Options >> 24) == FILE_CREATE))) != 0);
+}
+
+#endif //  __DCMODE_H__
@@ -0,0 +1,308 @@
+/*++
+Copyright (c)
+Module Name:
+    dcpolicy.h
+Abstract:
+    Decisions of the filter on creates, apart from the file system.
+
+    A policy is the compiled roots, their modes and the extension rule.
+    Given the name of a file and what a create asks for, the functions
+    here decide what the pre and post create callbacks do with it; the
+    filter only finds the name, counts, and carries the decision out.
+    The same code runs in DCApp and in tools on any host, so decisions
+    can be tested and measured without a Windows machine.
+
+    Names are parsed here rather than by FltParseFileNameInformation: the
+    final component is what follows the last separator, the extension
+    what follows its last dot, leaving out any stream name.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCPOLICY_H__
+#define __DCPOLICY_H__
+
+#include "dcport.h"
+#include "dctrie.h"
+#include "dcmode.h"
+#include "dcext.h"
+
+typedef struct _DCPOLICY {
+
+    //  Compiled protected roots and their modes, indexed by root id.
+    PDCTRIE Roots;
+    PDCMODE_TABLE Modes;
+
+    //  Extension rule of the files below the roots, NULL if every file
+    //  is protected.
+    PDCEXT_SET Extensions;
+
+} DCPOLICY, *PDCPOLICY;
+
+typedef const DCPOLICY *PCDCPOLICY;
+
+//  Decisions of DcPolicyDecideCreate.
+
+//  Not below a protected root. Neither is anything else in the parent
+//  directory, so the directory can be remembered as unprotected.
+#define DCPOLICY_ALLOW              0
+
+//  Below a root, but of an extension the rule leaves alone.
+#define DCPOLICY_ALLOW_EXCLUDED     1
+
+//  Asks for access, options or a disposition the mode denies.
+#define DCPOLICY_DENY               2
+
+//  Allowed, but what the file system grants has to be checked with
+//  DcPolicyDeniesOpen once the file is open.
+#define DCPOLICY_CHECK_OPEN         3
+
+DC_INLINE VOID
+DcPolicySplitName (
+    _In_ PCUNICODE_STRING Name,
+    _Out_ PUNICODE_STRING FinalComponent,
+    _Out_ PUNICODE_STRING Extension
+    )
+/*++
+Routine Description:
+    Finds the final component and the extension of a file name. Both
+    point into Name.
+Arguments:
+    Name - Full name of the file, e.g. \Device\HarddiskVolume3\a\b.txt.
+    FinalComponent - Receives what follows the last separator, stream
+        name included.
+    Extension - Receives the extension without the dot, empty if the
+        final component has none.
+--*/
+{
+    USHORT length = Name->Length / sizeof(WCHAR);
+    USHORT start = length;
+    USHORT end;
+    USHORT i;
+
+    while (start > 0 && Name->Buffer[start - 1] != DC_PATH_SEPARATOR) {
+        start--;
+    }
+
+    FinalComponent->Buffer = Name->Buffer + start;
+    FinalComponent->Length = (USHORT)((length - start) * sizeof(WCHAR));
+    FinalComponent->MaximumLength = FinalComponent->Length;
+
+    end = start;
+    while (end < length && Name->Buffer[end] != L':') {
+        end++;
+    }
+
+    Extension->Buffer = Name->Buffer + end;
+    Extension->Length = 0;
+    Extension->MaximumLength = 0;
+
+    for (i = end; i > start; i--) {
+        if (Name->Buffer[i - 1] == L'.') {
+            Extension->Buffer = Name->Buffer + i;
+            Extension->Length = (USHORT)((end - i) * sizeof(WCHAR));
+            Extension->MaximumLength = Extension->Length;
+            break;
+        }
+    }
+}
+
+DC_INLINE BOOLEAN
+DcPolicyIsExtensionProtected (
+    _In_ PCDCPOLICY Policy,
+    _In_ PCUNICODE_STRING Name
+    )
+/*++
+Routine Description:
+    Applies the extension rule to a file below one of the roots.
+--*/
+{
+    UNICODE_STRING finalComponent;
+    UNICODE_STRING extension;
+
+    if (Policy->Extensions == NULL) {
+        return TRUE;
+    }
+
+    DcPolicySplitName( Name, &finalComponent, &extension );
+    return DcExtIsProtected( Policy->Extensions, &extension );
+}
+
+DC_INLINE ULONG
+DcPolicyCheckPath (
+    _In_ PCDCPOLICY Policy,
+    _In_ PCUNICODE_STRING Name,
+    _Out_opt_ PDCMODE_ENTRY Mode
+    )
+/*++
+Routine Description:
+    Checks whether a normalized file name is below one of the roots.
+Arguments:
+    Policy - The policy.
+    Name - Normalized name of the file.
+    Mode - Receives the mode of the root, or an entry that denies nothing
+        if the file is not protected, also when the extension rule leaves
+        it out.
+Return Value:
+    The id of the deepest root above the file, or DCTRIE_NO_ROOT.
+--*/
+{
+    ULONG rootId;
+
+    if (Mode != NULL) {
+        RtlZeroMemory( Mode, sizeof(DCMODE_ENTRY) );
+    }
+
+    if (Name->Length == 0) {
+        return DCTRIE_NO_ROOT;
+    }
+
+    rootId = DcTrieMatch( Policy->Roots, Name );
+
+    if (Mode != NULL && rootId != DCTRIE_NO_ROOT &&
+        DcPolicyIsExtensionProtected( Policy, Name )) {
+        *Mode = *DcModeLookup( Policy->Modes, rootId );
+    }
+
+    return rootId;
+}
+
+DC_INLINE ULONG
+DcPolicyCheckOpenedPath (
+    _In_ PCDCPOLICY Policy,
+    _In_ PCUNICODE_STRING Name,
+    _Out_ PBOOLEAN Ambiguous,
+    _Out_opt_ PDCMODE_ENTRY Mode
+    )
+/*++
+Routine Description:
+    Checks whether a file name that has not been normalized is below one
+    of the roots, see DcTrieMatchOpenedName.
+Arguments:
+    Policy - The policy.
+    Name - Opened name of the file.
+    Ambiguous - Receives TRUE if the answer cannot be trusted and the
+        normalized name has to be checked instead.
+    Mode - As for DcPolicyCheckPath.
+Return Value:
+    The id of the deepest root above the file, or DCTRIE_NO_ROOT if the
+    file is not protected or the name is ambiguous.
+--*/
+{
+    UNICODE_STRING finalComponent;
+    UNICODE_STRING extension;
+    ULONG rootId;
+    USHORT i;
+
+    *Ambiguous = FALSE;
+    if (Mode != NULL) {
+        RtlZeroMemory( Mode, sizeof(DCMODE_ENTRY) );
+    }
+
+    if (Name->Length == 0) {
+        *Ambiguous = TRUE;
+        return DCTRIE_NO_ROOT;
+    }
+
+    rootId = DcTrieMatchOpenedName( Policy->Roots, Name, Ambiguous );
+
+    if (Mode == NULL || rootId == DCTRIE_NO_ROOT) {
+        return rootId;
+    }
+
+    if (DcPolicyIsExtensionProtected( Policy, Name )) {
+        *Mode = *DcModeLookup( Policy->Modes, rootId );
+        return rootId;
+    }
+
+    //  The extension of a short name is cut to three characters; only
+    //  the long name tells what it is.
+    DcPolicySplitName( Name, &finalComponent, &extension );
+    for (i = 0; i < finalComponent.Length / sizeof(WCHAR); i++) {
+        if (finalComponent.Buffer[i] == L'~') {
+            *Ambiguous = TRUE;
+            return DCTRIE_NO_ROOT;
+        }
+    }
+
+    return rootId;
+}
+
+DC_INLINE ULONG
+DcPolicyDecideCreate (
+    _In_ ULONG RootId,
+    _In_ PCDCMODE_ENTRY Mode,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG Options
+    )
+/*++
+Routine Description:
+    Decides on a create once its name has been checked.
+Arguments:
+    RootId - Root the file is below, as returned by the check.
+    Mode - Mode the check returned.
+    DesiredAccess - Access the create asks for, generic rights mapped.
+    Options - Create options, with the disposition in the high 8 bits.
+Return Value:
+    DCPOLICY_* decision.
+--*/
+{
+    if (RootId == DCTRIE_NO_ROOT) {
+        return DCPOLICY_ALLOW;
+    }
+
+    if (Mode->DeniedAccess == 0) {
+        return DCPOLICY_ALLOW_EXCLUDED;
+    }
+
+    if (DcModeDeniesCreate( Mode, DesiredAccess, Options )) {
+        return DCPOLICY_DENY;
+    }
+
+    return DCPOLICY_CHECK_OPEN;
+}
+
+DC_INLINE BOOLEAN
+DcPolicyDeniesOpen (
+    _In_ ACCESS_MASK DeniedAccess,
+    _In_ ACCESS_MASK GrantedAccess
+    )
+/*++
+Routine Description:
+    Decides on a file the file system opened after DCPOLICY_CHECK_OPEN.
+    Only a create that asked for MAXIMUM_ALLOWED can be granted more than
+    the pre create callback saw.
+Arguments:
+    DeniedAccess - DeniedAccess of the mode of the root.
+    GrantedAccess - Access the file system granted.
+Return Value:
+    TRUE if the open has to be undone.
+--*/
+{
+    return (BOOLEAN)((GrantedAccess & DeniedAccess) != 0);
+}
+
+DC_INLINE BOOLEAN
+DcPolicyDeniesCreated (
+    _In_ ULONG DeniedCreations,
+    _In_ ULONG Options,
+    _In_ ULONG_PTR Information
+    )
+/*++
+Routine Description:
+    Decides on a file the file system opened after DCPOLICY_CHECK_OPEN
+    that a disposition other than FILE_CREATE, e.g. FILE_OPEN_IF, may
+    have created.
+Arguments:
+    DeniedCreations - DeniedCreations of the mode of the root.
+    Options - Create options of the create.
+    Information - What the file system returned, FILE_CREATED if it
+        created the file.
+Return Value:
+    TRUE if the file has to be removed and the open undone.
+--*/
+{
+    return (BOOLEAN)(Information == FILE_CREATED && DcModeDeniesCreation( DeniedCreations, Options ));
+}
+
+#endif //  __DCPOLICY_H__
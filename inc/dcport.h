@@ -0,0 +1,469 @@
+/*++
+Copyright (c)
+Module Name:
+    dcport.h
+Abstract:
+    Portability definitions for the DirControl policy core. The core
+    sources are compiled into the filter, into DCApp and into plain
+    user mode libraries on non-Windows hosts, so they only rely on the
+    types and helpers declared here.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCPORT_H__
+#define __DCPORT_H__
+
+#if defined(_KERNEL_MODE)
+
+#include <fltKernel.h>
+
+#define DC_CORE_TAG         'Ccds'
+
+#define DcAllocate(Size)    ExAllocatePoolWithTag( NonPagedPool, (Size), DC_CORE_TAG )
+#define DcFree(Buffer)      ExFreePoolWithTag( (Buffer), DC_CORE_TAG )
+
+#define DcUpcaseChar(Char)  RtlUpcaseUnicodeChar( Char )
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+#include <winternl.h>
+#include <stdlib.h>
+#include <wctype.h>
+
+#define DcUpcaseChar(Char)  ((WCHAR)towupper( Char ))
+
+#else
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+
+typedef void VOID, *PVOID;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint8_t BOOLEAN, *PBOOLEAN;
+typedef uint16_t USHORT, *PUSHORT;
+typedef uint16_t WCHAR, *PWCHAR, *PWSTR;
+typedef const uint16_t *PCWSTR;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONG64, *PLONG64;
+typedef uint64_t ULONG64, *PULONG64;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef int32_t NTSTATUS;
+typedef uint32_t ACCESS_MASK, *PACCESS_MASK;
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWSTR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+#define TRUE    1
+#define FALSE   0
+
+#define ANYSIZE_ARRAY   1
+
+#define FIELD_OFFSET(type, field)   ((LONG)offsetof(type, field))
+
+#define RtlCopyMemory(Destination, Source, Length)  memcpy( (Destination), (Source), (Length) )
+#define RtlZeroMemory(Destination, Length)          memset( (Destination), 0, (Length) )
+#define RtlEqualMemory(Destination, Source, Length) (!memcmp( (Destination), (Source), (Length) ))
+
+//  Only as good as the C library's case mapping for the current locale.
+#define DcUpcaseChar(Char)  ((WCHAR)towupper( (wint_t)(Char) ))
+
+//  Source annotations are only meaningful to the Windows toolchain.
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _In_reads_(Count)
+#define _In_reads_bytes_(Size)
+#define _Out_writes_(Count)
+#define _Out_writes_bytes_(Size)
+#define _Outptr_
+#define _Outptr_result_maybenull_
+
+#endif
+
+//  In user mode the core allocates from the C runtime, unless the host
+//  defines DC_HOST_ALLOCATOR and supplies DcHostAllocate and DcHostFree,
+//  e.g. to count what the core allocates.
+
+#if !defined(_KERNEL_MODE)
+
+#if defined(DC_HOST_ALLOCATOR)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *DcHostAllocate( size_t Size );
+void DcHostFree( void *Buffer );
+
+#ifdef __cplusplus
+}
+#endif
+
+#define DcAllocate(Size)    DcHostAllocate( Size )
+#define DcFree(Buffer)      DcHostFree( Buffer )
+
+#else
+
+#define DcAllocate(Size)    malloc( Size )
+#define DcFree(Buffer)      free( Buffer )
+
+#endif
+
+#endif
+
+#ifndef NT_SUCCESS
+#define NT_SUCCESS(Status)                  (((NTSTATUS)(Status)) >= 0)
+#endif
+
+#ifndef STATUS_SUCCESS
+#define STATUS_SUCCESS                      ((NTSTATUS)0x00000000L)
+#endif
+
+#ifndef STATUS_INVALID_PARAMETER
+#define STATUS_INVALID_PARAMETER            ((NTSTATUS)0xC000000DL)
+#endif
+
+#ifndef STATUS_INSUFFICIENT_RESOURCES
+#define STATUS_INSUFFICIENT_RESOURCES       ((NTSTATUS)0xC000009AL)
+#endif
+
+#ifndef STATUS_NO_MORE_ENTRIES
+#define STATUS_NO_MORE_ENTRIES              ((NTSTATUS)0x8000001AL)
+#endif
+
+#ifndef STATUS_OBJECT_NAME_INVALID
+#define STATUS_OBJECT_NAME_INVALID          ((NTSTATUS)0xC0000033L)
+#endif
+
+#ifndef STATUS_INVALID_IMAGE_FORMAT
+#define STATUS_INVALID_IMAGE_FORMAT         ((NTSTATUS)0xC000007BL)
+#endif
+
+#ifndef STATUS_BUFFER_TOO_SMALL
+#define STATUS_BUFFER_TOO_SMALL             ((NTSTATUS)0xC0000023L)
+#endif
+
+//  Access rights, create options and create dispositions of files, for
+//  hosts whose headers do not have them.
+
+#ifndef DELETE
+#define DELETE                              0x00010000
+#endif
+
+#ifndef WRITE_DAC
+#define WRITE_DAC                           0x00040000
+#endif
+
+#ifndef WRITE_OWNER
+#define WRITE_OWNER                         0x00080000
+#endif
+
+#ifndef ACCESS_SYSTEM_SECURITY
+#define ACCESS_SYSTEM_SECURITY              0x01000000
+#endif
+
+#ifndef FILE_WRITE_DATA
+#define FILE_WRITE_DATA                     0x0002
+#endif
+
+#ifndef FILE_APPEND_DATA
+#define FILE_APPEND_DATA                    0x0004
+#endif
+
+#ifndef FILE_WRITE_EA
+#define FILE_WRITE_EA                       0x0010
+#endif
+
+#ifndef FILE_WRITE_ATTRIBUTES
+#define FILE_WRITE_ATTRIBUTES               0x0100
+#endif
+
+#ifndef FILE_DELETE_ON_CLOSE
+#define FILE_DELETE_ON_CLOSE                0x00001000
+#endif
+
+#ifndef FILE_SUPERSEDE
+#define FILE_SUPERSEDE                      0x00000000
+#define FILE_OPEN                           0x00000001
+#define FILE_CREATE                         0x00000002
+#define FILE_OPEN_IF                        0x00000003
+#define FILE_OVERWRITE                      0x00000004
+#define FILE_OVERWRITE_IF                   0x00000005
+#endif
+
+#ifndef FILE_DIRECTORY_FILE
+#define FILE_DIRECTORY_FILE                 0x00000001
+#endif
+
+#ifndef FILE_CREATED
+#define FILE_CREATED                        0x00000002
+#endif
+
+//  Atomic helpers for memory shared between threads or with user mode.
+
+#if defined(_KERNEL_MODE) || defined(_WIN32)
+
+#define DcReadAcquire(Source)                   ReadAcquire( Source )
+#define DcReadAcquire64(Source)                 ReadAcquire64( Source )
+#define DcWriteRelease(Destination, Value)      WriteRelease( (Destination), (Value) )
+#define DcWriteRelease64(Destination, Value)    WriteRelease64( (Destination), (Value) )
+#define DcInterlockedExchange(Target, Value)    InterlockedExchange( (Target), (Value) )
+#define DcInterlockedExchangePointer(Target, Value) \
+    InterlockedExchangePointer( (Target), (Value) )
+#define DcInterlockedCompareExchange(Destination, Exchange, Comparand) \
+    InterlockedCompareExchange( (Destination), (Exchange), (Comparand) )
+#define DcInterlockedAdd(Addend, Value)         InterlockedAdd( (Addend), (Value) )
+#define DcMemoryBarrier()                       MemoryBarrier()
+
+#else
+
+#define DcReadAcquire(Source)                   __atomic_load_n( (Source), __ATOMIC_ACQUIRE )
+#define DcReadAcquire64(Source)                 __atomic_load_n( (Source), __ATOMIC_ACQUIRE )
+#define DcWriteRelease(Destination, Value)      __atomic_store_n( (Destination), (Value), __ATOMIC_RELEASE )
+#define DcWriteRelease64(Destination, Value)    __atomic_store_n( (Destination), (Value), __ATOMIC_RELEASE )
+#define DcInterlockedExchange(Target, Value)    __atomic_exchange_n( (Target), (Value), __ATOMIC_SEQ_CST )
+#define DcInterlockedExchangePointer(Target, Value) \
+    __atomic_exchange_n( (Target), (Value), __ATOMIC_SEQ_CST )
+#define DcInterlockedCompareExchange(Destination, Exchange, Comparand) \
+    __sync_val_compare_and_swap( (Destination), (Comparand), (Exchange) )
+#define DcInterlockedAdd(Addend, Value)         __atomic_add_fetch( (Addend), (Value), __ATOMIC_SEQ_CST )
+#define DcMemoryBarrier()                       __atomic_thread_fence( __ATOMIC_SEQ_CST )
+
+#endif
+
+#define DC_PATH_SEPARATOR   L'\\'
+
+#define DC_INLINE           static __inline
+
+DC_INLINE ULONG
+DcHighestBit64 (
+    _In_ ULONG64 Value
+    )
+/*++
+Routine Description:
+    Index of the highest bit set in a value that is not 0.
+--*/
+{
+#if defined(_KERNEL_MODE) || defined(_WIN32)
+    unsigned long index;
+
+#if defined(_M_IX86) || defined(_M_ARM)
+    if (_BitScanReverse( &index, (ULONG)(Value >> 32) )) {
+        return index + 32;
+    }
+    _BitScanReverse( &index, (ULONG)Value );
+#else
+    _BitScanReverse64( &index, Value );
+#endif
+
+    return index;
+#else
+    return 63 - (ULONG)__builtin_clzll( Value );
+#endif
+}
+
+DC_INLINE ULONG
+DcLowestBit32 (
+    _In_ ULONG Value
+    )
+/*++
+Routine Description:
+    Index of the lowest bit set in a value that is not 0.
+--*/
+{
+#if defined(_KERNEL_MODE) || defined(_WIN32)
+    unsigned long index;
+
+    _BitScanForward( &index, Value );
+    return index;
+#else
+    return (ULONG)__builtin_ctz( Value );
+#endif
+}
+
+//  Rundown protection of something readers use without a lock, see
+//  dcslot.h. The filter uses the cache aware rundown protection of the
+//  kernel; user mode hosts, which have none, get one with the same
+//  behaviour: once a wait has started every acquire fails until the
+//  protection is reinitialized, and the wait returns once every
+//  reference acquired before it has been released, on any thread.
+
+#if defined(_KERNEL_MODE)
+
+typedef PEX_RUNDOWN_REF_CACHE_AWARE PDC_RUNDOWN;
+
+#define DcAllocateRundown()         ExAllocateCacheAwareRundownProtection( NonPagedPool, DC_CORE_TAG )
+#define DcFreeRundown(Rundown)      ExFreeCacheAwareRundownProtection( Rundown )
+#define DcAcquireRundown(Rundown)   ExAcquireRundownProtectionCacheAware( Rundown )
+#define DcReleaseRundown(Rundown)   ExReleaseRundownProtectionCacheAware( Rundown )
+#define DcWaitForRundown(Rundown)   ExWaitForRundownProtectionReleaseCacheAware( Rundown )
+#define DcReInitializeRundown(Rundown) \
+    ExReInitializeRundownProtectionCacheAware( Rundown )
+
+#else
+
+#if defined(_WIN32)
+#define DC_THREAD_LOCAL             __declspec(thread)
+#define DcYieldThread()             SwitchToThread()
+#else
+#include <sched.h>
+#define DC_THREAD_LOCAL             __thread
+#define DcYieldThread()             sched_yield()
+#endif
+
+//  Threads spread their references over the shards of a rundown, each on
+//  a cache line of its own, as the kernel spreads them over processors.
+//  A shard holds twice the references taken on it less those released
+//  on it, which may be negative, plus 1 once a wait has started.
+#define DC_RUNDOWN_SHARDS           16
+#define DC_RUNDOWN_WAITING          1
+#define DC_RUNDOWN_REFERENCE        2
+
+typedef struct _DC_RUNDOWN_SHARD {
+    volatile LONG Count;
+    UCHAR Reserved[64 - sizeof(LONG)];
+} DC_RUNDOWN_SHARD;
+
+typedef struct _DC_RUNDOWN {
+    DC_RUNDOWN_SHARD Shards[DC_RUNDOWN_SHARDS];
+} DC_RUNDOWN, *PDC_RUNDOWN;
+
+DC_INLINE volatile LONG *
+DcRundownShard (
+    _In_ PDC_RUNDOWN Rundown
+    )
+/*++
+Routine Description:
+    The shard of the calling thread, given out to threads in turn.
+--*/
+{
+    static DC_THREAD_LOCAL ULONG threadShard;
+    static volatile LONG nextShard;
+
+    if (threadShard == 0) {
+        threadShard = (ULONG)DcInterlockedAdd( &nextShard, 1 );
+    }
+
+    return &Rundown->Shards[threadShard % DC_RUNDOWN_SHARDS].Count;
+}
+
+DC_INLINE PDC_RUNDOWN
+DcAllocateRundown (
+    VOID
+    )
+{
+    PDC_RUNDOWN rundown = (PDC_RUNDOWN)DcAllocate( sizeof(DC_RUNDOWN) );
+
+    if (rundown != NULL) {
+        RtlZeroMemory( rundown, sizeof(DC_RUNDOWN) );
+    }
+
+    return rundown;
+}
+
+#define DcFreeRundown(Rundown)      DcFree( Rundown )
+
+DC_INLINE BOOLEAN
+DcAcquireRundown (
+    _In_ PDC_RUNDOWN Rundown
+    )
+{
+    volatile LONG *shard = DcRundownShard( Rundown );
+    LONG count;
+    LONG seen;
+
+    for (count = DcReadAcquire( shard ); (count & DC_RUNDOWN_WAITING) == 0; count = seen) {
+
+        seen = DcInterlockedCompareExchange( shard, count + DC_RUNDOWN_REFERENCE, count );
+        if (seen == count) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+DC_INLINE VOID
+DcReleaseRundown (
+    _In_ PDC_RUNDOWN Rundown
+    )
+{
+    DcInterlockedAdd( DcRundownShard( Rundown ), -DC_RUNDOWN_REFERENCE );
+}
+
+DC_INLINE VOID
+DcWaitForRundown (
+    _In_ PDC_RUNDOWN Rundown
+    )
+/*++
+Routine Description:
+    Fails every acquire from now on, then waits until the references
+    outstanding on all shards together are released.
+--*/
+{
+    LONG count;
+    LONG seen;
+    LONG outstanding;
+    ULONG i;
+
+    for (i = 0; i < DC_RUNDOWN_SHARDS; i++) {
+
+        count = DcReadAcquire( &Rundown->Shards[i].Count );
+        for (;;) {
+
+            seen = DcInterlockedCompareExchange( &Rundown->Shards[i].Count, count | DC_RUNDOWN_WAITING, count );
+            if (seen == count) {
+                break;
+            }
+            count = seen;
+        }
+    }
+
+    //  Only releases change the shards now, so the sum can only be
+    //  higher than what is outstanding while they are read one by one.
+    for (;;) {
+
+        outstanding = 0;
+        for (i = 0; i < DC_RUNDOWN_SHARDS; i++) {
+            outstanding += DcReadAcquire( &Rundown->Shards[i].Count ) & ~DC_RUNDOWN_WAITING;
+        }
+
+        if (outstanding == 0) {
+            break;
+        }
+
+        DcYieldThread();
+    }
+}
+
+DC_INLINE VOID
+DcReInitializeRundown (
+    _In_ PDC_RUNDOWN Rundown
+    )
+/*++
+Routine Description:
+    Lets acquires succeed again on a protection that was run down.
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < DC_RUNDOWN_SHARDS; i++) {
+        DcWriteRelease( &Rundown->Shards[i].Count, 0 );
+    }
+}
+
+#endif
+
+#endif //  __DCPORT_H__
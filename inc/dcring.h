@@ -0,0 +1,364 @@
+/*++
+Copyright (c)
+Module Name:
+    dcring.h
+Abstract:
+    Single producer, single consumer ring of variable length records in
+    memory shared between the filter and DCApp.
+
+    The ring is a header followed by a power of two sized data area.
+    Head and Tail are byte positions that only ever grow; a position maps
+    to the data area modulo its size. The producer owns Tail and the
+    consumer owns Head, and each keeps its own copy of everything else,
+    so nothing the other side writes into the shared memory can make it
+    read or write outside the ring. A record never wraps: when it does not
+    fit before the end of the data area the producer fills the rest with
+    a padding record and starts over at the beginning.
+
+    Records are published by storing Tail with release semantics after
+    they are written, and freed by storing Head after they are read. The
+    consumer raises ConsumerWaiting before it waits for a doorbell, and
+    the producer rings only when it finds the flag raised.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCRING_H__
+#define __DCRING_H__
+
+#include "dcport.h"
+
+#define DCRING_MAGIC            0x474E5244      //  'DRNG'
+#define DCRING_VERSION          1
+
+#define DCRING_CACHE_LINE       64
+#define DCRING_ALIGNMENT        8
+
+//  Type of the record that fills the end of the data area.
+#define DCRING_RECORD_PADDING   0
+
+typedef struct _DCRING_HEADER {
+
+    ULONG Magic;
+    ULONG Version;
+
+    //  Offset of the data area from the start of the header.
+    ULONG DataOffset;
+
+    //  Size of the data area in bytes, a power of two.
+    ULONG DataSize;
+
+    UCHAR Reserved0[DCRING_CACHE_LINE - 4 * sizeof(ULONG)];
+
+    //  Written by the producer only.
+    volatile LONG64 Tail;
+
+    UCHAR Reserved1[DCRING_CACHE_LINE - sizeof(LONG64)];
+
+    //  Written by the consumer only, except that the producer clears
+    //  ConsumerWaiting when it rings.
+    volatile LONG64 Head;
+    volatile LONG ConsumerWaiting;
+
+    UCHAR Reserved2[DCRING_CACHE_LINE - sizeof(LONG64) - sizeof(LONG)];
+
+} DCRING_HEADER, *PDCRING_HEADER;
+
+typedef struct _DCRING_RECORD {
+
+    //  Size of the record in bytes including this header, a multiple of
+    //  DCRING_ALIGNMENT.
+    ULONG Length;
+    ULONG Type;
+
+} DCRING_RECORD, *PDCRING_RECORD;
+
+#define DCRING_RECORD_SIZE(PayloadLength) \
+    ((ULONG)((sizeof(DCRING_RECORD) + (PayloadLength) + DCRING_ALIGNMENT - 1) & ~(DCRING_ALIGNMENT - 1)))
+
+typedef struct _DCRING_PRODUCER {
+    PDCRING_HEADER Ring;
+    PUCHAR Data;
+    ULONG DataSize;
+
+    //  End of the records reserved so far, published by DcRingCommit.
+    LONG64 Tail;
+
+    //  Last Head read from the ring.
+    LONG64 Head;
+
+    //  Set once the consumer has stored an impossible Head.
+    BOOLEAN Broken;
+} DCRING_PRODUCER, *PDCRING_PRODUCER;
+
+typedef struct _DCRING_CONSUMER {
+    PDCRING_HEADER Ring;
+    PUCHAR Data;
+    ULONG DataSize;
+    LONG64 Head;
+} DCRING_CONSUMER, *PDCRING_CONSUMER;
+
+
+DC_INLINE ULONG
+DcRingDataSize (
+    _In_ ULONG BufferSize
+    )
+/*++
+Routine Description:
+    Returns the largest power of two data area that fits in BufferSize
+    bytes after the header, or 0 if none does.
+--*/
+{
+    ULONG available;
+    ULONG size = DCRING_CACHE_LINE;
+
+    if (BufferSize < sizeof(DCRING_HEADER) + DCRING_CACHE_LINE) {
+        return 0;
+    }
+
+    available = BufferSize - (ULONG)sizeof(DCRING_HEADER);
+    while (size <= available / 2) {
+        size *= 2;
+    }
+
+    return size;
+}
+
+DC_INLINE NTSTATUS
+DcRingInitializeProducer (
+    _Out_ PDCRING_PRODUCER Producer,
+    _Out_writes_bytes_(BufferSize) PVOID Buffer,
+    _In_ ULONG BufferSize
+    )
+/*++
+Routine Description:
+    Formats Buffer as an empty ring and prepares Producer to write to it.
+    Buffer must be aligned to DCRING_ALIGNMENT.
+--*/
+{
+    PDCRING_HEADER ring = (PDCRING_HEADER)Buffer;
+    ULONG dataSize = DcRingDataSize( BufferSize );
+
+    if (dataSize == 0 || ((ULONG_PTR)Buffer & (DCRING_ALIGNMENT - 1)) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory( ring, sizeof(DCRING_HEADER) );
+    ring->Magic = DCRING_MAGIC;
+    ring->Version = DCRING_VERSION;
+    ring->DataOffset = (ULONG)sizeof(DCRING_HEADER);
+    ring->DataSize = dataSize;
+
+    Producer->Ring = ring;
+    Producer->Data = (PUCHAR)Buffer + sizeof(DCRING_HEADER);
+    Producer->DataSize = dataSize;
+    Producer->Tail = 0;
+    Producer->Head = 0;
+    Producer->Broken = FALSE;
+
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE PVOID
+DcRingReserve (
+    _Inout_ PDCRING_PRODUCER Producer,
+    _In_ ULONG Type,
+    _In_ ULONG PayloadLength
+    )
+/*++
+Routine Description:
+    Reserves a record. The record becomes visible to the consumer with
+    the next DcRingCommit, together with every record reserved before.
+Arguments:
+    Producer - Producer state.
+    Type - Record type, other than DCRING_RECORD_PADDING.
+    PayloadLength - Bytes the caller will write after the record header.
+Return Value:
+    The payload of the record, or NULL if the ring is full or broken.
+    A record longer than half the data area can be refused even by an
+    empty ring, when it would have to start over at the beginning.
+--*/
+{
+    PDCRING_RECORD record;
+    ULONG length;
+    ULONG offset;
+    ULONG padding;
+    LONG64 head;
+
+    if (Producer->Broken || PayloadLength > Producer->DataSize) {
+        return NULL;
+    }
+
+    length = DCRING_RECORD_SIZE( PayloadLength );
+    offset = (ULONG)Producer->Tail & (Producer->DataSize - 1);
+    padding = (offset + length > Producer->DataSize) ? Producer->DataSize - offset : 0;
+
+    if ((ULONG64)(Producer->Tail - Producer->Head) + padding + length > Producer->DataSize) {
+
+        //  Only look at the consumer's Head when the cached one says the
+        //  ring is full, and never trust it further than it can be.
+        head = DcReadAcquire64( &Producer->Ring->Head );
+        if (head < Producer->Head || head > Producer->Tail) {
+            Producer->Broken = TRUE;
+            return NULL;
+        }
+
+        Producer->Head = head;
+        if ((ULONG64)(Producer->Tail - head) + padding + length > Producer->DataSize) {
+            return NULL;
+        }
+    }
+
+    if (padding != 0) {
+        record = (PDCRING_RECORD)(Producer->Data + offset);
+        record->Length = padding;
+        record->Type = DCRING_RECORD_PADDING;
+        Producer->Tail += padding;
+        offset = 0;
+    }
+
+    record = (PDCRING_RECORD)(Producer->Data + offset);
+    record->Length = length;
+    record->Type = Type;
+    Producer->Tail += length;
+
+    return record + 1;
+}
+
+DC_INLINE VOID
+DcRingCommit (
+    _Inout_ PDCRING_PRODUCER Producer
+    )
+{
+    DcWriteRelease64( &Producer->Ring->Tail, Producer->Tail );
+}
+
+DC_INLINE BOOLEAN
+DcRingShouldRing (
+    _Inout_ PDCRING_PRODUCER Producer
+    )
+/*++
+Routine Description:
+    Called after DcRingCommit. Tells whether the consumer is waiting and
+    has to be woken up, and clears its flag if so.
+--*/
+{
+    //  Pairs with the barrier in DcRingPrepareWait: either the consumer
+    //  sees the new Tail or this sees its flag.
+    DcMemoryBarrier();
+
+    if (DcReadAcquire( &Producer->Ring->ConsumerWaiting ) == 0) {
+        return FALSE;
+    }
+
+    return (BOOLEAN)(DcInterlockedExchange( &Producer->Ring->ConsumerWaiting, 0 ) != 0);
+}
+
+DC_INLINE NTSTATUS
+DcRingAttachConsumer (
+    _Out_ PDCRING_CONSUMER Consumer,
+    _In_reads_bytes_(BufferSize) PVOID Buffer,
+    _In_ ULONG BufferSize
+    )
+/*++
+Routine Description:
+    Checks that Buffer holds a ring formatted by DcRingInitializeProducer
+    and prepares Consumer to read from it, from the Head stored in it.
+--*/
+{
+    PDCRING_HEADER ring = (PDCRING_HEADER)Buffer;
+
+    if (BufferSize < sizeof(DCRING_HEADER) ||
+        ring->Magic != DCRING_MAGIC ||
+        ring->Version != DCRING_VERSION ||
+        ring->DataOffset != sizeof(DCRING_HEADER) ||
+        ring->DataSize < DCRING_CACHE_LINE ||
+        (ring->DataSize & (ring->DataSize - 1)) != 0 ||
+        ring->DataSize > BufferSize - sizeof(DCRING_HEADER) ||
+        (ring->Head & (DCRING_ALIGNMENT - 1)) != 0) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Consumer->Ring = ring;
+    Consumer->Data = (PUCHAR)Buffer + sizeof(DCRING_HEADER);
+    Consumer->DataSize = ring->DataSize;
+    Consumer->Head = ring->Head;
+
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE const DCRING_RECORD *
+DcRingPeek (
+    _Inout_ PDCRING_CONSUMER Consumer
+    )
+/*++
+Routine Description:
+    Returns the oldest published record, skipping padding. The record
+    stays valid until it is released with DcRingRelease.
+Return Value:
+    The record, or NULL if the ring is empty or holds a malformed record.
+--*/
+{
+    const DCRING_RECORD *record;
+    LONG64 tail = DcReadAcquire64( &Consumer->Ring->Tail );
+    ULONG offset;
+
+    while (Consumer->Head < tail) {
+
+        offset = (ULONG)Consumer->Head & (Consumer->DataSize - 1);
+        record = (const DCRING_RECORD *)(Consumer->Data + offset);
+
+        if (record->Length < sizeof(DCRING_RECORD) ||
+            (record->Length & (DCRING_ALIGNMENT - 1)) != 0 ||
+            record->Length > Consumer->DataSize - offset ||
+            record->Length > (ULONG64)(tail - Consumer->Head)) {
+
+            return NULL;
+        }
+
+        if (record->Type != DCRING_RECORD_PADDING) {
+            return record;
+        }
+
+        Consumer->Head += record->Length;
+        DcWriteRelease64( &Consumer->Ring->Head, Consumer->Head );
+    }
+
+    return NULL;
+}
+
+DC_INLINE VOID
+DcRingRelease (
+    _Inout_ PDCRING_CONSUMER Consumer,
+    _In_ const DCRING_RECORD *Record
+    )
+{
+    Consumer->Head += Record->Length;
+    DcWriteRelease64( &Consumer->Ring->Head, Consumer->Head );
+}
+
+DC_INLINE BOOLEAN
+DcRingPrepareWait (
+    _Inout_ PDCRING_CONSUMER Consumer
+    )
+/*++
+Routine Description:
+    Raises ConsumerWaiting before the consumer waits for a doorbell.
+Return Value:
+    TRUE if the ring is still empty and the consumer may wait, FALSE if
+    records arrived meanwhile; the flag is then cleared again.
+--*/
+{
+    DcInterlockedExchange( &Consumer->Ring->ConsumerWaiting, 1 );
+    DcMemoryBarrier();
+
+    if (DcReadAcquire64( &Consumer->Ring->Tail ) == Consumer->Head) {
+        return TRUE;
+    }
+
+    DcInterlockedExchange( &Consumer->Ring->ConsumerWaiting, 0 );
+    return FALSE;
+}
+
+#endif //  __DCRING_H__
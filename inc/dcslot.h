@@ -0,0 +1,212 @@
+/*++
+Copyright (c)
+Module Name:
+    dcslot.h
+Abstract:
+    Two slots an immutable object, such as the protection policy of the
+    filter, is published in, so that readers reference the current one
+    without taking a lock and the previous one is taken back once the
+    last reader using it is gone.
+
+    Each slot holds an object and a rundown protection, see dcport.h.
+    Readers acquire the rundown of the active slot and read its object.
+    A publisher stores the new object in the inactive slot, reinitializes
+    its rundown, makes it the active slot, then runs the previous slot
+    down and takes its object back. A reader that still holds the index
+    of the previous slot either fails to acquire it, because it is
+    running down, and reads the index again, or acquires it before the
+    wait started and holds the publisher off until it releases it; once
+    the slot is reused it only ever finds the newer object there. Such a
+    reader can find the new object before the publisher has made its slot
+    the active one, and the next reference then the object it replaces,
+    so while a publish is under way readers may see both in turn; never
+    an object older than that.
+
+    Publishers must be serialized by the caller; readers never wait.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCSLOT_H__
+#define __DCSLOT_H__
+
+#include "dcport.h"
+
+#define DCSLOT_COUNT    2
+
+typedef struct _DCSLOT {
+
+    PDC_RUNDOWN Rundown;
+
+    PVOID Object;
+
+} DCSLOT, *PDCSLOT;
+
+typedef struct _DCSLOTS {
+
+    DCSLOT Slots[DCSLOT_COUNT];
+
+    //  Index of the slot readers reference.
+    volatile LONG Active;
+
+} DCSLOTS, *PDCSLOTS;
+
+DC_INLINE VOID
+DcSlotsUninitialize (
+    _Inout_ PDCSLOTS Slots
+    )
+/*++
+Routine Description:
+    Frees the rundown protections. The caller takes back whatever object
+    is still published beforehand, once no reader can reference it.
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < DCSLOT_COUNT; i++) {
+
+        if (Slots->Slots[i].Rundown != NULL) {
+            DcFreeRundown( Slots->Slots[i].Rundown );
+            Slots->Slots[i].Rundown = NULL;
+        }
+    }
+}
+
+DC_INLINE NTSTATUS
+DcSlotsInitialize (
+    _Out_ PDCSLOTS Slots
+    )
+/*++
+Routine Description:
+    Slot 0 starts out active with no object, slot 1 starts out run down
+    so that the first publish can reinitialize it.
+Return Value:
+    STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES.
+--*/
+{
+    ULONG i;
+
+    RtlZeroMemory( Slots, sizeof(DCSLOTS) );
+
+    for (i = 0; i < DCSLOT_COUNT; i++) {
+
+        Slots->Slots[i].Rundown = DcAllocateRundown();
+        if (Slots->Slots[i].Rundown == NULL) {
+            DcSlotsUninitialize( Slots );
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    DcWaitForRundown( Slots->Slots[1].Rundown );
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE PVOID
+DcSlotReference (
+    _In_ PDCSLOTS Slots
+    )
+/*++
+Routine Description:
+    References the active object without taking a lock.
+Return Value:
+    The active object, to be released with DcSlotDereference and the
+    slot the publisher was told it went into, or NULL if there is none.
+--*/
+{
+    PVOID object;
+    LONG slot;
+
+    for (;;) {
+
+        slot = DcReadAcquire( &Slots->Active );
+
+        //  Failing to acquire means a publish is draining this slot; the
+        //  active slot has already moved on, so read it again.
+        if (DcAcquireRundown( Slots->Slots[slot].Rundown )) {
+            break;
+        }
+    }
+
+    object = Slots->Slots[slot].Object;
+    if (object == NULL) {
+        DcReleaseRundown( Slots->Slots[slot].Rundown );
+    }
+
+    return object;
+}
+
+DC_INLINE VOID
+DcSlotDereference (
+    _In_ PDCSLOTS Slots,
+    _In_ ULONG Slot
+    )
+{
+    DcReleaseRundown( Slots->Slots[Slot].Rundown );
+}
+
+DC_INLINE ULONG
+DcSlotNext (
+    _In_ PDCSLOTS Slots
+    )
+/*++
+Routine Description:
+    The slot the next publish stores its object in, for the object to
+    record before it is published. Called by the publisher only.
+--*/
+{
+    return (ULONG)Slots->Active ^ 1;
+}
+
+DC_INLINE ULONG
+DcSlotPublish (
+    _In_ PDCSLOTS Slots,
+    _In_opt_ PVOID Object
+    )
+/*++
+Routine Description:
+    Makes Object the active object. New readers find it as soon as this
+    returns; the previous object is still referenced by its readers until
+    DcSlotRetire takes it back.
+Arguments:
+    Object - New object, or NULL for none.
+Return Value:
+    The slot of the previous object, for DcSlotRetire.
+--*/
+{
+    ULONG oldSlot = (ULONG)Slots->Active;
+    ULONG newSlot = oldSlot ^ 1;
+
+    //  The new slot was run down by the previous publish. Store the object
+    //  before reinitializing the rundown so that a reader that still holds
+    //  the stale slot index can only ever see the new object.
+    (VOID)DcInterlockedExchangePointer( &Slots->Slots[newSlot].Object, Object );
+    DcReInitializeRundown( Slots->Slots[newSlot].Rundown );
+
+    (VOID)DcInterlockedExchange( &Slots->Active, (LONG)newSlot );
+    return oldSlot;
+}
+
+DC_INLINE PVOID
+DcSlotRetire (
+    _In_ PDCSLOTS Slots,
+    _In_ ULONG Slot
+    )
+/*++
+Routine Description:
+    Waits for the readers of the object DcSlotPublish replaced and takes
+    it back. New readers fail to acquire the old slot and move on to the
+    new one. Must be called before the next publish.
+Return Value:
+    The previous object, or NULL if there was none.
+--*/
+{
+    PVOID object;
+
+    DcWaitForRundown( Slots->Slots[Slot].Rundown );
+    object = Slots->Slots[Slot].Object;
+    Slots->Slots[Slot].Object = NULL;
+
+    return object;
+}
+
+#endif //  __DCSLOT_H__
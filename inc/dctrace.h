@@ -0,0 +1,291 @@
+/*++
+Copyright (c)
+Module Name:
+    dctrace.h
+Abstract:
+    Binary trace format of create operations, as replayed through the
+    policy core by tools/dcreplay.c.
+
+    A trace is a DCTRACE_HEADER followed by records up to the end of the
+    data. Each record is a DCTRACE_RECORD followed by part of the path in
+    UTF-16, padded to a multiple of DCTRACE_ALIGNMENT. Creates of one
+    program tend to follow each other down the same directories, so a
+    record only holds the characters its path does not share with the
+    path of the record before it: PrefixLength characters are taken from
+    that path and the SuffixLength characters stored follow them. The
+    first record of a trace shares nothing.
+
+    Fields are in the byte order of the host that wrote the trace, which
+    the magic number tells; readers on a host of the other order reject
+    it.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCTRACE_H__
+#define __DCTRACE_H__
+
+#include "dcport.h"
+
+//  "DCTR" in the byte order of the writer.
+#define DCTRACE_MAGIC           0x52544344
+#define DCTRACE_VERSION         1
+#define DCTRACE_ALIGNMENT       4
+
+//  Longest path a trace can hold, in characters, as for UNICODE_STRING.
+#define DCTRACE_MAX_PATH        32767
+
+typedef struct _DCTRACE_HEADER {
+
+    ULONG Magic;
+    USHORT Version;
+
+    //  Offset of the first record from the start of the trace.
+    USHORT HeaderSize;
+
+    ULONG Flags;
+    ULONG Reserved;
+
+} DCTRACE_HEADER, *PDCTRACE_HEADER;
+
+typedef struct _DCTRACE_RECORD {
+
+    ULONG ProcessId;
+
+    //  Access the create asked for, generic rights mapped.
+    ACCESS_MASK DesiredAccess;
+
+    //  Create options, with the disposition in the high 8 bits, as in
+    //  the create parameters of the callback data.
+    ULONG Options;
+
+    //  Characters taken from the path of the previous record, and
+    //  characters stored after this header.
+    USHORT PrefixLength;
+    USHORT SuffixLength;
+
+} DCTRACE_RECORD, *PDCTRACE_RECORD;
+
+//  A create as the writer takes it and the reader returns it.
+
+typedef struct _DCTRACE_CREATE {
+    ULONG ProcessId;
+    ACCESS_MASK DesiredAccess;
+    ULONG Options;
+    UNICODE_STRING Path;
+} DCTRACE_CREATE, *PDCTRACE_CREATE;
+
+typedef const DCTRACE_CREATE *PCDCTRACE_CREATE;
+
+//  Both ends keep the path of the last record to share prefixes with.
+
+typedef struct _DCTRACE_WRITER {
+    PUCHAR Buffer;
+    ULONG Capacity;
+    ULONG Length;
+    ULONG Count;
+    USHORT PathLength;
+    WCHAR Path[DCTRACE_MAX_PATH];
+} DCTRACE_WRITER, *PDCTRACE_WRITER;
+
+typedef struct _DCTRACE_READER {
+    const UCHAR *Buffer;
+    ULONG Length;
+    ULONG Offset;
+    USHORT PathLength;
+    WCHAR Path[DCTRACE_MAX_PATH];
+} DCTRACE_READER, *PDCTRACE_READER;
+
+#define DCTRACE_ALIGN(Length) \
+    (((Length) + DCTRACE_ALIGNMENT - 1) & ~(ULONG)(DCTRACE_ALIGNMENT - 1))
+
+#define DCTRACE_RECORD_SIZE(SuffixLength) \
+    DCTRACE_ALIGN( (ULONG)sizeof(DCTRACE_RECORD) + (ULONG)(SuffixLength) * (ULONG)sizeof(WCHAR) )
+
+
+DC_INLINE BOOLEAN
+DcTraceBeginWrite (
+    _Out_ PDCTRACE_WRITER Writer,
+    _Out_writes_bytes_(Capacity) PVOID Buffer,
+    _In_ ULONG Capacity
+    )
+/*++
+Routine Description:
+    Starts a trace with its header in Buffer, which must be aligned to
+    DCTRACE_ALIGNMENT.
+Return Value:
+    FALSE if Buffer cannot even hold the header.
+--*/
+{
+    PDCTRACE_HEADER header = (PDCTRACE_HEADER)Buffer;
+
+    Writer->Buffer = (PUCHAR)Buffer;
+    Writer->Capacity = Capacity & ~(ULONG)(DCTRACE_ALIGNMENT - 1);
+    Writer->Length = 0;
+    Writer->Count = 0;
+    Writer->PathLength = 0;
+
+    if (Writer->Capacity < sizeof(DCTRACE_HEADER)) {
+        return FALSE;
+    }
+
+    header->Magic = DCTRACE_MAGIC;
+    header->Version = DCTRACE_VERSION;
+    header->HeaderSize = (USHORT)sizeof(DCTRACE_HEADER);
+    header->Flags = 0;
+    header->Reserved = 0;
+    Writer->Length = (ULONG)sizeof(DCTRACE_HEADER);
+
+    return TRUE;
+}
+
+DC_INLINE BOOLEAN
+DcTraceAppend (
+    _Inout_ PDCTRACE_WRITER Writer,
+    _In_ PCDCTRACE_CREATE Create
+    )
+/*++
+Routine Description:
+    Appends a create to the trace.
+Return Value:
+    FALSE if the buffer has no room left for it; DcTraceFlush makes room.
+--*/
+{
+    PDCTRACE_RECORD record;
+    USHORT length = Create->Path.Length / sizeof(WCHAR);
+    USHORT prefix = 0;
+    ULONG size;
+
+    while (prefix < length && prefix < Writer->PathLength &&
+           Create->Path.Buffer[prefix] == Writer->Path[prefix]) {
+        prefix++;
+    }
+
+    size = DCTRACE_RECORD_SIZE( length - prefix );
+    if (size > Writer->Capacity - Writer->Length) {
+        return FALSE;
+    }
+
+    record = (PDCTRACE_RECORD)(Writer->Buffer + Writer->Length);
+    record->ProcessId = Create->ProcessId;
+    record->DesiredAccess = Create->DesiredAccess;
+    record->Options = Create->Options;
+    record->PrefixLength = prefix;
+    record->SuffixLength = (USHORT)(length - prefix);
+
+    RtlCopyMemory( record + 1, Create->Path.Buffer + prefix, (length - prefix) * sizeof(WCHAR) );
+    RtlZeroMemory( (PUCHAR)(record + 1) + (length - prefix) * sizeof(WCHAR),
+                   size - sizeof(DCTRACE_RECORD) - (length - prefix) * sizeof(WCHAR) );
+
+    RtlCopyMemory( Writer->Path + prefix, Create->Path.Buffer + prefix, (length - prefix) * sizeof(WCHAR) );
+    Writer->PathLength = length;
+
+    Writer->Length += size;
+    Writer->Count++;
+
+    return TRUE;
+}
+
+DC_INLINE ULONG
+DcTraceFlush (
+    _Inout_ PDCTRACE_WRITER Writer
+    )
+/*++
+Routine Description:
+    Empties the buffer once the caller has taken what it holds. Records
+    appended afterwards continue the same trace.
+Return Value:
+    Number of bytes the buffer held.
+--*/
+{
+    ULONG length = Writer->Length;
+
+    Writer->Length = 0;
+    return length;
+}
+
+DC_INLINE NTSTATUS
+DcTraceBeginRead (
+    _Out_ PDCTRACE_READER Reader,
+    _In_reads_bytes_(Length) const VOID *Buffer,
+    _In_ ULONG Length
+    )
+/*++
+Routine Description:
+    Checks the header of a whole trace held in Buffer, which must be
+    aligned to DCTRACE_ALIGNMENT.
+Return Value:
+    STATUS_SUCCESS, or STATUS_INVALID_PARAMETER if the header is malformed,
+    from another version or written on a host of the other byte order.
+--*/
+{
+    const DCTRACE_HEADER *header = (const DCTRACE_HEADER *)Buffer;
+
+    if (Length < sizeof(DCTRACE_HEADER) ||
+        header->Magic != DCTRACE_MAGIC ||
+        header->Version != DCTRACE_VERSION ||
+        header->HeaderSize < sizeof(DCTRACE_HEADER) ||
+        (header->HeaderSize & (DCTRACE_ALIGNMENT - 1)) != 0 ||
+        header->HeaderSize > Length) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Reader->Buffer = (const UCHAR *)Buffer;
+    Reader->Length = Length;
+    Reader->Offset = header->HeaderSize;
+    Reader->PathLength = 0;
+
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE NTSTATUS
+DcTraceRead (
+    _Inout_ PDCTRACE_READER Reader,
+    _Out_ PDCTRACE_CREATE Create
+    )
+/*++
+Routine Description:
+    Decodes the next record of the trace.
+Arguments:
+    Reader - The reader.
+    Create - Receives the create; its path points into Reader and stays
+        valid until the next record is read.
+Return Value:
+    STATUS_SUCCESS, STATUS_NO_MORE_ENTRIES after the last record, or
+    STATUS_INVALID_PARAMETER if the trace is malformed.
+--*/
+{
+    const DCTRACE_RECORD *record;
+    ULONG remaining = Reader->Length - Reader->Offset;
+    ULONG length;
+
+    if (remaining == 0) {
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    record = (const DCTRACE_RECORD *)(Reader->Buffer + Reader->Offset);
+    if (remaining < sizeof(DCTRACE_RECORD) ||
+        DCTRACE_RECORD_SIZE( record->SuffixLength ) > remaining ||
+        record->PrefixLength > Reader->PathLength ||
+        (ULONG)record->PrefixLength + record->SuffixLength > DCTRACE_MAX_PATH) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    length = (ULONG)record->PrefixLength + record->SuffixLength;
+    RtlCopyMemory( Reader->Path + record->PrefixLength, record + 1, record->SuffixLength * sizeof(WCHAR) );
+    Reader->PathLength = (USHORT)length;
+    Reader->Offset += DCTRACE_RECORD_SIZE( record->SuffixLength );
+
+    Create->ProcessId = record->ProcessId;
+    Create->DesiredAccess = record->DesiredAccess;
+    Create->Options = record->Options;
+    Create->Path.Buffer = Reader->Path;
+    Create->Path.Length = (USHORT)(length * sizeof(WCHAR));
+    Create->Path.MaximumLength = Create->Path.Length;
+
+    return STATUS_SUCCESS;
+}
+
+#endif //  __DCTRACE_H__
@@ -0,0 +1,135 @@
+/*++
+Copyright (c)
+Module Name:
+    dctrie.h
+Abstract:
+    Compressed radix trie over path components used to match file names
+    against the set of protected roots.
+
+    The trie is built once per policy and stored as a single flat image
+    (header, node array, label pool) so it can be shared read-only by
+    every create without further allocation. Each node carries a label of
+    one or more path components; the children of a node are stored next
+    to each other, sorted by their first component, so a lookup costs one
+    binary search per branching point and is linear in the path length
+    regardless of how many roots are loaded.
+
+    Components are compared without regard to case, as the file systems
+    the filter attaches to do by default. Labels are stored upcased.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCTRIE_H__
+#define __DCTRIE_H__
+
+#include "dcport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DCTRIE_NO_ROOT      ((ULONG)-1)
+
+typedef struct _DCTRIE_ROOT {
+
+    //  Full path of the protected directory, e.g.
+    //  \Device\HarddiskVolume3\Data. Leading and trailing separators
+    //  are ignored.
+    UNICODE_STRING Path;
+
+    //  Caller defined identifier returned by DcTrieMatch.
+    ULONG RootId;
+
+} DCTRIE_ROOT, *PDCTRIE_ROOT;
+
+typedef struct _DCTRIE_NODE {
+
+    //  Components covered by this node, separated by '\', stored in the
+    //  label pool. The root node has an empty label.
+    ULONG LabelOffset;
+    USHORT LabelLength;
+
+    //  Length of the first component of the label, used to order and
+    //  search siblings without rescanning the label.
+    USHORT FirstComponentLength;
+
+    //  Children occupy Nodes[FirstChild .. FirstChild + ChildCount).
+    ULONG FirstChild;
+    ULONG ChildCount;
+
+    //  Root that ends at this node or DCTRIE_NO_ROOT.
+    ULONG RootId;
+
+} DCTRIE_NODE, *PDCTRIE_NODE;
+
+typedef struct _DCTRIE {
+
+    //  Size in bytes of the whole image including this header.
+    ULONG Size;
+
+    ULONG NodeCount;
+    ULONG RootCount;
+
+    //  Label pool length in WCHARs.
+    ULONG LabelPoolLength;
+
+    //  Byte offsets from the start of the image.
+    ULONG NodesOffset;
+    ULONG LabelPoolOffset;
+
+    //  Number of components of the longest root.
+    ULONG MaxDepth;
+
+} DCTRIE, *PDCTRIE;
+
+NTSTATUS
+DcTrieBuild (
+    _In_reads_(RootCount) const DCTRIE_ROOT *Roots,
+    _In_ ULONG RootCount,
+    _Outptr_ PDCTRIE *Trie
+    );
+
+VOID
+DcTrieFree (
+    _In_ PDCTRIE Trie
+    );
+
+NTSTATUS
+DcTrieValidate (
+    _In_ const DCTRIE *Trie,
+    _In_ ULONG Size,
+    _In_ ULONG RootIdLimit
+    );
+
+NTSTATUS
+DcTrieGetRoots (
+    _In_ const DCTRIE *Trie,
+    _Outptr_ PDCTRIE_ROOT *Roots,
+    _Out_ PULONG RootCount
+    );
+
+ULONG
+DcTrieMatch (
+    _In_ const DCTRIE *Trie,
+    _In_ PCUNICODE_STRING FileName
+    );
+
+BOOLEAN
+DcTrieHasRootBelow (
+    _In_ const DCTRIE *Trie,
+    _In_ PCUNICODE_STRING Prefix
+    );
+
+ULONG
+DcTrieMatchOpenedName (
+    _In_ const DCTRIE *Trie,
+    _In_ PCUNICODE_STRING FileName,
+    _Out_ PBOOLEAN Ambiguous
+    );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //  __DCTRIE_H__
@@ -15,6 +15,8 @@ Environment:
 #ifndef __DCUK_H__
 #define __DCUK_H__
 
+#include "dchist.h"
+
 //
 //  Name of port used to communicate
 //
@@ -22,22 +24,364 @@ Environment:
 const WCHAR DCAPPPortName[] = L"\\DirCtlPort";
 
 
-#define DCAPP_BUFFER_SIZE   256*2
+//
+//  Denial events are sent to DCApp in batches, as DCWIRE records, see
+//  dcwire.h. The filter does not wait for a reply.
+//
+
+#define DCAPP_MAX_MESSAGE_SIZE      (64 * 1024)
+
+//  Values of DCAPP_EVENT_MESSAGE.Type. A doorbell carries no batch; it
+//  tells DCApp that new records are in the event ring.
+#define DCAPP_MESSAGE_EVENTS        0
+#define DCAPP_MESSAGE_DOORBELL      1
+
+typedef struct _DCAPP_EVENT_MESSAGE {
+
+    ULONG Type;
+    ULONG Reserved;
+
+    //  DCWIRE_BATCH followed by its records, 8 byte aligned.
+    ULONG64 Batch[(DCAPP_MAX_MESSAGE_SIZE - 2 * sizeof(ULONG)) / sizeof(ULONG64)];
+} DCAPP_EVENT_MESSAGE, *PDCAPP_EVENT_MESSAGE;
+
+//
+//  Once DCApp has attached an event ring, see dcring.h, denials are
+//  written into it instead, one DCWIRE record per DCAPP_RECORD_EVENT
+//  ring record.
+//
+
+#define DCAPP_RECORD_EVENT      1
+
+//
+//  A name in a packed list, such as the extensions of DCAPP_EXTENSIONS,
+//  each entry padded to a ULONG boundary. The DCAPP_ROOT_* flags below
+//  are those of DCAPP_UPDATE_ADD_ROOT records; entries have none.
+//
+
+typedef struct _DCAPP_ROOT {
+
+    //  Length of Path in bytes, not counting any terminator.
+    USHORT Length;
+    USHORT Flags;
+    WCHAR Path[ANYSIZE_ARRAY];
+} DCAPP_ROOT, *PDCAPP_ROOT;
+
+//  The root is another spelling, e.g. with short component names, of
+//  the closest preceding root added without this flag.
+#define DCAPP_ROOT_ALIAS        0x0001
+
+//  The mode of the root, DCMODE_PROTECT_* flags of dcmode.h, is kept in
+//  the high byte of Flags. A root without any is read-only.
+#define DCAPP_ROOT_MODE_SHIFT   8
+#define DCAPP_ROOT_MODE_MASK    0xFF00
+
+#define DCAPP_ROOT_SIZE(PathLength) \
+    ((ULONG)((FIELD_OFFSET(DCAPP_ROOT, Path) + (PathLength) + 3) & ~3))
+
+//
+//  Upper bound on a single control message, large enough for tens of
+//  thousands of roots.
+//
 
-typedef struct _DCAPP_NOTIFICATION {
+#define DCAPP_MAX_INPUT_SIZE    (16 * 1024 * 1024)
 
-    UCHAR FilePath[DCAPP_BUFFER_SIZE];
-    UCHAR ProcessName[DCAPP_BUFFER_SIZE];
-    ULONG ProcessID;
-} DCAPP_NOTIFICATION, *PDCAPP_NOTIFICATION;
+//
+//  Values of DCAPP_INPUT.ONOFF.
+//
+
+#define DCAPP_PROTECTION_OFF        0
+#define DCAPP_QUERY_STATISTICS      2
+#define DCAPP_ATTACH_RING           3
+#define DCAPP_QUERY_POLICY_IMAGE    5
+#define DCAPP_UPDATE_POLICY         6
+#define DCAPP_QUERY_COUNTERS        7
+#define DCAPP_QUERY_LATENCY         8
+
+//
+//  Messages that carry nothing but their value, turning protection off
+//  and the queries.
+//
 
 typedef struct _DCAPP_INPUT {
 
     ULONG ONOFF;
-    ULONG FileSize;
-    UCHAR DirPath[DCAPP_BUFFER_SIZE];
 } DCAPP_INPUT, *PDCAPP_INPUT;
 
+//
+//  Extension rule, the value of a DCAPP_UPDATE_SET_EXTENSIONS record. The
+//  filter keeps the rule of the service key in this form as well. The
+//  extensions, without the dot, are packed as DCAPP_ROOT entries with no
+//  flags set.
+//
+
+typedef struct _DCAPP_EXTENSIONS {
+
+    //  DCEXT_RULE_* value of dcext.h.
+    ULONG Rule;
+    ULONG ExtensionCount;
+
+    //  Size in bytes of the DCAPP_ROOT entries in Extensions.
+    ULONG ExtensionsLength;
+    UCHAR Extensions[ANYSIZE_ARRAY];
+} DCAPP_EXTENSIONS, *PDCAPP_EXTENSIONS;
+
+//
+//  Sent instead of DCAPP_INPUT to share an event ring with the filter.
+//  The filter maps the whole section, which must be between the two
+//  sizes below, and formats it.
+//
+
+#define DCAPP_MIN_RING_SIZE     (64 * 1024)
+#define DCAPP_MAX_RING_SIZE     (16 * 1024 * 1024)
+
+typedef struct _DCAPP_RING_INPUT {
+
+    //  DCAPP_ATTACH_RING.
+    ULONG ONOFF;
+    ULONG Reserved;
+
+    //  DCApp's handle to a pagefile backed section with read/write access.
+    ULONG64 Section;
+} DCAPP_RING_INPUT, *PDCAPP_RING_INPUT;
+
+//
+//  Sent instead of DCAPP_INPUT to change the roots, their modes, the
+//  extension rule and the trusted process allowlist in one transaction.
+//  The message is a list of records applied in order to the policy in
+//  effect: roots and trusted images can be added and removed one by
+//  one, or cleared and listed again to replace them all. Every record is
+//  checked before anything is changed, and the resulting policy replaces
+//  the previous one at once, so protection is never off in between; a
+//  message that is rejected changes nothing.
+//
+//  Every change made through the port advances the policy generation.
+//  A message made against a given generation, e.g. one returned by an
+//  earlier update, is rejected with STATUS_REVISION_MISMATCH if another
+//  change came first.
+//
+
+#define DCAPP_UPDATE_VERSION        1
+
+#define DCAPP_ANY_GENERATION        ((ULONG64)-1)
+
+//  Values of DCAPP_UPDATE_RECORD.Type.
+#define DCAPP_UPDATE_CLEAR_ROOTS    1   //  No value.
+#define DCAPP_UPDATE_ADD_ROOT       2   //  Path; Flags as DCAPP_ROOT.Flags.
+#define DCAPP_UPDATE_REMOVE_ROOT    3   //  Path, removed with its aliases.
+#define DCAPP_UPDATE_SET_MODE       4   //  Path; the mode in Flags.
+#define DCAPP_UPDATE_CLEAR_TRUSTED  5   //  No value.
+#define DCAPP_UPDATE_ADD_TRUSTED    6   //  Image path in device form.
+#define DCAPP_UPDATE_REMOVE_TRUSTED 7   //  Image path in device form.
+#define DCAPP_UPDATE_SET_EXTENSIONS 8   //  DCAPP_EXTENSIONS.
+
+typedef struct _DCAPP_UPDATE_RECORD {
+
+    USHORT Type;
+    USHORT Flags;
+
+    //  Size of Value in bytes. Records are padded to a ULONG boundary.
+    ULONG Length;
+    UCHAR Value[ANYSIZE_ARRAY];
+} DCAPP_UPDATE_RECORD, *PDCAPP_UPDATE_RECORD;
+
+#define DCAPP_UPDATE_RECORD_SIZE(ValueLength) \
+    ((ULONG)((FIELD_OFFSET(DCAPP_UPDATE_RECORD, Value) + (ULONG64)(ValueLength) + 3) & ~3))
+
+typedef struct _DCAPP_UPDATE_INPUT {
+
+    //  DCAPP_UPDATE_POLICY.
+    ULONG ONOFF;
+    USHORT Version;
+    USHORT Reserved;
+
+    //  Generation the records were made against, or DCAPP_ANY_GENERATION.
+    ULONG64 Generation;
+
+    ULONG RecordCount;
+
+    //  Size in bytes of the records in Records.
+    ULONG RecordsLength;
+    UCHAR Records[ANYSIZE_ARRAY];
+} DCAPP_UPDATE_INPUT, *PDCAPP_UPDATE_INPUT;
+
+//  Returned for DCAPP_UPDATE_POLICY, also when the message is rejected.
+
+#define DCAPP_NO_RECORD             ((ULONG)-1)
+
+typedef struct _DCAPP_UPDATE_OUTPUT {
+
+    //  Generation of the policy in effect after the message.
+    ULONG64 Generation;
+
+    //  Protected paths, aliases included, and trusted images in effect.
+    ULONG RootCount;
+    ULONG TrustedCount;
+
+    //  Index of the record the message was rejected for, or
+    //  DCAPP_NO_RECORD.
+    ULONG Record;
+    ULONG Reserved;
+} DCAPP_UPDATE_OUTPUT, *PDCAPP_UPDATE_OUTPUT;
+
+//
+//  DCAPP_QUERY_POLICY_IMAGE returns the active policy as a policy image,
+//  see dcimage.h, which DCApp stores in the PolicyImage value of the
+//  service key for the filter to enforce from the next boot on.
+//
+
+#define DCAPP_POLICY_IMAGE_VALUE    L"PolicyImage"
+
+//
+//  Returned for DCAPP_QUERY_STATISTICS.
+//
+
+typedef struct _DCAPP_POOL_STATISTICS {
+
+    //  Objects handed out and returned.
+    ULONG64 Allocations;
+    ULONG64 Frees;
+
+    //  Objects the pool had to get from and give back to the general
+    //  pool, and objects it holds for reuse.
+    ULONG64 PoolAllocations;
+    ULONG64 PoolFrees;
+    ULONG64 Depth;
+} DCAPP_POOL_STATISTICS, *PDCAPP_POOL_STATISTICS;
+
+typedef struct _DCAPP_STATISTICS {
+
+    //  Creates answered by the negative lookup cache without a name
+    //  query, and cacheable creates that missed it.
+    ULONG64 NegativeCacheHits;
+    ULONG64 NegativeCacheMisses;
+
+    //  Creates decided on the opened name, on a normalized name found in
+    //  the name cache and on a freshly normalized name.
+    ULONG64 OpenedNames;
+    ULONG64 CachedNames;
+    ULONG64 NormalizedNames;
+
+    //  Denial events sent to DCApp, dropped because the event queue was
+    //  full, and lost because DCApp did not take them in time.
+    ULONG64 EventsSent;
+    ULONG64 EventsDropped;
+    ULONG64 EventsLost;
+
+    //  Denials counted against an earlier one instead of being reported,
+    //  and repeat records reported for them.
+    ULONG64 EventsSuppressed;
+    ULONG64 EventRepeats;
+
+    //  Running processes currently trusted.
+    ULONG64 TrustedProcesses;
+
+    //  Generation of the policy in effect, see DCAPP_UPDATE_INPUT.
+    ULONG64 PolicyGeneration;
+
+    //  Pool of the contexts passed from pre to post create.
+    DCAPP_POOL_STATISTICS CreateContextPool;
+} DCAPP_STATISTICS, *PDCAPP_STATISTICS;
+
+//
+//  Returned for DCAPP_QUERY_COUNTERS. The filter keeps these counters per
+//  processor and sums them up for the query, so consecutive snapshots
+//  give rates. Each counter only ever grows.
+//
+
+//  Callbacks entered.
+#define DCAPP_COUNTER_PRE_CREATE                0
+#define DCAPP_COUNTER_POST_CREATE               1
+#define DCAPP_COUNTER_PRE_WRITE                 2
+#define DCAPP_COUNTER_PRE_SET_INFORMATION       3
+#define DCAPP_COUNTER_PRE_FS_CONTROL            4
+
+//  File name queries issued to the filter manager and those that failed,
+//  and the name each create was decided on, see DCAPP_STATISTICS.
+#define DCAPP_COUNTER_NAME_QUERIES              5
+#define DCAPP_COUNTER_NAME_QUERY_FAILURES       6
+#define DCAPP_COUNTER_OPENED_NAMES              7
+#define DCAPP_COUNTER_CACHED_NAMES              8
+#define DCAPP_COUNTER_NORMALIZED_NAMES          9
+
+//  Names matched against the protected roots, and those below one.
+#define DCAPP_COUNTER_PATH_LOOKUPS              10
+#define DCAPP_COUNTER_PATH_MATCHES              11
+
+//  Operations denied: creates the mode of the root denies, opens undone
+//  because the file system granted more than the mode allows, writes,
+//  set information and file system controls through protected handles
+//  along with renames and deletes of directories that hold a root, and
+//  renames and hard links into a protected root.
+#define DCAPP_COUNTER_DENIED_CREATES            12
+#define DCAPP_COUNTER_DENIED_OPENS              13
+#define DCAPP_COUNTER_DENIED_WRITES             14
+#define DCAPP_COUNTER_DENIED_SET_INFORMATION    15
+#define DCAPP_COUNTER_DENIED_FS_CONTROLS        16
+#define DCAPP_COUNTER_DENIED_DESTINATIONS       17
+
+//  Event records queued for DCApp, dropped because the queue was full,
+//  sent to DCApp, lost on the way, and the bytes of the records sent.
+#define DCAPP_COUNTER_EVENTS_QUEUED             18
+#define DCAPP_COUNTER_EVENTS_DROPPED            19
+#define DCAPP_COUNTER_EVENTS_SENT               20
+#define DCAPP_COUNTER_EVENTS_LOST               21
+#define DCAPP_COUNTER_EVENT_BYTES_SENT          22
+
+//  Create contexts taken from and returned to their pool, see
+//  DCAPP_STATISTICS.CreateContextPool.
+#define DCAPP_COUNTER_CONTEXT_ALLOCATIONS       23
+#define DCAPP_COUNTER_CONTEXT_FREES             24
+
+#define DCAPP_COUNTER_COUNT                     25
+
+typedef struct _DCAPP_COUNTERS {
+
+    //  DCAPP_COUNTER_COUNT of the filter; a DCApp built with more only
+    //  looks at the first CounterCount.
+    ULONG CounterCount;
+
+    //  Processors the counters were summed over.
+    ULONG ProcessorCount;
+
+    //  Interrupt time of the snapshot, in 100ns units.
+    ULONG64 Timestamp;
+
+    ULONG64 Counters[DCAPP_COUNTER_COUNT];
+} DCAPP_COUNTERS, *PDCAPP_COUNTERS;
+
+//
+//  Returned for DCAPP_QUERY_LATENCY: how long the create callbacks, the
+//  queuing of denial events and the stages of the create path took, as
+//  histograms of performance counter ticks, see dchist.h. Kept per
+//  processor like the counters and merged for the query.
+//
+
+//  Whole callbacks, and DirCtlSendFileInfo for every denial.
+#define DCAPP_LATENCY_PRE_CREATE            0
+#define DCAPP_LATENCY_POST_CREATE           1
+#define DCAPP_LATENCY_NOTIFY                2
+
+//  Stages of the create path: each file name query, and checking the
+//  name against the protected roots and the extension rule.
+#define DCAPP_LATENCY_NAME_QUERY            3
+#define DCAPP_LATENCY_PATH_MATCH            4
+
+#define DCAPP_LATENCY_COUNT                 5
+
+typedef struct _DCAPP_LATENCY {
+
+    //  DCAPP_LATENCY_COUNT and DCHIST_BUCKET_COUNT of the filter; DCApp
+    //  only uses a reply that matches its own.
+    ULONG HistogramCount;
+    ULONG BucketCount;
+
+    //  Ticks per second of the performance counter.
+    ULONG64 Frequency;
+
+    DCHIST Histograms[DCAPP_LATENCY_COUNT];
+} DCAPP_LATENCY, *PDCAPP_LATENCY;
+
 #endif //  __DCUK_H__
 
 
@@ -0,0 +1,416 @@
+/*++
+Copyright (c)
+Module Name:
+    dcwire.h
+Abstract:
+    Wire format of the events the filter sends to DCApp.
+
+    An event is a DCWIRE_RECORD followed by its names in UTF-16, without
+    terminators. Records are padded to a multiple of DCWIRE_ALIGNMENT.
+    HeaderSize tells where the names start, so that later versions can
+    add fields to the header that older readers skip.
+
+    Records are sent in batches: a DCWIRE_BATCH header followed by Count
+    records. Readers check every length against the buffer they were
+    given before they look at what it covers; decoded names point into
+    that buffer.
+Environment:
+    Kernel & user mode
+--*/
+
+#ifndef __DCWIRE_H__
+#define __DCWIRE_H__
+
+#include "dcport.h"
+
+#define DCWIRE_VERSION          1
+#define DCWIRE_ALIGNMENT        8
+
+//  Values of DCWIRE_RECORD.Type. A repeat record sums up the denials
+//  with the same process, path and operation that were suppressed after
+//  the denial it repeats; its Timestamp is that of the denial.
+#define DCWIRE_RECORD_DENIAL    1
+#define DCWIRE_RECORD_REPEAT    2
+
+//  Values of DCWIRE_RECORD.Flags.
+#define DCWIRE_FLAG_TRUNCATED   0x00000001      //  A name was cut short.
+
+typedef struct _DCWIRE_RECORD {
+
+    USHORT Type;
+
+    //  Offset of the names from the start of the record.
+    USHORT HeaderSize;
+
+    //  Size of the record in bytes including the header, names and
+    //  padding.
+    ULONG Length;
+
+    ULONG64 ProcessId;
+    ULONG64 ThreadId;
+
+    //  System time of the event, in 100ns units since 1601.
+    LONG64 Timestamp;
+
+    //  IRP major function of the denied operation and the access it
+    //  asked for or was granted.
+    ULONG Operation;
+    ULONG AccessMask;
+
+    ULONG Flags;
+
+    //  Lengths of the names in UTF-16 code units. The file path comes
+    //  first, the process image name follows it.
+    USHORT FilePathLength;
+    USHORT ProcessNameLength;
+
+    //  Occurrences after the first one that were suppressed, and the
+    //  system time of the last one. 0 and Timestamp unless the record
+    //  is a repeat.
+    ULONG RepeatCount;
+    ULONG Reserved;
+    LONG64 LastTimestamp;
+
+} DCWIRE_RECORD, *PDCWIRE_RECORD;
+
+typedef struct _DCWIRE_BATCH {
+
+    USHORT Version;
+
+    //  Offset of the first record from the start of the batch.
+    USHORT HeaderSize;
+
+    //  Size of the batch in bytes including this header.
+    ULONG Length;
+
+    ULONG Count;
+    ULONG Reserved;
+
+} DCWIRE_BATCH, *PDCWIRE_BATCH;
+
+//  An event as the encoder takes it and the decoder returns it.
+
+typedef struct _DCWIRE_EVENT {
+    ULONG Type;
+    ULONG Flags;
+    ULONG64 ProcessId;
+    ULONG64 ThreadId;
+    LONG64 Timestamp;
+    ULONG Operation;
+    ULONG AccessMask;
+    ULONG RepeatCount;
+    LONG64 LastTimestamp;
+    PCWSTR FilePath;
+    PCWSTR ProcessName;
+    USHORT FilePathLength;
+    USHORT ProcessNameLength;
+} DCWIRE_EVENT, *PDCWIRE_EVENT;
+
+typedef const DCWIRE_EVENT *PCDCWIRE_EVENT;
+
+typedef struct _DCWIRE_WRITER {
+    PUCHAR Buffer;
+    ULONG Capacity;
+    ULONG Length;
+    ULONG Count;
+} DCWIRE_WRITER, *PDCWIRE_WRITER;
+
+typedef struct _DCWIRE_READER {
+    const UCHAR *Buffer;
+    ULONG Length;
+    ULONG Offset;
+    ULONG Remaining;
+} DCWIRE_READER, *PDCWIRE_READER;
+
+#define DCWIRE_ALIGN(Length) \
+    (((Length) + DCWIRE_ALIGNMENT - 1) & ~(ULONG)(DCWIRE_ALIGNMENT - 1))
+
+#define DCWIRE_RECORD_SIZE(NameLength) \
+    DCWIRE_ALIGN( (ULONG)sizeof(DCWIRE_RECORD) + (ULONG)(NameLength) * (ULONG)sizeof(WCHAR) )
+
+
+DC_INLINE ULONG
+DcWireEncodeRecord (
+    _Out_writes_bytes_(Capacity) PVOID Buffer,
+    _In_ ULONG Capacity,
+    _In_ PCDCWIRE_EVENT Event
+    )
+/*++
+Routine Description:
+    Encodes an event as a single record. Names that do not fit are
+    truncated, the process name first, and the record is flagged with
+    DCWIRE_FLAG_TRUNCATED.
+Arguments:
+    Buffer - Receives the record, aligned to DCWIRE_ALIGNMENT.
+    Capacity - Size of Buffer in bytes.
+    Event - Event to encode.
+Return Value:
+    Size of the record in bytes, or 0 if not even the header fits.
+--*/
+{
+    PDCWIRE_RECORD record = (PDCWIRE_RECORD)Buffer;
+    ULONG available;
+    ULONG filePathLength = Event->FilePathLength;
+    ULONG processNameLength = Event->ProcessNameLength;
+    ULONG flags = Event->Flags;
+
+    Capacity &= ~(ULONG)(DCWIRE_ALIGNMENT - 1);
+    if (Capacity < sizeof(DCWIRE_RECORD)) {
+        return 0;
+    }
+
+    available = (Capacity - (ULONG)sizeof(DCWIRE_RECORD)) / sizeof(WCHAR);
+    if (filePathLength > available) {
+        filePathLength = available;
+        flags |= DCWIRE_FLAG_TRUNCATED;
+    }
+    available -= filePathLength;
+    if (processNameLength > available) {
+        processNameLength = available;
+        flags |= DCWIRE_FLAG_TRUNCATED;
+    }
+
+    record->Type = (USHORT)Event->Type;
+    record->HeaderSize = (USHORT)sizeof(DCWIRE_RECORD);
+    record->Length = DCWIRE_RECORD_SIZE( filePathLength + processNameLength );
+    record->ProcessId = Event->ProcessId;
+    record->ThreadId = Event->ThreadId;
+    record->Timestamp = Event->Timestamp;
+    record->Operation = Event->Operation;
+    record->AccessMask = Event->AccessMask;
+    record->Flags = flags;
+    record->FilePathLength = (USHORT)filePathLength;
+    record->ProcessNameLength = (USHORT)processNameLength;
+    record->RepeatCount = Event->RepeatCount;
+    record->Reserved = 0;
+    record->LastTimestamp = Event->LastTimestamp;
+
+    RtlCopyMemory( record + 1, Event->FilePath, filePathLength * sizeof(WCHAR) );
+    RtlCopyMemory( (PWCHAR)(record + 1) + filePathLength,
+                   Event->ProcessName,
+                   processNameLength * sizeof(WCHAR) );
+
+    //  Padding is zeroed so that no stale memory goes on the wire.
+    RtlZeroMemory( (PUCHAR)Buffer + sizeof(DCWIRE_RECORD) + (filePathLength + processNameLength) * sizeof(WCHAR),
+                   record->Length - sizeof(DCWIRE_RECORD) - (filePathLength + processNameLength) * sizeof(WCHAR) );
+
+    return record->Length;
+}
+
+DC_INLINE NTSTATUS
+DcWireDecodeRecord (
+    _In_reads_bytes_(Length) const VOID *Buffer,
+    _In_ ULONG Length,
+    _Out_ PDCWIRE_EVENT Event
+    )
+/*++
+Routine Description:
+    Decodes the record at the start of Buffer. Buffer must be aligned to
+    DCWIRE_ALIGNMENT.
+Arguments:
+    Buffer - The record.
+    Length - Bytes available at Buffer, at least the record's length.
+    Event - Receives the event; its names point into Buffer.
+Return Value:
+    STATUS_SUCCESS or STATUS_INVALID_PARAMETER if the record is malformed.
+--*/
+{
+    const DCWIRE_RECORD *record = (const DCWIRE_RECORD *)Buffer;
+    ULONG recordLength;
+    ULONG headerSize;
+    ULONG nameLength;
+
+    if (Length < sizeof(DCWIRE_RECORD)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    recordLength = record->Length;
+    headerSize = record->HeaderSize;
+    nameLength = ((ULONG)record->FilePathLength + record->ProcessNameLength) * sizeof(WCHAR);
+
+    if (recordLength > Length ||
+        (recordLength & (DCWIRE_ALIGNMENT - 1)) != 0 ||
+        headerSize < sizeof(DCWIRE_RECORD) ||
+        (headerSize & (sizeof(WCHAR) - 1)) != 0 ||
+        headerSize > recordLength ||
+        nameLength > recordLength - headerSize) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Event->Type = record->Type;
+    Event->Flags = record->Flags;
+    Event->ProcessId = record->ProcessId;
+    Event->ThreadId = record->ThreadId;
+    Event->Timestamp = record->Timestamp;
+    Event->Operation = record->Operation;
+    Event->AccessMask = record->AccessMask;
+    Event->FilePathLength = record->FilePathLength;
+    Event->ProcessNameLength = record->ProcessNameLength;
+    Event->RepeatCount = record->RepeatCount;
+    Event->LastTimestamp = record->LastTimestamp;
+    Event->FilePath = (PCWSTR)((const UCHAR *)Buffer + headerSize);
+    Event->ProcessName = Event->FilePath + Event->FilePathLength;
+
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE BOOLEAN
+DcWireBeginBatch (
+    _Out_ PDCWIRE_WRITER Writer,
+    _Out_writes_bytes_(Capacity) PVOID Buffer,
+    _In_ ULONG Capacity
+    )
+/*++
+Routine Description:
+    Starts a batch in Buffer, which must be aligned to DCWIRE_ALIGNMENT.
+Return Value:
+    FALSE if Buffer cannot even hold the batch header.
+--*/
+{
+    Writer->Buffer = (PUCHAR)Buffer;
+    Writer->Capacity = Capacity & ~(ULONG)(DCWIRE_ALIGNMENT - 1);
+    Writer->Length = (ULONG)sizeof(DCWIRE_BATCH);
+    Writer->Count = 0;
+
+    return (BOOLEAN)(Writer->Capacity >= sizeof(DCWIRE_BATCH));
+}
+
+DC_INLINE BOOLEAN
+DcWireAppendRecord (
+    _Inout_ PDCWIRE_WRITER Writer,
+    _In_ const DCWIRE_RECORD *Record
+    )
+/*++
+Routine Description:
+    Appends a record encoded with DcWireEncodeRecord to the batch.
+Return Value:
+    FALSE if the batch has no room left for it.
+--*/
+{
+    if (Record->Length > Writer->Capacity - Writer->Length) {
+        return FALSE;
+    }
+
+    RtlCopyMemory( Writer->Buffer + Writer->Length, Record, Record->Length );
+    Writer->Length += Record->Length;
+    Writer->Count++;
+
+    return TRUE;
+}
+
+DC_INLINE BOOLEAN
+DcWireAppendEvent (
+    _Inout_ PDCWIRE_WRITER Writer,
+    _In_ PCDCWIRE_EVENT Event
+    )
+/*++
+Routine Description:
+    Encodes an event at the end of the batch, without truncating it.
+Return Value:
+    FALSE if the batch has no room left for it.
+--*/
+{
+    ULONG length = DCWIRE_RECORD_SIZE( (ULONG)Event->FilePathLength + Event->ProcessNameLength );
+
+    if (length > Writer->Capacity - Writer->Length) {
+        return FALSE;
+    }
+
+    Writer->Length += DcWireEncodeRecord( Writer->Buffer + Writer->Length, length, Event );
+    Writer->Count++;
+
+    return TRUE;
+}
+
+DC_INLINE ULONG
+DcWireEndBatch (
+    _Inout_ PDCWIRE_WRITER Writer
+    )
+/*++
+Routine Description:
+    Fills in the batch header.
+Return Value:
+    Size of the batch in bytes.
+--*/
+{
+    PDCWIRE_BATCH batch = (PDCWIRE_BATCH)Writer->Buffer;
+
+    batch->Version = DCWIRE_VERSION;
+    batch->HeaderSize = (USHORT)sizeof(DCWIRE_BATCH);
+    batch->Length = Writer->Length;
+    batch->Count = Writer->Count;
+    batch->Reserved = 0;
+
+    return Writer->Length;
+}
+
+DC_INLINE NTSTATUS
+DcWireBeginRead (
+    _Out_ PDCWIRE_READER Reader,
+    _In_reads_bytes_(Length) const VOID *Buffer,
+    _In_ ULONG Length
+    )
+/*++
+Routine Description:
+    Checks the header of a batch received in Buffer, which must be
+    aligned to DCWIRE_ALIGNMENT.
+Return Value:
+    STATUS_SUCCESS, or STATUS_INVALID_PARAMETER if the header is malformed
+    or from another version.
+--*/
+{
+    const DCWIRE_BATCH *batch = (const DCWIRE_BATCH *)Buffer;
+
+    if (Length < sizeof(DCWIRE_BATCH) ||
+        batch->Version != DCWIRE_VERSION ||
+        batch->HeaderSize < sizeof(DCWIRE_BATCH) ||
+        (batch->HeaderSize & (DCWIRE_ALIGNMENT - 1)) != 0 ||
+        batch->Length > Length ||
+        batch->HeaderSize > batch->Length) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Reader->Buffer = (const UCHAR *)Buffer;
+    Reader->Length = batch->Length;
+    Reader->Offset = batch->HeaderSize;
+    Reader->Remaining = batch->Count;
+
+    return STATUS_SUCCESS;
+}
+
+DC_INLINE NTSTATUS
+DcWireReadEvent (
+    _Inout_ PDCWIRE_READER Reader,
+    _Out_ PDCWIRE_EVENT Event
+    )
+/*++
+Routine Description:
+    Decodes the next record of the batch.
+Return Value:
+    STATUS_SUCCESS, STATUS_NO_MORE_ENTRIES after the last record, or
+    STATUS_INVALID_PARAMETER if the batch is malformed.
+--*/
+{
+    NTSTATUS status;
+
+    if (Reader->Remaining == 0) {
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    status = DcWireDecodeRecord( Reader->Buffer + Reader->Offset,
+                                 Reader->Length - Reader->Offset,
+                                 Event );
+    if (!NT_SUCCESS( status )) {
+        Reader->Remaining = 0;
+        return status;
+    }
+
+    Reader->Offset += ((const DCWIRE_RECORD *)(Reader->Buffer + Reader->Offset))->Length;
+    Reader->Remaining--;
+
+    return STATUS_SUCCESS;
+}
+
+#endif //  __DCWIRE_H__
@@ -0,0 +1,604 @@
+/*++
+Copyright (c)
+Module Name:
+    dcext.c
+Abstract:
+    Checks the compiled extension sets of dcext.h against looking the
+    extension up in the list one entry after the other, and measures
+    both.
+
+    dcext verify
+        Builds sets of every size up to 64 and of sizes up to the
+        largest allowed, with duplicates in another case, then looks up
+        every listed extension in any case, the same with a character
+        changed, dropped or added, extensions longer than allowed and
+        random ones, under both rules. Also checks what DcExtBuildSet
+        and DcExtValidate refuse.
+    dcext bench [lookups]
+        Times DcExtIsProtected and the scan of the list on lists of 1 to
+        1024 extensions, half of the lookups finding one.
+
+    Builds on any host, e.g.
+
+        cc -O2 -Iinc tools/dcext.c -o dcext
+Environment:
+    User mode
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include "dcext.h"
+
+#define DCEXT_RANDOM_LOOKUPS            2000
+#define DCEXT_BENCH_LOOKUPS             4096
+#define DCEXT_DEFAULT_LOOKUPS           4000000
+#define DCEXT_MAX_QUERY                 (DCEXT_MAX_LENGTH + 4)
+
+typedef struct _DCEXT_LIST {
+    ULONG Count;
+    UNICODE_STRING Extensions[DCEXT_MAX_EXTENSIONS];
+    WCHAR Buffer[DCEXT_MAX_EXTENSIONS][DCEXT_MAX_LENGTH];
+} DCEXT_LIST, *PDCEXT_LIST;
+
+//  Mostly what extensions are made of, and a few characters whose case
+//  the case table has to fold.
+static const WCHAR g_Characters[] = {
+    'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's',
+    't', 'u', 'v', 'w', 'x', 'y', 'z', '0', '1', '2', '7', '_', '-', '~', ' ', '$', '{',
+    0x00E9, 0x00C9, 0x00DF, 0x03A3, 0x03C3, 0x03C2, 0x0434, 0x0414, 0x65E5,
+};
+
+#define DCEXT_CHARACTERS                (sizeof(g_Characters) / sizeof(g_Characters[0]))
+#define DCEXT_ASCII_LETTERS             26
+
+static ULONG64 g_Checks;
+static ULONG64 g_Failures;
+
+static ULONG64
+DcExtNow (
+    VOID
+    )
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter( &counter );
+    QueryPerformanceFrequency( &frequency );
+    return (ULONG64)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+#endif
+}
+
+static ULONG
+DcExtRandom (
+    _Inout_ PULONG64 State
+    )
+{
+    ULONG64 x = *State;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+    return (ULONG)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static BOOLEAN
+DcExtScan (
+    _In_ const DCEXT_LIST *List,
+    _In_ PCUNICODE_STRING Extension
+    )
+/*++
+Routine Description:
+    Looks Extension up in the list one entry after the other, comparing
+    them ignoring case as RtlEqualUnicodeString does. Entries are as
+    given, not upcased beforehand.
+--*/
+{
+    ULONG length = Extension->Length / sizeof(WCHAR);
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < List->Count; i++) {
+
+        if (List->Extensions[i].Length != Extension->Length) {
+            continue;
+        }
+
+        for (j = 0; j < length; j++) {
+            if (DcUpcaseChar( List->Extensions[i].Buffer[j] ) != DcUpcaseChar( Extension->Buffer[j] )) {
+                break;
+            }
+        }
+
+        if (j == length) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static ULONG
+DcExtMakeExtension (
+    _Inout_ PULONG64 State,
+    _In_ BOOLEAN AsciiOnly,
+    _Out_writes_(DCEXT_MAX_QUERY) PWSTR Buffer,
+    _In_ ULONG MaxLength
+    )
+/*++
+Routine Description:
+    Makes up an extension, mostly of two to four characters.
+--*/
+{
+    ULONG length = DcExtRandom( State ) % 8;
+    ULONG i;
+
+    length = (length < 6) ? 2 + length % 3 : 1 + DcExtRandom( State ) % MaxLength;
+    if (length > MaxLength) {
+        length = MaxLength;
+    }
+
+    for (i = 0; i < length; i++) {
+        Buffer[i] = AsciiOnly ? g_Characters[DcExtRandom( State ) % DCEXT_ASCII_LETTERS] :
+                                g_Characters[DcExtRandom( State ) % DCEXT_CHARACTERS];
+    }
+
+    return length;
+}
+
+static VOID
+DcExtSpell (
+    _Inout_ PULONG64 State,
+    _Inout_ PWSTR Buffer,
+    _In_ ULONG Length
+    )
+/*++
+Routine Description:
+    Changes the case of some characters.
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        switch (DcExtRandom( State ) % 3) {
+        case 0:
+            Buffer[i] = (WCHAR)towupper( (wint_t)Buffer[i] );
+            break;
+        case 1:
+            Buffer[i] = (WCHAR)towlower( (wint_t)Buffer[i] );
+            break;
+        }
+    }
+}
+
+static VOID
+DcExtMakeList (
+    _Inout_ PULONG64 State,
+    _In_ ULONG Count,
+    _In_ BOOLEAN AsciiOnly,
+    _Out_ PDCEXT_LIST List
+    )
+/*++
+Routine Description:
+    Makes up a list of Count extensions, one in eight of them the same
+    as one before but for case, unless AsciiOnly.
+--*/
+{
+    ULONG i;
+    ULONG length;
+
+    List->Count = Count;
+
+    for (i = 0; i < Count; i++) {
+
+        if (!AsciiOnly && i != 0 && DcExtRandom( State ) % 8 == 0) {
+            const UNICODE_STRING *other = &List->Extensions[DcExtRandom( State ) % i];
+            length = other->Length / sizeof(WCHAR);
+            memcpy( List->Buffer[i], other->Buffer, other->Length );
+        } else {
+            length = DcExtMakeExtension( State, AsciiOnly, List->Buffer[i], DCEXT_MAX_LENGTH );
+        }
+
+        DcExtSpell( State, List->Buffer[i], length );
+        List->Extensions[i].Buffer = List->Buffer[i];
+        List->Extensions[i].Length = (USHORT)(length * sizeof(WCHAR));
+        List->Extensions[i].MaximumLength = (USHORT)sizeof(List->Buffer[i]);
+    }
+}
+
+static ULONG
+DcExtCountDistinct (
+    _In_ const DCEXT_LIST *List
+    )
+{
+    DCEXT_LIST before;
+    ULONG distinct = 0;
+    ULONG i;
+
+    before.Count = 0;
+    for (i = 0; i < List->Count; i++) {
+        if (!DcExtScan( &before, &List->Extensions[i] )) {
+            distinct++;
+        }
+        before.Extensions[before.Count++] = List->Extensions[i];
+    }
+
+    return distinct;
+}
+
+static VOID
+DcExtCheckLookup (
+    _In_ const DCEXT_LIST *List,
+    _In_ PCDCEXT_SET Only,
+    _In_ PCDCEXT_SET Except,
+    _In_ PCUNICODE_STRING Extension
+    )
+{
+    BOOLEAN listed = DcExtScan( List, Extension );
+    BOOLEAN empty = (BOOLEAN)(Extension->Length == 0);
+
+    g_Checks++;
+
+    //  A name without an extension is protected whatever the rule.
+    if (DcExtIsListed( Only, Extension ) != listed ||
+        DcExtIsListed( Except, Extension ) != listed ||
+        DcExtIsProtected( Only, Extension ) != (empty || listed) ||
+        DcExtIsProtected( Except, Extension ) != (empty || !listed) ||
+        !DcExtIsProtected( NULL, Extension )) {
+
+        if (g_Failures++ < 10) {
+            ULONG i;
+
+            printf( "%u extensions: %s by the scan, %s by the set:", List->Count,
+                    listed ? "listed" : "not listed", DcExtIsListed( Only, Extension ) ? "listed" : "not listed" );
+            for (i = 0; i < Extension->Length / sizeof(WCHAR); i++) {
+                printf( " %04X", Extension->Buffer[i] );
+            }
+            printf( "\n" );
+        }
+    }
+}
+
+static VOID
+DcExtCheckSet (
+    _Inout_ PULONG64 State,
+    _In_ ULONG Count
+    )
+/*++
+Routine Description:
+    Builds both rules on a list of Count extensions and looks up names
+    around every one of them and random ones.
+--*/
+{
+    static DCEXT_LIST list;
+    WCHAR buffer[DCEXT_MAX_QUERY];
+    UNICODE_STRING extension;
+    PDCEXT_SET only;
+    PDCEXT_SET except;
+    ULONG64 seed = ((ULONG64)DcExtRandom( State ) << 32) | DcExtRandom( State );
+    ULONG length;
+    ULONG position;
+    ULONG i;
+    NTSTATUS status;
+
+    DcExtMakeList( State, Count, FALSE, &list );
+
+    status = DcExtBuildSet( DCEXT_RULE_ONLY, list.Extensions, Count, seed, &only );
+    if (NT_SUCCESS( status )) {
+        status = DcExtBuildSet( DCEXT_RULE_EXCEPT, list.Extensions, Count, seed, &except );
+        if (!NT_SUCCESS( status )) {
+            DcExtFree( only );
+        }
+    }
+
+    g_Checks++;
+    if (!NT_SUCCESS( status )) {
+        printf( "DcExtBuildSet: 0x%08X for %u extensions\n", (unsigned)status, Count );
+        g_Failures++;
+        return;
+    }
+
+    g_Checks++;
+    if (only->Count != DcExtCountDistinct( &list ) ||
+        !NT_SUCCESS( DcExtValidate( only, only->Size ) ) ||
+        NT_SUCCESS( DcExtValidate( only, only->Size - 1 ) )) {
+        printf( "DcExtBuildSet: %u keys for %u distinct extensions, or not valid\n",
+                only->Count, DcExtCountDistinct( &list ) );
+        g_Failures++;
+    }
+
+    extension.Buffer = buffer;
+    extension.MaximumLength = (USHORT)sizeof(buffer);
+
+    for (i = 0; i < Count; i++) {
+
+        length = list.Extensions[i].Length / sizeof(WCHAR);
+        position = DcExtRandom( State ) % length;
+
+        //  In another case.
+        memcpy( buffer, list.Extensions[i].Buffer, length * sizeof(WCHAR) );
+        DcExtSpell( State, buffer, length );
+        extension.Length = (USHORT)(length * sizeof(WCHAR));
+        DcExtCheckLookup( &list, only, except, &extension );
+
+        //  A character changed.
+        buffer[position] = g_Characters[DcExtRandom( State ) % DCEXT_CHARACTERS];
+        DcExtCheckLookup( &list, only, except, &extension );
+
+        //  A character dropped.
+        memcpy( buffer, list.Extensions[i].Buffer, length * sizeof(WCHAR) );
+        memmove( buffer + position, buffer + position + 1, (length - position - 1) * sizeof(WCHAR) );
+        extension.Length = (USHORT)((length - 1) * sizeof(WCHAR));
+        DcExtCheckLookup( &list, only, except, &extension );
+
+        //  A character added, and up to four more past the longest.
+        memcpy( buffer, list.Extensions[i].Buffer, length * sizeof(WCHAR) );
+        buffer[length] = L'x';
+        extension.Length = (USHORT)((length + 1) * sizeof(WCHAR));
+        DcExtCheckLookup( &list, only, except, &extension );
+
+        if (length == DCEXT_MAX_LENGTH) {
+            buffer[length + 1] = L'y';
+            buffer[length + 2] = L'z';
+            extension.Length = (USHORT)((length + 3) * sizeof(WCHAR));
+            DcExtCheckLookup( &list, only, except, &extension );
+        }
+    }
+
+    for (i = 0; i < DCEXT_RANDOM_LOOKUPS; i++) {
+        extension.Length = (USHORT)(DcExtMakeExtension( State, FALSE, buffer, DCEXT_MAX_QUERY ) * sizeof(WCHAR));
+        DcExtCheckLookup( &list, only, except, &extension );
+    }
+
+    //  No extension: protected under any rule.
+    extension.Length = 0;
+    g_Checks++;
+    if (DcExtIsListed( only, &extension ) || !DcExtIsProtected( only, &extension ) ||
+        !DcExtIsProtected( except, &extension )) {
+        printf( "DcExtIsProtected: a name without an extension is not protected\n" );
+        g_Failures++;
+    }
+
+    DcExtFree( only );
+    DcExtFree( except );
+}
+
+static VOID
+DcExtCheckRefused (
+    _Inout_ PULONG64 State
+    )
+/*++
+Routine Description:
+    Checks that extensions that cannot be told apart from the rest of a
+    name, and sets that do not hold together, are refused.
+--*/
+{
+    static DCEXT_LIST list;
+    static const WCHAR bad[] = { L'.', L'\\', L':', 0 };
+    WCHAR tooLong[DCEXT_MAX_LENGTH + 1];
+    PDCEXT_SET set;
+    ULONG i;
+    ULONG length;
+
+    DcExtMakeList( State, 8, TRUE, &list );
+
+    g_Checks++;
+    if (!NT_SUCCESS( DcExtBuildSet( DCEXT_RULE_ALL, list.Extensions, 8, 1, &set ) ) || set != NULL ||
+        DcExtBuildSet( 3, list.Extensions, 8, 1, &set ) != STATUS_INVALID_PARAMETER ||
+        DcExtBuildSet( DCEXT_RULE_ONLY, list.Extensions, DCEXT_MAX_EXTENSIONS + 1, 1, &set ) !=
+            STATUS_INVALID_PARAMETER) {
+        printf( "DcExtBuildSet: wrong answer for a rule or a count\n" );
+        g_Failures++;
+    }
+
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+
+        length = list.Extensions[3].Length / sizeof(WCHAR);
+        list.Buffer[3][DcExtRandom( State ) % length] = bad[i];
+
+        g_Checks++;
+        if (DcExtBuildSet( DCEXT_RULE_ONLY, list.Extensions, 8, 1, &set ) != STATUS_OBJECT_NAME_INVALID) {
+            printf( "DcExtBuildSet: takes an extension with 0x%04X\n", bad[i] );
+            g_Failures++;
+        }
+        DcExtMakeList( State, 8, TRUE, &list );
+    }
+
+    list.Extensions[5].Length = 0;
+    g_Checks++;
+    if (DcExtBuildSet( DCEXT_RULE_EXCEPT, list.Extensions, 8, 1, &set ) != STATUS_OBJECT_NAME_INVALID) {
+        printf( "DcExtBuildSet: takes an empty extension\n" );
+        g_Failures++;
+    }
+
+    for (i = 0; i < DCEXT_MAX_LENGTH + 1; i++) {
+        tooLong[i] = L'a';
+    }
+    list.Extensions[5].Length = (USHORT)sizeof(tooLong);
+    list.Extensions[5].Buffer = tooLong;
+    g_Checks++;
+    if (DcExtBuildSet( DCEXT_RULE_EXCEPT, list.Extensions, 8, 1, &set ) != STATUS_OBJECT_NAME_INVALID) {
+        printf( "DcExtBuildSet: takes an extension of %u characters\n", DCEXT_MAX_LENGTH + 1 );
+        g_Failures++;
+    }
+
+    //  A set that sends a bucket past the keys, or has a key without a
+    //  name.
+    DcExtMakeList( State, 64, TRUE, &list );
+    if (NT_SUCCESS( DcExtBuildSet( DCEXT_RULE_ONLY, list.Extensions, 64, 1, &set ) )) {
+
+        LONG displacement = DcExtDisplacements( set )[0];
+        USHORT keyLength = DcExtKeys( set )[0].Length;
+
+        DcExtDisplacements( set )[0] = -(LONG)set->Count - 1;
+        g_Checks++;
+        if (NT_SUCCESS( DcExtValidate( set, set->Size ) )) {
+            printf( "DcExtValidate: takes a bucket past the keys\n" );
+            g_Failures++;
+        }
+        DcExtDisplacements( set )[0] = displacement;
+
+        DcExtKeys( set )[0].Length = 0;
+        g_Checks++;
+        if (NT_SUCCESS( DcExtValidate( set, set->Size ) )) {
+            printf( "DcExtValidate: takes an empty key\n" );
+            g_Failures++;
+        }
+        DcExtKeys( set )[0].Length = keyLength;
+
+        DcExtFree( set );
+    }
+}
+
+static int
+DcExtVerify (
+    VOID
+    )
+{
+    static const ULONG sizes[] = { 100, 255, 256, 257, 511, 512, 513, 1000, 1023, DCEXT_MAX_EXTENSIONS };
+    ULONG64 state = 1;
+    ULONG count;
+    ULONG round;
+    ULONG i;
+
+    for (round = 0; round < 4; round++) {
+
+        for (count = 0; count <= 64; count++) {
+            DcExtCheckSet( &state, count );
+        }
+
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            DcExtCheckSet( &state, sizes[i] );
+        }
+    }
+
+    DcExtCheckRefused( &state );
+
+    printf( "%llu checks, %llu failures\n", (unsigned long long)g_Checks, (unsigned long long)g_Failures );
+    return g_Failures != 0;
+}
+
+static int
+DcExtBench (
+    _In_ ULONG Lookups
+    )
+/*++
+Routine Description:
+    Lists of short ASCII extensions in any case, and lookups of names
+    half of which have a listed extension.
+--*/
+{
+    static const ULONG sizes[] = { 1, 4, 16, 64, 256, DCEXT_MAX_EXTENSIONS };
+    static DCEXT_LIST list;
+    static WCHAR buffers[DCEXT_BENCH_LOOKUPS][DCEXT_MAX_QUERY];
+    static UNICODE_STRING names[DCEXT_BENCH_LOOKUPS];
+    PDCEXT_SET set;
+    ULONG64 state = 1;
+    ULONG64 start;
+    ULONG64 hashTime;
+    ULONG64 scanTime;
+    ULONG scans;
+    ULONG found;
+    ULONG length;
+    ULONG i;
+    ULONG j;
+
+    printf( "extensions  DcExtIsProtected  list scan\n" );
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+
+        DcExtMakeList( &state, sizes[i], TRUE, &list );
+
+        if (!NT_SUCCESS( DcExtBuildSet( DCEXT_RULE_ONLY, list.Extensions, sizes[i], state, &set ) )) {
+            fprintf( stderr, "DcExtBuildSet failed\n" );
+            return 1;
+        }
+
+        for (j = 0; j < DCEXT_BENCH_LOOKUPS; j++) {
+
+            if (j % 2 == 0) {
+                const UNICODE_STRING *listed = &list.Extensions[DcExtRandom( &state ) % sizes[i]];
+                length = listed->Length / sizeof(WCHAR);
+                memcpy( buffers[j], listed->Buffer, listed->Length );
+                DcExtSpell( &state, buffers[j], length );
+            } else {
+                length = DcExtMakeExtension( &state, TRUE, buffers[j], DCEXT_MAX_LENGTH );
+            }
+            names[j].Buffer = buffers[j];
+            names[j].Length = (USHORT)(length * sizeof(WCHAR));
+            names[j].MaximumLength = (USHORT)sizeof(buffers[j]);
+        }
+
+        found = 0;
+        start = DcExtNow();
+        for (j = 0; j < Lookups; j++) {
+            found += DcExtIsProtected( set, &names[j & (DCEXT_BENCH_LOOKUPS - 1)] );
+        }
+        hashTime = DcExtNow() - start;
+
+        //  The scan takes as long as the list, so it gets fewer lookups.
+        scans = Lookups / sizes[i];
+        if (scans < DCEXT_BENCH_LOOKUPS) {
+            scans = DCEXT_BENCH_LOOKUPS;
+        }
+
+        start = DcExtNow();
+        for (j = 0; j < scans; j++) {
+            found -= DcExtScan( &list, &names[j & (DCEXT_BENCH_LOOKUPS - 1)] );
+        }
+        scanTime = DcExtNow() - start;
+
+        printf( "%10u  %13.1f ns  %9.1f ns\n", sizes[i],
+                (double)hashTime / Lookups, (double)scanTime / scans );
+
+        DcExtFree( set );
+
+        //  Keeps the lookups from being optimized away.
+        if (found == 0x7FFFFFFF) {
+            printf( "\n" );
+        }
+    }
+
+    return 0;
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ULONG lookups = DCEXT_DEFAULT_LOOKUPS;
+
+    //  Lets towupper upcase more than ASCII where the C library can.
+    setlocale( LC_CTYPE, "C.UTF-8" );
+
+    if (argc == 2 && strcmp( argv[1], "verify" ) == 0) {
+        return DcExtVerify();
+    }
+
+    if ((argc == 2 || argc == 3) && strcmp( argv[1], "bench" ) == 0) {
+
+        if (argc == 3) {
+            lookups = (ULONG)strtoul( argv[2], NULL, 0 );
+        }
+        if (lookups != 0) {
+            return DcExtBench( lookups );
+        }
+    }
+
+    fprintf( stderr, "Usage: dcext verify\n" );
+    fprintf( stderr, "       dcext bench [lookups]\n" );
+    return 2;
+}
@@ -0,0 +1,473 @@
+/*++
+Copyright (c)
+Module Name:
+    dcfold.c
+Abstract:
+    Checks the case-folding compare kernels of dcfold.h against upcasing
+    every code unit with DcUpcaseChar, and measures them.
+
+    dcfold verify
+        Compares every kernel the build has with the reference: every
+        code unit of the name and of the upcased string in every lane of
+        a block and in the tail, every length up to three AVX2 blocks
+        with the first difference at every position, and random strings.
+    dcfold bench [iterations]
+        Times each kernel on strings of 4 to 256 code units that only
+        differ in case, ASCII and not.
+
+    Builds on any host, e.g. with the AVX2 kernel:
+
+        cc -O2 -mavx2 -Iinc tools/dcfold.c -o dcfold
+Environment:
+    User mode
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include "dcfold.h"
+
+#define DCFOLD_MAX_LENGTH           256
+#define DCFOLD_SWEEP_LENGTH         40
+#define DCFOLD_RANDOM_PAIRS         1000000
+#define DCFOLD_BENCH_PAIRS          1024
+#define DCFOLD_DEFAULT_ITERATIONS   2000000
+
+typedef LONG (*PDCFOLD_COMPARE) (
+    _In_reads_(NameLength) PCWSTR Name,
+    _In_ ULONG NameLength,
+    _In_reads_(UpcasedLength) PCWSTR Upcased,
+    _In_ ULONG UpcasedLength
+    );
+
+static LONG
+DcFoldReference (
+    _In_reads_(NameLength) PCWSTR Name,
+    _In_ ULONG NameLength,
+    _In_reads_(UpcasedLength) PCWSTR Upcased,
+    _In_ ULONG UpcasedLength
+    )
+/*++
+Routine Description:
+    What every kernel has to agree with: the case table for every code
+    unit.
+--*/
+{
+    ULONG length = (NameLength < UpcasedLength) ? NameLength : UpcasedLength;
+    ULONG i;
+
+    for (i = 0; i < length; i++) {
+
+        WCHAR c = DcUpcaseChar( Name[i] );
+
+        if (c != Upcased[i]) {
+            return (c < Upcased[i]) ? -1 : 1;
+        }
+    }
+
+    if (NameLength == UpcasedLength) {
+        return 0;
+    }
+
+    return (NameLength < UpcasedLength) ? -1 : 1;
+}
+
+#ifdef DC_FOLD_SSE2
+
+static LONG
+DcFoldSse2 (
+    _In_reads_(NameLength) PCWSTR Name,
+    _In_ ULONG NameLength,
+    _In_reads_(UpcasedLength) PCWSTR Upcased,
+    _In_ ULONG UpcasedLength
+    )
+{
+    ULONG length = (NameLength < UpcasedLength) ? NameLength : UpcasedLength;
+
+    return DcFoldCompareLengths( DcFoldCompareRangeSse2( Name, Upcased, 0, length ),
+                                 NameLength,
+                                 UpcasedLength );
+}
+
+#endif
+
+#ifdef DC_FOLD_AVX2
+
+static LONG
+DcFoldAvx2 (
+    _In_reads_(NameLength) PCWSTR Name,
+    _In_ ULONG NameLength,
+    _In_reads_(UpcasedLength) PCWSTR Upcased,
+    _In_ ULONG UpcasedLength
+    )
+{
+    ULONG length = (NameLength < UpcasedLength) ? NameLength : UpcasedLength;
+
+    return DcFoldCompareLengths( DcFoldCompareRangeAvx2( Name, Upcased, 0, length ),
+                                 NameLength,
+                                 UpcasedLength );
+}
+
+#endif
+
+static const struct {
+    const char *Name;
+    PDCFOLD_COMPARE Compare;
+} g_Kernels[] = {
+    { "reference",  DcFoldReference },
+    { "scalar",     DcFoldCompareScalar },
+#ifdef DC_FOLD_SSE2
+    { "sse2",       DcFoldSse2 },
+#endif
+#ifdef DC_FOLD_AVX2
+    { "avx2",       DcFoldAvx2 },
+#endif
+};
+
+#define DCFOLD_KERNELS  (sizeof(g_Kernels) / sizeof(g_Kernels[0]))
+
+static ULONG64 g_Checks;
+static ULONG64 g_Failures;
+
+static ULONG64
+DcFoldNow (
+    VOID
+    )
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter( &counter );
+    QueryPerformanceFrequency( &frequency );
+    return (ULONG64)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+#endif
+}
+
+static ULONG
+DcFoldRandom (
+    _Inout_ PULONG64 State
+    )
+{
+    ULONG64 x = *State;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+    return (ULONG)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static VOID
+DcFoldCheck (
+    _In_reads_(NameLength) PCWSTR Name,
+    _In_ ULONG NameLength,
+    _In_reads_(UpcasedLength) PCWSTR Upcased,
+    _In_ ULONG UpcasedLength
+    )
+/*++
+Routine Description:
+    Runs every kernel on a pair and reports those that disagree with the
+    reference. The strings are copied to the end of a buffer the size of
+    the longest one, so that a kernel reading past them is caught by the
+    address sanitizer where there is one.
+--*/
+{
+    static WCHAR nameCopy[DCFOLD_MAX_LENGTH];
+    static WCHAR upcasedCopy[DCFOLD_MAX_LENGTH];
+    PWCHAR name = nameCopy + DCFOLD_MAX_LENGTH - NameLength;
+    PWCHAR upcased = upcasedCopy + DCFOLD_MAX_LENGTH - UpcasedLength;
+    LONG expected;
+    LONG order;
+    ULONG i;
+    ULONG j;
+
+    memmove( name, Name, NameLength * sizeof(WCHAR) );
+    memmove( upcased, Upcased, UpcasedLength * sizeof(WCHAR) );
+
+    expected = DcFoldReference( name, NameLength, upcased, UpcasedLength );
+
+    for (i = 1; i < DCFOLD_KERNELS; i++) {
+
+        order = g_Kernels[i].Compare( name, NameLength, upcased, UpcasedLength );
+        g_Checks++;
+
+        if (order != expected) {
+
+            if (g_Failures++ < 10) {
+                printf( "%s: %d instead of %d for", g_Kernels[i].Name, (int)order, (int)expected );
+                for (j = 0; j < NameLength; j++) {
+                    printf( " %04X", name[j] );
+                }
+                printf( " against" );
+                for (j = 0; j < UpcasedLength; j++) {
+                    printf( " %04X", upcased[j] );
+                }
+                printf( "\n" );
+            }
+        }
+    }
+}
+
+static VOID
+DcFoldMakeName (
+    _Inout_ PULONG64 State,
+    _Out_writes_(Length) PWCHAR Name,
+    _Out_writes_(Length) PWCHAR Upcased,
+    _In_ ULONG Length
+    )
+/*++
+Routine Description:
+    Makes up an ASCII name in mixed case and its upcased form.
+--*/
+{
+    static const char characters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ._-~$@`{";
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        Name[i] = (WCHAR)characters[DcFoldRandom( State ) % (sizeof(characters) - 1)];
+        Upcased[i] = DcUpcaseChar( Name[i] );
+    }
+}
+
+static int
+DcFoldVerify (
+    VOID
+    )
+{
+    WCHAR name[DCFOLD_MAX_LENGTH];
+    WCHAR upcased[DCFOLD_MAX_LENGTH];
+    WCHAR saved[2];
+    ULONG64 state = 1;
+    ULONG length;
+    ULONG position;
+    ULONG unit;
+    ULONG i;
+    LONG delta;
+
+    printf( "kernels:" );
+    for (i = 1; i < DCFOLD_KERNELS; i++) {
+        printf( " %s", g_Kernels[i].Name );
+    }
+    printf( "\n" );
+
+    //  Every code unit on its own.
+    for (unit = 0; unit <= 0xFFFF; unit++) {
+        if (DcFoldChar( (WCHAR)unit ) != DcUpcaseChar( (WCHAR)unit )) {
+            if (g_Failures++ < 10) {
+                printf( "DcFoldChar: %04X instead of %04X for %04X\n",
+                        DcFoldChar( (WCHAR)unit ), DcUpcaseChar( (WCHAR)unit ), unit );
+            }
+        }
+        g_Checks++;
+    }
+
+    //  Every code unit, in the name and in the upcased string, at every
+    //  position of a name that spans two AVX2 blocks and an SSE2 block,
+    //  against its upcased form and the code units next to it.
+    DcFoldMakeName( &state, name, upcased, DCFOLD_SWEEP_LENGTH );
+
+    for (position = 0; position < DCFOLD_SWEEP_LENGTH; position++) {
+
+        saved[0] = name[position];
+        saved[1] = upcased[position];
+
+        for (unit = 0; unit <= 0xFFFF; unit++) {
+
+            name[position] = (WCHAR)unit;
+            for (delta = -1; delta <= 1; delta++) {
+                upcased[position] = (WCHAR)(DcUpcaseChar( (WCHAR)unit ) + delta);
+                DcFoldCheck( name, DCFOLD_SWEEP_LENGTH, upcased, DCFOLD_SWEEP_LENGTH );
+            }
+
+            //  Equal code units are only equal upcased if they are
+            //  uppercase.
+            upcased[position] = (WCHAR)unit;
+            DcFoldCheck( name, DCFOLD_SWEEP_LENGTH, upcased, DCFOLD_SWEEP_LENGTH );
+
+            name[position] = saved[0];
+            upcased[position] = (WCHAR)unit;
+            DcFoldCheck( name, DCFOLD_SWEEP_LENGTH, upcased, DCFOLD_SWEEP_LENGTH );
+        }
+
+        name[position] = saved[0];
+        upcased[position] = saved[1];
+    }
+
+    //  Every length up to three AVX2 blocks, equal, with the first
+    //  difference at every position, and against every shorter and
+    //  longer prefix.
+    for (length = 0; length <= 48; length++) {
+
+        DcFoldMakeName( &state, name, upcased, length + 1 );
+
+        for (i = 0; i <= length + 1; i++) {
+            DcFoldCheck( name, length, upcased, i );
+            DcFoldCheck( name, i, upcased, length );
+        }
+
+        for (position = 0; position < length; position++) {
+            for (delta = -1; delta <= 1; delta += 2) {
+                upcased[position] = (WCHAR)(upcased[position] + delta);
+                DcFoldCheck( name, length, upcased, length );
+                upcased[position] = (WCHAR)(upcased[position] - delta);
+            }
+
+            //  A code unit that is not ASCII ahead of a difference.
+            saved[0] = name[position];
+            saved[1] = upcased[position];
+            name[position] = 0x00E9;
+            upcased[position] = DcUpcaseChar( 0x00E9 );
+            if (position + 1 < length) {
+                upcased[length - 1] = (WCHAR)(upcased[length - 1] ^ 1);
+            }
+            DcFoldCheck( name, length, upcased, length );
+            if (position + 1 < length) {
+                upcased[length - 1] = (WCHAR)(upcased[length - 1] ^ 1);
+            }
+            name[position] = saved[0];
+            upcased[position] = saved[1];
+        }
+    }
+
+    //  Random strings, mostly ASCII, that differ here and there.
+    for (i = 0; i < DCFOLD_RANDOM_PAIRS; i++) {
+
+        ULONG r = DcFoldRandom( &state );
+        ULONG j;
+
+        length = r % 80;
+        DcFoldMakeName( &state, name, upcased, length );
+
+        for (j = 0; j < length; j++) {
+
+            r = DcFoldRandom( &state );
+            if (r % 16 == 0) {
+                name[j] = (WCHAR)(r >> 16);
+                upcased[j] = DcUpcaseChar( name[j] );
+            }
+            if ((r >> 4) % 64 == 0) {
+                upcased[j] = (WCHAR)(r >> 12);
+            }
+        }
+
+        r = DcFoldRandom( &state );
+        DcFoldCheck( name, length, upcased, (r & 1) && length > 0 ? length - 1 : length );
+    }
+
+    printf( "%llu checks, %llu failures\n", (unsigned long long)g_Checks, (unsigned long long)g_Failures );
+    return g_Failures != 0;
+}
+
+static int
+DcFoldBench (
+    _In_ ULONG Iterations
+    )
+{
+    static const ULONG lengths[] = { 4, 8, 16, 32, 64, 128, 256 };
+    PWCHAR names;
+    PWCHAR upcased;
+    ULONG64 state = 1;
+    ULONG64 start;
+    ULONG64 elapsed;
+    volatile LONG sink = 0;
+    ULONG l;
+    ULONG k;
+    ULONG i;
+    ULONG j;
+    int ascii;
+
+    names = malloc( DCFOLD_BENCH_PAIRS * DCFOLD_MAX_LENGTH * sizeof(WCHAR) );
+    upcased = malloc( DCFOLD_BENCH_PAIRS * DCFOLD_MAX_LENGTH * sizeof(WCHAR) );
+    if (names == NULL || upcased == NULL) {
+        fprintf( stderr, "out of memory\n" );
+        return 1;
+    }
+
+    printf( "%-10s%-8s", "length", "text" );
+    for (k = 0; k < DCFOLD_KERNELS; k++) {
+        printf( "%12s", g_Kernels[k].Name );
+    }
+    printf( "   ns per compare of equal strings\n" );
+
+    for (ascii = 1; ascii >= 0; ascii--) {
+
+        for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+
+            for (i = 0; i < DCFOLD_BENCH_PAIRS; i++) {
+
+                PWCHAR name = names + i * DCFOLD_MAX_LENGTH;
+                PWCHAR up = upcased + i * DCFOLD_MAX_LENGTH;
+
+                DcFoldMakeName( &state, name, up, lengths[l] );
+
+                //  Cyrillic letters, one in four code units.
+                if (!ascii) {
+                    for (j = 0; j < lengths[l]; j += 4) {
+                        name[j] = (WCHAR)(0x0430 + DcFoldRandom( &state ) % 32);
+                        up[j] = DcUpcaseChar( name[j] );
+                    }
+                }
+            }
+
+            printf( "%-10u%-8s", lengths[l], ascii ? "ascii" : "mixed" );
+
+            for (k = 0; k < DCFOLD_KERNELS; k++) {
+
+                start = DcFoldNow();
+                for (i = 0; i < Iterations; i++) {
+                    j = i % DCFOLD_BENCH_PAIRS;
+                    sink += g_Kernels[k].Compare( names + j * DCFOLD_MAX_LENGTH, lengths[l],
+                                                  upcased + j * DCFOLD_MAX_LENGTH, lengths[l] );
+                }
+                elapsed = DcFoldNow() - start;
+
+                printf( "%12.1f", (double)elapsed / Iterations );
+            }
+            printf( "\n" );
+        }
+    }
+
+    free( names );
+    free( upcased );
+    return sink != 0;
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ULONG iterations = DCFOLD_DEFAULT_ITERATIONS;
+
+    //  Lets towupper upcase more than ASCII where the C library can.
+    setlocale( LC_CTYPE, "C.UTF-8" );
+
+    if (argc == 2 && strcmp( argv[1], "verify" ) == 0) {
+        return DcFoldVerify();
+    }
+
+    if ((argc == 2 || argc == 3) && strcmp( argv[1], "bench" ) == 0) {
+
+        if (argc == 3) {
+            iterations = (ULONG)strtoul( argv[2], NULL, 0 );
+        }
+        if (iterations != 0) {
+            return DcFoldBench( iterations );
+        }
+    }
+
+    fprintf( stderr, "Usage: dcfold verify\n" );
+    fprintf( stderr, "       dcfold bench [iterations]\n" );
+    return 1;
+}
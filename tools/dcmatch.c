@@ -0,0 +1,684 @@
+/*++
+Copyright (c)
+Module Name:
+    dcmatch.c
+Abstract:
+    Checks DcTrieMatch against matching every root in turn, the way the
+    filter did with RtlPrefixUnicodeString before there was a trie, and
+    measures it.
+
+    dcmatch verify [roots]
+        Builds a trie of made up roots, nested in one another, spelled
+        with leading and trailing separators and in any case, then
+        matches names at, below, beside and above each of them and
+        compares the result with the deepest root found by the reference.
+    dcmatch bench [roots] [matches]
+        Times DcTrieMatch and the reference on names of the same kinds.
+
+    Builds on any host the core builds on:
+
+        cc -O2 -Iinc tools/dcmatch.c core/dctrie.c -o dcmatch
+Environment:
+    User mode
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include "dctrie.h"
+
+#define DCMATCH_DEFAULT_ROOTS           10000
+#define DCMATCH_DEFAULT_MATCHES         20000000
+#define DCMATCH_VERIFY_NAMES            20000
+#define DCMATCH_BENCH_NAMES             65536
+#define DCMATCH_REFERENCE_NAMES         2000
+#define DCMATCH_VOLUMES                 4
+#define DCMATCH_MAX_PATH                512
+
+//  A path made up for the test: a volume, a directory that holds roots
+//  or a root. Text is upcased and without leading or trailing separators.
+typedef struct _DCMATCH_PATH {
+    PWSTR Text;
+    ULONG Length;
+    ULONG RootId;
+} DCMATCH_PATH, *PDCMATCH_PATH;
+
+typedef struct _DCMATCH_SET {
+    PDCMATCH_PATH Paths;
+    ULONG PathCount;
+    ULONG PathCapacity;
+
+    //  Root n is Paths[RootPaths[n]].
+    PULONG RootPaths;
+    PDCTRIE_ROOT Roots;
+    ULONG RootCount;
+
+    //  Open addressing on the upcased text, to keep paths unique.
+    PULONG Hash;
+    ULONG HashSize;
+
+    PDCTRIE Trie;
+} DCMATCH_SET, *PDCMATCH_SET;
+
+//  Components share prefixes with each other, so that a root must not
+//  match a sibling that merely starts like it, and some only differ in
+//  case outside ASCII.
+static const wchar_t *g_Words[] = {
+    L"Data", L"Dat", L"Data1", L"Data 1", L"DataX", L"Users", L"User", L"Projects", L"Project",
+    L"src", L"Windows", L"System32", L"Program Files", L"Program Files (x86)", L"a", L"ab",
+    L"a.b", L"a~1", L"PROGRA~1", L"Logs", L"log", L".git", L"x",
+    L"na\x00EFve", L"\x00C9t\x00E9", L"\x00E9T\x00C9", L"Stra\x00DF" L"e", L"\x03A3\x03CD\x03C3\x03C4\x03B7\x03BC\x03B1",
+    L"\x03C3\x03CD\x03C3\x03C4\x03B7\x03BC\x03B1", L"\x0414\x0430\x043D\x043D\x044B\x0435", L"\x65E5\x672C",
+};
+
+#define DCMATCH_WORDS                   (sizeof(g_Words) / sizeof(g_Words[0]))
+
+static ULONG64 g_Checks;
+static ULONG64 g_Failures;
+
+static ULONG64
+DcMatchNow (
+    VOID
+    )
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter( &counter );
+    QueryPerformanceFrequency( &frequency );
+    return (ULONG64)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+#endif
+}
+
+static ULONG
+DcMatchRandom (
+    _Inout_ PULONG64 State
+    )
+{
+    ULONG64 x = *State;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+    return (ULONG)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static PVOID
+DcMatchAllocate (
+    _In_ size_t Size
+    )
+{
+    PVOID buffer = malloc( Size );
+
+    if (buffer == NULL) {
+        fprintf( stderr, "out of memory\n" );
+        exit( 1 );
+    }
+
+    return buffer;
+}
+
+static ULONG
+DcMatchCopyText (
+    _In_ const wchar_t *Text,
+    _Out_ PWSTR Buffer
+    )
+/*++
+Routine Description:
+    Copies Text upcased, whatever the size of wchar_t on the host.
+--*/
+{
+    ULONG length;
+
+    for (length = 0; Text[length] != 0; length++) {
+        Buffer[length] = DcUpcaseChar( (WCHAR)Text[length] );
+    }
+
+    return length;
+}
+
+static VOID
+DcMatchPrintName (
+    _In_ PCUNICODE_STRING Name
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Name->Length / sizeof(WCHAR); i++) {
+        if (Name->Buffer[i] < 0x80) {
+            putchar( Name->Buffer[i] );
+        } else {
+            printf( "\\x%04X", Name->Buffer[i] );
+        }
+    }
+}
+
+static ULONG
+DcMatchHashText (
+    _In_reads_(Length) PCWSTR Text,
+    _In_ ULONG Length
+    )
+{
+    ULONG hash = 2166136261u;
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        hash = (hash ^ Text[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static PDCMATCH_PATH
+DcMatchAddPath (
+    _Inout_ PDCMATCH_SET Set,
+    _In_reads_(Length) PCWSTR Text,
+    _In_ ULONG Length,
+    _Out_ PBOOLEAN Added
+    )
+/*++
+Routine Description:
+    Adds an upcased path unless it is already there.
+Return Value:
+    The path, new or not.
+--*/
+{
+    ULONG slot = DcMatchHashText( Text, Length ) & (Set->HashSize - 1);
+    PDCMATCH_PATH path;
+
+    while (Set->Hash[slot] != (ULONG)-1) {
+
+        path = &Set->Paths[Set->Hash[slot]];
+        if (path->Length == Length && memcmp( path->Text, Text, Length * sizeof(WCHAR) ) == 0) {
+            *Added = FALSE;
+            return path;
+        }
+        slot = (slot + 1) & (Set->HashSize - 1);
+    }
+
+    path = &Set->Paths[Set->PathCount];
+    path->Text = DcMatchAllocate( Length * sizeof(WCHAR) );
+    memcpy( path->Text, Text, Length * sizeof(WCHAR) );
+    path->Length = Length;
+    path->RootId = DCTRIE_NO_ROOT;
+    Set->Hash[slot] = Set->PathCount++;
+
+    *Added = TRUE;
+    return path;
+}
+
+static ULONG
+DcMatchSpell (
+    _Inout_ PULONG64 State,
+    _In_reads_(Length) PCWSTR Text,
+    _In_ ULONG Length,
+    _Out_writes_(Length) PWSTR Spelling
+    )
+/*++
+Routine Description:
+    Copies upcased Text, lowering the case of some of its characters.
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        Spelling[i] = (DcMatchRandom( State ) & 1) ? (WCHAR)towlower( (wint_t)Text[i] ) : Text[i];
+    }
+
+    return Length;
+}
+
+static ULONG
+DcMatchSeparators (
+    _Inout_ PULONG64 State,
+    _Out_writes_(2) PWSTR Buffer
+    )
+/*++
+Routine Description:
+    Writes no separator, mostly, or one or two.
+--*/
+{
+    ULONG count = DcMatchRandom( State ) % 8;
+
+    Buffer[0] = DC_PATH_SEPARATOR;
+    Buffer[1] = DC_PATH_SEPARATOR;
+    return (count < 6) ? 0 : count - 5;
+}
+
+static ULONG
+DcMatchComponent (
+    _Inout_ PULONG64 State,
+    _Out_writes_(32) PWSTR Buffer
+    )
+/*++
+Routine Description:
+    Writes an upcased component: a word, mostly with a number.
+--*/
+{
+    ULONG length = DcMatchCopyText( g_Words[DcMatchRandom( State ) % DCMATCH_WORDS], Buffer );
+    ULONG number = DcMatchRandom( State ) % 400;
+
+    if (number < 100) {
+        Buffer[length++] = (WCHAR)(L'0' + number / 10);
+        Buffer[length++] = (WCHAR)(L'0' + number % 10);
+    } else if (number < 300) {
+        Buffer[length++] = (WCHAR)(L'0' + number % 10);
+    }
+
+    return length;
+}
+
+static VOID
+DcMatchBuildSet (
+    _Inout_ PULONG64 State,
+    _In_ ULONG RootCount,
+    _Out_ PDCMATCH_SET Set
+    )
+/*++
+Routine Description:
+    Makes up RootCount roots on a few volumes, each below a volume, a
+    directory or another root, spells each the way a user might and
+    builds the trie from them.
+--*/
+{
+    WCHAR text[DCMATCH_MAX_PATH];
+    PWSTR spelling;
+    PDCMATCH_PATH parent;
+    PDCMATCH_PATH path = NULL;
+    ULONG length;
+    ULONG components;
+    ULONG choice;
+    ULONG i;
+    BOOLEAN added;
+    NTSTATUS status;
+
+    memset( Set, 0, sizeof(*Set) );
+
+    Set->PathCapacity = DCMATCH_VOLUMES + 8 * RootCount;
+    Set->Paths = DcMatchAllocate( Set->PathCapacity * sizeof(DCMATCH_PATH) );
+    Set->RootPaths = DcMatchAllocate( RootCount * sizeof(ULONG) );
+    Set->Roots = DcMatchAllocate( RootCount * sizeof(DCTRIE_ROOT) );
+
+    for (Set->HashSize = 1; Set->HashSize < 2 * Set->PathCapacity; Set->HashSize *= 2) {
+    }
+    Set->Hash = DcMatchAllocate( Set->HashSize * sizeof(ULONG) );
+    memset( Set->Hash, 0xFF, Set->HashSize * sizeof(ULONG) );
+
+    for (i = 0; i < DCMATCH_VOLUMES; i++) {
+        length = DcMatchCopyText( L"Device\\HarddiskVolume", text );
+        text[length++] = (WCHAR)(L'1' + i);
+        DcMatchAddPath( Set, text, length, &added );
+    }
+
+    while (Set->RootCount < RootCount) {
+
+        //  Below a root one time out of five, so that roots nest, and
+        //  twice as often right on a volume, so that many directories
+        //  are not below any root.
+        choice = DcMatchRandom( State ) % 5;
+        if (choice == 0 && Set->RootCount != 0) {
+            parent = &Set->Paths[Set->RootPaths[DcMatchRandom( State ) % Set->RootCount]];
+        } else if (choice <= 2) {
+            parent = &Set->Paths[DcMatchRandom( State ) % DCMATCH_VOLUMES];
+        } else {
+            parent = &Set->Paths[DcMatchRandom( State ) % Set->PathCount];
+        }
+
+        if (Set->PathCount + 3 > Set->PathCapacity) {
+            fprintf( stderr, "cannot make up %u different roots\n", RootCount );
+            exit( 1 );
+        }
+
+        if (parent->Length + 3 * 34 > DCMATCH_MAX_PATH) {
+            continue;
+        }
+
+        memcpy( text, parent->Text, parent->Length * sizeof(WCHAR) );
+        length = parent->Length;
+
+        //  The directories on the way are paths names can be made from
+        //  too.
+        for (components = 1 + DcMatchRandom( State ) % 3; components != 0; components--) {
+            text[length++] = DC_PATH_SEPARATOR;
+            length += DcMatchComponent( State, text + length );
+            path = DcMatchAddPath( Set, text, length, &added );
+        }
+
+        if (path->RootId != DCTRIE_NO_ROOT) {
+            continue;
+        }
+
+        path->RootId = Set->RootCount;
+        Set->RootPaths[Set->RootCount] = (ULONG)(path - Set->Paths);
+
+        //  \Device\..., with up to two more separators before and after,
+        //  in any case.
+        spelling = DcMatchAllocate( (path->Length + 6) * sizeof(WCHAR) );
+        length = DcMatchSeparators( State, spelling );
+        spelling[length++] = DC_PATH_SEPARATOR;
+        length += DcMatchSpell( State, path->Text, path->Length, spelling + length );
+        length += DcMatchSeparators( State, spelling + length );
+
+        Set->Roots[Set->RootCount].Path.Buffer = spelling;
+        Set->Roots[Set->RootCount].Path.Length = (USHORT)(length * sizeof(WCHAR));
+        Set->Roots[Set->RootCount].Path.MaximumLength = (USHORT)(length * sizeof(WCHAR));
+        Set->Roots[Set->RootCount].RootId = Set->RootCount;
+        Set->RootCount++;
+    }
+
+    status = DcTrieBuild( Set->Roots, Set->RootCount, &Set->Trie );
+    if (!NT_SUCCESS( status )) {
+        fprintf( stderr, "DcTrieBuild: 0x%08X\n", (unsigned)status );
+        exit( 1 );
+    }
+}
+
+static VOID
+DcMatchFreeSet (
+    _Inout_ PDCMATCH_SET Set
+    )
+{
+    ULONG i;
+
+    DcTrieFree( Set->Trie );
+    for (i = 0; i < Set->PathCount; i++) {
+        free( Set->Paths[i].Text );
+    }
+    for (i = 0; i < Set->RootCount; i++) {
+        free( Set->Roots[i].Path.Buffer );
+    }
+    free( Set->Paths );
+    free( Set->RootPaths );
+    free( Set->Roots );
+    free( Set->Hash );
+}
+
+static ULONG
+DcMatchReference (
+    _In_ const DCMATCH_SET *Set,
+    _In_ PCUNICODE_STRING FileName
+    )
+/*++
+Routine Description:
+    Tries every root in turn: FileName lies below a root when, without
+    its leading separators and ignoring case, it starts with the root
+    and a separator and goes on after them. Of those roots the longest
+    is the deepest.
+--*/
+{
+    WCHAR name[DCMATCH_MAX_PATH * 2];
+    PCWSTR buffer = FileName->Buffer;
+    ULONG length = FileName->Length / sizeof(WCHAR);
+    ULONG match = DCTRIE_NO_ROOT;
+    ULONG matchLength = 0;
+    ULONG i;
+
+    while (length != 0 && buffer[0] == DC_PATH_SEPARATOR) {
+        buffer++;
+        length--;
+    }
+
+    for (i = 0; i < length; i++) {
+        name[i] = DcUpcaseChar( buffer[i] );
+    }
+
+    for (i = 0; i < Set->RootCount; i++) {
+
+        const DCMATCH_PATH *root = &Set->Paths[Set->RootPaths[i]];
+
+        if (root->Length + 1 < length &&
+            root->Length >= matchLength &&
+            name[root->Length] == DC_PATH_SEPARATOR &&
+            memcmp( name, root->Text, root->Length * sizeof(WCHAR) ) == 0) {
+
+            match = i;
+            matchLength = root->Length;
+        }
+    }
+
+    return match;
+}
+
+static ULONG
+DcMatchMakeName (
+    _Inout_ PULONG64 State,
+    _In_ const DCMATCH_SET *Set,
+    _Out_writes_(DCMATCH_MAX_PATH * 2) PWSTR Name
+    )
+/*++
+Routine Description:
+    Makes up a name around one of the paths of the set, mostly a root:
+    the path itself, with a trailing separator, with a file or more
+    directories below it, with doubled separators, or with its last
+    component longer or shorter by a character.
+Return Value:
+    Length of the name in characters.
+--*/
+{
+    const DCMATCH_PATH *path;
+    ULONG length;
+    ULONG kind = DcMatchRandom( State ) % 10;
+    ULONG components;
+    ULONG start;
+
+    if (DcMatchRandom( State ) % 2 != 0) {
+        path = &Set->Paths[Set->RootPaths[DcMatchRandom( State ) % Set->RootCount]];
+    } else {
+        path = &Set->Paths[DcMatchRandom( State ) % Set->PathCount];
+    }
+
+    length = DcMatchSeparators( State, Name );
+    Name[length++] = DC_PATH_SEPARATOR;
+    length += DcMatchSpell( State, path->Text, path->Length, Name + length );
+
+    switch (kind) {
+    case 0:
+        break;
+    case 1:
+        Name[length++] = DC_PATH_SEPARATOR;
+        break;
+    case 2:
+        Name[length++] = L'q';
+        Name[length++] = DC_PATH_SEPARATOR;
+        Name[length++] = L'f';
+        break;
+    case 3:
+        Name[length - 1] = DC_PATH_SEPARATOR;
+        Name[length++] = L'f';
+        break;
+    case 4:
+        Name[length++] = DC_PATH_SEPARATOR;
+        Name[length++] = DC_PATH_SEPARATOR;
+        Name[length++] = L'f';
+        break;
+    default:
+        for (components = 1 + kind % 3; components != 0; components--) {
+            Name[length++] = DC_PATH_SEPARATOR;
+            start = length;
+            length += DcMatchComponent( State, Name + length );
+            DcMatchSpell( State, Name + start, length - start, Name + start );
+        }
+        if (kind == 9) {
+            Name[length++] = DC_PATH_SEPARATOR;
+        }
+        break;
+    }
+
+    return length;
+}
+
+static int
+DcMatchVerify (
+    _In_ ULONG RootCount
+    )
+{
+    WCHAR name[DCMATCH_MAX_PATH * 2];
+    DCMATCH_SET set;
+    UNICODE_STRING fileName;
+    UNICODE_STRING rootName;
+    ULONG64 state = 1;
+    ULONG expected;
+    ULONG match;
+    ULONG matched = 0;
+    ULONG nested = 0;
+    ULONG i;
+
+    DcMatchBuildSet( &state, RootCount, &set );
+
+    g_Checks++;
+    if (!NT_SUCCESS( DcTrieValidate( set.Trie, set.Trie->Size, set.RootCount ) ) ||
+        set.Trie->RootCount != set.RootCount) {
+        printf( "DcTrieValidate: rejects the trie it was built from\n" );
+        g_Failures++;
+    }
+
+    fileName.Buffer = name;
+
+    //  Every root, at it or below it, then made up names.
+    for (i = 0; i < set.RootCount + DCMATCH_VERIFY_NAMES; i++) {
+
+        if (i < set.RootCount) {
+            const DCMATCH_PATH *root = &set.Paths[set.RootPaths[i]];
+            ULONG length = DcMatchSpell( &state, root->Text, root->Length, name );
+            if (i % 2 != 0) {
+                name[length++] = DC_PATH_SEPARATOR;
+                name[length++] = L'f';
+            }
+            fileName.Length = (USHORT)(length * sizeof(WCHAR));
+        } else {
+            fileName.Length = (USHORT)(DcMatchMakeName( &state, &set, name ) * sizeof(WCHAR));
+        }
+        fileName.MaximumLength = fileName.Length;
+
+        expected = DcMatchReference( &set, &fileName );
+        match = DcTrieMatch( set.Trie, &fileName );
+
+        g_Checks++;
+        if (match != expected) {
+            if (g_Failures++ < 10) {
+                printf( "DcTrieMatch: root %d instead of %d for ", (int)match, (int)expected );
+                DcMatchPrintName( &fileName );
+                printf( "\n" );
+            }
+        }
+
+        //  The root found is nested if another root is found above it.
+        if (expected != DCTRIE_NO_ROOT) {
+            matched++;
+            rootName.Buffer = set.Paths[set.RootPaths[expected]].Text;
+            rootName.Length = (USHORT)(set.Paths[set.RootPaths[expected]].Length * sizeof(WCHAR));
+            rootName.MaximumLength = rootName.Length;
+            if (DcMatchReference( &set, &rootName ) != DCTRIE_NO_ROOT) {
+                nested++;
+            }
+        }
+    }
+
+    printf( "roots: %u, paths: %u, trie: %u nodes, %u bytes\n", set.RootCount, set.PathCount,
+            set.Trie->NodeCount, set.Trie->Size );
+    printf( "names: %u, below no root: %u, below a root: %u, below a nested root: %u\n",
+            i, i - matched, matched - nested, nested );
+
+    DcMatchFreeSet( &set );
+
+    printf( "%llu checks, %llu failures\n", (unsigned long long)g_Checks, (unsigned long long)g_Failures );
+    return g_Failures != 0;
+}
+
+static int
+DcMatchBench (
+    _In_ ULONG RootCount,
+    _In_ ULONG Matches
+    )
+{
+    DCMATCH_SET set;
+    PUNICODE_STRING names;
+    PWSTR pool;
+    ULONG64 state = 1;
+    ULONG64 start;
+    ULONG64 trieTime;
+    ULONG64 referenceTime;
+    ULONG matched = 0;
+    ULONG i;
+
+    DcMatchBuildSet( &state, RootCount, &set );
+
+    names = DcMatchAllocate( DCMATCH_BENCH_NAMES * sizeof(UNICODE_STRING) );
+    pool = DcMatchAllocate( (size_t)DCMATCH_BENCH_NAMES * DCMATCH_MAX_PATH * 2 * sizeof(WCHAR) );
+
+    for (i = 0; i < DCMATCH_BENCH_NAMES; i++) {
+        names[i].Buffer = pool + (size_t)i * DCMATCH_MAX_PATH * 2;
+        names[i].Length = (USHORT)(DcMatchMakeName( &state, &set, names[i].Buffer ) * sizeof(WCHAR));
+        names[i].MaximumLength = names[i].Length;
+    }
+
+    start = DcMatchNow();
+    for (i = 0; i < Matches; i++) {
+        matched += DcTrieMatch( set.Trie, &names[i & (DCMATCH_BENCH_NAMES - 1)] ) != DCTRIE_NO_ROOT;
+    }
+    trieTime = DcMatchNow() - start;
+
+    start = DcMatchNow();
+    for (i = 0; i < DCMATCH_REFERENCE_NAMES; i++) {
+        matched += DcMatchReference( &set, &names[i] ) != DCTRIE_NO_ROOT;
+    }
+    referenceTime = DcMatchNow() - start;
+
+    printf( "roots: %u, trie: %u nodes, %u bytes, %u%% of the names below a root\n", set.RootCount,
+            set.Trie->NodeCount, set.Trie->Size, (ULONG)(100ULL * matched / (Matches + DCMATCH_REFERENCE_NAMES)) );
+    printf( "DcTrieMatch: %.1f ns per name, %.2f million names/s\n",
+            (double)trieTime / Matches, Matches * 1e3 / (double)trieTime );
+    printf( "reference:   %.1f ns per name, %.2f million names/s\n",
+            (double)referenceTime / DCMATCH_REFERENCE_NAMES, DCMATCH_REFERENCE_NAMES * 1e3 / (double)referenceTime );
+
+    free( names );
+    free( pool );
+    DcMatchFreeSet( &set );
+    return 0;
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ULONG roots = DCMATCH_DEFAULT_ROOTS;
+    ULONG matches = DCMATCH_DEFAULT_MATCHES;
+
+    //  Lets towupper upcase more than ASCII where the C library can.
+    setlocale( LC_CTYPE, "C.UTF-8" );
+
+    if (argc >= 3) {
+        roots = (ULONG)strtoul( argv[2], NULL, 0 );
+    }
+
+    if ((argc == 2 || argc == 3) && strcmp( argv[1], "verify" ) == 0 && roots != 0) {
+        return DcMatchVerify( roots );
+    }
+
+    if (argc >= 2 && argc <= 4 && strcmp( argv[1], "bench" ) == 0) {
+
+        if (argc == 4) {
+            matches = (ULONG)strtoul( argv[3], NULL, 0 );
+        }
+        if (roots != 0 && matches != 0) {
+            return DcMatchBench( roots, matches );
+        }
+    }
+
+    fprintf( stderr, "Usage: dcmatch verify [roots]\n" );
+    fprintf( stderr, "       dcmatch bench [roots] [matches]\n" );
+    return 2;
+}
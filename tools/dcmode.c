@@ -0,0 +1,338 @@
+/*++
+Copyright (c)
+Module Name:
+    dcmode.c
+Abstract:
+    Checks the decision tables of dcmode.h and the create decisions of
+    dcpolicy.h against the chain of tests the filter made on creates
+    before modes were compiled, extended to every mode.
+
+    dcmode
+        Decides on every mode, with the flags that are ignored, against
+        every single access right and every combination of the rights a
+        mode can deny, with and without read rights, for every create
+        disposition, with no create option and with each one on its own,
+        and on the file each create would have created.
+
+    Builds on any host the core builds on:
+
+        cc -O2 -Iinc tools/dcmode.c core/dctrie.c -o dcmode
+Environment:
+    User mode
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dcpolicy.h"
+
+#ifndef FILE_READ_DATA
+#define FILE_READ_DATA                  0x0001
+#endif
+
+#ifndef FILE_READ_ATTRIBUTES
+#define FILE_READ_ATTRIBUTES            0x0080
+#endif
+
+#ifndef READ_CONTROL
+#define READ_CONTROL                    0x00020000
+#endif
+
+#ifndef FILE_OPENED
+#define FILE_OPENED                     0x00000001
+#endif
+
+#ifndef SYNCHRONIZE
+#define SYNCHRONIZE                     0x00100000
+#endif
+
+#define FlagOn(Flags, Flag)             (((Flags) & (Flag)) != 0)
+
+//  Every right the filter ever denied on a create, DIRCTL_WRITE_ACCESS
+//  of the filter before modes.
+#define DCMODE_WRITE_ACCESS             (FILE_WRITE_DATA | FILE_APPEND_DATA | DELETE |      \
+                                         FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA |            \
+                                         WRITE_DAC | WRITE_OWNER | ACCESS_SYSTEM_SECURITY)
+
+#define DCMODE_READ_ACCESS              (FILE_READ_DATA | FILE_READ_ATTRIBUTES | READ_CONTROL | SYNCHRONIZE)
+
+#define DCMODE_MODES                    64
+#define DCMODE_DISPOSITIONS             256
+
+static const ACCESS_MASK g_WriteRights[] = {
+    FILE_WRITE_DATA, FILE_APPEND_DATA, DELETE, FILE_WRITE_ATTRIBUTES, FILE_WRITE_EA,
+    WRITE_DAC, WRITE_OWNER, ACCESS_SYSTEM_SECURITY,
+};
+
+#define DCMODE_WRITE_RIGHTS             (sizeof(g_WriteRights) / sizeof(g_WriteRights[0]))
+
+static ULONG64 g_Checks;
+static ULONG64 g_Failures;
+
+static BOOLEAN
+DcModeReadOnlyReference (
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG Options
+    )
+/*++
+Routine Description:
+    The pre create test of the filter when every root was read-only, and
+    FILE_CREATE, which it let through.
+--*/
+{
+    UCHAR createDisposition = (UCHAR)(Options >> 24);
+
+    return (BOOLEAN)(createDisposition == FILE_SUPERSEDE || createDisposition == FILE_OVERWRITE
+                     || createDisposition == FILE_OVERWRITE_IF || createDisposition == FILE_CREATE
+                     || FlagOn( DesiredAccess, DCMODE_WRITE_ACCESS )
+                     || FlagOn( Options, FILE_DELETE_ON_CLOSE ));
+}
+
+static BOOLEAN
+DcModeReference (
+    _In_ ULONG Mode,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG Options
+    )
+/*++
+Routine Description:
+    The same chain of tests, one kind of change after the other, for the
+    changes a mode protects.
+--*/
+{
+    UCHAR createDisposition = (UCHAR)(Options >> 24);
+
+    Mode &= DCMODE_PROTECT_ALL;
+    if (Mode == 0) {
+        Mode = DCMODE_READ_ONLY;
+    }
+
+    if (FlagOn( Mode, DCMODE_PROTECT_DATA ) &&
+        (createDisposition == FILE_SUPERSEDE || createDisposition == FILE_OVERWRITE
+         || createDisposition == FILE_OVERWRITE_IF
+         || (createDisposition == FILE_CREATE && !FlagOn( Options, FILE_DIRECTORY_FILE ))
+         || FlagOn( DesiredAccess, FILE_WRITE_DATA ))) {
+        return TRUE;
+    }
+
+    if (FlagOn( Mode, DCMODE_PROTECT_APPEND ) &&
+        ((createDisposition == FILE_CREATE && FlagOn( Options, FILE_DIRECTORY_FILE ))
+         || FlagOn( DesiredAccess, FILE_APPEND_DATA ))) {
+        return TRUE;
+    }
+
+    if (FlagOn( Mode, DCMODE_PROTECT_DELETE ) &&
+        (createDisposition == FILE_SUPERSEDE
+         || FlagOn( DesiredAccess, DELETE )
+         || FlagOn( Options, FILE_DELETE_ON_CLOSE ))) {
+        return TRUE;
+    }
+
+    if (FlagOn( Mode, DCMODE_PROTECT_ATTRIBUTES ) &&
+        FlagOn( DesiredAccess, FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA )) {
+        return TRUE;
+    }
+
+    if (FlagOn( Mode, DCMODE_PROTECT_SECURITY ) &&
+        FlagOn( DesiredAccess, WRITE_DAC | WRITE_OWNER | ACCESS_SYSTEM_SECURITY )) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static VOID
+DcModeFail (
+    _In_ const char *What,
+    _In_ ULONG Mode,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG Options,
+    _In_ ULONG Got,
+    _In_ ULONG Expected
+    )
+{
+    if (g_Failures++ < 10) {
+        printf( "%s: %u instead of %u for mode 0x%02X access 0x%08X options 0x%08X\n",
+                What, Got, Expected, Mode, DesiredAccess, Options );
+    }
+}
+
+static VOID
+DcModeCheck (
+    _In_ PCDCMODE_TABLE Table,
+    _In_ ULONG Mode,
+    _In_ ACCESS_MASK DesiredAccess,
+    _In_ ULONG Options
+    )
+/*++
+Routine Description:
+    Decides on a create below the root of the table that has Mode, which
+    is root Mode, and outside every root.
+--*/
+{
+    PCDCMODE_ENTRY entry = DcModeLookup( Table, Mode );
+    BOOLEAN expected = DcModeReference( Mode, DesiredAccess, Options );
+    BOOLEAN denied = DcModeDeniesCreate( entry, DesiredAccess, Options );
+    ULONG decision;
+
+    g_Checks++;
+
+    if (denied != expected) {
+        DcModeFail( "DcModeDeniesCreate", Mode, DesiredAccess, Options, denied, expected );
+    }
+
+    //  A mode without flags is read-only, as every root was.
+    if ((Mode & DCMODE_PROTECT_ALL) == 0 || (Mode & DCMODE_PROTECT_ALL) == DCMODE_READ_ONLY) {
+        if (expected != DcModeReadOnlyReference( DesiredAccess, Options )) {
+            DcModeFail( "read-only reference", Mode, DesiredAccess, Options, expected,
+                        DcModeReadOnlyReference( DesiredAccess, Options ) );
+        }
+    }
+
+    decision = DcPolicyDecideCreate( Mode, entry, DesiredAccess, Options );
+    if (decision != (expected ? DCPOLICY_DENY : DCPOLICY_CHECK_OPEN)) {
+        DcModeFail( "DcPolicyDecideCreate", Mode, DesiredAccess, Options, decision,
+                    expected ? DCPOLICY_DENY : DCPOLICY_CHECK_OPEN );
+    }
+
+    //  What MAXIMUM_ALLOWED got from the file system is judged by the
+    //  rights alone.
+    if (DcPolicyDeniesOpen( entry->DeniedAccess, DesiredAccess ) !=
+        DcModeReference( Mode, DesiredAccess, (ULONG)FILE_OPEN << 24 )) {
+        DcModeFail( "DcPolicyDeniesOpen", Mode, DesiredAccess, 0,
+                    DcPolicyDeniesOpen( entry->DeniedAccess, DesiredAccess ), !expected );
+    }
+
+    //  A create let through that created its file is judged as the same
+    //  create with FILE_CREATE; one that opened a file is left alone.
+    if (decision == DCPOLICY_CHECK_OPEN) {
+
+        BOOLEAN created = DcModeReference( Mode, DesiredAccess,
+                                           (Options & 0x00FFFFFF) | ((ULONG)FILE_CREATE << 24) );
+
+        if (DcPolicyDeniesCreated( entry->DeniedCreations, Options, FILE_CREATED ) != created) {
+            DcModeFail( "DcPolicyDeniesCreated", Mode, DesiredAccess, Options,
+                        DcPolicyDeniesCreated( entry->DeniedCreations, Options, FILE_CREATED ), created );
+        }
+
+        if (DcPolicyDeniesCreated( entry->DeniedCreations, Options, FILE_OPENED )) {
+            DcModeFail( "DcPolicyDeniesCreated", Mode, DesiredAccess, Options, 1, 0 );
+        }
+    }
+
+    entry = DcModeLookup( Table, DCTRIE_NO_ROOT );
+    if (DcModeDeniesCreate( entry, DesiredAccess, Options ) ||
+        DcPolicyDecideCreate( DCTRIE_NO_ROOT, entry, DesiredAccess, Options ) != DCPOLICY_ALLOW) {
+        DcModeFail( "outside the roots", Mode, DesiredAccess, Options, 1, 0 );
+    }
+}
+
+static VOID
+DcModeCheckAccess (
+    _In_ PCDCMODE_TABLE Table,
+    _In_ ACCESS_MASK DesiredAccess
+    )
+/*++
+Routine Description:
+    Decides on a create asking for DesiredAccess in every mode, with
+    every disposition and every create option.
+--*/
+{
+    ULONG mode;
+    ULONG disposition;
+    ULONG option;
+
+    for (mode = 0; mode < DCMODE_MODES; mode++) {
+
+        for (disposition = 0; disposition < DCMODE_DISPOSITIONS; disposition++) {
+
+            DcModeCheck( Table, mode, DesiredAccess, disposition << 24 );
+
+            for (option = 0; option < 24; option++) {
+                DcModeCheck( Table, mode, DesiredAccess, (disposition << 24) | (1UL << option) );
+            }
+        }
+    }
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ULONG modes[DCMODE_MODES];
+    PDCMODE_TABLE table;
+    DCMODE_ENTRY saved;
+    ULONG subset;
+    ULONG i;
+
+    (VOID)argv;
+
+    if (argc != 1) {
+        fprintf( stderr, "Usage: dcmode\n" );
+        return 2;
+    }
+
+    //  Root n has mode n.
+    for (i = 0; i < DCMODE_MODES; i++) {
+        modes[i] = i;
+    }
+
+    if (!NT_SUCCESS( DcModeBuildTable( modes, DCMODE_MODES, &table ) )) {
+        fprintf( stderr, "out of memory\n" );
+        return 1;
+    }
+
+    //  The table as it would be found in a policy image.
+    g_Checks++;
+    if (!NT_SUCCESS( DcModeValidate( table, DcModeTableSize( DCMODE_MODES ) ) )) {
+        printf( "DcModeValidate: rejects the table it was built from\n" );
+        g_Failures++;
+    }
+
+    for (i = 1; i <= DCMODE_MODES; i++) {
+
+        saved = table->Entries[i];
+        table->Entries[i].DeniedAccess ^= FILE_APPEND_DATA;
+
+        g_Checks++;
+        if (NT_SUCCESS( DcModeValidate( table, DcModeTableSize( DCMODE_MODES ) ) )) {
+            printf( "DcModeValidate: takes a changed entry for mode 0x%02X\n", i - 1 );
+            g_Failures++;
+        }
+        table->Entries[i] = saved;
+    }
+
+    g_Checks++;
+    if (NT_SUCCESS( DcModeValidate( table, DcModeTableSize( DCMODE_MODES ) - 1 ) )) {
+        printf( "DcModeValidate: takes a short table\n" );
+        g_Failures++;
+    }
+
+    //  Every right on its own.
+    for (i = 0; i < 32; i++) {
+        DcModeCheckAccess( table, 1UL << i );
+    }
+
+    //  Every combination of the rights a mode denies, alone and along
+    //  with the rights of a plain open.
+    for (subset = 0; subset < (1UL << DCMODE_WRITE_RIGHTS); subset++) {
+
+        ACCESS_MASK access = 0;
+
+        for (i = 0; i < DCMODE_WRITE_RIGHTS; i++) {
+            if ((subset & (1UL << i)) != 0) {
+                access |= g_WriteRights[i];
+            }
+        }
+
+        DcModeCheckAccess( table, access );
+        DcModeCheckAccess( table, access | DCMODE_READ_ACCESS );
+    }
+
+    DcModeFree( table );
+
+    printf( "%llu checks, %llu failures\n", (unsigned long long)g_Checks, (unsigned long long)g_Failures );
+    return g_Failures != 0;
+}
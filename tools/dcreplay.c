@@ -0,0 +1,1011 @@
+/*++
+Copyright (c)
+Module Name:
+    dcreplay.c
+Abstract:
+    Replays creates through the policy core, dcpolicy.h, the way the
+    filter's create callbacks would decide on them, and reports the
+    decisions, the time a create took and what the core allocated.
+
+    dcreplay gen <trace> [count] [seed]
+        Writes a trace of count synthetic creates, 1000000 by default,
+        below \Device\HarddiskVolume3.
+    dcreplay import <text> <trace>
+        Converts lines of "pid access options path", numbers in C
+        notation, to a trace, e.g. creates recorded on a test machine.
+    dcreplay run <policy> <trace> [passes]
+        Replays a trace against a policy, 5 times by default. A policy
+        file has a line per root, its mode followed by its path, e.g.
+        "readonly \Device\HarddiskVolume3\Data", and at most one line
+        "only" or "except" followed by extensions, e.g. "except log,tmp".
+        Modes are those of DCApp: readonly, appendonly, nodelete, noacl.
+
+    Traces are in the format of dctrace.h. A trace is decoded in full
+    before it is replayed, so the time reported is that of the checks
+    alone. Builds on any host the core builds on, e.g.
+
+        cc -O2 -DDC_HOST_ALLOCATOR -Iinc tools/dcreplay.c core/dctrie.c -o dcreplay
+Environment:
+    User mode
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include "dcpolicy.h"
+#include "dctrace.h"
+
+#ifndef DC_HOST_ALLOCATOR
+#error Build with -DDC_HOST_ALLOCATOR so that the allocations of the core are counted
+#endif
+
+#ifndef MAXIMUM_ALLOWED
+#define MAXIMUM_ALLOWED                 0x02000000
+#endif
+
+#ifndef FILE_ALL_ACCESS
+#define FILE_ALL_ACCESS                 0x001F01FF
+#endif
+
+#ifndef FILE_OPEN_BY_FILE_ID
+#define FILE_OPEN_BY_FILE_ID            0x00002000
+#endif
+
+#define DCREPLAY_DEFAULT_COUNT          1000000
+#define DCREPLAY_DEFAULT_PASSES         5
+#define DCREPLAY_BUFFER_SIZE            (1024 * 1024)
+#define DCREPLAY_MAX_LINE               4096
+
+//  Decisions of DcReplayCreate: the DCPOLICY_* values, and an open that
+//  DcPolicyDeniesOpen undid.
+#define DCREPLAY_UNDONE                 4
+#define DCREPLAY_DECISIONS              5
+
+static const char *g_DecisionNames[DCREPLAY_DECISIONS] = {
+    "allowed",
+    "excluded",
+    "denied",
+    "checked after open",
+    "undone",
+};
+
+static const struct {
+    const char *Name;
+    ULONG Mode;
+} g_ModeNames[] = {
+    { "readonly",   DCMODE_READ_ONLY },
+    { "appendonly", DCMODE_APPEND_ONLY },
+    { "nodelete",   DCMODE_NO_DELETE },
+    { "noacl",      DCMODE_NO_ACL_CHANGE },
+};
+
+//  A decoded create; its path lies in the pool of the trace.
+typedef struct _DCREPLAY_OP {
+    ULONG ProcessId;
+    ACCESS_MASK DesiredAccess;
+    ULONG Options;
+    ULONG PathOffset;
+    USHORT PathLength;
+} DCREPLAY_OP, *PDCREPLAY_OP;
+
+typedef struct _DCREPLAY_TRACE {
+    PDCREPLAY_OP Ops;
+    ULONG Count;
+    PWCHAR Pool;
+    ULONG PoolLength;
+    ULONG Size;
+} DCREPLAY_TRACE, *PDCREPLAY_TRACE;
+
+static ULONG64 g_Allocations;
+static ULONG64 g_AllocatedBytes;
+static ULONG64 g_Frees;
+
+
+void *
+DcHostAllocate (
+    size_t Size
+    )
+{
+    g_Allocations++;
+    g_AllocatedBytes += Size;
+    return malloc( Size );
+}
+
+void
+DcHostFree (
+    void *Buffer
+    )
+{
+    g_Frees++;
+    free( Buffer );
+}
+
+static ULONG64
+DcReplayNow (
+    VOID
+    )
+/*++
+Routine Description:
+    Monotonic time in nanoseconds.
+--*/
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter( &counter );
+    QueryPerformanceFrequency( &frequency );
+    return (ULONG64)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+#endif
+}
+
+static ULONG64
+DcReplayRandom (
+    _Inout_ PULONG64 State
+    )
+/*++
+Routine Description:
+    xorshift64*, enough to make up creates.
+--*/
+{
+    ULONG64 x = *State;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static LONG
+DcReplayWiden (
+    _In_ const char *Text,
+    _In_ size_t Length,
+    _Out_writes_(Capacity) PWCHAR Buffer,
+    _In_ ULONG Capacity
+    )
+/*++
+Routine Description:
+    Converts UTF-8 to UTF-16.
+Return Value:
+    Number of characters written, or -1 if the text is malformed or does
+    not fit.
+--*/
+{
+    ULONG written = 0;
+    size_t i = 0;
+
+    while (i < Length) {
+
+        ULONG c = (UCHAR)Text[i++];
+        ULONG extra;
+
+        if (c < 0x80) {
+            extra = 0;
+        } else if ((c & 0xE0) == 0xC0) {
+            c &= 0x1F;
+            extra = 1;
+        } else if ((c & 0xF0) == 0xE0) {
+            c &= 0x0F;
+            extra = 2;
+        } else if ((c & 0xF8) == 0xF0) {
+            c &= 0x07;
+            extra = 3;
+        } else {
+            return -1;
+        }
+
+        if (Length - i < extra) {
+            return -1;
+        }
+
+        for (; extra > 0; extra--) {
+            if ((Text[i] & 0xC0) != 0x80) {
+                return -1;
+            }
+            c = (c << 6) | (Text[i++] & 0x3F);
+        }
+
+        if (c >= 0x10000) {
+            if (c > 0x10FFFF || Capacity - written < 2) {
+                return -1;
+            }
+            c -= 0x10000;
+            Buffer[written++] = (WCHAR)(0xD800 + (c >> 10));
+            Buffer[written++] = (WCHAR)(0xDC00 + (c & 0x3FF));
+        } else {
+            if (Capacity - written < 1) {
+                return -1;
+            }
+            Buffer[written++] = (WCHAR)c;
+        }
+    }
+
+    return (LONG)written;
+}
+
+static char *
+DcReplayTrim (
+    _Inout_ char *Text
+    )
+{
+    size_t length;
+
+    while (isspace( (UCHAR)*Text )) {
+        Text++;
+    }
+
+    length = strlen( Text );
+    while (length > 0 && isspace( (UCHAR)Text[length - 1] )) {
+        Text[--length] = 0;
+    }
+
+    return Text;
+}
+
+static BOOLEAN
+DcReplayAppendCreate (
+    _Inout_ PDCTRACE_WRITER Writer,
+    _In_ FILE *File,
+    _In_ PCDCTRACE_CREATE Create
+    )
+/*++
+Routine Description:
+    Appends a create to a trace, writing out the buffer when it is full.
+--*/
+{
+    ULONG length;
+
+    if (DcTraceAppend( Writer, Create )) {
+        return TRUE;
+    }
+
+    length = DcTraceFlush( Writer );
+    if (fwrite( Writer->Buffer, 1, length, File ) != length) {
+        return FALSE;
+    }
+
+    return DcTraceAppend( Writer, Create );
+}
+
+static BOOLEAN
+DcReplayEndTrace (
+    _Inout_ PDCTRACE_WRITER Writer,
+    _In_ FILE *File
+    )
+{
+    ULONG length = DcTraceFlush( Writer );
+
+    return (BOOLEAN)(fwrite( Writer->Buffer, 1, length, File ) == length &&
+                     fflush( File ) == 0);
+}
+
+static int
+DcReplayGenerate (
+    _In_ const char *TracePath,
+    _In_ ULONG Count,
+    _In_ ULONG64 Seed
+    )
+/*++
+Routine Description:
+    Writes a trace of synthetic creates: mostly reads, spread over a few
+    directory trees, each program staying in one directory for a while,
+    with a share of writes, deletes, MAXIMUM_ALLOWED opens, short names
+    and stream names.
+--*/
+{
+    static const char *directories[] = {
+        "\\Device\\HarddiskVolume3\\Windows\\System32",
+        "\\Device\\HarddiskVolume3\\Windows\\WinSxS\\amd64_microsoft-windows",
+        "\\Device\\HarddiskVolume3\\Program Files\\App%u\\bin",
+        "\\Device\\HarddiskVolume3\\PROGRA~1\\App%u",
+        "\\Device\\HarddiskVolume3\\Users\\user%u\\Documents",
+        "\\Device\\HarddiskVolume3\\Users\\user%u\\AppData\\Local\\Temp",
+        "\\Device\\HarddiskVolume3\\Data\\Projects\\p%u\\src",
+        "\\Device\\HarddiskVolume3\\Data\\Reports\\%u",
+    };
+    static const char *extensions[] = {
+        "dll", "exe", "txt", "log", "docx", "tmp", "dat", "c", "h", "",
+    };
+    DCTRACE_WRITER *writer;
+    DCTRACE_CREATE create;
+    char directory[256];
+    char path[512];
+    WCHAR widePath[512];
+    ULONG64 state = Seed != 0 ? Seed : 1;
+    ULONG64 r;
+    ULONG disposition;
+    ULONG i;
+    LONG length;
+    FILE *file;
+    int result = 1;
+
+    writer = malloc( sizeof(DCTRACE_WRITER) + DCREPLAY_BUFFER_SIZE );
+    file = fopen( TracePath, "wb" );
+    if (writer == NULL || file == NULL) {
+        fprintf( stderr, "cannot create %s\n", TracePath );
+        goto Cleanup;
+    }
+
+    DcTraceBeginWrite( writer, writer + 1, DCREPLAY_BUFFER_SIZE );
+    directory[0] = 0;
+
+    for (i = 0; i < Count; i++) {
+
+        r = DcReplayRandom( &state );
+        if (directory[0] == 0 || r % 10 < 3) {
+            snprintf( directory, sizeof(directory),
+                      directories[(r >> 8) % (sizeof(directories) / sizeof(directories[0]))],
+                      (ULONG)((r >> 16) % 16) );
+        }
+
+        r = DcReplayRandom( &state );
+        snprintf( path, sizeof(path), "%s\\%s%u%s%s%s",
+                  directory,
+                  r % 50 == 0 ? "FILE~" : "file",
+                  (ULONG)((r >> 8) % 500),
+                  extensions[(r >> 20) % (sizeof(extensions) / sizeof(extensions[0]))][0] != 0 ? "." : "",
+                  extensions[(r >> 20) % (sizeof(extensions) / sizeof(extensions[0]))],
+                  r % 97 == 0 ? ":Zone.Identifier" : "" );
+
+        length = DcReplayWiden( path, strlen( path ), widePath, sizeof(widePath) / sizeof(WCHAR) );
+
+        r = DcReplayRandom( &state );
+        switch (r % 100) {
+        case 0: case 1: case 2:
+            create.DesiredAccess = MAXIMUM_ALLOWED;
+            break;
+        case 3: case 4: case 5: case 6: case 7:
+            create.DesiredAccess = DELETE | 0x00100000;
+            break;
+        case 8:
+            create.DesiredAccess = WRITE_DAC | 0x00020000;
+            break;
+        default:
+            if (r % 100 < 25) {
+                create.DesiredAccess = 0x00120116;     //  FILE_GENERIC_WRITE
+            } else {
+                create.DesiredAccess = 0x00120089;     //  FILE_GENERIC_READ
+            }
+            break;
+        }
+
+        switch ((r >> 8) % 20) {
+        case 0:
+            disposition = FILE_CREATE;
+            break;
+        case 1:
+            disposition = FILE_OVERWRITE_IF;
+            break;
+        case 2:
+            disposition = FILE_OPEN_IF;
+            break;
+        case 3:
+            disposition = (r >> 16) % 8 == 0 ? FILE_SUPERSEDE : FILE_OVERWRITE;
+            break;
+        default:
+            disposition = FILE_OPEN;
+            break;
+        }
+
+        //  FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT.
+        create.Options = (disposition << 24) | 0x00000060;
+        if ((r >> 24) % 200 == 0) {
+            create.Options |= FILE_DELETE_ON_CLOSE;
+        }
+
+        create.ProcessId = 4 + 4 * (ULONG)((r >> 32) % 64);
+        create.Path.Buffer = widePath;
+        create.Path.Length = (USHORT)(length * sizeof(WCHAR));
+        create.Path.MaximumLength = create.Path.Length;
+
+        if (!DcReplayAppendCreate( writer, file, &create )) {
+            fprintf( stderr, "cannot write %s\n", TracePath );
+            goto Cleanup;
+        }
+    }
+
+    if (!DcReplayEndTrace( writer, file )) {
+        fprintf( stderr, "cannot write %s\n", TracePath );
+        goto Cleanup;
+    }
+
+    printf( "%u creates written to %s, %ld bytes\n", Count, TracePath, ftell( file ) );
+    result = 0;
+
+Cleanup:
+    if (file != NULL) {
+        fclose( file );
+    }
+    free( writer );
+    return result;
+}
+
+static BOOLEAN
+DcReplayParseCreate (
+    _In_ char *Text,
+    _Out_ PDCTRACE_CREATE Create,
+    _Out_writes_(DCTRACE_MAX_PATH) PWCHAR Path
+    )
+/*++
+Routine Description:
+    Parses a line of "pid access options path".
+--*/
+{
+    ULONG values[3];
+    char *end;
+    LONG length;
+    ULONG i;
+
+    for (i = 0; i < 3; i++) {
+        values[i] = (ULONG)strtoul( Text, &end, 0 );
+        if (end == Text || !isspace( (UCHAR)*end )) {
+            return FALSE;
+        }
+        Text = end;
+    }
+
+    Text = DcReplayTrim( Text );
+    length = DcReplayWiden( Text, strlen( Text ), Path, DCTRACE_MAX_PATH );
+    if (length <= 0) {
+        return FALSE;
+    }
+
+    Create->ProcessId = values[0];
+    Create->DesiredAccess = values[1];
+    Create->Options = values[2];
+    Create->Path.Buffer = Path;
+    Create->Path.Length = (USHORT)(length * sizeof(WCHAR));
+    Create->Path.MaximumLength = Create->Path.Length;
+
+    return TRUE;
+}
+
+static int
+DcReplayImport (
+    _In_ const char *TextPath,
+    _In_ const char *TracePath
+    )
+/*++
+Routine Description:
+    Converts a text list of creates to a trace.
+--*/
+{
+    DCTRACE_WRITER *writer;
+    DCTRACE_CREATE create;
+    static WCHAR widePath[DCTRACE_MAX_PATH];
+    char line[DCREPLAY_MAX_LINE];
+    char *text;
+    ULONG lineNumber = 0;
+    ULONG count = 0;
+    FILE *input;
+    FILE *file = NULL;
+    int result = 1;
+
+    writer = malloc( sizeof(DCTRACE_WRITER) + DCREPLAY_BUFFER_SIZE );
+    input = fopen( TextPath, "r" );
+    if (writer == NULL || input == NULL) {
+        fprintf( stderr, "cannot open %s\n", TextPath );
+        goto Cleanup;
+    }
+
+    file = fopen( TracePath, "wb" );
+    if (file == NULL) {
+        fprintf( stderr, "cannot create %s\n", TracePath );
+        goto Cleanup;
+    }
+
+    DcTraceBeginWrite( writer, writer + 1, DCREPLAY_BUFFER_SIZE );
+
+    while (fgets( line, sizeof(line), input ) != NULL) {
+
+        lineNumber++;
+        text = DcReplayTrim( line );
+        if (*text == 0 || *text == '#') {
+            continue;
+        }
+
+        if (!DcReplayParseCreate( text, &create, widePath )) {
+            fprintf( stderr, "%s(%u): expected pid, access, options and path\n", TextPath, lineNumber );
+            goto Cleanup;
+        }
+
+        if (!DcReplayAppendCreate( writer, file, &create )) {
+            fprintf( stderr, "cannot write %s\n", TracePath );
+            goto Cleanup;
+        }
+        count++;
+    }
+
+    if (!DcReplayEndTrace( writer, file )) {
+        fprintf( stderr, "cannot write %s\n", TracePath );
+        goto Cleanup;
+    }
+
+    printf( "%u creates written to %s, %ld bytes\n", count, TracePath, ftell( file ) );
+    result = 0;
+
+Cleanup:
+    if (file != NULL) {
+        fclose( file );
+    }
+    if (input != NULL) {
+        fclose( input );
+    }
+    free( writer );
+    return result;
+}
+
+static int
+DcReplayLoadPolicy (
+    _In_ const char *PolicyPath,
+    _Out_ PDCPOLICY Policy
+    )
+/*++
+Routine Description:
+    Compiles a policy file, counting what the core allocates for it.
+--*/
+{
+    PDCTRIE_ROOT roots = NULL;
+    PULONG modes = NULL;
+    UNICODE_STRING extensions[DCEXT_MAX_EXTENSIONS];
+    WCHAR extensionPool[DCEXT_MAX_EXTENSIONS * DCEXT_MAX_LENGTH];
+    ULONG extensionCount = 0;
+    ULONG extensionLength = 0;
+    ULONG rule = DCEXT_RULE_ALL;
+    ULONG rootCount = 0;
+    ULONG rootCapacity = 0;
+    ULONG64 allocations = g_Allocations;
+    ULONG64 bytes = g_AllocatedBytes;
+    static WCHAR widePath[DCTRACE_MAX_PATH];
+    char line[DCREPLAY_MAX_LINE];
+    char *text;
+    char *token;
+    ULONG lineNumber = 0;
+    ULONG mode;
+    ULONG i;
+    LONG length;
+    NTSTATUS status;
+    FILE *file;
+    int result = 1;
+
+    RtlZeroMemory( Policy, sizeof(DCPOLICY) );
+
+    file = fopen( PolicyPath, "r" );
+    if (file == NULL) {
+        fprintf( stderr, "cannot open %s\n", PolicyPath );
+        return 1;
+    }
+
+    while (fgets( line, sizeof(line), file ) != NULL) {
+
+        lineNumber++;
+        text = DcReplayTrim( line );
+        if (*text == 0 || *text == '#') {
+            continue;
+        }
+
+        token = text;
+        while (*text != 0 && !isspace( (UCHAR)*text )) {
+            text++;
+        }
+        if (*text != 0) {
+            *text++ = 0;
+        }
+        text = DcReplayTrim( text );
+
+        if (strcmp( token, "only" ) == 0 || strcmp( token, "except" ) == 0) {
+
+            if (rule != DCEXT_RULE_ALL) {
+                fprintf( stderr, "%s(%u): more than one extension rule\n", PolicyPath, lineNumber );
+                goto Cleanup;
+            }
+            rule = strcmp( token, "only" ) == 0 ? DCEXT_RULE_ONLY : DCEXT_RULE_EXCEPT;
+
+            for (token = strtok( text, ", \t" ); token != NULL; token = strtok( NULL, ", \t" )) {
+
+                if (*token == '.') {
+                    token++;
+                }
+
+                length = extensionCount < DCEXT_MAX_EXTENSIONS ?
+                         DcReplayWiden( token, strlen( token ), extensionPool + extensionLength, DCEXT_MAX_LENGTH ) :
+                         -1;
+                if (length <= 0) {
+                    fprintf( stderr, "%s(%u): bad extension %s\n", PolicyPath, lineNumber, token );
+                    goto Cleanup;
+                }
+
+                extensions[extensionCount].Buffer = extensionPool + extensionLength;
+                extensions[extensionCount].Length = (USHORT)(length * sizeof(WCHAR));
+                extensions[extensionCount].MaximumLength = extensions[extensionCount].Length;
+                extensionCount++;
+                extensionLength += DCEXT_MAX_LENGTH;
+            }
+            continue;
+        }
+
+        for (i = 0; i < sizeof(g_ModeNames) / sizeof(g_ModeNames[0]); i++) {
+            if (strcmp( token, g_ModeNames[i].Name ) == 0) {
+                break;
+            }
+        }
+        if (i == sizeof(g_ModeNames) / sizeof(g_ModeNames[0])) {
+            fprintf( stderr, "%s(%u): unknown mode %s\n", PolicyPath, lineNumber, token );
+            goto Cleanup;
+        }
+        mode = g_ModeNames[i].Mode;
+
+        length = DcReplayWiden( text, strlen( text ), widePath, DCTRACE_MAX_PATH );
+        if (length <= 0) {
+            fprintf( stderr, "%s(%u): expected a path\n", PolicyPath, lineNumber );
+            goto Cleanup;
+        }
+
+        if (rootCount == rootCapacity) {
+
+            PDCTRIE_ROOT newRoots;
+            PULONG newModes;
+
+            rootCapacity = rootCapacity != 0 ? rootCapacity * 2 : 16;
+            newRoots = realloc( roots, rootCapacity * sizeof(DCTRIE_ROOT) );
+            if (newRoots != NULL) {
+                roots = newRoots;
+            }
+            newModes = realloc( modes, rootCapacity * sizeof(ULONG) );
+            if (newModes != NULL) {
+                modes = newModes;
+            }
+            if (newRoots == NULL || newModes == NULL) {
+                fprintf( stderr, "out of memory\n" );
+                goto Cleanup;
+            }
+        }
+
+        roots[rootCount].Path.Buffer = malloc( length * sizeof(WCHAR) );
+        if (roots[rootCount].Path.Buffer == NULL) {
+            fprintf( stderr, "out of memory\n" );
+            goto Cleanup;
+        }
+        RtlCopyMemory( roots[rootCount].Path.Buffer, widePath, length * sizeof(WCHAR) );
+        roots[rootCount].Path.Length = (USHORT)(length * sizeof(WCHAR));
+        roots[rootCount].Path.MaximumLength = roots[rootCount].Path.Length;
+        roots[rootCount].RootId = rootCount;
+        modes[rootCount] = mode;
+        rootCount++;
+    }
+
+    status = DcModeBuildTable( modes, rootCount, &Policy->Modes );
+    if (NT_SUCCESS( status )) {
+        status = DcTrieBuild( roots, rootCount, &Policy->Roots );
+    }
+    if (NT_SUCCESS( status ) && rule != DCEXT_RULE_ALL) {
+        status = DcExtBuildSet( rule, extensions, extensionCount,
+                                DcReplayNow() ^ 0x9E3779B97F4A7C15ULL, &Policy->Extensions );
+    }
+    if (!NT_SUCCESS( status )) {
+        fprintf( stderr, "%s: cannot compile the policy, status 0x%08X\n", PolicyPath, (ULONG)status );
+        goto Cleanup;
+    }
+
+    printf( "policy: %u roots, extension rule %s with %u extensions, %llu allocations, %llu bytes\n",
+            rootCount,
+            rule == DCEXT_RULE_ONLY ? "only" : rule == DCEXT_RULE_EXCEPT ? "except" : "none",
+            extensionCount,
+            (unsigned long long)(g_Allocations - allocations),
+            (unsigned long long)(g_AllocatedBytes - bytes) );
+    result = 0;
+
+Cleanup:
+    for (i = 0; i < rootCount; i++) {
+        free( roots[i].Path.Buffer );
+    }
+    free( roots );
+    free( modes );
+    fclose( file );
+    return result;
+}
+
+static VOID
+DcReplayFreePolicy (
+    _In_ PDCPOLICY Policy
+    )
+{
+    if (Policy->Roots != NULL) {
+        DcTrieFree( Policy->Roots );
+    }
+    if (Policy->Modes != NULL) {
+        DcModeFree( Policy->Modes );
+    }
+    if (Policy->Extensions != NULL) {
+        DcExtFree( Policy->Extensions );
+    }
+}
+
+static int
+DcReplayLoadTrace (
+    _In_ const char *TracePath,
+    _Out_ PDCREPLAY_TRACE Trace
+    )
+/*++
+Routine Description:
+    Reads and decodes a whole trace.
+--*/
+{
+    DCTRACE_READER *reader = NULL;
+    DCTRACE_CREATE create;
+    PUCHAR buffer = NULL;
+    ULONG capacity = 0;
+    ULONG poolCapacity = 0;
+    long size;
+    NTSTATUS status;
+    FILE *file;
+    int result = 1;
+
+    RtlZeroMemory( Trace, sizeof(DCREPLAY_TRACE) );
+
+    file = fopen( TracePath, "rb" );
+    if (file == NULL) {
+        fprintf( stderr, "cannot open %s\n", TracePath );
+        return 1;
+    }
+
+    if (fseek( file, 0, SEEK_END ) != 0 || (size = ftell( file )) < 0 ||
+        (unsigned long)size > 0xFFFFFFF0UL || fseek( file, 0, SEEK_SET ) != 0) {
+        fprintf( stderr, "cannot read %s\n", TracePath );
+        goto Cleanup;
+    }
+
+    buffer = malloc( size != 0 ? (size_t)size : 1 );
+    reader = malloc( sizeof(DCTRACE_READER) );
+    if (buffer == NULL || reader == NULL) {
+        fprintf( stderr, "out of memory\n" );
+        goto Cleanup;
+    }
+
+    if (fread( buffer, 1, (size_t)size, file ) != (size_t)size) {
+        fprintf( stderr, "cannot read %s\n", TracePath );
+        goto Cleanup;
+    }
+    Trace->Size = (ULONG)size;
+
+    status = DcTraceBeginRead( reader, buffer, (ULONG)size );
+    while (NT_SUCCESS( status )) {
+
+        status = DcTraceRead( reader, &create );
+        if (status != STATUS_SUCCESS) {
+            break;
+        }
+
+        if (Trace->Count == capacity) {
+            capacity = capacity != 0 ? capacity * 2 : 65536;
+            Trace->Ops = realloc( Trace->Ops, capacity * sizeof(DCREPLAY_OP) );
+            if (Trace->Ops == NULL) {
+                fprintf( stderr, "out of memory\n" );
+                goto Cleanup;
+            }
+        }
+
+        while (poolCapacity - Trace->PoolLength < create.Path.Length / sizeof(WCHAR)) {
+            poolCapacity = poolCapacity != 0 ? poolCapacity * 2 : 1024 * 1024;
+            Trace->Pool = realloc( Trace->Pool, poolCapacity * sizeof(WCHAR) );
+            if (Trace->Pool == NULL) {
+                fprintf( stderr, "out of memory\n" );
+                goto Cleanup;
+            }
+        }
+
+        Trace->Ops[Trace->Count].ProcessId = create.ProcessId;
+        Trace->Ops[Trace->Count].DesiredAccess = create.DesiredAccess;
+        Trace->Ops[Trace->Count].Options = create.Options;
+        Trace->Ops[Trace->Count].PathOffset = Trace->PoolLength;
+        Trace->Ops[Trace->Count].PathLength = create.Path.Length / sizeof(WCHAR);
+        RtlCopyMemory( Trace->Pool + Trace->PoolLength, create.Path.Buffer, create.Path.Length );
+        Trace->PoolLength += create.Path.Length / sizeof(WCHAR);
+        Trace->Count++;
+    }
+
+    if (status != STATUS_NO_MORE_ENTRIES) {
+        fprintf( stderr, "%s: malformed trace after %u creates\n", TracePath, Trace->Count );
+        goto Cleanup;
+    }
+
+    result = 0;
+
+Cleanup:
+    free( reader );
+    free( buffer );
+    fclose( file );
+    return result;
+}
+
+static ULONG
+DcReplayCreate (
+    _In_ PCDCPOLICY Policy,
+    _In_ const DCREPLAY_OP *Op,
+    _In_ PCWSTR Pool
+    )
+/*++
+Routine Description:
+    Decides on a create as DirCtlDecideCreate and DirCtlPostCreate do.
+    The filter checks the opened name first and the normalized name if
+    that is ambiguous; a trace holds one name, which serves as both.
+    Where the filter waits for the open, the file system is taken to
+    grant what was asked for, and everything for MAXIMUM_ALLOWED, and to
+    open a file that exists rather than create one.
+Return Value:
+    DCPOLICY_* decision, or DCREPLAY_UNDONE.
+--*/
+{
+    UNICODE_STRING path;
+    DCMODE_ENTRY mode;
+    BOOLEAN ambiguous = TRUE;
+    ACCESS_MASK granted;
+    ULONG rootId = DCTRIE_NO_ROOT;
+    ULONG decision;
+
+    path.Buffer = (PWSTR)(Pool + Op->PathOffset);
+    path.Length = (USHORT)(Op->PathLength * sizeof(WCHAR));
+    path.MaximumLength = path.Length;
+
+    if ((Op->Options & FILE_OPEN_BY_FILE_ID) == 0) {
+        rootId = DcPolicyCheckOpenedPath( Policy, &path, &ambiguous, &mode );
+    }
+    if (ambiguous) {
+        rootId = DcPolicyCheckPath( Policy, &path, &mode );
+    }
+
+    decision = DcPolicyDecideCreate( rootId, &mode, Op->DesiredAccess, Op->Options );
+    if (decision == DCPOLICY_CHECK_OPEN) {
+
+        granted = (Op->DesiredAccess & MAXIMUM_ALLOWED) != 0 ? FILE_ALL_ACCESS : Op->DesiredAccess;
+        if (DcPolicyDeniesOpen( mode.DeniedAccess, granted )) {
+            decision = DCREPLAY_UNDONE;
+        }
+    }
+
+    return decision;
+}
+
+static int
+DcReplayRun (
+    _In_ const char *PolicyPath,
+    _In_ const char *TracePath,
+    _In_ ULONG Passes
+    )
+{
+    DCPOLICY policy;
+    DCREPLAY_TRACE trace;
+    ULONG64 decisions[DCREPLAY_DECISIONS] = { 0 };
+    ULONG64 allocations;
+    ULONG64 bytes;
+    ULONG64 frees;
+    ULONG64 start;
+    ULONG64 elapsed;
+    ULONG64 total = 0;
+    ULONG64 best = (ULONG64)-1;
+    ULONG pass;
+    ULONG i;
+    int result = 1;
+
+    if (DcReplayLoadPolicy( PolicyPath, &policy ) != 0) {
+        DcReplayFreePolicy( &policy );
+        return 1;
+    }
+
+    if (DcReplayLoadTrace( TracePath, &trace ) != 0) {
+        goto Cleanup;
+    }
+
+    printf( "trace: %u creates, %u bytes, %.1f bytes per create\n",
+            trace.Count, trace.Size, trace.Count != 0 ? (double)trace.Size / trace.Count : 0.0 );
+
+    if (trace.Count == 0) {
+        result = 0;
+        goto Cleanup;
+    }
+
+    allocations = g_Allocations;
+    bytes = g_AllocatedBytes;
+    frees = g_Frees;
+
+    for (pass = 0; pass < Passes; pass++) {
+
+        start = DcReplayNow();
+        for (i = 0; i < trace.Count; i++) {
+            decisions[DcReplayCreate( &policy, &trace.Ops[i], trace.Pool )]++;
+        }
+        elapsed = DcReplayNow() - start;
+
+        total += elapsed;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    printf( "replay: %u passes, %.1f ns/op mean, %.1f ns/op best, %.2f million creates/s\n",
+            Passes,
+            (double)total / ((double)trace.Count * Passes),
+            (double)best / trace.Count,
+            (double)trace.Count * Passes * 1e3 / (double)total );
+
+    printf( "allocations during replay: %llu, %llu bytes, %llu frees\n",
+            (unsigned long long)(g_Allocations - allocations),
+            (unsigned long long)(g_AllocatedBytes - bytes),
+            (unsigned long long)(g_Frees - frees) );
+
+    printf( "decisions per pass:" );
+    for (i = 0; i < DCREPLAY_DECISIONS; i++) {
+        printf( "%s %s %llu", i != 0 ? "," : "", g_DecisionNames[i],
+                (unsigned long long)(decisions[i] / Passes) );
+    }
+    printf( "\n" );
+
+    result = 0;
+
+Cleanup:
+    free( trace.Ops );
+    free( trace.Pool );
+    DcReplayFreePolicy( &policy );
+    return result;
+}
+
+static void
+Usage (
+    void
+    )
+{
+    fprintf( stderr, "Usage: dcreplay gen <trace> [count] [seed]\n" );
+    fprintf( stderr, "       dcreplay import <text> <trace>\n" );
+    fprintf( stderr, "       dcreplay run <policy> <trace> [passes]\n" );
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ULONG count = DCREPLAY_DEFAULT_COUNT;
+    ULONG passes = DCREPLAY_DEFAULT_PASSES;
+    ULONG64 seed = 1;
+
+    if (argc >= 3 && argc <= 5 && strcmp( argv[1], "gen" ) == 0) {
+
+        if (argc >= 4) {
+            count = (ULONG)strtoul( argv[3], NULL, 0 );
+        }
+        if (argc == 5) {
+            seed = strtoull( argv[4], NULL, 0 );
+        }
+        return DcReplayGenerate( argv[2], count, seed );
+    }
+
+    if (argc == 4 && strcmp( argv[1], "import" ) == 0) {
+        return DcReplayImport( argv[2], argv[3] );
+    }
+
+    if ((argc == 4 || argc == 5) && strcmp( argv[1], "run" ) == 0) {
+
+        if (argc == 5) {
+            passes = (ULONG)strtoul( argv[4], NULL, 0 );
+        }
+        if (passes == 0) {
+            Usage();
+            return 1;
+        }
+        return DcReplayRun( argv[2], argv[3], passes );
+    }
+
+    Usage();
+    return 1;
+}
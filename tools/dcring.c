@@ -0,0 +1,1182 @@
+/*++
+Copyright (c)
+Module Name:
+    dcring.c
+Abstract:
+    Checks the shared event ring of dcring.h, alone and with a producer
+    and a consumer thread.
+
+    dcring verify
+        Fills rings to the last byte, wraps records around the end with
+        padding, walks the ConsumerWaiting handshake step by step, has
+        the consumer store Heads the producer must not believe, and feeds
+        the consumer rings full of random bytes. Then runs producer and
+        consumer threads where the consumer stores an impossible Head
+        after a while, which must leave the producer broken.
+    dcring stress [records]
+        Runs a producer thread against a consumer thread through a small
+        ring, each in turn faster than the other, so that the ring wraps,
+        fills and empties and the consumer waits for the doorbell. Every
+        record is checked where it is found.
+
+    Builds on any host with threads, e.g.
+
+        cc -O2 -Iinc tools/dcring.c -o dcring -lpthread
+
+    Each ring ends where its allocation does, so the address sanitizer,
+    -fsanitize=address, catches any access past it.
+Environment:
+    User mode
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+#include "dcring.h"
+
+#define DCRING_TEST_DATA_SIZE           4096
+#define DCRING_TEST_BUFFER_SIZE         (sizeof(DCRING_HEADER) + DCRING_TEST_DATA_SIZE)
+#define DCRING_DEFAULT_RECORDS          1000000
+#define DCRING_BOGUS_ROUNDS             200
+#define DCRING_FUZZ_ROUNDS              20000
+#define DCRING_DOORBELL_TIMEOUT         1000
+
+//  Records are sent in phases of 4096. In one phase out of eight the
+//  producer pauses every few records, so that the consumer runs dry and
+//  waits; in another the consumer pauses on every record, so that the
+//  ring fills.
+#define DCRING_PHASE(Sequence)          ((ULONG)((Sequence) >> 12) & 7)
+#define DCRING_PHASE_SLOW_PRODUCER      6
+#define DCRING_PHASE_SLOW_CONSUMER      7
+
+#ifdef _WIN32
+#define DCRING_THREAD_RESULT            DWORD WINAPI
+#define DCRING_THREAD_RETURN            0
+typedef HANDLE DCRING_THREAD;
+typedef LPTHREAD_START_ROUTINE DCRING_THREAD_ROUTINE;
+#else
+#define DCRING_THREAD_RESULT            void *
+#define DCRING_THREAD_RETURN            NULL
+typedef pthread_t DCRING_THREAD;
+typedef void *(*DCRING_THREAD_ROUTINE)(void *);
+#endif
+
+typedef struct _DCRING_DOORBELL {
+#ifdef _WIN32
+    HANDLE Event;
+#else
+    pthread_mutex_t Lock;
+    pthread_cond_t Rung;
+    BOOLEAN Signaled;
+#endif
+} DCRING_DOORBELL, *PDCRING_DOORBELL;
+
+typedef struct _DCRING_TEST {
+    PUCHAR Buffer;
+    DCRING_PRODUCER Producer;
+    DCRING_CONSUMER Consumer;
+    DCRING_DOORBELL Doorbell;
+    ULONG64 Records;
+
+    //  Set by each side when it stops, read by the other.
+    volatile LONG64 ProducerDone;
+    volatile LONG64 ConsumerDone;
+
+    //  For a test of a broken consumer: how many records it reads before
+    //  storing Bogus as its Head, and how it makes up Bogus.
+    BOOLEAN Sabotage;
+    ULONG64 SabotageAfter;
+    ULONG SabotageKind;
+
+    //  Kept by the producer.
+    ULONG64 Sent;
+    ULONG64 Outside;
+    ULONG64 Full;
+    ULONG64 Rings;
+
+    //  Kept by the consumer.
+    ULONG64 Received;
+    ULONG64 Paddings;
+    ULONG64 Waits;
+    ULONG64 Timeouts;
+} DCRING_TEST, *PDCRING_TEST;
+
+static ULONG64 g_Checks;
+static ULONG64 g_Failures;
+
+#define DcRingFail(...)                                         \
+    do {                                                        \
+        if (g_Failures++ < 10) {                                \
+            printf( __VA_ARGS__ );                              \
+            printf( "\n" );                                     \
+        }                                                       \
+    } while (0)
+
+static ULONG64
+DcRingNow (
+    VOID
+    )
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter( &counter );
+    QueryPerformanceFrequency( &frequency );
+    return (ULONG64)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+#endif
+}
+
+static ULONG
+DcRingRandom (
+    _Inout_ PULONG64 State
+    )
+{
+    ULONG64 x = *State;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+    return (ULONG)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static ULONG64
+DcRingMix (
+    _In_ ULONG64 Value
+    )
+/*++
+Routine Description:
+    Scrambles a sequence number, so that producer and consumer agree on
+    everything about a record without sharing a generator.
+--*/
+{
+    Value += 0x9E3779B97F4A7C15ULL;
+    Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBULL;
+    return Value ^ (Value >> 31);
+}
+
+static ULONG
+DcRingPayloadLength (
+    _In_ ULONG64 Sequence,
+    _In_ ULONG DataSize
+    )
+/*++
+Routine Description:
+    Payloads are mostly short, and one in 256 is anything up to the
+    largest that fits an empty ring wherever its Tail is, half the data
+    area.
+--*/
+{
+    ULONG64 mix = DcRingMix( Sequence );
+    ULONG largest = DataSize / 2 - (ULONG)sizeof(DCRING_RECORD);
+
+    if ((mix & 0xFF) == 0) {
+        return (ULONG)((mix >> 8) % (largest + 1));
+    }
+
+    return (ULONG)((mix >> 8) % 200);
+}
+
+static ULONG
+DcRingType (
+    _In_ ULONG64 Sequence
+    )
+{
+    return (ULONG)Sequence | 0x80000000;
+}
+
+static VOID
+DcRingFillPayload (
+    _In_ ULONG64 Sequence,
+    _Out_writes_bytes_(Length) PUCHAR Payload,
+    _In_ ULONG Length
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        Payload[i] = (UCHAR)((Sequence >> (8 * (i & 7))) ^ i);
+    }
+}
+
+static BOOLEAN
+DcRingCheckPayload (
+    _In_ ULONG64 Sequence,
+    _In_reads_bytes_(Length) const UCHAR *Payload,
+    _In_ ULONG Length
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        if (Payload[i] != (UCHAR)((Sequence >> (8 * (i & 7))) ^ i)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static VOID
+DcRingPause (
+    _In_ ULONG Spins
+    )
+{
+    volatile ULONG spin;
+
+    for (spin = 0; spin < Spins; spin++) {
+    }
+}
+
+static VOID
+DcRingYield (
+    VOID
+    )
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static BOOLEAN
+DcRingInitializeDoorbell (
+    _Out_ PDCRING_DOORBELL Doorbell
+    )
+{
+#ifdef _WIN32
+    Doorbell->Event = CreateEventW( NULL, FALSE, FALSE, NULL );
+    return (BOOLEAN)(Doorbell->Event != NULL);
+#else
+    Doorbell->Signaled = FALSE;
+    return (BOOLEAN)(pthread_mutex_init( &Doorbell->Lock, NULL ) == 0 &&
+                     pthread_cond_init( &Doorbell->Rung, NULL ) == 0);
+#endif
+}
+
+static VOID
+DcRingDeleteDoorbell (
+    _Inout_ PDCRING_DOORBELL Doorbell
+    )
+{
+#ifdef _WIN32
+    CloseHandle( Doorbell->Event );
+#else
+    pthread_cond_destroy( &Doorbell->Rung );
+    pthread_mutex_destroy( &Doorbell->Lock );
+#endif
+}
+
+static VOID
+DcRingRingDoorbell (
+    _Inout_ PDCRING_DOORBELL Doorbell
+    )
+/*++
+Routine Description:
+    Sets the doorbell, which stays set until a wait takes it, as the
+    event the filter signals does.
+--*/
+{
+#ifdef _WIN32
+    SetEvent( Doorbell->Event );
+#else
+    pthread_mutex_lock( &Doorbell->Lock );
+    Doorbell->Signaled = TRUE;
+    pthread_cond_signal( &Doorbell->Rung );
+    pthread_mutex_unlock( &Doorbell->Lock );
+#endif
+}
+
+static BOOLEAN
+DcRingWaitDoorbell (
+    _Inout_ PDCRING_DOORBELL Doorbell,
+    _In_ ULONG Milliseconds
+    )
+/*++
+Return Value:
+    TRUE if the doorbell rang, FALSE if the wait timed out.
+--*/
+{
+#ifdef _WIN32
+    return (BOOLEAN)(WaitForSingleObject( Doorbell->Event, Milliseconds ) == WAIT_OBJECT_0);
+#else
+    struct timespec deadline;
+    BOOLEAN rung;
+
+    clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += Milliseconds / 1000;
+    deadline.tv_nsec += (long)(Milliseconds % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock( &Doorbell->Lock );
+    while (!Doorbell->Signaled) {
+        if (pthread_cond_timedwait( &Doorbell->Rung, &Doorbell->Lock, &deadline ) != 0) {
+            break;
+        }
+    }
+    rung = Doorbell->Signaled;
+    Doorbell->Signaled = FALSE;
+    pthread_mutex_unlock( &Doorbell->Lock );
+
+    return rung;
+#endif
+}
+
+static BOOLEAN
+DcRingStartThread (
+    _Out_ DCRING_THREAD *Thread,
+    _In_ DCRING_THREAD_ROUTINE Routine,
+    _In_ PVOID Context
+    )
+{
+#ifdef _WIN32
+    *Thread = CreateThread( NULL, 0, Routine, Context, 0, NULL );
+    return (BOOLEAN)(*Thread != NULL);
+#else
+    return (BOOLEAN)(pthread_create( Thread, NULL, Routine, Context ) == 0);
+#endif
+}
+
+static VOID
+DcRingJoinThread (
+    _In_ DCRING_THREAD Thread
+    )
+{
+#ifdef _WIN32
+    WaitForSingleObject( Thread, INFINITE );
+    CloseHandle( Thread );
+#else
+    pthread_join( Thread, NULL );
+#endif
+}
+
+static PUCHAR
+DcRingAllocate (
+    _In_ ULONG Size
+    )
+/*++
+Routine Description:
+    Allocates a ring buffer. malloc aligns it for any type, and the ring
+    ends where the allocation does.
+--*/
+{
+    PUCHAR buffer = malloc( Size );
+
+    if (buffer == NULL) {
+        fprintf( stderr, "out of memory\n" );
+        exit( 1 );
+    }
+
+    return buffer;
+}
+
+static VOID
+DcRingFormat (
+    _Out_writes_bytes_(DCRING_TEST_BUFFER_SIZE) PUCHAR Buffer,
+    _Out_ PDCRING_PRODUCER Producer,
+    _Out_ PDCRING_CONSUMER Consumer
+    )
+/*++
+Routine Description:
+    Formats an empty test ring and attaches both sides to it.
+--*/
+{
+    if (!NT_SUCCESS( DcRingInitializeProducer( Producer, Buffer, DCRING_TEST_BUFFER_SIZE ) ) ||
+        !NT_SUCCESS( DcRingAttachConsumer( Consumer, Buffer, DCRING_TEST_BUFFER_SIZE ) )) {
+        fprintf( stderr, "cannot format a ring of %u bytes\n", (ULONG)DCRING_TEST_BUFFER_SIZE );
+        exit( 1 );
+    }
+}
+
+static BOOLEAN
+DcRingPayloadInside (
+    _In_ const DCRING_PRODUCER *Producer,
+    _In_ const VOID *Payload,
+    _In_ ULONG Length
+    )
+{
+    const UCHAR *record = (const UCHAR *)Payload - sizeof(DCRING_RECORD);
+
+    return (BOOLEAN)(record >= Producer->Data && (const UCHAR *)Payload + Length <= Producer->Data + Producer->DataSize);
+}
+
+static VOID
+DcRingCheckPayloadInside (
+    _In_ const DCRING_PRODUCER *Producer,
+    _In_ const VOID *Payload,
+    _In_ ULONG Length
+    )
+{
+    g_Checks++;
+    if (!DcRingPayloadInside( Producer, Payload, Length )) {
+        DcRingFail( "DcRingReserve: %u bytes at %td outside the data area",
+                    Length, (const UCHAR *)Payload - sizeof(DCRING_RECORD) - Producer->Data );
+    }
+}
+
+static VOID
+DcRingCheckRecordInside (
+    _In_ const DCRING_CONSUMER *Consumer,
+    _In_ const DCRING_RECORD *Record
+    )
+{
+    const UCHAR *start = (const UCHAR *)Record;
+
+    g_Checks++;
+    if (start < Consumer->Data || start + Record->Length > Consumer->Data + Consumer->DataSize) {
+        DcRingFail( "DcRingPeek: %u bytes at %td outside the data area",
+                    Record->Length, start - Consumer->Data );
+    }
+}
+
+static VOID
+DcRingCheckLayout (
+    VOID
+    )
+/*++
+Routine Description:
+    Checks the sizes rings are made in and that a consumer only attaches
+    to a header that describes a ring inside the buffer.
+--*/
+{
+    PUCHAR buffer = DcRingAllocate( DCRING_TEST_BUFFER_SIZE + DCRING_ALIGNMENT );
+    DCRING_PRODUCER producer;
+    DCRING_CONSUMER consumer;
+    DCRING_HEADER saved;
+    PDCRING_HEADER ring = (PDCRING_HEADER)buffer;
+    ULONG size;
+    ULONG dataSize;
+    ULONG i;
+
+    for (size = 0; size <= 3 * DCRING_TEST_BUFFER_SIZE; size++) {
+
+        dataSize = DcRingDataSize( size );
+
+        g_Checks++;
+        if (size < sizeof(DCRING_HEADER) + DCRING_CACHE_LINE ? dataSize != 0 :
+            (dataSize & (dataSize - 1)) != 0 || dataSize < DCRING_CACHE_LINE ||
+            dataSize > size - sizeof(DCRING_HEADER) || 2 * dataSize <= size - sizeof(DCRING_HEADER)) {
+            DcRingFail( "DcRingDataSize: %u bytes of data in %u", dataSize, size );
+        }
+    }
+
+    g_Checks++;
+    if (NT_SUCCESS( DcRingInitializeProducer( &producer, buffer + 4, DCRING_TEST_BUFFER_SIZE ) ) ||
+        NT_SUCCESS( DcRingInitializeProducer( &producer, buffer, sizeof(DCRING_HEADER) + DCRING_CACHE_LINE - 1 ) ) ||
+        !NT_SUCCESS( DcRingInitializeProducer( &producer, buffer, DCRING_TEST_BUFFER_SIZE ) ) ||
+        producer.DataSize != DCRING_TEST_DATA_SIZE) {
+        DcRingFail( "DcRingInitializeProducer: wrong buffers taken or refused" );
+    }
+
+    g_Checks++;
+    if (!NT_SUCCESS( DcRingAttachConsumer( &consumer, buffer, DCRING_TEST_BUFFER_SIZE ) ) ||
+        NT_SUCCESS( DcRingAttachConsumer( &consumer, buffer, DCRING_TEST_BUFFER_SIZE - 1 ) ) ||
+        NT_SUCCESS( DcRingAttachConsumer( &consumer, buffer, sizeof(DCRING_HEADER) - 1 ) )) {
+        DcRingFail( "DcRingAttachConsumer: wrong buffer sizes taken or refused" );
+    }
+
+    saved = *ring;
+    for (i = 0; i < 8; i++) {
+
+        *ring = saved;
+        switch (i) {
+        case 0: ring->Magic++; break;
+        case 1: ring->Version++; break;
+        case 2: ring->DataOffset += DCRING_ALIGNMENT; break;
+        case 3: ring->DataOffset = 0; break;
+        case 4: ring->DataSize *= 2; break;
+        case 5: ring->DataSize += DCRING_CACHE_LINE; break;
+        case 6: ring->DataSize = DCRING_CACHE_LINE / 2; break;
+        case 7: ring->DataSize = 0; break;
+        }
+
+        g_Checks++;
+        if (NT_SUCCESS( DcRingAttachConsumer( &consumer, buffer, DCRING_TEST_BUFFER_SIZE ) )) {
+            DcRingFail( "DcRingAttachConsumer: takes header change %u", i );
+        }
+    }
+
+    free( buffer );
+}
+
+static VOID
+DcRingCheckFullAndPadding (
+    VOID
+    )
+/*++
+Routine Description:
+    Fills a ring to the last byte with records of every size, frees them
+    one by one, and checks where the padding goes when the next record
+    does not fit before the end of the data area.
+--*/
+{
+    PUCHAR buffer = DcRingAllocate( DCRING_TEST_BUFFER_SIZE );
+    DCRING_PRODUCER producer;
+    DCRING_CONSUMER consumer;
+    const DCRING_RECORD *record;
+    const DCRING_RECORD *padding;
+    ULONG payloadLength;
+    ULONG length;
+    ULONG offset;
+    ULONG needed;
+    ULONG room;
+    ULONG count;
+    ULONG i;
+    PVOID payload;
+
+    for (payloadLength = 0; payloadLength <= DCRING_TEST_DATA_SIZE; payloadLength++) {
+
+        DcRingFormat( buffer, &producer, &consumer );
+        length = DCRING_RECORD_SIZE( payloadLength );
+
+        //  As many records as fit, and not one more.
+        for (count = 0; (payload = DcRingReserve( &producer, 1, payloadLength )) != NULL; count++) {
+            DcRingCheckPayloadInside( &producer, payload, payloadLength );
+            memset( payload, 0xA5, payloadLength );
+        }
+        DcRingCommit( &producer );
+
+        g_Checks++;
+        if (producer.Broken || count != DCRING_TEST_DATA_SIZE / length) {
+            DcRingFail( "DcRingReserve: %u records of %u bytes in %u", count, length, DCRING_TEST_DATA_SIZE );
+            continue;
+        }
+
+        if (count == 0) {
+            continue;
+        }
+
+        //  Freeing the oldest makes room for one more, after padding if
+        //  the data area is not a multiple of the record.
+        for (i = 0; i < count; i++) {
+
+            record = DcRingPeek( &consumer );
+
+            g_Checks++;
+            if (record == NULL || record->Type != 1 || record->Length != length) {
+                DcRingFail( "DcRingPeek: no record %u of %u bytes", i, length );
+                break;
+            }
+            DcRingCheckRecordInside( &consumer, record );
+            DcRingRelease( &consumer, record );
+
+            offset = (ULONG)producer.Tail & (DCRING_TEST_DATA_SIZE - 1);
+            needed = length + ((offset + length > DCRING_TEST_DATA_SIZE) ? DCRING_TEST_DATA_SIZE - offset : 0);
+            room = DCRING_TEST_DATA_SIZE - (ULONG)(producer.Tail - consumer.Head);
+            payload = DcRingReserve( &producer, 2, payloadLength );
+            DcRingCommit( &producer );
+
+            g_Checks++;
+            if ((payload != NULL) != (needed <= room)) {
+                DcRingFail( "DcRingReserve: %u bytes %s with %u free",
+                            needed, payload != NULL ? "taken" : "refused", room );
+            }
+
+            g_Checks++;
+            if (offset + length > DCRING_TEST_DATA_SIZE && payload != NULL) {
+
+                //  Only when the records up to the end have been freed.
+                padding = (const DCRING_RECORD *)(producer.Data + offset);
+                if (padding->Type != DCRING_RECORD_PADDING || padding->Length != DCRING_TEST_DATA_SIZE - offset ||
+                    (PUCHAR)payload != producer.Data + sizeof(DCRING_RECORD)) {
+                    DcRingFail( "DcRingReserve: no padding of %u bytes before a record of %u",
+                                DCRING_TEST_DATA_SIZE - offset, length );
+                }
+            }
+
+            if (payload != NULL) {
+                DcRingCheckPayloadInside( &producer, payload, payloadLength );
+                memset( payload, 0x5A, payloadLength );
+            }
+        }
+    }
+
+    free( buffer );
+}
+
+static VOID
+DcRingCheckDoorbell (
+    VOID
+    )
+/*++
+Routine Description:
+    Walks the ConsumerWaiting handshake one side at a time.
+--*/
+{
+    PUCHAR buffer = DcRingAllocate( DCRING_TEST_BUFFER_SIZE );
+    DCRING_PRODUCER producer;
+    DCRING_CONSUMER consumer;
+    PDCRING_HEADER ring = (PDCRING_HEADER)buffer;
+
+    DcRingFormat( buffer, &producer, &consumer );
+
+    //  Nobody waits, nobody rings.
+    DcRingReserve( &producer, 1, 8 );
+    DcRingCommit( &producer );
+
+    g_Checks++;
+    if (DcRingShouldRing( &producer ) || ring->ConsumerWaiting != 0) {
+        DcRingFail( "DcRingShouldRing: rings with nobody waiting" );
+    }
+
+    //  Records are there, so the consumer must not wait.
+    g_Checks++;
+    if (DcRingPrepareWait( &consumer ) || ring->ConsumerWaiting != 0) {
+        DcRingFail( "DcRingPrepareWait: waits with a record in the ring" );
+    }
+
+    DcRingRelease( &consumer, DcRingPeek( &consumer ) );
+
+    //  Empty: the consumer waits, and the next commit rings once.
+    g_Checks++;
+    if (!DcRingPrepareWait( &consumer ) || ring->ConsumerWaiting != 1) {
+        DcRingFail( "DcRingPrepareWait: does not wait on an empty ring" );
+    }
+
+    DcRingReserve( &producer, 1, 8 );
+
+    //  Not before the record is committed.
+    g_Checks++;
+    if (DcRingPrepareWait( &consumer ) != TRUE) {
+        DcRingFail( "DcRingPrepareWait: sees a record before it is committed" );
+    }
+
+    DcRingCommit( &producer );
+
+    g_Checks++;
+    if (!DcRingShouldRing( &producer ) || ring->ConsumerWaiting != 0 || DcRingShouldRing( &producer )) {
+        DcRingFail( "DcRingShouldRing: does not ring once for a waiting consumer" );
+    }
+
+    g_Checks++;
+    if (DcRingPeek( &consumer ) == NULL) {
+        DcRingFail( "DcRingPeek: misses the record it was woken for" );
+    }
+
+    free( buffer );
+}
+
+static LONG64
+DcRingBogusHead (
+    _In_ ULONG Kind,
+    _In_ LONG64 Head,
+    _In_ LONG64 Tail,
+    _In_ ULONG DataSize
+    )
+/*++
+Routine Description:
+    Makes up a Head no producer may believe, from the Head the consumer
+    reached and the Tail it last saw. The producer never caches a Head
+    more than the data area behind the consumer's, nor reserves more
+    than the data area past it.
+--*/
+{
+    switch (Kind % 5) {
+    case 0:
+        return Head - DataSize - DCRING_ALIGNMENT;
+    case 1:
+        return -1;
+    case 2:
+        return LLONG_MIN;
+    case 3:
+        return Tail + DataSize + DCRING_ALIGNMENT;
+    default:
+        return LLONG_MAX;
+    }
+}
+
+static VOID
+DcRingCheckBogusHead (
+    _Inout_ PULONG64 State
+    )
+/*++
+Routine Description:
+    Fills a ring, has the consumer read part of it and then store a
+    Head of its own making. A Head outside what the producer handed out
+    must break the producer; one inside it, even off a record boundary,
+    must at worst let it overwrite records, never write outside the
+    data area.
+--*/
+{
+    PUCHAR buffer = DcRingAllocate( DCRING_TEST_BUFFER_SIZE );
+    DCRING_PRODUCER producer;
+    DCRING_CONSUMER consumer;
+    const DCRING_RECORD *record;
+    PDCRING_HEADER ring = (PDCRING_HEADER)buffer;
+    LONG64 head;
+    ULONG round;
+    ULONG read;
+    ULONG length;
+    ULONG i;
+    PVOID payload;
+    BOOLEAN impossible;
+
+    for (round = 0; round < 20 * DCRING_BOGUS_ROUNDS; round++) {
+
+        DcRingFormat( buffer, &producer, &consumer );
+
+        //  A lap or two, so that positions are past the data area.
+        for (i = DcRingRandom( State ) % 200; i != 0; i--) {
+            while (DcRingReserve( &producer, 1, DcRingRandom( State ) % 300 ) == NULL) {
+                DcRingCommit( &producer );
+                DcRingRelease( &consumer, DcRingPeek( &consumer ) );
+            }
+        }
+        while (DcRingReserve( &producer, 1, DcRingRandom( State ) % 300 ) != NULL) {
+        }
+        DcRingCommit( &producer );
+
+        for (read = DcRingRandom( State ) % 8; read != 0 && (record = DcRingPeek( &consumer )) != NULL; read--) {
+            DcRingRelease( &consumer, record );
+        }
+
+        if (round % 2 == 0) {
+            head = DcRingBogusHead( round / 2, consumer.Head, ring->Tail, DCRING_TEST_DATA_SIZE );
+            impossible = TRUE;
+        } else {
+            head = producer.Head + DcRingRandom( State ) % (ULONG)(producer.Tail - producer.Head + 1);
+            impossible = FALSE;
+        }
+        ring->Head = head;
+
+        for (i = 0; i < 1000; i++) {
+
+            length = DcRingRandom( State ) % 600;
+            payload = DcRingReserve( &producer, 1, length );
+            DcRingCommit( &producer );
+            if (payload == NULL) {
+                if (producer.Broken || !impossible) {
+                    break;
+                }
+                continue;
+            }
+
+            DcRingCheckPayloadInside( &producer, payload, length );
+            memset( payload, 0xEE, length );
+
+            //  A Head inside what was handed out lets records be
+            //  written up to it, and then the ring is full again.
+            if (!impossible) {
+                ring->Head = producer.Head + DcRingRandom( State ) % (ULONG)(producer.Tail - producer.Head + 1);
+            }
+        }
+
+        g_Checks++;
+        if (producer.Broken != impossible) {
+            DcRingFail( "DcRingReserve: producer %s by Head %lld with Tail %lld",
+                        impossible ? "not broken" : "broken", (long long)head, (long long)producer.Tail );
+        }
+
+        g_Checks++;
+        if (producer.Broken && DcRingReserve( &producer, 1, 0 ) != NULL) {
+            DcRingFail( "DcRingReserve: a broken producer reserves" );
+        }
+    }
+
+    free( buffer );
+}
+
+static VOID
+DcRingCheckConsumerFuzz (
+    _Inout_ PULONG64 State
+    )
+/*++
+Routine Description:
+    Reads rings of random bytes, with random Heads and Tails, checking
+    that every record the consumer returns lies inside the data area.
+--*/
+{
+    PUCHAR buffer = DcRingAllocate( DCRING_TEST_BUFFER_SIZE );
+    DCRING_PRODUCER producer;
+    DCRING_CONSUMER consumer;
+    const DCRING_RECORD *record;
+    PDCRING_HEADER ring = (PDCRING_HEADER)buffer;
+    PULONG data = (PULONG)(buffer + sizeof(DCRING_HEADER));
+    ULONG round;
+    ULONG i;
+
+    DcRingInitializeProducer( &producer, buffer, DCRING_TEST_BUFFER_SIZE );
+
+    for (round = 0; round < DCRING_FUZZ_ROUNDS; round++) {
+
+        //  Mostly plausible lengths, so that the consumer gets somewhere.
+        for (i = 0; i < DCRING_TEST_DATA_SIZE / sizeof(ULONG); i++) {
+            ULONG r = DcRingRandom( State );
+            data[i] = (i % 2 == 0 && (r & 3) != 0) ? (r >> 2) % 512 : r;
+        }
+
+        ring->Head = ((LONG64)DcRingRandom( State ) << 20) | DcRingRandom( State ) % 0x100000;
+        if (round % 2 == 0) {
+            ring->Head &= ~(LONG64)(DCRING_ALIGNMENT - 1);
+        }
+        switch (round % 3) {
+        case 0:
+            ring->Tail = ring->Head + DcRingRandom( State ) % (2 * DCRING_TEST_DATA_SIZE);
+            break;
+        case 1:
+            ring->Tail = LLONG_MAX;
+            break;
+        default:
+            ring->Tail = ring->Head - DcRingRandom( State ) % 64;
+            break;
+        }
+
+        //  A Head off the record alignment is refused outright.
+        g_Checks++;
+        if (NT_SUCCESS( DcRingAttachConsumer( &consumer, buffer, DCRING_TEST_BUFFER_SIZE ) ) !=
+            ((ring->Head & (DCRING_ALIGNMENT - 1)) == 0)) {
+            DcRingFail( "DcRingAttachConsumer: wrong answer for Head %lld", (long long)ring->Head );
+            break;
+        }
+        if ((ring->Head & (DCRING_ALIGNMENT - 1)) != 0) {
+            continue;
+        }
+
+        for (i = 0; i < 10000 && (record = DcRingPeek( &consumer )) != NULL; i++) {
+            DcRingCheckRecordInside( &consumer, record );
+            DcRingRelease( &consumer, record );
+        }
+    }
+
+    free( buffer );
+}
+
+static VOID
+DcRingPublish (
+    _Inout_ PDCRING_TEST Test
+    )
+{
+    DcRingCommit( &Test->Producer );
+    if (DcRingShouldRing( &Test->Producer )) {
+        Test->Rings++;
+        DcRingRingDoorbell( &Test->Doorbell );
+    }
+}
+
+static DCRING_THREAD_RESULT
+DcRingProducerThread (
+    PVOID Context
+    )
+/*++
+Routine Description:
+    Sends Records records, or until the producer is broken, committing
+    a few at a time.
+--*/
+{
+    PDCRING_TEST test = (PDCRING_TEST)Context;
+    PDCRING_PRODUCER producer = &test->Producer;
+    ULONG64 sequence = 0;
+    ULONG length;
+    PVOID payload;
+    LONG64 consumerDone;
+
+    while (test->Sabotage || sequence < test->Records) {
+
+        consumerDone = DcReadAcquire64( &test->ConsumerDone );
+        length = DcRingPayloadLength( sequence, producer->DataSize );
+        payload = DcRingReserve( producer, DcRingType( sequence ), length );
+
+        if (payload == NULL) {
+
+            //  The consumer stored its last Head before it stopped, and a
+            //  full ring has read it since.
+            if (producer->Broken || consumerDone != 0) {
+                break;
+            }
+
+            test->Full++;
+            DcRingPublish( test );
+            DcRingYield();
+            continue;
+        }
+
+        //  The checks are counted by the consumer thread only.
+        if (!DcRingPayloadInside( producer, payload, length )) {
+            test->Outside++;
+            break;
+        }
+        DcRingFillPayload( sequence, payload, length );
+        sequence++;
+
+        if ((DcRingMix( sequence ) & 3) == 0 || sequence == test->Records) {
+            DcRingPublish( test );
+        }
+
+        if (DCRING_PHASE( sequence ) == DCRING_PHASE_SLOW_PRODUCER && (sequence & 15) == 0) {
+            DcRingPublish( test );
+            DcRingPause( 20000 );
+        }
+    }
+
+    DcRingPublish( test );
+    test->Sent = sequence;
+    DcWriteRelease64( &test->ProducerDone, 1 );
+    DcRingRingDoorbell( &test->Doorbell );
+
+    return DCRING_THREAD_RETURN;
+}
+
+static DCRING_THREAD_RESULT
+DcRingConsumerThread (
+    PVOID Context
+    )
+/*++
+Routine Description:
+    Receives records, checking each against the sequence number it must
+    have and the position it must be at, after padding where the record
+    before left too little room before the end of the data area.
+--*/
+{
+    PDCRING_TEST test = (PDCRING_TEST)Context;
+    PDCRING_CONSUMER consumer = &test->Consumer;
+    const DCRING_RECORD *record;
+    ULONG64 sequence = 0;
+    LONG64 expected = 0;
+    LONG64 tail;
+    ULONG payloadLength;
+    ULONG length;
+    ULONG offset;
+
+    while (test->Sabotage || sequence < test->Records) {
+
+        if (test->Sabotage && sequence == test->SabotageAfter) {
+            DcWriteRelease64( &consumer->Ring->Head,
+                              DcRingBogusHead( test->SabotageKind, consumer->Head,
+                                               DcReadAcquire64( &consumer->Ring->Tail ), consumer->DataSize ) );
+            break;
+        }
+
+        tail = DcReadAcquire64( &consumer->Ring->Tail );
+        record = DcRingPeek( consumer );
+
+        if (record == NULL) {
+
+            //  Peek read a Tail no older than this one.
+            if (consumer->Head < tail) {
+                DcRingFail( "DcRingPeek: malformed record %llu at %lld", (unsigned long long)sequence,
+                            (long long)consumer->Head );
+                break;
+            }
+
+            if (DcReadAcquire64( &test->ProducerDone ) != 0 && DcReadAcquire64( &consumer->Ring->Tail ) == consumer->Head) {
+                break;
+            }
+
+            if (DcRingPrepareWait( consumer )) {
+                test->Waits++;
+                if (!DcRingWaitDoorbell( &test->Doorbell, DCRING_DOORBELL_TIMEOUT )) {
+
+                    //  A committed record must have rung.
+                    test->Timeouts++;
+                    if (DcReadAcquire64( &consumer->Ring->Tail ) != consumer->Head) {
+                        DcRingFail( "doorbell lost with record %llu in the ring", (unsigned long long)sequence );
+                    }
+                }
+            }
+            continue;
+        }
+
+        payloadLength = DcRingPayloadLength( sequence, consumer->DataSize );
+        length = DCRING_RECORD_SIZE( payloadLength );
+        offset = (ULONG)expected & (consumer->DataSize - 1);
+        if (offset + length > consumer->DataSize) {
+            expected += consumer->DataSize - offset;
+            test->Paddings++;
+        }
+
+        g_Checks++;
+        if (consumer->Head != expected || record->Type != DcRingType( sequence ) || record->Length != length ||
+            !DcRingCheckPayload( sequence, (const UCHAR *)(record + 1), payloadLength )) {
+            DcRingFail( "record %llu at %lld, type 0x%08X, %u bytes, expected at %lld, %u bytes",
+                        (unsigned long long)sequence, (long long)consumer->Head, record->Type, record->Length,
+                        (long long)expected, length );
+            break;
+        }
+        DcRingCheckRecordInside( consumer, record );
+
+        DcRingRelease( consumer, record );
+        expected += length;
+        sequence++;
+
+        if (DCRING_PHASE( sequence ) == DCRING_PHASE_SLOW_CONSUMER) {
+            DcRingPause( 2000 );
+        }
+    }
+
+    test->Received = sequence;
+    DcWriteRelease64( &test->ConsumerDone, 1 );
+    return DCRING_THREAD_RETURN;
+}
+
+static VOID
+DcRingRunThreads (
+    _Inout_ PDCRING_TEST Test
+    )
+/*++
+Routine Description:
+    Runs a producer and a consumer thread through a fresh ring.
+--*/
+{
+    DCRING_THREAD producer;
+    DCRING_THREAD consumer;
+
+    Test->Buffer = DcRingAllocate( DCRING_TEST_BUFFER_SIZE );
+    Test->ProducerDone = 0;
+    Test->ConsumerDone = 0;
+
+    DcRingFormat( Test->Buffer, &Test->Producer, &Test->Consumer );
+    if (!DcRingInitializeDoorbell( &Test->Doorbell )) {
+        fprintf( stderr, "cannot create the doorbell\n" );
+        exit( 1 );
+    }
+
+    if (!DcRingStartThread( &consumer, DcRingConsumerThread, Test )) {
+        fprintf( stderr, "cannot start threads\n" );
+        exit( 1 );
+    }
+    if (!DcRingStartThread( &producer, DcRingProducerThread, Test )) {
+        fprintf( stderr, "cannot start threads\n" );
+        exit( 1 );
+    }
+
+    DcRingJoinThread( producer );
+    DcRingJoinThread( consumer );
+
+    g_Checks++;
+    if (Test->Outside != 0) {
+        DcRingFail( "DcRingReserve: a record outside the data area" );
+    }
+
+    DcRingDeleteDoorbell( &Test->Doorbell );
+    free( Test->Buffer );
+}
+
+static VOID
+DcRingCheckSabotage (
+    _Inout_ PULONG64 State
+    )
+/*++
+Routine Description:
+    Lets a consumer thread read for a while and then store an impossible
+    Head, while the producer thread keeps sending. The producer must
+    stop, broken, once the ring fills.
+--*/
+{
+    DCRING_TEST test;
+    ULONG round;
+
+    for (round = 0; round < DCRING_BOGUS_ROUNDS; round++) {
+
+        memset( &test, 0, sizeof(test) );
+        test.Sabotage = TRUE;
+        test.SabotageAfter = DcRingRandom( State ) % 5000;
+        test.SabotageKind = round;
+
+        DcRingRunThreads( &test );
+
+        g_Checks++;
+        if (!test.Producer.Broken || test.Received != test.SabotageAfter) {
+            DcRingFail( "producer not broken by bogus Head %u after %llu records",
+                        round % 5, (unsigned long long)test.SabotageAfter );
+        }
+    }
+}
+
+static int
+DcRingVerify (
+    VOID
+    )
+{
+    ULONG64 state = 1;
+
+    DcRingCheckLayout();
+    DcRingCheckFullAndPadding();
+    DcRingCheckDoorbell();
+    DcRingCheckBogusHead( &state );
+    DcRingCheckConsumerFuzz( &state );
+    DcRingCheckSabotage( &state );
+
+    printf( "%llu checks, %llu failures\n", (unsigned long long)g_Checks, (unsigned long long)g_Failures );
+    return g_Failures != 0;
+}
+
+static int
+DcRingStress (
+    _In_ ULONG64 Records
+    )
+{
+    DCRING_TEST test;
+    ULONG64 start;
+    ULONG64 elapsed;
+
+    memset( &test, 0, sizeof(test) );
+    test.Records = Records;
+
+    start = DcRingNow();
+    DcRingRunThreads( &test );
+    elapsed = DcRingNow() - start;
+
+    g_Checks++;
+    if (test.Sent != Records || test.Received != Records || test.Producer.Broken) {
+        DcRingFail( "%llu records sent and %llu received of %llu", (unsigned long long)test.Sent,
+                    (unsigned long long)test.Received, (unsigned long long)Records );
+    }
+
+    //  Each side must have been held up by the other.
+    g_Checks++;
+    if (Records >= 8 * 4096 && (test.Paddings == 0 || test.Full == 0 || test.Waits == 0 || test.Rings == 0)) {
+        DcRingFail( "ring never wrapped, filled or waited" );
+    }
+
+    printf( "records: %llu in %.2f s, %.2f million records/s\n", (unsigned long long)Records,
+            elapsed / 1e9, Records * 1e3 / (double)elapsed );
+    printf( "paddings: %llu, ring full: %llu, waits: %llu, doorbells: %llu, timeouts: %llu\n",
+            (unsigned long long)test.Paddings, (unsigned long long)test.Full, (unsigned long long)test.Waits,
+            (unsigned long long)test.Rings, (unsigned long long)test.Timeouts );
+    printf( "%llu checks, %llu failures\n", (unsigned long long)g_Checks, (unsigned long long)g_Failures );
+    return g_Failures != 0;
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ULONG64 records = DCRING_DEFAULT_RECORDS;
+
+    if (argc == 2 && strcmp( argv[1], "verify" ) == 0) {
+        return DcRingVerify();
+    }
+
+    if ((argc == 2 || argc == 3) && strcmp( argv[1], "stress" ) == 0) {
+
+        if (argc == 3) {
+            records = strtoull( argv[2], NULL, 0 );
+        }
+        if (records != 0) {
+            return DcRingStress( records );
+        }
+    }
+
+    fprintf( stderr, "Usage: dcring verify\n"
+                     "       dcring stress [records]\n" );
+    return 2;
+}
@@ -0,0 +1,743 @@
+/*++
+Copyright (c)
+Module Name:
+    dcslot.c
+Abstract:
+    Checks the two slot publication of dcslot.h, that the filter
+    publishes its policy with, with reader threads referencing objects
+    while a writer thread keeps replacing them, and measures how many
+    references the readers make with and without the writer.
+
+    dcslot verify [readers]
+        Checks the rundown protection of dcport.h on its own, then runs
+        readers, 4 by default, against a writer that publishes new
+        objects, and now and then none, as fast as it can, for 100000
+        publishes or two seconds in each of three rounds. Readers check
+        that the object they hold is not taken back and not older than
+        the one the newest they held replaced; the writer checks that it
+        takes back the object it published before, and poisons it before
+        freeing it.
+    dcslot bench [readers] [milliseconds]
+        Counts references per second made by 1, 2, 4 and so on up to
+        readers threads, while the writer is idle and while it keeps
+        publishing, and the publishes per second.
+
+    Builds on any host with threads, e.g.
+
+        cc -O2 -Iinc tools/dcslot.c -o dcslot -lpthread
+
+    With -fsanitize=address any reference to an object after it was
+    freed is caught, and with -fsanitize=thread any access to one that
+    is not ordered after its publication or before it is taken back.
+Environment:
+    User mode
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <time.h>
+#endif
+#include "dcslot.h"
+
+#define DCSLOT_TEST_PAYLOAD             8
+#define DCSLOT_TEST_QUARANTINE          4
+#define DCSLOT_MAX_READERS              64
+#define DCSLOT_DEFAULT_READERS          4
+#define DCSLOT_DEFAULT_PUBLISHES        100000
+#define DCSLOT_VERIFY_MILLISECONDS      2000
+#define DCSLOT_DEFAULT_MILLISECONDS     1000
+#define DCSLOT_HOLD_MILLISECONDS        50
+
+#define DCSLOT_LIVE                     0x4556494C      //  'LIVE'
+#define DCSLOT_RETIRED                  0x44414544      //  'DEAD'
+
+#ifdef _WIN32
+#define DCSLOT_THREAD_RESULT            DWORD WINAPI
+#define DCSLOT_THREAD_RETURN            0
+typedef HANDLE DCSLOT_THREAD;
+typedef LPTHREAD_START_ROUTINE DCSLOT_THREAD_ROUTINE;
+#else
+#define DCSLOT_THREAD_RESULT            void *
+#define DCSLOT_THREAD_RETURN            NULL
+typedef pthread_t DCSLOT_THREAD;
+typedef void *(*DCSLOT_THREAD_ROUTINE)(void *);
+#endif
+
+typedef struct _DCSLOT_OBJECT {
+    ULONG State;
+    ULONG Slot;
+    ULONG64 Generation;
+    ULONG64 Payload[DCSLOT_TEST_PAYLOAD];
+} DCSLOT_OBJECT, *PDCSLOT_OBJECT;
+
+typedef struct _DCSLOT_TEST {
+
+    DCSLOTS Slots;
+
+    //  Set by the writer once it has published Publishes objects, or by
+    //  the main thread when a bench run is over.
+    volatile LONG Stop;
+
+    //  Publishes to make, or 0 to publish until Stop.
+    ULONG64 Publishes;
+
+    //  Spins a reader holds each reference for.
+    ULONG HoldSpins;
+
+    //  Written by the writer only.
+    ULONG64 Published;
+    ULONG64 Generation;
+    PDCSLOT_OBJECT Quarantine[DCSLOT_TEST_QUARANTINE];
+    ULONG Quarantined;
+    ULONG64 WriterFailures;
+
+} DCSLOT_TEST, *PDCSLOT_TEST;
+
+typedef struct _DCSLOT_READER {
+
+    PDCSLOT_TEST Test;
+
+    ULONG64 References;
+    ULONG64 Empty;
+    ULONG64 Failures;
+
+    //  What the first failure found.
+    ULONG FailedState;
+    ULONG64 FailedGeneration;
+    ULONG64 NewestGeneration;
+
+    //  Keeps the counters of readers off each other's cache lines.
+    UCHAR Reserved[64];
+
+} DCSLOT_READER, *PDCSLOT_READER;
+
+typedef struct _DCSLOT_HOLDER {
+    PDC_RUNDOWN Rundown;
+    BOOLEAN Release;
+    volatile LONG Held;
+    volatile LONG Released;
+} DCSLOT_HOLDER, *PDCSLOT_HOLDER;
+
+static ULONG64 g_Checks;
+static ULONG64 g_Failures;
+
+#define DcSlotFail(...)                                                     \
+    do {                                                                    \
+        if (g_Failures++ < 10) {                                            \
+            printf( __VA_ARGS__ );                                          \
+            printf( "\n" );                                                 \
+        }                                                                   \
+    } while (0)
+
+static ULONG64
+DcSlotNow (
+    VOID
+    )
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter( &counter );
+    QueryPerformanceFrequency( &frequency );
+    return (ULONG64)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+#endif
+}
+
+static VOID
+DcSlotSleep (
+    _In_ ULONG Milliseconds
+    )
+{
+#ifdef _WIN32
+    Sleep( Milliseconds );
+#else
+    struct timespec delay;
+
+    delay.tv_sec = Milliseconds / 1000;
+    delay.tv_nsec = (long)(Milliseconds % 1000) * 1000000;
+    nanosleep( &delay, NULL );
+#endif
+}
+
+static BOOLEAN
+DcSlotStartThread (
+    _Out_ DCSLOT_THREAD *Thread,
+    _In_ DCSLOT_THREAD_ROUTINE Routine,
+    _In_ PVOID Context
+    )
+{
+#ifdef _WIN32
+    *Thread = CreateThread( NULL, 0, Routine, Context, 0, NULL );
+    return (BOOLEAN)(*Thread != NULL);
+#else
+    return (BOOLEAN)(pthread_create( Thread, NULL, Routine, Context ) == 0);
+#endif
+}
+
+static VOID
+DcSlotJoinThread (
+    _In_ DCSLOT_THREAD Thread
+    )
+{
+#ifdef _WIN32
+    WaitForSingleObject( Thread, INFINITE );
+    CloseHandle( Thread );
+#else
+    pthread_join( Thread, NULL );
+#endif
+}
+
+static DCSLOT_THREAD
+DcSlotStart (
+    _In_ DCSLOT_THREAD_ROUTINE Routine,
+    _In_ PVOID Context
+    )
+{
+    DCSLOT_THREAD thread;
+
+    if (!DcSlotStartThread( &thread, Routine, Context )) {
+        fprintf( stderr, "cannot start threads\n" );
+        exit( 1 );
+    }
+
+    return thread;
+}
+
+static DCSLOT_THREAD_RESULT
+DcSlotHolderThread (
+    _In_ PVOID Context
+    )
+/*++
+Routine Description:
+    Holds a reference on a rundown for a while, or acquires one for the
+    main thread to release.
+--*/
+{
+    PDCSLOT_HOLDER holder = (PDCSLOT_HOLDER)Context;
+
+    if (!DcAcquireRundown( holder->Rundown )) {
+        DcWriteRelease( &holder->Held, -1 );
+        return DCSLOT_THREAD_RETURN;
+    }
+
+    DcWriteRelease( &holder->Held, 1 );
+
+    if (holder->Release) {
+        DcSlotSleep( DCSLOT_HOLD_MILLISECONDS );
+        DcWriteRelease( &holder->Released, 1 );
+        DcReleaseRundown( holder->Rundown );
+    }
+
+    return DCSLOT_THREAD_RETURN;
+}
+
+static VOID
+DcSlotCheckRundown (
+    VOID
+    )
+/*++
+Routine Description:
+    Checks that a wait returns only once a reference held on another
+    thread is released, that acquires fail from then on until the
+    protection is reinitialized, and that a reference released on
+    another thread than the one that acquired it counts as released.
+--*/
+{
+    DCSLOT_HOLDER holder;
+    DCSLOT_THREAD thread;
+    PDC_RUNDOWN rundown = DcAllocateRundown();
+
+    if (rundown == NULL) {
+        fprintf( stderr, "out of memory\n" );
+        exit( 1 );
+    }
+
+    memset( &holder, 0, sizeof(holder) );
+    holder.Rundown = rundown;
+    holder.Release = TRUE;
+
+    thread = DcSlotStart( DcSlotHolderThread, &holder );
+    while (DcReadAcquire( &holder.Held ) == 0) {
+        DcYieldThread();
+    }
+
+    DcWaitForRundown( rundown );
+
+    g_Checks++;
+    if (DcReadAcquire( &holder.Held ) != 1 || DcReadAcquire( &holder.Released ) != 1) {
+        DcSlotFail( "DcWaitForRundown: returned while a reference was held" );
+    }
+    DcSlotJoinThread( thread );
+
+    g_Checks++;
+    if (DcAcquireRundown( rundown )) {
+        DcSlotFail( "DcAcquireRundown: acquired after a wait" );
+        DcReleaseRundown( rundown );
+    }
+
+    DcReInitializeRundown( rundown );
+
+    g_Checks++;
+    if (!DcAcquireRundown( rundown )) {
+        DcSlotFail( "DcAcquireRundown: failed after DcReInitializeRundown" );
+    } else {
+        DcReleaseRundown( rundown );
+    }
+
+    //  Acquired on the holder's shard, released on this one.
+    memset( &holder, 0, sizeof(holder) );
+    holder.Rundown = rundown;
+
+    thread = DcSlotStart( DcSlotHolderThread, &holder );
+    DcSlotJoinThread( thread );
+
+    g_Checks++;
+    if (holder.Held != 1) {
+        DcSlotFail( "DcAcquireRundown: failed on another thread" );
+    } else {
+        DcReleaseRundown( rundown );
+    }
+
+    DcWaitForRundown( rundown );
+    DcFreeRundown( rundown );
+}
+
+static VOID
+DcSlotCheckSingle (
+    VOID
+    )
+/*++
+Routine Description:
+    Publishes and takes back objects on one thread.
+--*/
+{
+    DCSLOTS slots;
+    DCSLOT_OBJECT objects[2];
+    PVOID object;
+    ULONG slot;
+    ULONG i;
+
+    if (!NT_SUCCESS( DcSlotsInitialize( &slots ) )) {
+        fprintf( stderr, "out of memory\n" );
+        exit( 1 );
+    }
+
+    g_Checks++;
+    if (DcSlotReference( &slots ) != NULL) {
+        DcSlotFail( "DcSlotReference: found an object before any was published" );
+    }
+
+    for (i = 0; i < 6; i++) {
+
+        //  Objects 0, 1, none, 0, 1, none.
+        object = (i % 3 == 2) ? NULL : &objects[i % 3];
+        slot = DcSlotNext( &slots );
+        if (object != NULL) {
+            objects[i % 3].Slot = slot;
+        }
+
+        g_Checks++;
+        if (DcSlotPublish( &slots, object ) != (slot ^ 1) ||
+            DcSlotRetire( &slots, slot ^ 1 ) != ((i % 3 == 0) ? NULL : &objects[(i - 1) % 3])) {
+            DcSlotFail( "DcSlotPublish: publish %u did not take back the object before", i );
+        }
+
+        g_Checks++;
+        if (DcSlotReference( &slots ) != object) {
+            DcSlotFail( "DcSlotReference: publish %u not found", i );
+        } else if (object != NULL) {
+            DcSlotDereference( &slots, slot );
+        }
+
+        g_Checks++;
+        if (DcAcquireRundown( slots.Slots[slot ^ 1].Rundown )) {
+            DcSlotFail( "DcSlotRetire: slot %u still acquired", slot ^ 1 );
+            DcReleaseRundown( slots.Slots[slot ^ 1].Rundown );
+        }
+    }
+
+    DcSlotsUninitialize( &slots );
+}
+
+static VOID
+DcSlotReaderFail (
+    _Inout_ PDCSLOT_READER Reader,
+    _In_ const DCSLOT_OBJECT *Object
+    )
+{
+    if (Reader->Failures++ == 0) {
+        Reader->FailedState = Object->State;
+        Reader->FailedGeneration = Object->Generation;
+    }
+}
+
+static VOID
+DcSlotCheckObject (
+    _Inout_ PDCSLOT_READER Reader,
+    _In_ const DCSLOT_OBJECT *Object
+    )
+{
+    ULONG i;
+
+    //  While a publish is under way a reader can find the new object and
+    //  then the one it replaces, see dcslot.h, but never an older one.
+    if (Object->State != DCSLOT_LIVE || Object->Generation + 1 < Reader->NewestGeneration) {
+        DcSlotReaderFail( Reader, Object );
+        return;
+    }
+
+    for (i = 0; i < DCSLOT_TEST_PAYLOAD; i++) {
+        if (Object->Payload[i] != Object->Generation + i) {
+            DcSlotReaderFail( Reader, Object );
+            return;
+        }
+    }
+
+    if (Object->Generation > Reader->NewestGeneration) {
+        Reader->NewestGeneration = Object->Generation;
+    }
+}
+
+static DCSLOT_THREAD_RESULT
+DcSlotReaderThread (
+    _In_ PVOID Context
+    )
+/*++
+Routine Description:
+    References the active object until told to stop, checking it before
+    and after holding it for a while.
+--*/
+{
+    PDCSLOT_READER reader = (PDCSLOT_READER)Context;
+    PDCSLOT_TEST test = reader->Test;
+    PDCSLOT_OBJECT object;
+    volatile ULONG spin;
+
+    while (DcReadAcquire( &test->Stop ) == 0) {
+
+        object = (PDCSLOT_OBJECT)DcSlotReference( &test->Slots );
+        if (object == NULL) {
+            reader->Empty++;
+            continue;
+        }
+
+        DcSlotCheckObject( reader, object );
+
+        if (test->HoldSpins != 0) {
+            for (spin = 0; spin < test->HoldSpins; spin++) {
+            }
+            DcSlotCheckObject( reader, object );
+        }
+
+        DcSlotDereference( &test->Slots, object->Slot );
+        reader->References++;
+    }
+
+    return DCSLOT_THREAD_RETURN;
+}
+
+static VOID
+DcSlotFreeObject (
+    _Inout_ PDCSLOT_TEST Test,
+    _In_ PDCSLOT_OBJECT Object
+    )
+/*++
+Routine Description:
+    Poisons an object taken back and frees it a few publishes later, so
+    that a reader still using it finds the poison, or the sanitizer finds
+    the reader.
+--*/
+{
+    PDCSLOT_OBJECT oldest;
+
+    Object->State = DCSLOT_RETIRED;
+    memset( Object->Payload, 0xFF, sizeof(Object->Payload) );
+
+    oldest = Test->Quarantine[Test->Quarantined % DCSLOT_TEST_QUARANTINE];
+    Test->Quarantine[Test->Quarantined++ % DCSLOT_TEST_QUARANTINE] = Object;
+    free( oldest );
+}
+
+static DCSLOT_THREAD_RESULT
+DcSlotWriterThread (
+    _In_ PVOID Context
+    )
+/*++
+Routine Description:
+    Publishes new objects, one in sixteen times none, and takes back the
+    one each replaces, until Publishes were made or told to stop.
+--*/
+{
+    PDCSLOT_TEST test = (PDCSLOT_TEST)Context;
+    PDCSLOT_OBJECT previous = NULL;
+    PDCSLOT_OBJECT object;
+    PDCSLOT_OBJECT old;
+    ULONG i;
+
+    while (DcReadAcquire( &test->Stop ) == 0) {
+
+        if (test->Publishes != 0 && test->Published == test->Publishes) {
+            DcWriteRelease( &test->Stop, 1 );
+            break;
+        }
+
+        object = NULL;
+        if (test->Published % 16 != 15) {
+
+            object = (PDCSLOT_OBJECT)malloc( sizeof(DCSLOT_OBJECT) );
+            if (object == NULL) {
+                fprintf( stderr, "out of memory\n" );
+                exit( 1 );
+            }
+
+            object->State = DCSLOT_LIVE;
+            object->Generation = ++test->Generation;
+            for (i = 0; i < DCSLOT_TEST_PAYLOAD; i++) {
+                object->Payload[i] = object->Generation + i;
+            }
+            object->Slot = DcSlotNext( &test->Slots );
+        }
+
+        old = (PDCSLOT_OBJECT)DcSlotRetire( &test->Slots, DcSlotPublish( &test->Slots, object ) );
+        test->Published++;
+
+        if (old != previous || (old != NULL && old->State != DCSLOT_LIVE)) {
+            test->WriterFailures++;
+        }
+
+        if (old != NULL) {
+            DcSlotFreeObject( test, old );
+        }
+        previous = object;
+    }
+
+    return DCSLOT_THREAD_RETURN;
+}
+
+static VOID
+DcSlotRun (
+    _Inout_ PDCSLOT_TEST Test,
+    _Out_writes_(Readers) PDCSLOT_READER ReaderArray,
+    _In_ ULONG Readers,
+    _In_ BOOLEAN Writer,
+    _In_ ULONG Milliseconds
+    )
+/*++
+Routine Description:
+    Runs Readers reader threads, and the writer if Writer, until the
+    writer is done or for Milliseconds, whichever comes first. Takes
+    back the last object published.
+--*/
+{
+    DCSLOT_THREAD readers[DCSLOT_MAX_READERS];
+    DCSLOT_THREAD writer;
+    PDCSLOT_OBJECT object;
+    ULONG64 deadline;
+    ULONG i;
+
+    if (!NT_SUCCESS( DcSlotsInitialize( &Test->Slots ) )) {
+        fprintf( stderr, "out of memory\n" );
+        exit( 1 );
+    }
+
+    //  A single object for readers that only read.
+    if (!Writer) {
+        Test->Publishes = 1;
+        DcSlotWriterThread( Test );
+        Test->Stop = 0;
+    }
+
+    for (i = 0; i < Readers; i++) {
+        memset( &ReaderArray[i], 0, sizeof(DCSLOT_READER) );
+        ReaderArray[i].Test = Test;
+        readers[i] = DcSlotStart( DcSlotReaderThread, &ReaderArray[i] );
+    }
+
+    if (Writer) {
+        writer = DcSlotStart( DcSlotWriterThread, Test );
+    }
+
+    deadline = DcSlotNow() + Milliseconds * 1000000ULL;
+    while (DcReadAcquire( &Test->Stop ) == 0 && DcSlotNow() < deadline) {
+        DcSlotSleep( 10 );
+    }
+    DcWriteRelease( &Test->Stop, 1 );
+
+    if (Writer) {
+        DcSlotJoinThread( writer );
+    }
+    for (i = 0; i < Readers; i++) {
+        DcSlotJoinThread( readers[i] );
+    }
+
+    object = (PDCSLOT_OBJECT)DcSlotRetire( &Test->Slots, DcSlotPublish( &Test->Slots, NULL ) );
+    if (object != NULL) {
+        DcSlotFreeObject( Test, object );
+    }
+
+    for (i = 0; i < DCSLOT_TEST_QUARANTINE; i++) {
+        free( Test->Quarantine[i] );
+    }
+
+    DcSlotsUninitialize( &Test->Slots );
+}
+
+static int
+DcSlotVerify (
+    _In_ ULONG Readers
+    )
+{
+    static const ULONG holds[] = { 0, 100, 2000 };
+    DCSLOT_READER readers[DCSLOT_MAX_READERS];
+    DCSLOT_TEST test;
+    ULONG64 references;
+    ULONG round;
+    ULONG i;
+
+    DcSlotCheckRundown();
+    DcSlotCheckSingle();
+
+    for (round = 0; round < sizeof(holds) / sizeof(holds[0]); round++) {
+
+        memset( &test, 0, sizeof(test) );
+        test.Publishes = DCSLOT_DEFAULT_PUBLISHES;
+        test.HoldSpins = holds[round];
+
+        DcSlotRun( &test, readers, Readers, TRUE, DCSLOT_VERIFY_MILLISECONDS );
+
+        g_Checks++;
+        if (test.WriterFailures != 0) {
+            DcSlotFail( "DcSlotRetire: took back the wrong object %llu times",
+                        (unsigned long long)test.WriterFailures );
+        }
+
+        references = 0;
+        for (i = 0; i < Readers; i++) {
+
+            references += readers[i].References;
+
+            g_Checks++;
+            if (readers[i].Failures != 0) {
+                DcSlotFail( "reader %u: %llu bad references, first to generation %llu in state 0x%08X, newest %llu",
+                            i, (unsigned long long)readers[i].Failures,
+                            (unsigned long long)readers[i].FailedGeneration, readers[i].FailedState,
+                            (unsigned long long)readers[i].NewestGeneration );
+            }
+        }
+
+        printf( "%u readers holding for %u spins: %llu references over %llu publishes\n",
+                Readers, holds[round], (unsigned long long)references, (unsigned long long)test.Published );
+    }
+
+    printf( "%llu checks, %llu failures\n", (unsigned long long)g_Checks, (unsigned long long)g_Failures );
+    return g_Failures != 0;
+}
+
+static ULONG64
+DcSlotBenchRun (
+    _In_ ULONG Readers,
+    _In_ BOOLEAN Writer,
+    _In_ ULONG Milliseconds,
+    _Out_ PULONG64 Publishes
+    )
+/*++
+Routine Description:
+    References made per second by Readers threads together.
+--*/
+{
+    DCSLOT_READER readers[DCSLOT_MAX_READERS];
+    DCSLOT_TEST test;
+    ULONG64 references = 0;
+    ULONG64 start;
+    double seconds;
+    ULONG i;
+
+    memset( &test, 0, sizeof(test) );
+
+    start = DcSlotNow();
+    DcSlotRun( &test, readers, Readers, Writer, Milliseconds );
+    seconds = (double)(DcSlotNow() - start) / 1e9;
+
+    for (i = 0; i < Readers; i++) {
+        references += readers[i].References;
+        if (readers[i].Failures != 0) {
+            fprintf( stderr, "bad references, run dcslot verify\n" );
+            exit( 1 );
+        }
+    }
+
+    *Publishes = (ULONG64)((double)test.Published / seconds);
+    return (ULONG64)((double)references / seconds);
+}
+
+static int
+DcSlotBench (
+    _In_ ULONG Readers,
+    _In_ ULONG Milliseconds
+    )
+{
+    ULONG64 idle;
+    ULONG64 swapping;
+    ULONG64 publishes;
+    ULONG readers;
+
+    printf( "readers  references/s idle  references/s swapping  publishes/s\n" );
+
+    //  Powers of two, then Readers.
+    for (readers = 1; ; readers = (readers * 2 < Readers) ? readers * 2 : Readers) {
+
+        idle = DcSlotBenchRun( readers, FALSE, Milliseconds, &publishes );
+        swapping = DcSlotBenchRun( readers, TRUE, Milliseconds, &publishes );
+
+        printf( "%7u  %17llu  %21llu  %11llu\n", readers, (unsigned long long)idle,
+                (unsigned long long)swapping, (unsigned long long)publishes );
+
+        if (readers == Readers) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ULONG readers = DCSLOT_DEFAULT_READERS;
+    ULONG milliseconds = DCSLOT_DEFAULT_MILLISECONDS;
+
+    if (argc >= 3) {
+        readers = (ULONG)strtoul( argv[2], NULL, 0 );
+    }
+
+    if (argc == 4) {
+        milliseconds = (ULONG)strtoul( argv[3], NULL, 0 );
+    }
+
+    if (readers != 0 && readers <= DCSLOT_MAX_READERS && milliseconds != 0) {
+
+        if ((argc == 2 || argc == 3) && strcmp( argv[1], "verify" ) == 0) {
+            return DcSlotVerify( readers );
+        }
+
+        if (argc >= 2 && argc <= 4 && strcmp( argv[1], "bench" ) == 0) {
+            return DcSlotBench( readers, milliseconds );
+        }
+    }
+
+    fprintf( stderr, "Usage: dcslot verify [readers]\n" );
+    fprintf( stderr, "       dcslot bench [readers] [milliseconds]\n" );
+    return 2;
+}
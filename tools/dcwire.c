@@ -0,0 +1,560 @@
+/*++
+Copyright (c)
+Module Name:
+    dcwire.c
+Abstract:
+    Checks the event wire format of dcwire.h and measures it.
+
+    dcwire verify
+        Round trips random events through batches, encodes an event with
+        long names into every capacity up to its size, and decodes
+        batches with every header field and length changed, cut short
+        and with random bytes flipped, checking that the reader rejects
+        them or returns names inside the batch.
+    dcwire bench [records]
+        Times encoding records into batches and reading them back, in
+        records per second.
+
+    Builds on any host, e.g.
+
+        cc -O2 -Iinc tools/dcwire.c -o dcwire
+
+    Checks that the reader stays inside the buffer are best made with
+    the address sanitizer, -fsanitize=address, where there is one.
+Environment:
+    User mode
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include "dcwire.h"
+
+#define DCWIRE_BATCH_SIZE               (64 * 1024)
+#define DCWIRE_MAX_NAME                 1024
+#define DCWIRE_ROUND_TRIPS              2000
+#define DCWIRE_RANDOM_FLIPS             200000
+#define DCWIRE_DEFAULT_RECORDS          10000000
+
+static ULONG64 g_Checks;
+static ULONG64 g_Failures;
+
+static WCHAR g_FilePath[DCWIRE_MAX_NAME];
+static WCHAR g_ProcessName[DCWIRE_MAX_NAME];
+
+#define DcWireFail(...)                                         \
+    do {                                                        \
+        if (g_Failures++ < 10) {                                \
+            printf( __VA_ARGS__ );                              \
+            printf( "\n" );                                     \
+        }                                                       \
+    } while (0)
+
+static ULONG64
+DcWireNow (
+    VOID
+    )
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter( &counter );
+    QueryPerformanceFrequency( &frequency );
+    return (ULONG64)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (ULONG64)now.tv_sec * 1000000000ULL + (ULONG64)now.tv_nsec;
+#endif
+}
+
+static ULONG
+DcWireRandom (
+    _Inout_ PULONG64 State
+    )
+{
+    ULONG64 x = *State;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+    return (ULONG)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static VOID
+DcWireMakeEvent (
+    _Inout_ PULONG64 State,
+    _Out_ PDCWIRE_EVENT Event,
+    _In_ ULONG MaxName
+    )
+/*++
+Routine Description:
+    Makes up an event whose names are taken from the two name buffers,
+    which DcWireFillNames has filled.
+--*/
+{
+    Event->Type = (DcWireRandom( State ) & 1) ? DCWIRE_RECORD_DENIAL : DCWIRE_RECORD_REPEAT;
+    Event->Flags = 0;
+    Event->ProcessId = ((ULONG64)DcWireRandom( State ) << 32) | DcWireRandom( State );
+    Event->ThreadId = ((ULONG64)DcWireRandom( State ) << 32) | DcWireRandom( State );
+    Event->Timestamp = (LONG64)(((ULONG64)DcWireRandom( State ) << 32) | DcWireRandom( State ));
+    Event->Operation = DcWireRandom( State ) % 28;
+    Event->AccessMask = DcWireRandom( State );
+    Event->RepeatCount = (Event->Type == DCWIRE_RECORD_REPEAT) ? DcWireRandom( State ) : 0;
+    Event->LastTimestamp = Event->Timestamp + (DcWireRandom( State ) % 10000000);
+    Event->FilePathLength = (USHORT)(DcWireRandom( State ) % (MaxName + 1));
+    Event->ProcessNameLength = (USHORT)(DcWireRandom( State ) % (MaxName + 1));
+    Event->FilePath = g_FilePath + DcWireRandom( State ) % (DCWIRE_MAX_NAME - Event->FilePathLength + 1);
+    Event->ProcessName = g_ProcessName + DcWireRandom( State ) % (DCWIRE_MAX_NAME - Event->ProcessNameLength + 1);
+}
+
+static BOOLEAN
+DcWireSameEvent (
+    _In_ PCDCWIRE_EVENT Sent,
+    _In_ PCDCWIRE_EVENT Received
+    )
+{
+    return (BOOLEAN)(Sent->Type == Received->Type &&
+                     Sent->Flags == Received->Flags &&
+                     Sent->ProcessId == Received->ProcessId &&
+                     Sent->ThreadId == Received->ThreadId &&
+                     Sent->Timestamp == Received->Timestamp &&
+                     Sent->Operation == Received->Operation &&
+                     Sent->AccessMask == Received->AccessMask &&
+                     Sent->RepeatCount == Received->RepeatCount &&
+                     Sent->LastTimestamp == Received->LastTimestamp &&
+                     Sent->FilePathLength == Received->FilePathLength &&
+                     Sent->ProcessNameLength == Received->ProcessNameLength &&
+                     memcmp( Sent->FilePath, Received->FilePath, Sent->FilePathLength * sizeof(WCHAR) ) == 0 &&
+                     memcmp( Sent->ProcessName, Received->ProcessName, Sent->ProcessNameLength * sizeof(WCHAR) ) == 0);
+}
+
+static BOOLEAN
+DcWireInside (
+    _In_ const VOID *Buffer,
+    _In_ ULONG Length,
+    _In_ PCWSTR Name,
+    _In_ ULONG NameLength
+    )
+{
+    const UCHAR *start = (const UCHAR *)Buffer;
+    const UCHAR *name = (const UCHAR *)Name;
+
+    return (BOOLEAN)(name >= start && name + NameLength * sizeof(WCHAR) <= start + Length);
+}
+
+static ULONG
+DcWireReadAll (
+    _In_reads_bytes_(Length) const VOID *Buffer,
+    _In_ ULONG Length
+    )
+/*++
+Routine Description:
+    Reads what a batch that may be malformed holds, checking that every
+    name returned lies inside it.
+Return Value:
+    Number of events read.
+--*/
+{
+    DCWIRE_READER reader;
+    DCWIRE_EVENT event;
+    ULONG count = 0;
+
+    if (!NT_SUCCESS( DcWireBeginRead( &reader, Buffer, Length ) )) {
+        return 0;
+    }
+
+    while (NT_SUCCESS( DcWireReadEvent( &reader, &event ) )) {
+
+        g_Checks++;
+        if (!DcWireInside( Buffer, Length, event.FilePath, event.FilePathLength ) ||
+            !DcWireInside( Buffer, Length, event.ProcessName, event.ProcessNameLength )) {
+            DcWireFail( "event %u of a batch of %u bytes has names outside it", count, Length );
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static VOID
+DcWireCheckRoundTrips (
+    _Inout_ PULONG64 State,
+    _Out_writes_bytes_(DCWIRE_BATCH_SIZE) PVOID Buffer
+    )
+/*++
+Routine Description:
+    Fills batches with random events until they are full and reads them
+    back.
+--*/
+{
+    static DCWIRE_EVENT sent[DCWIRE_BATCH_SIZE / sizeof(DCWIRE_RECORD)];
+    DCWIRE_WRITER writer;
+    DCWIRE_READER reader;
+    DCWIRE_EVENT received;
+    NTSTATUS status;
+    ULONG length;
+    ULONG count;
+    ULONG batch;
+    ULONG i;
+
+    for (batch = 0; batch < DCWIRE_ROUND_TRIPS; batch++) {
+
+        //  Short names mostly, every so often names near the longest.
+        ULONG maxName = (batch % 8 == 0) ? DCWIRE_MAX_NAME : 64;
+
+        if (!DcWireBeginBatch( &writer, Buffer, DCWIRE_BATCH_SIZE )) {
+            DcWireFail( "DcWireBeginBatch: no room for the header" );
+            return;
+        }
+
+        for (count = 0; ; count++) {
+
+            DcWireMakeEvent( State, &sent[count], maxName );
+            if (!DcWireAppendEvent( &writer, &sent[count] )) {
+
+                //  Only full batches refuse an event.
+                g_Checks++;
+                length = DCWIRE_RECORD_SIZE( (ULONG)sent[count].FilePathLength + sent[count].ProcessNameLength );
+                if (writer.Length + length <= DCWIRE_BATCH_SIZE) {
+                    DcWireFail( "DcWireAppendEvent: refused %u bytes with %u free",
+                                length, DCWIRE_BATCH_SIZE - writer.Length );
+                }
+                break;
+            }
+        }
+
+        length = DcWireEndBatch( &writer );
+
+        g_Checks++;
+        status = DcWireBeginRead( &reader, Buffer, length );
+        if (!NT_SUCCESS( status )) {
+            DcWireFail( "DcWireBeginRead: 0x%08X for a batch of %u events", (unsigned)status, count );
+            continue;
+        }
+
+        for (i = 0; i < count; i++) {
+
+            g_Checks++;
+            status = DcWireReadEvent( &reader, &received );
+            if (!NT_SUCCESS( status ) || !DcWireSameEvent( &sent[i], &received )) {
+                DcWireFail( "DcWireReadEvent: event %u of %u differs, status 0x%08X", i, count, (unsigned)status );
+                break;
+            }
+        }
+
+        g_Checks++;
+        if (i == count && DcWireReadEvent( &reader, &received ) != STATUS_NO_MORE_ENTRIES) {
+            DcWireFail( "DcWireReadEvent: more than the %u events of the batch", count );
+        }
+    }
+}
+
+static VOID
+DcWireCheckTruncation (
+    _Inout_ PULONG64 State
+    )
+/*++
+Routine Description:
+    Encodes events with long names into every capacity up to their size,
+    aligned or not, and checks what the record keeps of them.
+--*/
+{
+    static ULONG64 record[(sizeof(DCWIRE_RECORD) + 2 * DCWIRE_MAX_NAME * sizeof(WCHAR)) / sizeof(ULONG64) + 1];
+    DCWIRE_EVENT event;
+    DCWIRE_EVENT decoded;
+    ULONG capacity;
+    ULONG available;
+    ULONG length;
+    ULONG full;
+    ULONG i;
+
+    for (i = 0; i < 20; i++) {
+
+        DcWireMakeEvent( State, &event, DCWIRE_MAX_NAME );
+        full = DCWIRE_RECORD_SIZE( (ULONG)event.FilePathLength + event.ProcessNameLength );
+
+        for (capacity = 0; capacity <= full + DCWIRE_ALIGNMENT; capacity++) {
+
+            g_Checks++;
+            length = DcWireEncodeRecord( record, capacity, &event );
+
+            if (capacity < sizeof(DCWIRE_RECORD)) {
+                if (length != 0) {
+                    DcWireFail( "DcWireEncodeRecord: %u bytes into %u", length, capacity );
+                }
+                continue;
+            }
+
+            if (length == 0 || length > capacity || !NT_SUCCESS( DcWireDecodeRecord( record, length, &decoded ) )) {
+                DcWireFail( "DcWireEncodeRecord: %u bytes into %u cannot be decoded", length, capacity );
+                continue;
+            }
+
+            //  The file path is kept first, and as much of both names as
+            //  fits.
+            available = ((capacity & ~(ULONG)(DCWIRE_ALIGNMENT - 1)) - (ULONG)sizeof(DCWIRE_RECORD)) / sizeof(WCHAR);
+            if (decoded.FilePathLength != ((event.FilePathLength < available) ? event.FilePathLength : available) ||
+                decoded.ProcessNameLength != ((event.ProcessNameLength < available - decoded.FilePathLength) ?
+                                              event.ProcessNameLength : available - decoded.FilePathLength) ||
+                memcmp( decoded.FilePath, event.FilePath, decoded.FilePathLength * sizeof(WCHAR) ) != 0 ||
+                memcmp( decoded.ProcessName, event.ProcessName, decoded.ProcessNameLength * sizeof(WCHAR) ) != 0) {
+                DcWireFail( "DcWireEncodeRecord: names %u and %u cut to %u and %u in %u bytes",
+                            event.FilePathLength, event.ProcessNameLength,
+                            decoded.FilePathLength, decoded.ProcessNameLength, capacity );
+            }
+
+            if (((decoded.Flags & DCWIRE_FLAG_TRUNCATED) != 0) !=
+                (decoded.FilePathLength != event.FilePathLength ||
+                 decoded.ProcessNameLength != event.ProcessNameLength)) {
+                DcWireFail( "DcWireEncodeRecord: truncation flag wrong in %u bytes", capacity );
+            }
+        }
+    }
+}
+
+static VOID
+DcWireCheckMalformed (
+    _Inout_ PULONG64 State,
+    _Out_writes_bytes_(DCWIRE_BATCH_SIZE) PVOID Buffer
+    )
+/*++
+Routine Description:
+    Decodes a small batch with each of its header fields and lengths
+    set to values around the edges, cut short at every length, and with
+    random bytes flipped. The batch is copied to the end of an
+    allocation of its size each time, so that reading past it is caught
+    by the address sanitizer where there is one.
+--*/
+{
+    static const ULONG values[] = {
+        0, 1, 2, 4, 6, 7, 8, 9, 16, sizeof(DCWIRE_BATCH), sizeof(DCWIRE_RECORD),
+        0x7F, 0x80, 0xFF, 0x100, 0x7FFF, 0x8000, 0xFFFF, 0x10000, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF,
+    };
+    DCWIRE_WRITER writer;
+    DCWIRE_EVENT event;
+    PUCHAR copy;
+    PUCHAR batch = (PUCHAR)Buffer;
+    ULONG length;
+    ULONG offset;
+    ULONG size;
+    ULONG count;
+    ULONG value;
+    ULONG i;
+
+    DcWireBeginBatch( &writer, Buffer, DCWIRE_BATCH_SIZE );
+    for (i = 0; i < 3; i++) {
+        DcWireMakeEvent( State, &event, 40 );
+        DcWireAppendEvent( &writer, &event );
+    }
+    length = DcWireEndBatch( &writer );
+
+    copy = malloc( length );
+    if (copy == NULL) {
+        DcWireFail( "out of memory" );
+        return;
+    }
+
+    //  Every value at every aligned offset of the batch header and of the
+    //  first record's header, in every size a field has there.
+    for (offset = 0; offset + sizeof(USHORT) <= sizeof(DCWIRE_BATCH) + sizeof(DCWIRE_RECORD); offset += sizeof(USHORT)) {
+
+        for (size = sizeof(USHORT); size <= sizeof(ULONG) && offset % size == 0; size *= 2) {
+
+            for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+
+                memcpy( copy, batch, length );
+                value = values[i];
+                if (size == sizeof(USHORT)) {
+                    USHORT narrow = (USHORT)value;
+                    memcpy( copy + offset, &narrow, sizeof(narrow) );
+                } else {
+                    memcpy( copy + offset, &value, sizeof(value) );
+                }
+
+                DcWireReadAll( copy, length );
+            }
+        }
+    }
+
+    //  Cut short at every length, the header still saying the full one.
+    for (size = 0; size <= length; size++) {
+
+        PUCHAR cut = malloc( size ? size : 1 );
+
+        if (cut == NULL) {
+            break;
+        }
+        memcpy( cut, batch, size );
+        count = DcWireReadAll( cut, size );
+
+        g_Checks++;
+        if (size < length && count != 0) {
+            DcWireFail( "DcWireBeginRead: read a batch of %u bytes from %u", length, size );
+        }
+        free( cut );
+    }
+
+    //  Random bytes flipped anywhere.
+    for (i = 0; i < DCWIRE_RANDOM_FLIPS; i++) {
+
+        ULONG flips = 1 + DcWireRandom( State ) % 4;
+
+        memcpy( copy, batch, length );
+        while (flips-- != 0) {
+            ULONG r = DcWireRandom( State );
+            copy[r % length] ^= (UCHAR)(1 + (r >> 16) % 255);
+        }
+
+        DcWireReadAll( copy, length );
+    }
+
+    free( copy );
+}
+
+static int
+DcWireVerify (
+    VOID
+    )
+{
+    ULONG64 *buffer = malloc( DCWIRE_BATCH_SIZE );
+    ULONG64 state = 1;
+    ULONG i;
+
+    if (buffer == NULL) {
+        fprintf( stderr, "out of memory\n" );
+        return 1;
+    }
+
+    for (i = 0; i < DCWIRE_MAX_NAME; i++) {
+        g_FilePath[i] = (WCHAR)(DcWireRandom( &state ) & 0xFFFF);
+        g_ProcessName[i] = (WCHAR)(DcWireRandom( &state ) & 0xFFFF);
+    }
+
+    DcWireCheckRoundTrips( &state, buffer );
+    DcWireCheckTruncation( &state );
+    DcWireCheckMalformed( &state, buffer );
+
+    free( buffer );
+
+    printf( "%llu checks, %llu failures\n", (unsigned long long)g_Checks, (unsigned long long)g_Failures );
+    return g_Failures != 0;
+}
+
+static int
+DcWireBench (
+    _In_ ULONG Records
+    )
+/*++
+Routine Description:
+    Encodes denials of a typical size, a 60 character path and a 30
+    character image name, into batches of the size the filter sends,
+    then reads every batch back.
+--*/
+{
+    ULONG batchCount = 256;
+    PUCHAR batches = malloc( (size_t)batchCount * DCWIRE_BATCH_SIZE );
+    PULONG lengths = malloc( batchCount * sizeof(ULONG) );
+    DCWIRE_WRITER writer;
+    DCWIRE_READER reader;
+    DCWIRE_EVENT event;
+    ULONG64 state = 1;
+    ULONG64 start;
+    ULONG64 encodeTime = 0;
+    ULONG64 readTime = 0;
+    ULONG64 encoded = 0;
+    ULONG64 read = 0;
+    volatile ULONG64 sink = 0;
+    ULONG i;
+
+    if (batches == NULL || lengths == NULL) {
+        fprintf( stderr, "out of memory\n" );
+        return 1;
+    }
+
+    for (i = 0; i < DCWIRE_MAX_NAME; i++) {
+        g_FilePath[i] = (WCHAR)(L'a' + i % 26);
+        g_ProcessName[i] = (WCHAR)(L'A' + i % 26);
+    }
+
+    DcWireMakeEvent( &state, &event, 0 );
+    event.Type = DCWIRE_RECORD_DENIAL;
+    event.FilePathLength = 60;
+    event.ProcessNameLength = 30;
+
+    while (encoded < Records) {
+
+        start = DcWireNow();
+        for (i = 0; i < batchCount && encoded < Records; i++) {
+
+            DcWireBeginBatch( &writer, batches + (size_t)i * DCWIRE_BATCH_SIZE, DCWIRE_BATCH_SIZE );
+            while (encoded < Records) {
+                event.Timestamp++;
+                if (!DcWireAppendEvent( &writer, &event )) {
+                    break;
+                }
+                encoded++;
+            }
+            lengths[i] = DcWireEndBatch( &writer );
+        }
+        encodeTime += DcWireNow() - start;
+
+        start = DcWireNow();
+        for (batchCount = i, i = 0; i < batchCount; i++) {
+
+            DCWIRE_EVENT received;
+
+            DcWireBeginRead( &reader, batches + (size_t)i * DCWIRE_BATCH_SIZE, lengths[i] );
+            while (NT_SUCCESS( DcWireReadEvent( &reader, &received ) )) {
+                sink += received.FilePath[received.FilePathLength - 1] + received.Timestamp;
+                read++;
+            }
+        }
+        readTime += DcWireNow() - start;
+        batchCount = 256;
+    }
+
+    printf( "records: %llu, %u bytes each\n", (unsigned long long)encoded,
+            DCWIRE_RECORD_SIZE( (ULONG)event.FilePathLength + event.ProcessNameLength ) );
+    printf( "encode: %.1f ns per record, %.2f million records/s\n",
+            (double)encodeTime / encoded, encoded * 1e3 / (double)encodeTime );
+    printf( "read:   %.1f ns per record, %.2f million records/s\n",
+            (double)readTime / read, read * 1e3 / (double)readTime );
+
+    free( batches );
+    free( lengths );
+    return read != encoded || sink == 0;
+}
+
+int
+main (
+    int argc,
+    char *argv[]
+    )
+{
+    ULONG records = DCWIRE_DEFAULT_RECORDS;
+
+    if (argc == 2 && strcmp( argv[1], "verify" ) == 0) {
+        return DcWireVerify();
+    }
+
+    if ((argc == 2 || argc == 3) && strcmp( argv[1], "bench" ) == 0) {
+
+        if (argc == 3) {
+            records = (ULONG)strtoul( argv[2], NULL, 0 );
+        }
+        if (records != 0) {
+            return DcWireBench( records );
+        }
+    }
+
+    fprintf( stderr, "Usage: dcwire verify\n"
+                     "       dcwire bench [records]\n" );
+    return 2;
+}
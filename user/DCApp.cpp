@@ -2,26 +2,1437 @@
 //
 
 #include <iostream>
+#include <conio.h>
 #include "windows.h"
 #include <fltuser.h>
 #include "dcuk.h"
+#include "dcring.h"
+#include "dcwire.h"
+#include "dcmode.h"
+#include "dcext.h"
+#include "dcimage.h"
 #include "dcapp.h"
 
-//  Default and Maximum number of threads.
+//  Requests each worker keeps posted to the filter by default, and the
+//  most workers and requests that can be asked for. Workers default to
+//  one per processor; they are waited for with one wait, hence the
+//  limit.
 #define DCAPP_DEFAULT_REQUEST_COUNT       5
-#define DCAPP_DEFAULT_THREAD_COUNT        1
-#define DCAPP_MAX_THREAD_COUNT            2
+#define DCAPP_MAX_REQUEST_COUNT           16
+#define DCAPP_MAX_THREAD_COUNT            MAXIMUM_WAIT_OBJECTS
+//  Most message buffers in the pool. By default the pool has a spare
+//  buffer per worker on top of those posted.
+#define DCAPP_MAX_BUFFER_COUNT            2048
+#define DCAPP_CACHE_LINE_SIZE             64
 #define MAX_PATH_LEN                      MAX_PATH*2
+
+//  Service key of the filter, see DirControl.inf.
+#define DCAPP_SERVICE_KEY                 L"SYSTEM\\CurrentControlSet\\Services\\DirCtl"
+//  Every mix of long and short component names of a root is sent to the
+//  filter so that it can match opened names without normalizing them.
+//  Roots with more spellings than this are only sent in their long form.
+#define DCAPP_MAX_ROOT_SPELLINGS          16
+#define DCAPP_MAX_PATH_COMPONENTS         128
+//  Size of the section shared with the filter for denial events, and how
+//  often the workers look at it without a doorbell, in milliseconds, in
+//  case one was lost.
+#define DCAPP_RING_SIZE                   (sizeof(DCRING_HEADER) + 1024 * 1024)
+#define DCAPP_RING_POLL_INTERVAL          1000
+//  Default interval between two samples of DCApp stats, in seconds.
+#define DCAPP_DEFAULT_STATS_INTERVAL      1
+//  Denial events wait for the writer thread in entries of this size,
+//  which hold an event with about 1000 characters of names.
+#define DCAPP_SINK_ENTRY_SIZE             2048
+#define DCAPP_SINK_ENTRY_COUNT            4096
+//  Bytes of lines formatted before they are written out, longest line,
+//  and how long the writer lets them wait, in milliseconds.
+#define DCAPP_SINK_BUFFER_SIZE            (64 * 1024)
+#define DCAPP_SINK_LINE_SIZE              8192
+#define DCAPP_SINK_FLUSH_INTERVAL         1000
+//  How often the writer prints how deep the queue of requests was kept,
+//  in milliseconds.
+#define DCAPP_POOL_REPORT_INTERVAL        60000
+//  Rotated files kept beside the current one, as path.1 to path.N.
+#define DCAPP_SINK_ROTATE_COUNT           4
+#define DCAPP_MAX_ROTATE_SIZE             4096
+//  Events shown on the console per second.
+#define DCAPP_DEFAULT_CONSOLE_RATE        20
+#define DCAPP_MAX_CONSOLE_RATE            1000
+//  Message buffers, carved out of one slab with each on its own cache
+//  lines, and how many requests the filter holds. When none is posted
+//  the filter has to wait for DCApp before it can send anything.
+typedef struct _DCAPP_POOL {
+    //  Buffers not posted nor being read by a worker.
+    SLIST_HEADER Free;
+    PUCHAR Slab;
+    SIZE_T Stride;
+    DWORD Count;
+    //  Requests posted and not dequeued yet, the fewest there were after
+    //  one was dequeued since the last report, and how often there were
+    //  none since then.
+    volatile LONG Pending;
+    volatile LONG Lowest;
+    volatile LONG Empty;
+    //  How often a worker found no spare buffer to post before reading
+    //  the message it dequeued.
+    volatile LONG Exhausted;
+    volatile LONG64 Received;
+    //  Lowest and Empty over the whole run, folded in at each report.
+    volatile LONG RunLowest;
+    volatile LONG RunEmpty;
+    //  Figures at the last report and when it was, for the writer only.
+    LONG64 ReportedReceived;
+    LONG ReportedExhausted;
+    ULONG64 ReportedTick;
+} DCAPP_POOL, * PDCAPP_POOL;
+
 //  Context passed to worker threads
 typedef struct _DCAPP_THREAD_CONTEXT {
     HANDLE Port;
     HANDLE Completion;
+    PDCAPP_POOL Pool;
 } DCAPP_THREAD_CONTEXT, * PDCAPP_THREAD_CONTEXT;
 
-BOOL g_bContinue = TRUE;
-VOID Usage(VOID) {
-    wprintf(L"Connects to the directory protect filter \n");
-    wprintf(L"Usage: DCAPP [directory path] \n");
+//  An event queued for the writer thread, as a DCWIRE record.
+typedef struct _DCAPP_SINK_ENTRY {
+    SLIST_ENTRY Entry;
+    ULONG64 Record[(DCAPP_SINK_ENTRY_SIZE - sizeof(SLIST_ENTRY)) / sizeof(ULONG64)];
+} DCAPP_SINK_ENTRY, * PDCAPP_SINK_ENTRY;
+
+typedef struct _DCAPP_LINE {
+    WCHAR Text[DCAPP_SINK_LINE_SIZE];
+    size_t Length;
+} DCAPP_LINE, * PDCAPP_LINE;
+
+//  Every name of an entry escaped for JSON fits on a line.
+C_ASSERT(DCAPP_SINK_LINE_SIZE > 6 * DCAPP_SINK_ENTRY_SIZE / sizeof(WCHAR) + 512);
+
+//  Denial events on their way from the workers to a file or pipe and the
+//  console. Workers push them on Queue; the writer thread takes them all
+//  at once and is the only one to touch the rest.
+typedef struct _DCAPP_SINK {
+    SLIST_HEADER Queue;
+    SLIST_HEADER Free;
+    PUCHAR Slab;
+    HANDLE Wake;
+    HANDLE Thread;
+    HANDLE File;
+    PCWSTR Path;
+    //  Pool whose queue depth the writer reports, or NULL.
+    PDCAPP_POOL Pool;
+    ULONG64 RotateSize;
+    ULONG64 FileSize;
+    ULONG64 ConsoleSecond;
+    //  Events dropped with the queue full, written to the file, not
+    //  shown on the console for the rate, failed writes and rotations.
+    volatile LONG64 Dropped;
+    LONG64 Written;
+    LONG64 Hidden;
+    LONG64 WriteErrors;
+    LONG64 Rotations;
+    BOOL Pipe;
+    BOOL Json;
+    volatile BOOL Stop;
+    DWORD ConsoleRate;
+    DWORD ConsoleShown;
+    DWORD ConsoleHidden;
+    DWORD Buffered;
+    DCAPP_LINE Line;
+    char Buffer[DCAPP_SINK_BUFFER_SIZE];
+} DCAPP_SINK, * PDCAPP_SINK;
+
+//  Modes that can be given with -m.
+typedef struct _DCAPP_MODE_NAME {
+    PCWSTR Name;
+    ULONG Mode;
+} DCAPP_MODE_NAME, * PDCAPP_MODE_NAME;
+
+const DCAPP_MODE_NAME g_ModeNames[] = {
+    { L"readonly",      DCMODE_READ_ONLY },
+    { L"appendonly",    DCMODE_APPEND_ONLY },
+    { L"nodelete",      DCMODE_NO_DELETE },
+    { L"noacl",         DCMODE_NO_ACL_CHANGE },
+};
+
+//  Names DCApp stats prints the counters under, by DCAPP_COUNTER_*.
+const PCWSTR g_CounterNames[DCAPP_COUNTER_COUNT] = {
+    L"Pre create callbacks",
+    L"Post create callbacks",
+    L"Pre write callbacks",
+    L"Pre set information callbacks",
+    L"Pre file system control callbacks",
+    L"Name queries",
+    L"Failed name queries",
+    L"Creates decided on the opened name",
+    L"Creates decided on a cached name",
+    L"Creates decided on a normalized name",
+    L"Path lookups",
+    L"Path matches",
+    L"Denied creates",
+    L"Denied opens",
+    L"Denied writes",
+    L"Denied set information",
+    L"Denied file system controls",
+    L"Denied renames and links",
+    L"Events queued",
+    L"Events dropped",
+    L"Events sent",
+    L"Events lost",
+    L"Event bytes sent",
+    L"Create contexts allocated",
+    L"Create contexts freed",
+};
+
+//  Names DCApp stats prints the latency histograms under, by
+//  DCAPP_LATENCY_*.
+const PCWSTR g_LatencyNames[DCAPP_LATENCY_COUNT] = {
+    L"Pre create",
+    L"Post create",
+    L"Denial notification",
+    L"Name query",
+    L"Path match",
+};
+
+BOOL g_bContinue = TRUE;
+//  Event ring, drained by one worker at a time.
+BOOL g_bRing = FALSE;
+DCRING_CONSUMER g_Ring;
+CRITICAL_SECTION g_RingLock;
+DCAPP_SINK g_Sink;
+VOID Usage(VOID) {
+    wprintf(L"Connects to the directory protect filter \n");
+    wprintf(L"Usage: DCAPP [-p] [-w workers] [-q requests] [-b buffers] [-o file|pipe [-j] [-r MB]] [-e events] [-t trusted executable path] ... [-x only|except:ext,...] [[-m mode] directory path | @file with one path per line] ... \n");
+    wprintf(L"       -m applies to the directories after it: readonly (default), appendonly, nodelete or noacl\n");
+    wprintf(L"       -x only:exe,dll protects only files with these extensions, -x except:log,tmp all others\n");
+    wprintf(L"       -p stores the policy for the driver to enforce at boot and leaves it on on exit\n");
+    wprintf(L"       -w sets the worker threads (default one per processor, up to %u), -q the requests\n", DCAPP_MAX_THREAD_COUNT);
+    wprintf(L"       each keeps posted to the driver (default %u, up to %u), -b the message buffers\n", DCAPP_DEFAULT_REQUEST_COUNT, DCAPP_MAX_REQUEST_COUNT);
+    wprintf(L"       (default one more per worker than are posted, up to %u)\n", DCAPP_MAX_BUFFER_COUNT);
+    wprintf(L"       -o writes denials to a file or \\\\.\\pipe\\name, -j as JSON lines, -r rotates the file past MB\n");
+    wprintf(L"       -e sets the denials shown on the console per second (default %u, 0 for none)\n", DCAPP_DEFAULT_CONSOLE_RATE);
+    wprintf(L"       DCAPP -c removes the stored policy\n");
+    wprintf(L"       DCAPP stats [seconds] prints the filter's counters and their rates until a key is pressed\n");
+}
+
+/*++
+Routine Description
+    Converts a DOS path such as C:\Data into the device form the filter
+    matches against, e.g. \Device\HarddiskVolume3\Data\
+Arguments
+    DosPath - Path given by the user
+    DevicePath - Receives the device path
+    DevicePathSize - Size of DevicePath in WCHARs
+    bDirectory - TRUE to end the device path with a backslash
+Return Value
+    TRUE if the path could be converted.
+--*/
+BOOL DCAppGetDevicePath( _In_ PCWSTR DosPath, _Out_writes_(DevicePathSize) PWSTR DevicePath,
+                         _In_ DWORD DevicePathSize, _In_ BOOL bDirectory )
+{
+    WCHAR szDriveName[3] = L"";
+    size_t nLen = wcsnlen_s(DosPath, MAX_PATH_LEN);
+
+    if (nLen < 2 || DosPath[1] != L':') {
+        return FALSE;
+    }
+
+    szDriveName[0] = DosPath[0];
+    szDriveName[1] = L':';
+    if (QueryDosDeviceW(szDriveName, DevicePath, DevicePathSize) == 0) {
+        return FALSE;
+    }
+
+    if (wcscat_s(DevicePath, DevicePathSize, DosPath + 2) != 0) {
+        return FALSE;
+    }
+
+    nLen = wcslen(DevicePath);
+    if (bDirectory && DevicePath[nLen - 1] != L'\\' &&
+        wcscat_s(DevicePath, DevicePathSize, L"\\") != 0) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Appends a record to the policy update, growing it as needed.
+Arguments
+    Update - Update being built, may be reallocated
+    UpdateCapacity - Bytes allocated for Update
+    Type - DCAPP_UPDATE_* type of the record
+    Flags - Flags of the record
+    Value - Value of the record, NULL if it has none
+    Length - Size of Value in bytes
+Return Value
+    TRUE if the record was added.
+--*/
+BOOL DCAppAppendRecord( _Inout_ PDCAPP_UPDATE_INPUT* Update, _Inout_ PDWORD UpdateCapacity,
+                        _In_ USHORT Type, _In_ USHORT Flags, _In_opt_ const VOID* Value,
+                        _In_ DWORD Length )
+{
+    DWORD nSize = FIELD_OFFSET(DCAPP_UPDATE_INPUT, Records) + (*Update)->RecordsLength;
+    DWORD nRecordSize = DCAPP_UPDATE_RECORD_SIZE(Length);
+    PDCAPP_UPDATE_RECORD record;
+
+    if (nSize + nRecordSize > *UpdateCapacity) {
+
+        DWORD nCapacity = max(*UpdateCapacity * 2, nSize + nRecordSize);
+        PDCAPP_UPDATE_INPUT pGrown = (PDCAPP_UPDATE_INPUT)realloc(*Update, nCapacity);
+        if (pGrown == NULL) {
+            return FALSE;
+        }
+        *Update = pGrown;
+        *UpdateCapacity = nCapacity;
+    }
+
+    record = (PDCAPP_UPDATE_RECORD)&(*Update)->Records[(*Update)->RecordsLength];
+    memset(record, 0, nRecordSize);
+    record->Type = Type;
+    record->Flags = Flags;
+    record->Length = Length;
+    if (Length != 0) {
+        memcpy(record->Value, Value, Length);
+    }
+
+    (*Update)->RecordCount++;
+    (*Update)->RecordsLength += nRecordSize;
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Appends one spelling of a protected root to the policy update.
+Arguments
+    Update - Update being built, may be reallocated
+    UpdateCapacity - Bytes allocated for Update
+    DosPath - Directory path
+    Flags - DCAPP_ROOT_ALIAS if this is another spelling of the previous root,
+            and the mode of the root
+Return Value
+    TRUE if the root was added.
+--*/
+BOOL DCAppAppendRoot( _Inout_ PDCAPP_UPDATE_INPUT* Update, _Inout_ PDWORD UpdateCapacity,
+                      _In_ PCWSTR DosPath, _In_ USHORT Flags )
+{
+    WCHAR szDevicePath[MAX_PATH_LEN] = L"";
+
+    if (!DCAppGetDevicePath(DosPath, szDevicePath, MAX_PATH_LEN, TRUE)) {
+        wprintf(L"ERROR: Cannot resolve %s: %d\n", DosPath, GetLastError());
+        return FALSE;
+    }
+
+    if (!DCAppAppendRecord(Update, UpdateCapacity, DCAPP_UPDATE_ADD_ROOT, Flags, szDevicePath,
+                           (DWORD)(wcslen(szDevicePath) * sizeof(WCHAR)))) {
+        return FALSE;
+    }
+
+    if ((Flags & DCAPP_ROOT_ALIAS) == 0) {
+        wprintf(L"DCAPP: Protecting %s, mode 0x%02x\n", szDevicePath,
+                (Flags & DCAPP_ROOT_MODE_MASK) >> DCAPP_ROOT_MODE_SHIFT);
+    }
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Splits a path into its components in place.
+Arguments
+    Path - Path to split, its separators are overwritten
+    Components - Receives the start of every component
+Return Value
+    Number of components, or 0 if there are too many.
+--*/
+DWORD DCAppSplitPath( _Inout_ PWSTR Path,
+                      _Out_writes_(DCAPP_MAX_PATH_COMPONENTS) PWSTR* Components )
+{
+    DWORD nCount = 0;
+    PWSTR pNext = Path;
+
+    while (*pNext != L'\0') {
+
+        PWSTR pEnd = wcschr(pNext, L'\\');
+        if (pEnd != NULL) {
+            *pEnd = L'\0';
+        }
+
+        if (*pNext != L'\0') {
+            if (nCount == DCAPP_MAX_PATH_COMPONENTS) {
+                return 0;
+            }
+            Components[nCount++] = pNext;
+        }
+
+        if (pEnd == NULL) {
+            break;
+        }
+        pNext = pEnd + 1;
+    }
+
+    return nCount;
+}
+
+/*++
+Routine Description
+    Appends a protected root to the policy update in every spelling the
+    filter may see it in: with each component in its long or short form.
+Arguments
+    Update - Update being built, may be reallocated
+    UpdateCapacity - Bytes allocated for Update
+    DosPath - Directory path given by the user
+    Mode - DCMODE_* mode of the root
+Return Value
+    TRUE if the root was added.
+--*/
+BOOL DCAppAddRoot( _Inout_ PDCAPP_UPDATE_INPUT* Update, _Inout_ PDWORD UpdateCapacity,
+                   _In_ PCWSTR DosPath, _In_ ULONG Mode )
+{
+    WCHAR szLongPath[MAX_PATH_LEN] = L"";
+    WCHAR szShortPath[MAX_PATH_LEN] = L"";
+    WCHAR szSpelling[MAX_PATH_LEN];
+    PWSTR longNames[DCAPP_MAX_PATH_COMPONENTS];
+    PWSTR shortNames[DCAPP_MAX_PATH_COMPONENTS];
+    DWORD differing[DCAPP_MAX_PATH_COMPONENTS];
+    DWORD nComponents, nDiffering = 0;
+    DWORD nLength, nMask, i;
+    USHORT nModeFlags = (USHORT)(Mode << DCAPP_ROOT_MODE_SHIFT);
+
+    //  A directory that does not exist yet is protected as spelled; the
+    //  filter falls back to normalized names for its short forms.
+    nLength = GetLongPathNameW(DosPath, szLongPath, MAX_PATH_LEN);
+    if (nLength != 0 && nLength < MAX_PATH_LEN) {
+        nLength = GetShortPathNameW(szLongPath, szShortPath, MAX_PATH_LEN);
+    }
+    if (nLength == 0 || nLength >= MAX_PATH_LEN) {
+        return DCAppAppendRoot(Update, UpdateCapacity, DosPath, nModeFlags);
+    }
+
+    nComponents = DCAppSplitPath(szLongPath, longNames);
+    if (nComponents == 0 || nComponents != DCAppSplitPath(szShortPath, shortNames)) {
+        return DCAppAppendRoot(Update, UpdateCapacity, DosPath, nModeFlags);
+    }
+
+    for (i = 0; i < nComponents; i++) {
+        if (_wcsicmp(longNames[i], shortNames[i]) != 0) {
+            differing[nDiffering++] = i;
+        }
+    }
+
+    if (nDiffering >= 32 || (1UL << nDiffering) > DCAPP_MAX_ROOT_SPELLINGS) {
+        wprintf(L"DCAPP: Too many short names in %s, sending the long form only\n", DosPath);
+        nDiffering = 0;
+    }
+
+    //  Bit j of nMask selects the short form of component differing[j];
+    //  mask 0 is the long form and goes first.
+    for (nMask = 0; nMask < (1UL << nDiffering); nMask++) {
+
+        szSpelling[0] = L'\0';
+        for (i = 0; i < nComponents; i++) {
+
+            PCWSTR pName = longNames[i];
+            for (DWORD j = 0; j < nDiffering; j++) {
+                if (differing[j] == i && (nMask & (1UL << j)) != 0) {
+                    pName = shortNames[i];
+                }
+            }
+
+            if ((i > 0 && wcscat_s(szSpelling, MAX_PATH_LEN, L"\\") != 0) ||
+                wcscat_s(szSpelling, MAX_PATH_LEN, pName) != 0) {
+                return FALSE;
+            }
+        }
+
+        if (!DCAppAppendRoot(Update, UpdateCapacity, szSpelling,
+                             nModeFlags | ((nMask == 0) ? 0 : DCAPP_ROOT_ALIAS))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Appends the extension rule to the policy update.
+Arguments
+    Update - Update being built, may be reallocated
+    UpdateCapacity - Bytes allocated for Update
+    Rule - only:ext,... or except:ext,... as given after -x
+Return Value
+    TRUE if the rule was added.
+--*/
+BOOL DCAppAppendExtensions( _Inout_ PDCAPP_UPDATE_INPUT* Update, _Inout_ PDWORD UpdateCapacity,
+                            _In_ PCWSTR Rule )
+{
+    //  An entry takes at most 8 bytes per character of the list.
+    ULONG rgBuffer[(FIELD_OFFSET(DCAPP_EXTENSIONS, Extensions) + 8 * MAX_PATH_LEN) / sizeof(ULONG)];
+    PDCAPP_EXTENSIONS extensions = (PDCAPP_EXTENSIONS)rgBuffer;
+    WCHAR szList[MAX_PATH_LEN];
+    PDCAPP_ROOT entry;
+    PWSTR pToken, pContext = NULL;
+    DWORD nSize = FIELD_OFFSET(DCAPP_EXTENSIONS, Extensions);
+    DWORD nEntrySize;
+    USHORT nLength;
+    ULONG nRule;
+
+    if (_wcsnicmp(Rule, L"only:", 5) == 0) {
+        nRule = DCEXT_RULE_ONLY;
+        Rule += 5;
+    } else if (_wcsnicmp(Rule, L"except:", 7) == 0) {
+        nRule = DCEXT_RULE_EXCEPT;
+        Rule += 7;
+    } else {
+        Usage();
+        return FALSE;
+    }
+
+    if (wcscpy_s(szList, MAX_PATH_LEN, Rule) != 0) {
+        return FALSE;
+    }
+
+    memset(extensions, 0, nSize);
+    extensions->Rule = nRule;
+
+    for (pToken = wcstok_s(szList, L",", &pContext); pToken != NULL;
+         pToken = wcstok_s(NULL, L",", &pContext)) {
+
+        //  *.exe and .exe are taken for exe.
+        if (pToken[0] == L'*') {
+            pToken++;
+        }
+        if (pToken[0] == L'.') {
+            pToken++;
+        }
+
+        nLength = (USHORT)(wcslen(pToken) * sizeof(WCHAR));
+        if (nLength == 0 || nLength > DCEXT_MAX_LENGTH * sizeof(WCHAR)) {
+            wprintf(L"ERROR: Invalid extension %s\n", pToken);
+            return FALSE;
+        }
+
+        nEntrySize = DCAPP_ROOT_SIZE(nLength);
+        if (nSize + nEntrySize > sizeof(rgBuffer)) {
+            return FALSE;
+        }
+
+        entry = (PDCAPP_ROOT)((PUCHAR)extensions + nSize);
+        memset(entry, 0, nEntrySize);
+        entry->Length = nLength;
+        memcpy(entry->Path, pToken, nLength);
+
+        extensions->ExtensionCount++;
+        extensions->ExtensionsLength += nEntrySize;
+        nSize += nEntrySize;
+    }
+
+    if (!DCAppAppendRecord(Update, UpdateCapacity, DCAPP_UPDATE_SET_EXTENSIONS, 0,
+                           extensions, nSize)) {
+        return FALSE;
+    }
+
+    wprintf(L"DCAPP: Protecting %s %u extensions\n",
+            nRule == DCEXT_RULE_ONLY ? L"only files with" : L"all files but those with",
+            extensions->ExtensionCount);
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Appends an executable to the trusted executables of the policy update.
+Arguments
+    Update - Update being built, may be reallocated
+    UpdateCapacity - Bytes allocated for Update
+    Path - Path of the executable given after -t
+Return Value
+    TRUE if the executable was added.
+--*/
+BOOL DCAppAppendTrusted( _Inout_ PDCAPP_UPDATE_INPUT* Update, _Inout_ PDWORD UpdateCapacity,
+                         _In_ PCWSTR Path )
+{
+    WCHAR szLongPath[MAX_PATH_LEN];
+    WCHAR szDevicePath[MAX_PATH_LEN];
+    DWORD nPathLength;
+
+    //  The filter matches the normalized name of the image, which has
+    //  long component names.
+    nPathLength = GetFullPathNameW(Path, MAX_PATH_LEN, szDevicePath, NULL);
+    if (nPathLength != 0 && nPathLength < MAX_PATH_LEN) {
+        nPathLength = GetLongPathNameW(szDevicePath, szLongPath, MAX_PATH_LEN);
+    }
+    if (nPathLength == 0 || nPathLength >= MAX_PATH_LEN ||
+        !DCAppGetDevicePath(szLongPath, szDevicePath, MAX_PATH_LEN, FALSE)) {
+        wprintf(L"ERROR: Cannot resolve trusted executable %s: %d\n", Path, GetLastError());
+        return FALSE;
+    }
+
+    if (!DCAppAppendRecord(Update, UpdateCapacity, DCAPP_UPDATE_ADD_TRUSTED, 0, szDevicePath,
+                           (DWORD)(wcslen(szDevicePath) * sizeof(WCHAR)))) {
+        return FALSE;
+    }
+
+    wprintf(L"DCAPP: Trusting %s\n", szDevicePath);
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Builds the policy update for the command line, which replaces the
+    roots, their modes, the extension rule and the trusted executables in
+    effect in a single transaction. Every directory named becomes a root;
+    arguments starting with @ name a text file with one directory per
+    line. -m sets the mode of the directories after it, -x the extension
+    rule and -t adds a trusted executable; no -t trusts none. -p, -j, and
+    -w, -q, -b, -o, -r and -e with the argument after them, are skipped.
+Arguments
+    argc, argv - Command line
+    UpdateSize - Receives the size of the update in bytes
+Return Value
+    The update, to be released with free, or NULL.
+--*/
+PDCAPP_UPDATE_INPUT DCAppBuildUpdate( _In_ int argc, _In_ wchar_t* argv[], _Out_ PDWORD UpdateSize )
+{
+    DWORD nCapacity = 4096;
+    PDCAPP_UPDATE_INPUT update = (PDCAPP_UPDATE_INPUT)malloc(nCapacity);
+    ULONG nMode = DCMODE_READ_ONLY;
+    PCWSTR pExtensions = NULL;
+    DWORD nRoots = 0;
+    BOOL bResult;
+    int i;
+
+    *UpdateSize = 0;
+    if (update == NULL) {
+        return NULL;
+    }
+
+    memset(update, 0, FIELD_OFFSET(DCAPP_UPDATE_INPUT, Records));
+    update->ONOFF = DCAPP_UPDATE_POLICY;
+    update->Version = DCAPP_UPDATE_VERSION;
+    update->Generation = DCAPP_ANY_GENERATION;
+
+    bResult = DCAppAppendRecord(&update, &nCapacity, DCAPP_UPDATE_CLEAR_ROOTS, 0, NULL, 0) &&
+              DCAppAppendRecord(&update, &nCapacity, DCAPP_UPDATE_CLEAR_TRUSTED, 0, NULL, 0);
+
+    for (i = 1; i < argc && bResult; i++) {
+
+        if (_wcsicmp(argv[i], L"-w") == 0 || _wcsicmp(argv[i], L"-q") == 0 ||
+            _wcsicmp(argv[i], L"-b") == 0 || _wcsicmp(argv[i], L"-o") == 0 ||
+            _wcsicmp(argv[i], L"-r") == 0 || _wcsicmp(argv[i], L"-e") == 0) {
+            i++;
+            continue;
+        }
+
+        if (_wcsicmp(argv[i], L"-p") == 0 || _wcsicmp(argv[i], L"-j") == 0) {
+            continue;
+        }
+
+        if (_wcsicmp(argv[i], L"-t") == 0) {
+
+            if (i + 1 == argc) {
+                Usage();
+                bResult = FALSE;
+                break;
+            }
+
+            bResult = DCAppAppendTrusted(&update, &nCapacity, argv[++i]);
+            continue;
+        }
+
+        if (_wcsicmp(argv[i], L"-x") == 0) {
+
+            if (i + 1 == argc) {
+                Usage();
+                bResult = FALSE;
+                break;
+            }
+
+            pExtensions = argv[++i];
+            continue;
+        }
+
+        if (_wcsicmp(argv[i], L"-m") == 0) {
+
+            size_t j = 0;
+            while (i + 1 < argc && j < ARRAYSIZE(g_ModeNames) &&
+                   _wcsicmp(argv[i + 1], g_ModeNames[j].Name) != 0) {
+                j++;
+            }
+
+            if (i + 1 == argc || j == ARRAYSIZE(g_ModeNames)) {
+                Usage();
+                bResult = FALSE;
+                break;
+            }
+
+            nMode = g_ModeNames[j].Mode;
+            i++;
+            continue;
+        }
+
+        if (argv[i][0] != L'@') {
+            bResult = DCAppAddRoot(&update, &nCapacity, argv[i], nMode);
+            nRoots++;
+            continue;
+        }
+
+        FILE* pFile = NULL;
+        WCHAR szLine[MAX_PATH_LEN];
+        if (_wfopen_s(&pFile, argv[i] + 1, L"rt, ccs=UTF-8") != 0 || pFile == NULL) {
+            wprintf(L"ERROR: Cannot open %s\n", argv[i] + 1);
+            bResult = FALSE;
+            break;
+        }
+
+        while (bResult && fgetws(szLine, MAX_PATH_LEN, pFile) != NULL) {
+
+            szLine[wcscspn(szLine, L"\r\n")] = L'\0';
+            if (szLine[0] != L'\0') {
+                bResult = DCAppAddRoot(&update, &nCapacity, szLine, nMode);
+                nRoots++;
+            }
+        }
+        fclose(pFile);
+    }
+
+    //  The last -x applies.
+    if (bResult && nRoots != 0 && pExtensions != NULL) {
+        bResult = DCAppAppendExtensions(&update, &nCapacity, pExtensions);
+    }
+
+    if (!bResult || nRoots == 0) {
+        free(update);
+        return NULL;
+    }
+
+    *UpdateSize = FIELD_OFFSET(DCAPP_UPDATE_INPUT, Records) + update->RecordsLength;
+    return update;
+}
+
+/*++
+Routine Description
+    Shares an event ring with the filter, so that denials no longer
+    travel through the port one batch at a time.
+Arguments
+    Port - Connected filter port
+Return Value
+    TRUE if the ring is attached.
+--*/
+BOOL DCAppAttachRing( _In_ HANDLE Port )
+{
+    DCAPP_RING_INPUT input;
+    DWORD dwBytesReturned = 0;
+    HANDLE hSection;
+    PVOID pView;
+    HRESULT hr;
+
+    hSection = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                                  (DWORD)DCAPP_RING_SIZE, NULL);
+    if (hSection == NULL) {
+        wprintf(L"ERROR: Creating event ring: %d\n", GetLastError());
+        return FALSE;
+    }
+
+    pView = MapViewOfFile(hSection, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, DCAPP_RING_SIZE);
+    if (pView == NULL) {
+        wprintf(L"ERROR: Mapping event ring: %d\n", GetLastError());
+        CloseHandle(hSection);
+        return FALSE;
+    }
+
+    memset(&input, 0, sizeof(input));
+    input.ONOFF = DCAPP_ATTACH_RING;
+    input.Section = (ULONG64)(ULONG_PTR)hSection;
+    hr = FilterSendMessage(Port, &input, sizeof(input), NULL, 0, &dwBytesReturned);
+
+    //  The filter keeps its own reference to the section.
+    CloseHandle(hSection);
+
+    if (FAILED(hr) || !NT_SUCCESS(DcRingAttachConsumer(&g_Ring, pView, DCAPP_RING_SIZE))) {
+        wprintf(L"DCAPP: No event ring (0x%08x), receiving events through the port\n", hr);
+        UnmapViewOfFile(pView);
+        return FALSE;
+    }
+
+    DcRingPrepareWait(&g_Ring);
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Appends to a line of the sink, cutting what does not fit.
+--*/
+VOID DCAppLinePrintf( _Inout_ PDCAPP_LINE Line, _In_z_ _Printf_format_string_ PCWSTR Format, ... )
+{
+    va_list args;
+    int nLength;
+
+    va_start(args, Format);
+    nLength = _vsnwprintf_s(Line->Text + Line->Length, DCAPP_SINK_LINE_SIZE - Line->Length,
+                            _TRUNCATE, Format, args);
+    va_end(args);
+
+    Line->Length = (nLength < 0) ? DCAPP_SINK_LINE_SIZE - 1 : Line->Length + nLength;
+}
+
+/*++
+Routine Description
+    Appends a name to a line of the sink as the inside of a JSON string.
+--*/
+VOID DCAppLineEscape( _Inout_ PDCAPP_LINE Line, _In_reads_(Length) PCWSTR Name, _In_ USHORT Length )
+{
+    USHORT i;
+
+    for (i = 0; i < Length; i++) {
+
+        WCHAR c = Name[i];
+
+        if (c == L'"' || c == L'\\') {
+            DCAppLinePrintf(Line, L"\\%c", c);
+        } else if (c < 0x20) {
+            DCAppLinePrintf(Line, L"\\u%04x", c);
+        } else if (Line->Length + 1 < DCAPP_SINK_LINE_SIZE) {
+            Line->Text[Line->Length++] = c;
+            Line->Text[Line->Length] = L'\0';
+        }
+    }
+}
+
+/*++
+Routine Description
+    Formats a denial event, or how often one was repeated, as a line of
+    text in local time or as a JSON object in UTC.
+Arguments
+    Event - The event
+    Json - TRUE for JSON
+    Line - Receives the line, without a line break
+--*/
+VOID DCAppFormatEvent( _In_ PCDCWIRE_EVENT Event, _In_ BOOL Json, _Out_ PDCAPP_LINE Line )
+{
+    FILETIME localTime;
+    SYSTEMTIME time = { 0 };
+    SYSTEMTIME lastTime = { 0 };
+    BOOL bTruncated = (Event->Flags & DCWIRE_FLAG_TRUNCATED) != 0;
+
+    Line->Length = 0;
+    Line->Text[0] = L'\0';
+
+    if (Json) {
+
+        FileTimeToSystemTime((const FILETIME*)&Event->Timestamp, &time);
+        DCAppLinePrintf(Line, L"{\"time\":\"%04u-%02u-%02uT%02u:%02u:%02u.%03uZ\",\"type\":\"%s\",\"pid\":%llu,",
+                        time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute, time.wSecond,
+                        time.wMilliseconds,
+                        (Event->Type == DCWIRE_RECORD_REPEAT) ? L"repeat" : L"denial",
+                        Event->ProcessId);
+
+        if (Event->Type == DCWIRE_RECORD_REPEAT) {
+            FileTimeToSystemTime((const FILETIME*)&Event->LastTimestamp, &lastTime);
+            DCAppLinePrintf(Line, L"\"count\":%u,\"last\":\"%04u-%02u-%02uT%02u:%02u:%02u.%03uZ\",",
+                            Event->RepeatCount, lastTime.wYear, lastTime.wMonth, lastTime.wDay,
+                            lastTime.wHour, lastTime.wMinute, lastTime.wSecond, lastTime.wMilliseconds);
+        } else {
+            DCAppLinePrintf(Line, L"\"tid\":%llu,\"access\":%u,", Event->ThreadId, Event->AccessMask);
+        }
+
+        DCAppLinePrintf(Line, L"\"operation\":%u,\"truncated\":%s,\"path\":\"",
+                        Event->Operation, bTruncated ? L"true" : L"false");
+        DCAppLineEscape(Line, Event->FilePath, Event->FilePathLength);
+        DCAppLinePrintf(Line, L"\",\"process\":\"");
+        DCAppLineEscape(Line, Event->ProcessName, Event->ProcessNameLength);
+        DCAppLinePrintf(Line, L"\"}");
+        return;
+    }
+
+    FileTimeToLocalFileTime((const FILETIME*)&Event->Timestamp, &localTime);
+    FileTimeToSystemTime(&localTime, &time);
+
+    if (Event->Type == DCWIRE_RECORD_REPEAT) {
+
+        FileTimeToLocalFileTime((const FILETIME*)&Event->LastTimestamp, &localTime);
+        FileTimeToSystemTime(&localTime, &lastTime);
+
+        DCAppLinePrintf(Line, L"%02u:%02u:%02u.%03u File path %.*s%s Process (P)ID %llu Operation %u repeated %u times until %02u:%02u:%02u.%03u",
+            time.wHour, time.wMinute, time.wSecond, time.wMilliseconds,
+            (int)Event->FilePathLength, Event->FilePath, bTruncated ? L"..." : L"",
+            Event->ProcessId, Event->Operation, Event->RepeatCount,
+            lastTime.wHour, lastTime.wMinute, lastTime.wSecond, lastTime.wMilliseconds);
+        return;
+    }
+
+    DCAppLinePrintf(Line, L"%02u:%02u:%02u.%03u File path %.*s%s Process (P)ID %llu TID %llu Process path %.*s Operation %u Access 0x%08x",
+        time.wHour, time.wMinute, time.wSecond, time.wMilliseconds,
+        (int)Event->FilePathLength, Event->FilePath, bTruncated ? L"..." : L"",
+        Event->ProcessId, Event->ThreadId,
+        (int)Event->ProcessNameLength, Event->ProcessName,
+        Event->Operation, Event->AccessMask);
+}
+
+/*++
+Routine Description
+    Queues a denial event for the writer thread. Workers only copy the
+    event, so the filter never waits on the console or the disk. Records
+    of types this version does not know are skipped.
+Return Value
+    FALSE if the queue was full and the event was dropped.
+--*/
+BOOL DCAppQueueEvent( _In_ PCDCWIRE_EVENT Event )
+{
+    PDCAPP_SINK_ENTRY entry;
+
+    if (Event->Type != DCWIRE_RECORD_DENIAL && Event->Type != DCWIRE_RECORD_REPEAT) {
+        return TRUE;
+    }
+
+    entry = (PDCAPP_SINK_ENTRY)InterlockedPopEntrySList(&g_Sink.Free);
+    if (entry == NULL) {
+        InterlockedIncrement64(&g_Sink.Dropped);
+        return FALSE;
+    }
+
+    //  Names too long for the entry are cut and the event flagged.
+    DcWireEncodeRecord(entry->Record, sizeof(entry->Record), Event);
+
+    //  The writer is only woken by the first event of a batch.
+    if (InterlockedPushEntrySList(&g_Sink.Queue, &entry->Entry) == NULL) {
+        SetEvent(g_Sink.Wake);
+    }
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Opens the output of the sink: a named pipe, which must exist, or a
+    file, which is appended to.
+Return Value
+    TRUE if the output is open.
+--*/
+BOOL DCAppOpenSinkFile( _Inout_ PDCAPP_SINK Sink )
+{
+    LARGE_INTEGER size;
+
+    if (Sink->Pipe) {
+        Sink->File = CreateFileW(Sink->Path, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    } else {
+        Sink->File = CreateFileW(Sink->Path, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+                                 FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+
+    if (Sink->File == INVALID_HANDLE_VALUE) {
+        wprintf(L"ERROR: Opening %s: %d\n", Sink->Path, GetLastError());
+        return FALSE;
+    }
+
+    Sink->FileSize = 0;
+    if (!Sink->Pipe && GetFileSizeEx(Sink->File, &size)) {
+        Sink->FileSize = (ULONG64)size.QuadPart;
+    }
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Moves the output file aside as path.1, path.1 as path.2 and so on,
+    the oldest being deleted, and starts a new file.
+--*/
+VOID DCAppRotateSinkFile( _Inout_ PDCAPP_SINK Sink )
+{
+    WCHAR szFrom[MAX_PATH_LEN];
+    WCHAR szTo[MAX_PATH_LEN];
+    DWORD i;
+
+    CloseHandle(Sink->File);
+    Sink->File = INVALID_HANDLE_VALUE;
+
+    for (i = DCAPP_SINK_ROTATE_COUNT; i > 0; i--) {
+
+        if (i == 1) {
+            wcscpy_s(szFrom, MAX_PATH_LEN, Sink->Path);
+        } else {
+            swprintf_s(szFrom, MAX_PATH_LEN, L"%s.%u", Sink->Path, i - 1);
+        }
+        swprintf_s(szTo, MAX_PATH_LEN, L"%s.%u", Sink->Path, i);
+        MoveFileExW(szFrom, szTo, MOVEFILE_REPLACE_EXISTING);
+    }
+
+    Sink->Rotations++;
+    DCAppOpenSinkFile(Sink);
+}
+
+/*++
+Routine Description
+    Writes out the lines formatted so far, rotating the file first if
+    they would take it past its size.
+--*/
+VOID DCAppFlushSink( _Inout_ PDCAPP_SINK Sink )
+{
+    DWORD dwWritten = 0;
+
+    if (Sink->Buffered == 0) {
+        return;
+    }
+
+    if (!Sink->Pipe && Sink->RotateSize != 0 && Sink->FileSize != 0 &&
+        Sink->File != INVALID_HANDLE_VALUE &&
+        Sink->FileSize + Sink->Buffered > Sink->RotateSize) {
+        DCAppRotateSinkFile(Sink);
+    }
+
+    if (Sink->File == INVALID_HANDLE_VALUE ||
+        !WriteFile(Sink->File, Sink->Buffer, Sink->Buffered, &dwWritten, NULL) ||
+        dwWritten != Sink->Buffered) {
+        Sink->WriteErrors++;
+    }
+
+    Sink->FileSize += dwWritten;
+    Sink->Buffered = 0;
+}
+
+/*++
+Routine Description
+    Prints how many events were not shown on the console over the last
+    second, once that second is over.
+--*/
+VOID DCAppTickConsole( _Inout_ PDCAPP_SINK Sink )
+{
+    ULONG64 second = GetTickCount64() / 1000;
+
+    if (second == Sink->ConsoleSecond) {
+        return;
+    }
+
+    if (Sink->ConsoleHidden != 0) {
+        wprintf(L"DCAPP: %u more events not shown\n", Sink->ConsoleHidden);
+    }
+
+    Sink->ConsoleSecond = second;
+    Sink->ConsoleShown = 0;
+    Sink->ConsoleHidden = 0;
+}
+
+/*++
+Routine Description
+    Formats an event dequeued by the writer to the output and, as the
+    rate allows, to the console.
+--*/
+VOID DCAppWriteEvent( _Inout_ PDCAPP_SINK Sink, _In_ PDCAPP_SINK_ENTRY Entry )
+{
+    DCWIRE_EVENT event;
+    int nBytes;
+
+    if (!NT_SUCCESS(DcWireDecodeRecord(Entry->Record, sizeof(Entry->Record), &event))) {
+        return;
+    }
+
+    if (Sink->File != INVALID_HANDLE_VALUE) {
+
+        DCAppFormatEvent(&event, Sink->Json, &Sink->Line);
+
+        //  Every code unit takes at most 3 bytes in UTF-8.
+        if (DCAPP_SINK_BUFFER_SIZE - Sink->Buffered < Sink->Line.Length * 3 + 1) {
+            DCAppFlushSink(Sink);
+        }
+
+        nBytes = WideCharToMultiByte(CP_UTF8, 0, Sink->Line.Text, (int)Sink->Line.Length,
+                                     Sink->Buffer + Sink->Buffered,
+                                     (int)(DCAPP_SINK_BUFFER_SIZE - Sink->Buffered), NULL, NULL);
+        Sink->Buffered += nBytes;
+        Sink->Buffer[Sink->Buffered++] = '\n';
+        Sink->Written++;
+    }
+
+    if (Sink->ConsoleRate != 0) {
+
+        DCAppTickConsole(Sink);
+        if (Sink->ConsoleShown < Sink->ConsoleRate) {
+            DCAppFormatEvent(&event, FALSE, &Sink->Line);
+            wprintf(L"%s\n", Sink->Line.Text);
+            Sink->ConsoleShown++;
+        } else {
+            Sink->ConsoleHidden++;
+            Sink->Hidden++;
+        }
+    }
+}
+
+VOID DCAppReportPool( _Inout_ PDCAPP_POOL Pool );
+
+/*++
+Routine Description
+    Writer thread of the sink. Takes every queued event at once, writes
+    them in the order they were queued and flushes the output once per
+    batch, or once a second when nothing comes in. Reports the queue
+    depth of the pool once per DCAPP_POOL_REPORT_INTERVAL.
+Arguments
+    Sink - The sink
+Return Value
+    0.
+--*/
+DWORD DCAppSinkWriter( _In_ PDCAPP_SINK Sink )
+{
+    PSLIST_ENTRY list, ordered, next;
+    BOOL bStop;
+
+    for (;;) {
+
+        //  Read first, so that what was queued before the stop is written.
+        bStop = Sink->Stop;
+
+        //  The queue is a stack; reversing it restores the order.
+        list = InterlockedFlushSList(&Sink->Queue);
+        for (ordered = NULL; list != NULL; list = next) {
+            next = list->Next;
+            list->Next = ordered;
+            ordered = list;
+        }
+
+        for (; ordered != NULL; ordered = next) {
+            next = ordered->Next;
+            DCAppWriteEvent(Sink, (PDCAPP_SINK_ENTRY)ordered);
+            InterlockedPushEntrySList(&Sink->Free, ordered);
+        }
+
+        DCAppFlushSink(Sink);
+        if (Sink->ConsoleRate != 0) {
+            DCAppTickConsole(Sink);
+        }
+        if (Sink->Pool != NULL) {
+            DCAppReportPool(Sink->Pool);
+        }
+
+        if (bStop) {
+            break;
+        }
+        WaitForSingleObject(Sink->Wake, DCAPP_SINK_FLUSH_INTERVAL);
+    }
+
+    return 0;
+}
+
+/*++
+Routine Description
+    Writes out what is still queued, stops the writer thread and
+    releases the sink.
+--*/
+VOID DCAppStopSink( _Inout_ PDCAPP_SINK Sink )
+{
+    if (Sink->Thread != NULL) {
+
+        Sink->Stop = TRUE;
+        SetEvent(Sink->Wake);
+        WaitForSingleObject(Sink->Thread, INFINITE);
+        CloseHandle(Sink->Thread);
+        Sink->Thread = NULL;
+
+        wprintf(L"DCAPP: Events written %lld, dropped %lld, not shown %lld, write errors %lld, files rotated %lld\n",
+                Sink->Written, Sink->Dropped, Sink->Hidden, Sink->WriteErrors, Sink->Rotations);
+    }
+
+    if (Sink->File != INVALID_HANDLE_VALUE) {
+        CloseHandle(Sink->File);
+        Sink->File = INVALID_HANDLE_VALUE;
+    }
+
+    if (Sink->Wake != NULL) {
+        CloseHandle(Sink->Wake);
+        Sink->Wake = NULL;
+    }
+
+    if (Sink->Slab != NULL) {
+        VirtualFree(Sink->Slab, 0, MEM_RELEASE);
+        Sink->Slab = NULL;
+    }
+}
+
+/*++
+Routine Description
+    Starts the sink the workers queue denial events to.
+Arguments
+    Sink - Sink to start
+    Path - File or named pipe to write the events to, or NULL for none
+    Json - TRUE to write JSON lines rather than text
+    RotateSize - Size in bytes past which the file is rotated, 0 for never
+    ConsoleRate - Events shown on the console per second, 0 for none
+    Pool - Pool whose queue depth is reported while the sink runs, or NULL
+Return Value
+    TRUE if the sink is started.
+--*/
+BOOL DCAppStartSink( _Out_ PDCAPP_SINK Sink, _In_opt_ PCWSTR Path, _In_ BOOL Json,
+                     _In_ ULONG64 RotateSize, _In_ DWORD ConsoleRate,
+                     _In_opt_ PDCAPP_POOL Pool )
+{
+    DWORD i;
+
+    memset(Sink, 0, sizeof(DCAPP_SINK));
+    InitializeSListHead(&Sink->Queue);
+    InitializeSListHead(&Sink->Free);
+    Sink->File = INVALID_HANDLE_VALUE;
+    Sink->Path = Path;
+    Sink->Pipe = (Path != NULL && _wcsnicmp(Path, L"\\\\.\\pipe\\", 9) == 0);
+    Sink->Json = Json;
+    Sink->RotateSize = RotateSize;
+    Sink->ConsoleRate = ConsoleRate;
+    Sink->Pool = Pool;
+
+    Sink->Slab = (PUCHAR)VirtualAlloc(NULL, (SIZE_T)DCAPP_SINK_ENTRY_COUNT * sizeof(DCAPP_SINK_ENTRY),
+                                      MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (Sink->Slab == NULL) {
+        wprintf(L"ERROR: Allocating the event queue: %d\n", GetLastError());
+        return FALSE;
+    }
+
+    for (i = DCAPP_SINK_ENTRY_COUNT; i > 0; i--) {
+        InterlockedPushEntrySList(&Sink->Free,
+                                  &((PDCAPP_SINK_ENTRY)Sink->Slab)[i - 1].Entry);
+    }
+
+    Sink->Wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (Sink->Wake == NULL || (Path != NULL && !DCAppOpenSinkFile(Sink))) {
+        DCAppStopSink(Sink);
+        return FALSE;
+    }
+
+    Sink->Thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)DCAppSinkWriter, Sink, 0, NULL);
+    if (Sink->Thread == NULL) {
+        wprintf(L"ERROR: Couldn't create the writer thread: %d\n", GetLastError());
+        DCAppStopSink(Sink);
+        return FALSE;
+    }
+
+    if (Path != NULL) {
+        wprintf(L"DCAPP: Writing events to %s as %s\n", Path, Json ? L"JSON lines" : L"text");
+    }
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Queues the denial events found in the event ring, then asks the
+    filter for a doorbell before the next ones.
+--*/
+VOID DCAppDrainRing( VOID )
+{
+    const DCRING_RECORD* record;
+    DCWIRE_EVENT event;
+    ULONG nCount;
+
+    EnterCriticalSection(&g_RingLock);
+
+    //  Stops when a pass finds nothing even though the ring is not empty,
+    //  which can only be a record arriving right after the pass; the next
+    //  poll picks it up.
+    do {
+        nCount = 0;
+        while ((record = DcRingPeek(&g_Ring)) != NULL) {
+
+            if (record->Type == DCAPP_RECORD_EVENT &&
+                NT_SUCCESS(DcWireDecodeRecord(record + 1, record->Length - sizeof(DCRING_RECORD),
+                                              &event))) {
+                DCAppQueueEvent(&event);
+            }
+
+            DcRingRelease(&g_Ring, record);
+            nCount++;
+        }
+    } while (!DcRingPrepareWait(&g_Ring) && nCount != 0);
+
+    LeaveCriticalSection(&g_RingLock);
+}
+
+/*++
+Routine Description
+    Allocates the message buffers in one slab. The slab is page aligned
+    and each buffer takes whole cache lines, so buffers the filter fills
+    and workers read at the same time never share one.
+Arguments
+    Pool - Pool to initialize
+    Count - Number of buffers
+Return Value
+    TRUE if the buffers are allocated.
+--*/
+BOOL DCAppCreatePool( _Out_ PDCAPP_POOL Pool, _In_ DWORD Count )
+{
+    DWORD i;
+
+    memset(Pool, 0, sizeof(DCAPP_POOL));
+    InitializeSListHead(&Pool->Free);
+    Pool->Stride = (sizeof(DCAPP_MESSAGE) + DCAPP_CACHE_LINE_SIZE - 1) & ~(SIZE_T)(DCAPP_CACHE_LINE_SIZE - 1);
+    Pool->Slab = (PUCHAR)VirtualAlloc(NULL, Pool->Stride * Count, MEM_COMMIT | MEM_RESERVE,
+                                      PAGE_READWRITE);
+    if (Pool->Slab == NULL) {
+        wprintf(L"ERROR: Allocating %u message buffers: %d\n", Count, GetLastError());
+        return FALSE;
+    }
+
+    Pool->Count = Count;
+    Pool->Lowest = MAXLONG;
+    Pool->RunLowest = MAXLONG;
+    Pool->ReportedTick = GetTickCount64();
+
+    //  A free buffer holds its list entry at its start.
+    for (i = Count; i > 0; i--) {
+        InterlockedPushEntrySList(&Pool->Free, (PSLIST_ENTRY)(Pool->Slab + (i - 1) * Pool->Stride));
+    }
+
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Takes a buffer out of the pool.
+Return Value
+    The buffer, or NULL if every buffer is posted or being read.
+--*/
+PDCAPP_MESSAGE DCAppAllocateMessage( _Inout_ PDCAPP_POOL Pool )
+{
+    return (PDCAPP_MESSAGE)InterlockedPopEntrySList(&Pool->Free);
+}
+
+VOID DCAppFreeMessage( _Inout_ PDCAPP_POOL Pool, _In_ PDCAPP_MESSAGE Message )
+{
+    InterlockedPushEntrySList(&Pool->Free, (PSLIST_ENTRY)Message);
+}
+
+/*++
+Routine Description
+    Posts a buffer for the filter to send a message into.
+Arguments
+    Pool - Pool the buffer belongs to
+    Port - Connected filter port, associated with the completion port
+    Message - The buffer
+Return Value
+    HRESULT_FROM_WIN32(ERROR_IO_PENDING) if the request is posted.
+--*/
+HRESULT DCAppPostMessage( _Inout_ PDCAPP_POOL Pool, _In_ HANDLE Port, _In_ PDCAPP_MESSAGE Message )
+{
+    HRESULT hr;
+
+    //  Counted first, the request may complete before FilterGetMessage
+    //  returns.
+    InterlockedIncrement(&Pool->Pending);
+
+    memset(&Message->Ovlp, 0, sizeof(OVERLAPPED));
+    hr = FilterGetMessage(Port, &Message->MessageHeader, FIELD_OFFSET(DCAPP_MESSAGE, Ovlp),
+                          &Message->Ovlp);
+
+    if (hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING)) {
+        InterlockedDecrement(&Pool->Pending);
+    }
+    return hr;
+}
+
+/*++
+Routine Description
+    Lowers a figure to a value if it is below it.
+--*/
+VOID DCAppLowerTo( _Inout_ volatile LONG* Lowest, _In_ LONG Value )
+{
+    LONG nLowest = *Lowest;
+
+    while (Value < nLowest) {
+
+        LONG nPrevious = InterlockedCompareExchange(Lowest, Value, nLowest);
+        if (nPrevious == nLowest) {
+            break;
+        }
+        nLowest = nPrevious;
+    }
+}
+
+/*++
+Routine Description
+    Counts a request a worker dequeued from the completion port.
+--*/
+VOID DCAppTakeMessage( _Inout_ PDCAPP_POOL Pool )
+{
+    LONG nPending = InterlockedDecrement(&Pool->Pending);
+
+    DCAppLowerTo(&Pool->Lowest, nPending);
+    if (nPending == 0) {
+        InterlockedIncrement(&Pool->Empty);
+    }
+    InterlockedIncrement64(&Pool->Received);
+}
+
+/*++
+Routine Description
+    Takes the fewest requests posted and how often none was since the
+    last call, starts both over and folds them into those of the run.
+Arguments
+    Pool - The pool
+    Lowest - Receives the fewest posted, MAXLONG if none was dequeued
+    Empty - Receives how often none was posted
+--*/
+VOID DCAppFoldPool( _Inout_ PDCAPP_POOL Pool, _Out_ PLONG Lowest, _Out_ PLONG Empty )
+{
+    *Lowest = InterlockedExchange(&Pool->Lowest, MAXLONG);
+    *Empty = InterlockedExchange(&Pool->Empty, 0);
+
+    DCAppLowerTo(&Pool->RunLowest, *Lowest);
+    InterlockedExchangeAdd(&Pool->RunEmpty, *Empty);
+}
+
+/*++
+Routine Description
+    Prints how deep the queue of requests posted to the filter was kept
+    since the last report, once DCAPP_POOL_REPORT_INTERVAL is over. Only
+    the writer thread of the sink calls it.
+--*/
+VOID DCAppReportPool( _Inout_ PDCAPP_POOL Pool )
+{
+    ULONG64 tick = GetTickCount64();
+    LONG64 nReceived;
+    LONG nExhausted, nPending, nLowest, nEmpty;
+
+    if (tick - Pool->ReportedTick < DCAPP_POOL_REPORT_INTERVAL) {
+        return;
+    }
+
+    nPending = Pool->Pending;
+    DCAppFoldPool(Pool, &nLowest, &nEmpty);
+    nReceived = Pool->Received;
+    nExhausted = Pool->Exhausted;
+
+    wprintf(L"DCAPP: Last %llu s: messages received %lld, requests posted %d, fewest posted %d, none posted %d times, no spare buffer %d times\n",
+            (tick - Pool->ReportedTick) / 1000, nReceived - Pool->ReportedReceived, nPending,
+            (nLowest != MAXLONG) ? nLowest : nPending, nEmpty,
+            nExhausted - Pool->ReportedExhausted);
+
+    Pool->ReportedReceived = nReceived;
+    Pool->ReportedExhausted = nExhausted;
+    Pool->ReportedTick = tick;
+}
+
+/*++
+Routine Description
+    Prints how deep the queue of requests posted to the filter was kept
+    over the whole run.
+Arguments
+    Pool - The pool
+    ThreadCount - Number of workers
+    RequestCount - Requests posted per worker
+--*/
+VOID DCAppPrintPool( _Inout_ PDCAPP_POOL Pool, _In_ DWORD ThreadCount, _In_ DWORD RequestCount )
+{
+    LONG nPending = Pool->Pending;
+    LONG nLowest, nEmpty;
+
+    //  What was counted since the last report goes into the run.
+    DCAppFoldPool(Pool, &nLowest, &nEmpty);
+
+    wprintf(L"DCAPP: %u workers, %u requests posted each, %u buffers of %Iu bytes\n",
+            ThreadCount, RequestCount, Pool->Count, Pool->Stride);
+    wprintf(L"DCAPP: Messages received %lld, requests posted %d, fewest posted %d, none posted %d times, no spare buffer %d times\n",
+            Pool->Received, nPending, (Pool->RunLowest != MAXLONG) ? Pool->RunLowest : nPending,
+            Pool->RunEmpty, Pool->Exhausted);
+}
+
+VOID DCAppDeletePool( _Inout_ PDCAPP_POOL Pool )
+{
+    if (Pool->Slab != NULL) {
+        VirtualFree(Pool->Slab, 0, MEM_RELEASE);
+        Pool->Slab = NULL;
+    }
 }
 
 /*++
@@ -35,9 +1446,10 @@ Return Value
 --*/
 DWORD DCAPPWorker( _In_ PDCAPP_THREAD_CONTEXT Context )
 {
-    PDCAPP_NOTIFICATION notification;
-    DCAPP_REPLY_MESSAGE replyMessage;
+    DCWIRE_READER reader;
+    DCWIRE_EVENT event;
     PDCAPP_MESSAGE message = NULL;
+    PDCAPP_MESSAGE spare;
     LPOVERLAPPED pOvlp;
     BOOL result = FALSE;
     DWORD outSize = 0;
@@ -50,7 +1462,13 @@ DWORD DCAPPWorker( _In_ PDCAPP_THREAD_CONTEXT Context )
             break;
 
         //  Poll for messages from the filter component to scan.
-        result = GetQueuedCompletionStatus(Context->Completion, &outSize, &key, &pOvlp, INFINITE);
+        result = GetQueuedCompletionStatus(Context->Completion, &outSize, &key, &pOvlp,
+                                           g_bRing ? DCAPP_RING_POLL_INTERVAL : INFINITE);
+
+        if (!result && pOvlp == NULL && GetLastError() == WAIT_TIMEOUT) {
+            DCAppDrainRing();
+            continue;
+        }
 
         //  Obtain the message: note that the message we sent down via FltGetMessage() may NOT be
         //  the one dequeued off the completion queue: this is solely because there are multiple
@@ -61,41 +1479,43 @@ DWORD DCAPPWorker( _In_ PDCAPP_THREAD_CONTEXT Context )
             hr = HRESULT_FROM_WIN32(GetLastError());
             break;
         }
-                
-        wprintf(L"Received message, size %Id \n", pOvlp->InternalHigh);
-
-        notification = &message->Notification;
-        
-        /*int nLen = MultiByteToWideChar(CP_UTF8, 0, (LPCCH)notification->FilePath, -1, NULL, 0);
-        WCHAR* wFilePath = new WCHAR[nLen];
-        MultiByteToWideChar(CP_UTF8, 0, (LPCCH)notification->FilePath, -1, wFilePath, nLen);
-        
-        nLen = MultiByteToWideChar(CP_UTF8, 0, (LPCCH)notification->FilePath, -1, NULL, 0);
-        WCHAR* wProcessPath = new WCHAR[nLen];
-        MultiByteToWideChar(CP_UTF8, 0, (LPCCH)notification->ProcessName, -1, wProcessPath, nLen);*/
-
-        wprintf(L"File path %s Process (P)ID %d Process path %s \n", 
-            (WCHAR*)notification->FilePath, notification->ProcessID, (WCHAR*)notification->ProcessName);
-        replyMessage.ReplyHeader.Status = 0;
-        replyMessage.ReplyHeader.MessageId = message->MessageHeader.MessageId;
-        
-        /*delete[] wFilePath;
-        delete[] wProcessPath;*/
-
-        hr = FilterReplyMessage(Context->Port, (PFILTER_REPLY_HEADER)&replyMessage,
-                                sizeof(replyMessage));
-        if (SUCCEEDED(hr)) {
-            wprintf(L"Replied message \n");
+
+        //  A spare buffer goes to the filter before this one is read, so
+        //  that the filter keeps as many requests while workers are busy.
+        DCAppTakeMessage(Context->Pool);
+        spare = DCAppAllocateMessage(Context->Pool);
+        if (spare == NULL) {
+            InterlockedIncrement(&Context->Pool->Exhausted);
+        } else {
+            hr = DCAppPostMessage(Context->Pool, Context->Port, spare);
+            if (hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING)) {
+                DCAppFreeMessage(Context->Pool, spare);
+                spare = NULL;
+            }
+        }
+
+        //  The filter sends denials in batches, or only rings the doorbell
+        //  when they are in the event ring, and does not wait for a reply.
+        if (message->Event.Type == DCAPP_MESSAGE_DOORBELL && g_bRing) {
+            DCAppDrainRing();
         }
-        else {
-            wprintf(L"DCAPP: Error replying message. Error = 0x%X \n", hr);
-            break;
+
+        if (message->Event.Type == DCAPP_MESSAGE_EVENTS &&
+            pOvlp->InternalHigh > FIELD_OFFSET(DCAPP_MESSAGE, Event.Batch) &&
+            NT_SUCCESS(DcWireBeginRead(&reader, message->Event.Batch,
+                                       (ULONG)(pOvlp->InternalHigh - FIELD_OFFSET(DCAPP_MESSAGE, Event.Batch))))) {
+
+            while (NT_SUCCESS(DcWireReadEvent(&reader, &event))) {
+                DCAppQueueEvent(&event);
+            }
         }
 
-        memset(&message->Ovlp, 0, sizeof(OVERLAPPED));
-        hr = FilterGetMessage(Context->Port, &message->MessageHeader,
-                                FIELD_OFFSET(DCAPP_MESSAGE, Ovlp), &message->Ovlp);
+        if (spare != NULL) {
+            DCAppFreeMessage(Context->Pool, message);
+            continue;
+        }
 
+        hr = DCAppPostMessage(Context->Pool, Context->Port, message);
         if (hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING)) {
             break;
         }
@@ -110,29 +1530,322 @@ DWORD DCAPPWorker( _In_ PDCAPP_THREAD_CONTEXT Context )
         }
     }
 
-    free(message);
     return hr;
 }
 
+/*++
+Routine Description
+    Stores the policy the filter enforces as a policy image in the
+    filter's service key, where the filter finds it when it loads at the
+    next boot. The image replaces the stored one in a single value write,
+    which the registry makes atomic, and the key is flushed before
+    success is reported.
+Arguments
+    Port - Connected filter port
+Return Value
+    TRUE if the image is stored.
+--*/
+BOOL DCAppPersistPolicy( _In_ HANDLE Port )
+{
+    DCAPP_INPUT input;
+    PVOID pImage = malloc(DCIMAGE_MAX_SIZE);
+    DWORD dwImageSize = 0;
+    HKEY hKey;
+    LSTATUS status;
+    HRESULT hr;
+
+    if (pImage == NULL) {
+        return FALSE;
+    }
+
+    memset(&input, 0, sizeof(DCAPP_INPUT));
+    input.ONOFF = DCAPP_QUERY_POLICY_IMAGE;
+    hr = FilterSendMessage(Port, &input, sizeof(DCAPP_INPUT), pImage, DCIMAGE_MAX_SIZE, &dwImageSize);
+    if (FAILED(hr)) {
+        wprintf(L"ERROR: Getting the policy image from the driver: 0x%08x\n", hr);
+        free(pImage);
+        return FALSE;
+    }
+
+    status = RegOpenKeyExW(HKEY_LOCAL_MACHINE, DCAPP_SERVICE_KEY, 0, KEY_SET_VALUE, &hKey);
+    if (status == ERROR_SUCCESS) {
+
+        status = RegSetValueExW(hKey, DCAPP_POLICY_IMAGE_VALUE, 0, REG_BINARY,
+                                (const BYTE*)pImage, dwImageSize);
+        if (status == ERROR_SUCCESS) {
+            status = RegFlushKey(hKey);
+        }
+        RegCloseKey(hKey);
+    }
+
+    free(pImage);
+
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"ERROR: Storing the policy image: %d\n", status);
+        return FALSE;
+    }
+
+    wprintf(L"DCAPP: Stored a %u byte policy image, enforced from the next boot on\n", dwImageSize);
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Removes the stored policy image, so that the filter loads without
+    protection from the next boot on.
+Return Value
+    TRUE if no image is stored any more.
+--*/
+BOOL DCAppClearPolicy( VOID )
+{
+    LSTATUS status = RegDeleteKeyValueW(HKEY_LOCAL_MACHINE, DCAPP_SERVICE_KEY,
+                                        DCAPP_POLICY_IMAGE_VALUE);
+
+    if (status != ERROR_SUCCESS && status != ERROR_FILE_NOT_FOUND) {
+        wprintf(L"ERROR: Removing the policy image: %d\n", status);
+        return FALSE;
+    }
+
+    wprintf(L"DCAPP: No policy is enforced at boot\n");
+    return TRUE;
+}
+
+/*++
+Routine Description
+    Prints the count, mean and percentiles of a latency histogram, in
+    microseconds.
+Arguments
+    Name - Name of the histogram
+    Hist - The histogram
+    Frequency - Ticks per second of the filter's performance counter
+--*/
+VOID DCAppPrintLatency( _In_ PCWSTR Name, _In_ PCDCHIST Hist, _In_ ULONG64 Frequency )
+{
+    double scale = 1000000.0 / (double)Frequency;
+
+    if (Hist->Count == 0) {
+        wprintf(L"%-24s %12llu\n", Name, Hist->Count);
+        return;
+    }
+
+    wprintf(L"%-24s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", Name, Hist->Count,
+            (double)Hist->Sum / (double)Hist->Count * scale,
+            (double)DcHistPercentile(Hist, 500) * scale,
+            (double)DcHistPercentile(Hist, 900) * scale,
+            (double)DcHistPercentile(Hist, 990) * scale,
+            (double)Hist->Max * scale);
+}
+
+/*++
+Routine Description
+    Polls the filter's counters and prints each with its rate over the
+    last interval, and the latencies of the callbacks and their stages
+    over that interval, until a key is pressed. Protection is left as it
+    is.
+Arguments
+    Interval - Seconds between two samples
+Return Value
+    0, or 2 if the filter could not be reached.
+--*/
+int DCAppShowStats( _In_ DWORD Interval )
+{
+    DCAPP_INPUT input;
+    DCAPP_COUNTERS counters, previous;
+    DCAPP_LATENCY latency, previousLatency;
+    DCHIST interval;
+    DWORD dwByteReturned = 0;
+    double seconds;
+    HANDLE port;
+    HRESULT hr;
+    DWORD i, elapsed;
+
+    hr = FilterConnectCommunicationPort(DCAPPPortName, 0, NULL, 0, NULL, &port);
+    if (IS_ERROR(hr)) {
+        wprintf(L"ERROR: Connecting to filter port: 0x%08x\n", hr);
+        return 2;
+    }
+
+    memset(&input, 0, sizeof(DCAPP_INPUT));
+    input.ONOFF = DCAPP_QUERY_COUNTERS;
+    memset(&previous, 0, sizeof(previous));
+    memset(&previousLatency, 0, sizeof(previousLatency));
+
+    for (;;) {
+
+        hr = FilterSendMessage(port, &input, sizeof(DCAPP_INPUT), &counters, sizeof(counters),
+                               &dwByteReturned);
+        if (FAILED(hr)) {
+            wprintf(L"ERROR: Querying the counters: 0x%08x\n", hr);
+            break;
+        }
+
+        //  Rates are per second of interrupt time between the samples;
+        //  the first sample has none.
+        seconds = (double)(counters.Timestamp - previous.Timestamp) / 10000000.0;
+        wprintf(L"\nDCAPP: Counters over %u processors\n", counters.ProcessorCount);
+        for (i = 0; i < counters.CounterCount && i < DCAPP_COUNTER_COUNT; i++) {
+            if (previous.Timestamp != 0 && seconds > 0) {
+                wprintf(L"%-40s %16llu %12.1f/s\n", g_CounterNames[i], counters.Counters[i],
+                        (double)(counters.Counters[i] - previous.Counters[i]) / seconds);
+            } else {
+                wprintf(L"%-40s %16llu\n", g_CounterNames[i], counters.Counters[i]);
+            }
+        }
+        previous = counters;
+
+        //  The histograms only grow, the difference between two of them
+        //  holds what was recorded in between; Max is the largest ever.
+        input.ONOFF = DCAPP_QUERY_LATENCY;
+        hr = FilterSendMessage(port, &input, sizeof(DCAPP_INPUT), &latency, sizeof(latency),
+                               &dwByteReturned);
+        input.ONOFF = DCAPP_QUERY_COUNTERS;
+        if (SUCCEEDED(hr) && latency.HistogramCount == DCAPP_LATENCY_COUNT &&
+            latency.BucketCount == DCHIST_BUCKET_COUNT && latency.Frequency != 0) {
+
+            wprintf(L"\n%-24s %12s %10s %10s %10s %10s %10s\n", L"Latency (us)", L"Count",
+                    L"Mean", L"p50", L"p90", L"p99", L"Max");
+            for (i = 0; i < DCAPP_LATENCY_COUNT; i++) {
+                interval = latency.Histograms[i];
+                DcHistSubtract(&interval, &previousLatency.Histograms[i]);
+                DCAppPrintLatency(g_LatencyNames[i], &interval, latency.Frequency);
+            }
+            previousLatency = latency;
+        }
+
+        for (elapsed = 0; elapsed < Interval * 1000 && !_kbhit(); elapsed += 100) {
+            Sleep(100);
+        }
+        if (_kbhit()) {
+            _getwch();
+            break;
+        }
+    }
+
+    CloseHandle(port);
+    return 0;
+}
+
 int wmain(int argc, wchar_t* argv[])
 {
     DWORD requestCount = DCAPP_DEFAULT_REQUEST_COUNT;
-    DWORD threadCount = DCAPP_DEFAULT_THREAD_COUNT;
+    DWORD threadCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    DWORD bufferCount = 0;
     HANDLE threads[DCAPP_MAX_THREAD_COUNT];
+    DWORD threadsStarted = 0;
     DCAPP_THREAD_CONTEXT context;
+    DCAPP_POOL pool;
     HANDLE port, completion;
     PDCAPP_MESSAGE msg;
     DWORD threadId;
     HRESULT hr;
-    DWORD i, j;
+    DWORD i;
 
-    if (argc != 2) {
+    if (argc < 2) {
         Usage();
         return 1;
     }
 
-    size_t dwPathLen = wcsnlen_s(argv[1], MAX_PATH_LEN);
-    if (dwPathLen == 0) {
+    if (argc == 2 && _wcsicmp(argv[1], L"-c") == 0) {
+        return DCAppClearPolicy() ? 0 : 1;
+    }
+
+    if (argc <= 3 && _wcsicmp(argv[1], L"stats") == 0) {
+        DWORD dwInterval = DCAPP_DEFAULT_STATS_INTERVAL;
+        if (argc == 3) {
+            dwInterval = wcstoul(argv[2], NULL, 10);
+            if (dwInterval == 0 || dwInterval > 3600) {
+                Usage();
+                return 1;
+            }
+        }
+        return DCAppShowStats(dwInterval);
+    }
+
+    BOOL bPersist = FALSE;
+    BOOL bJson = FALSE;
+    PCWSTR pOutput = NULL;
+    DWORD dwRotateSize = 0;
+    DWORD dwConsoleRate = DCAPP_DEFAULT_CONSOLE_RATE;
+    for (i = 1; i < (DWORD)argc; i++) {
+
+        if (_wcsicmp(argv[i], L"-p") == 0) {
+            bPersist = TRUE;
+            continue;
+        }
+
+        if (_wcsicmp(argv[i], L"-j") == 0) {
+            bJson = TRUE;
+            continue;
+        }
+
+        if (_wcsicmp(argv[i], L"-o") == 0) {
+            if (++i == (DWORD)argc) {
+                Usage();
+                return 1;
+            }
+            pOutput = argv[i];
+            continue;
+        }
+
+        PDWORD pCount = NULL;
+        DWORD dwMin = 1;
+        DWORD dwMax = 0;
+        if (_wcsicmp(argv[i], L"-w") == 0) {
+            pCount = &threadCount;
+            dwMax = DCAPP_MAX_THREAD_COUNT;
+        } else if (_wcsicmp(argv[i], L"-q") == 0) {
+            pCount = &requestCount;
+            dwMax = DCAPP_MAX_REQUEST_COUNT;
+        } else if (_wcsicmp(argv[i], L"-b") == 0) {
+            pCount = &bufferCount;
+            dwMax = DCAPP_MAX_BUFFER_COUNT;
+        } else if (_wcsicmp(argv[i], L"-r") == 0) {
+            pCount = &dwRotateSize;
+            dwMax = DCAPP_MAX_ROTATE_SIZE;
+        } else if (_wcsicmp(argv[i], L"-e") == 0) {
+            pCount = &dwConsoleRate;
+            dwMin = 0;
+            dwMax = DCAPP_MAX_CONSOLE_RATE;
+        } else {
+            continue;
+        }
+
+        if (++i == (DWORD)argc) {
+            Usage();
+            return 1;
+        }
+        *pCount = wcstoul(argv[i], NULL, 10);
+        if (*pCount < dwMin || *pCount > dwMax) {
+            Usage();
+            return 1;
+        }
+    }
+
+    threadCount = min(max(threadCount, 1UL), (DWORD)DCAPP_MAX_THREAD_COUNT);
+    if (bufferCount == 0) {
+        bufferCount = min(threadCount * (requestCount + 1), (DWORD)DCAPP_MAX_BUFFER_COUNT);
+    }
+    if (bufferCount < threadCount * requestCount) {
+        wprintf(L"ERROR: %u buffers cannot hold %u requests for each of %u workers\n",
+                bufferCount, requestCount, threadCount);
+        return 1;
+    }
+
+    DWORD dwUpdateSize = 0;
+    PDCAPP_UPDATE_INPUT pUpdate = DCAppBuildUpdate(argc, argv, &dwUpdateSize);
+    if (pUpdate == NULL) {
+        return 1;
+    }
+
+    if (!DCAppCreatePool(&pool, bufferCount)) {
+        free(pUpdate);
+        return 1;
+    }
+
+    if (!DCAppStartSink(&g_Sink, pOutput, bJson, (ULONG64)dwRotateSize * 1024 * 1024,
+                        dwConsoleRate, &pool)) {
+        DCAppDeletePool(&pool);
+        free(pUpdate);
         return 1;
     }
 
@@ -141,6 +1854,9 @@ int wmain(int argc, wchar_t* argv[])
     hr = FilterConnectCommunicationPort(DCAPPPortName, 0, NULL, 0, NULL, &port);
     if (IS_ERROR(hr)) {
         wprintf(L"ERROR: Connecting to filter port: 0x%08x\n", hr);
+        DCAppStopSink(&g_Sink);
+        DCAppDeletePool(&pool);
+        free(pUpdate);
         return 2;
     }
 
@@ -148,14 +1864,37 @@ int wmain(int argc, wchar_t* argv[])
     if (completion == NULL) {
         wprintf(L"ERROR: Creating completion port: %d\n", GetLastError());
         CloseHandle(port);
+        DCAppStopSink(&g_Sink);
+        DCAppDeletePool(&pool);
+        free(pUpdate);
         return 3;
     }
     wprintf(L"DCAPP: Port = 0x%p Completion = 0x%p\n", port, completion);
 
+    InitializeCriticalSection(&g_RingLock);
+    g_bRing = DCAppAttachRing(port);
+
     context.Port = port;
     context.Completion = completion;
+    context.Pool = &pool;
     BOOL bContinue = TRUE;
-    for (i = 0; i < threadCount; i++) {
+
+    //  Every request is posted before the workers start; completions wait
+    //  in the completion port until one dequeues them.
+    for (i = 0; i < threadCount * requestCount; i++) {
+
+        msg = DCAppAllocateMessage(&pool);
+        hr = DCAppPostMessage(&pool, port, msg);
+
+        if (hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING)) {
+            wprintf(L"ERROR: Posting requests to the filter: 0x%08x\n", hr);
+            DCAppFreeMessage(&pool, msg);
+            bContinue = FALSE;
+            break;
+        }
+    }
+
+    for (i = 0; i < threadCount && bContinue; i++) {
 
         threads[i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)DCAPPWorker, &context,
             0, &threadId);
@@ -166,79 +1905,89 @@ int wmain(int argc, wchar_t* argv[])
             bContinue = FALSE;
             break;
         }
+        threadsStarted++;
+    }
 
-        for (j = 0; j < requestCount; j++) {
-
-            msg = (DCAPP_MESSAGE*)malloc(sizeof(DCAPP_MESSAGE));
+    if (bContinue) {
 
-            if (msg == NULL) {
-                hr = ERROR_NOT_ENOUGH_MEMORY;
-                bContinue = FALSE;
-                break;
-            }
+        DWORD dwByteReturned = 0;
 
-            memset(&msg->Ovlp, 0, sizeof(OVERLAPPED));
-            hr = FilterGetMessage(port, &msg->MessageHeader, FIELD_OFFSET(DCAPP_MESSAGE, Ovlp), 
-                &msg->Ovlp);
+        //To start the directory protection. The roots and the trusted
+        //executables replace those in effect in one transaction, so
+        //protection does not lapse if a policy is already in effect.
+        DCAPP_UPDATE_OUTPUT update;
+        memset(&update, 0, sizeof(update));
+        update.Record = DCAPP_NO_RECORD;
+        hr = FilterSendMessage(port, pUpdate, dwUpdateSize, &update, sizeof(update), &dwByteReturned);
 
-            if (hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING)) {
-                free(msg);
-                bContinue = FALSE;
-                break;
+        if (hr != S_OK) {
+            wprintf(L"Failed to send the input to the driver 0x%08x\n", hr);
+            if (update.Record != DCAPP_NO_RECORD) {
+                wprintf(L"DCAPP: Record %u of the update was rejected\n", update.Record);
+            }
+        } else {
+            wprintf(L"DCAPP: Policy generation %llu, %u protected paths, %u trusted executables\n",
+                    update.Generation, update.RootCount, update.TrustedCount);
+            if (bPersist) {
+                DCAppPersistPolicy(port);
             }
         }
-    }
-
-    if (bContinue) {
 
-        DWORD dwByteReturned = 0;
-        int nWcharsSize = 0;
-        WCHAR szDosName[MAX_PATH_LEN] = L"";
-        WCHAR szDriveName[3] = L"";
-        memcpy_s(szDriveName, 2 * sizeof(WCHAR), argv[1], 2 * sizeof(WCHAR));
-        QueryDosDeviceW(szDriveName, szDosName, MAX_PATH_LEN);
-        DWORD dwlstErr = GetLastError();
-        WCHAR* szDirPath = argv[1];
-        if (dwlstErr == 0) {
-            wmemcpy_s(szDosName + wcslen(szDosName), dwPathLen - 2, szDirPath + 2, dwPathLen - 2);
-            int nVal = _wcsnicmp(szDosName + wcslen(szDosName), L"\\", 1);
-            if (nVal != 0) {
-                wmemcpy_s(szDosName + wcslen(szDosName), 1, L"\\", 1);
-            }
-
-            DCAPP_INPUT input;
-            input.ONOFF = 1;
-            input.FileSize = (ULONG)wcslen(szDosName) * sizeof(WCHAR);
-
-            memcpy(input.DirPath, szDosName, wcslen(szDosName) * sizeof(WCHAR));
-            //To start the directory protection
-            hr = FilterSendMessage(port, &input, sizeof(DCAPP_INPUT), NULL, 0, &dwByteReturned);
+        //press any key to stop the directory protection.
+        getchar();
 
-            if (hr != S_OK) {
-                wprintf(L"Failed to send the input to the driver \n");
-            }
+        g_bContinue = FALSE;
+        DCAPP_INPUT input;
+        memset(&input, 0, sizeof(DCAPP_INPUT));
 
-            //press any key to stop the directory protection.
-            getchar();
+        DCAPP_STATISTICS stats;
+        input.ONOFF = DCAPP_QUERY_STATISTICS;
+        if (SUCCEEDED(FilterSendMessage(port, &input, sizeof(DCAPP_INPUT), &stats,
+                                        sizeof(stats), &dwByteReturned))) {
+            wprintf(L"DCAPP: Negative cache hits %llu misses %llu\n",
+                    stats.NegativeCacheHits, stats.NegativeCacheMisses);
+            wprintf(L"DCAPP: Names opened %llu cached %llu normalized %llu\n",
+                    stats.OpenedNames, stats.CachedNames, stats.NormalizedNames);
+            wprintf(L"DCAPP: Events sent %llu dropped %llu lost %llu\n",
+                    stats.EventsSent, stats.EventsDropped, stats.EventsLost);
+            wprintf(L"DCAPP: Repeated events suppressed %llu reported %llu\n",
+                    stats.EventsSuppressed, stats.EventRepeats);
+            wprintf(L"DCAPP: Trusted processes %llu\n", stats.TrustedProcesses);
+            wprintf(L"DCAPP: Policy generation %llu\n", stats.PolicyGeneration);
+            wprintf(L"DCAPP: Create contexts allocated %llu freed %llu, from pool %llu to pool %llu, cached %llu\n",
+                    stats.CreateContextPool.Allocations, stats.CreateContextPool.Frees,
+                    stats.CreateContextPool.PoolAllocations, stats.CreateContextPool.PoolFrees,
+                    stats.CreateContextPool.Depth);
+        }
+        DCAppPrintPool(&pool, threadCount, requestCount);
 
-            g_bContinue = FALSE;
-            //To stop the directory protection.
-            input.ONOFF = 0;
-            input.FileSize = 0;
+        //To stop the directory protection. A stored policy stays on, as it
+        //would after a reboot.
+        if (!bPersist) {
+            input.ONOFF = DCAPP_PROTECTION_OFF;
             hr = FilterSendMessage(port, &input, sizeof(DCAPP_INPUT), NULL, 0, &dwByteReturned);
         }
+    }
 
-        DWORD dwExitCode = 0;
-        for (i = 0; i < threadCount; i++) {
-            TerminateThread(threads[i], dwExitCode);
-        }
-        WaitForMultipleObjectsEx(i, threads, TRUE, INFINITE, FALSE);
+    DWORD dwExitCode = 0;
+    for (i = 0; i < threadsStarted; i++) {
+        TerminateThread(threads[i], dwExitCode);
+    }
+    if (threadsStarted != 0) {
+        WaitForMultipleObjectsEx(threadsStarted, threads, TRUE, INFINITE, FALSE);
     }
 
+    //  What the workers queued is written out before DCApp exits.
+    DCAppStopSink(&g_Sink);
+
     wprintf(L"DCAPP:  All done. Result = 0x%08x\n", hr);
     CloseHandle(port);
     CloseHandle(completion);
 
+    //  Closing the port cancelled the requests still posted.
+    DCAppDeletePool(&pool);
+    free(pUpdate);
+
     return hr;
 }
 
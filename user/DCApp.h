@@ -16,19 +16,12 @@ typedef struct _DCAPP_MESSAGE {
     //  Required structure header.
     FILTER_MESSAGE_HEADER MessageHeader;
     //  Private DCAPP-specific fields begin here.
-    DCAPP_NOTIFICATION Notification;
+    DCAPP_EVENT_MESSAGE Event;
     //  Overlapped structure: this is not really part of the message
     //  However we embed it instead of using a separately allocated overlap structure
     OVERLAPPED Ovlp;
 } DCAPP_MESSAGE, * PDCAPP_MESSAGE;
 
-typedef struct _DCAPP_REPLY_MESSAGE {
-    //  Required structure header.
-    FILTER_REPLY_HEADER ReplyHeader;
-    //  Private DCAPP-specific fields begin here.
-    //DCAPP_REPLY Reply;
-} DCAPP_REPLY_MESSAGE, * PDCAPP_REPLY_MESSAGE;
-
 #endif //  __DCAPP_H__
 
 